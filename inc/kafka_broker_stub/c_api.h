@@ -0,0 +1,136 @@
+#ifndef KAFKA_BROKER_STUB_C_API_H_INC_
+#define KAFKA_BROKER_STUB_C_API_H_INC_
+
+/*
+ * C interface of the broker stub for embedding it in test harnesses written
+ * in other languages (e.g. through Python ctypes or cgo).
+ *
+ * The interface is implemented by the shared library built in the lib
+ * directory. A stub handle is not thread safe - all calls for a handle must
+ * be made from one thread at a time. Produce requests may be appended on
+ * worker threads, but these finish before kbs_stub_handle_data() returns, so
+ * no call for the handle runs concurrently with an append. Pointers returned
+ * into the stub (stored records and responses) are not copies and stay valid
+ * until the next call modifying the stub through the same handle.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define KBS_API __attribute__((visibility("default")))
+#else
+#define KBS_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Return codes */
+#define KBS_OK 0
+#define KBS_ERR_INVALID_ARG -1
+#define KBS_ERR_TOPIC_EXISTS -2
+#define KBS_ERR_UNKNOWN_TOPIC -3
+#define KBS_ERR_UNKNOWN_PARTITION -4
+#define KBS_ERR_PARSE -5
+#define KBS_ERR_INTERNAL -6
+
+typedef struct kbs_stub kbs_stub;
+
+/**
+ * Stored message - key and value point into the partition. A NULL key or
+ * value (with size 0) was produced as null or is the value of a tombstone,
+ * while empty ones point to zero bytes. The pointers are only valid until
+ * the next call modifying the stub through the handle (adding topics or
+ * messages, handling data or destroying it), which may move, evict or
+ * compact the stored messages.
+ */
+typedef struct kbs_record
+{
+	int64_t offset;
+	int64_t timestamp;
+	const uint8_t* key;
+	size_t key_size;
+	const uint8_t* value;
+	size_t value_size;
+} kbs_record;
+
+/**
+ * Retained messages and bytes of a partition
+ */
+typedef struct kbs_partition_stats
+{
+	int64_t log_start_offset;
+	int64_t next_offset;
+	uint64_t messages;
+	uint64_t size_bytes;
+} kbs_partition_stats;
+
+/**
+ * Totals of a stub
+ */
+typedef struct kbs_stub_stats
+{
+	uint64_t topics;
+	uint64_t partitions;
+	uint64_t messages;
+	uint64_t size_bytes;
+	uint64_t requests;
+	uint64_t bytes_received;
+	uint64_t bytes_sent;
+} kbs_stub_stats;
+
+/**
+ * Make a stub with a node ID advertising host and port - NULL on failure
+ */
+KBS_API kbs_stub* kbs_stub_create(int32_t node_id, const char* host, int32_t port);
+
+KBS_API void kbs_stub_destroy(kbs_stub* stub);
+
+/**
+ * Add a topic with partitions led by the stub
+ */
+KBS_API int kbs_stub_add_topic(kbs_stub* stub, const char* name, int32_t num_partitions);
+
+/**
+ * Append a message to a partition - a NULL key is stored as empty key
+ */
+KBS_API int kbs_stub_add_message(kbs_stub* stub, const char* topic, int32_t partition, const uint8_t* key,
+                                 size_t key_size, const uint8_t* value, size_t value_size);
+
+/**
+ * Handle requests, each framed with its size in front. Returns the number of
+ * bytes read (less than size if a request is incomplete) or KBS_ERR_PARSE.
+ * The responses are kept until kbs_stub_clear_responses().
+ */
+KBS_API int64_t kbs_stub_handle_data(kbs_stub* stub, const uint8_t* data, size_t size);
+
+KBS_API size_t kbs_stub_response_count(const kbs_stub* stub);
+
+/**
+ * Get a response with its size in front - NULL if index is out of range
+ */
+KBS_API const uint8_t* kbs_stub_response(const kbs_stub* stub, size_t index, size_t* size);
+
+KBS_API void kbs_stub_clear_responses(kbs_stub* stub);
+
+/**
+ * Fill up to max records of a partition starting at offset - returns the
+ * number of records filled (0 at the end of the partition) or an error. The
+ * records point into the stub (see kbs_record) - copy what is needed before
+ * modifying the stub.
+ */
+KBS_API int64_t kbs_stub_read_records(const kbs_stub* stub, const char* topic, int32_t partition, int64_t offset,
+                                      kbs_record* records, size_t max);
+
+KBS_API int kbs_stub_get_partition_stats(const kbs_stub* stub, const char* topic, int32_t partition,
+                                         kbs_partition_stats* stats);
+
+KBS_API int kbs_stub_get_stats(const kbs_stub* stub, kbs_stub_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,172 @@
+#ifndef KAFKA_BROKER_STUB_CLUSTER_HPP_INC_
+#define KAFKA_BROKER_STUB_CLUSTER_HPP_INC_
+
+/*
+ * Simulation of a cluster of broker stubs in a single process.
+ */
+
+#include "main.hpp"
+#include "topology.hpp"
+#include <string>
+#include <vector>
+
+namespace kafka_broker_stub {
+
+	/**
+	 * Cluster of broker stubs sharing one topic registry
+	 *
+	 * Every node knows all other nodes so metadata responses from any node
+	 * describe the full cluster. Partition leaders and replicas are assigned
+	 * round-robin across the nodes and each node only accepts produce requests
+	 * for the partitions it leads.
+	 *
+	 * As the registry is shared the nodes must not handle data concurrently.
+	 */
+	class cluster
+	{
+	public:
+		cluster():
+			m_topics(),
+			m_nodes(),
+			m_addresses()
+		{
+
+		}
+
+		~cluster()
+		{
+			for (size_t i=0; i<m_nodes.size(); ++i)
+			{
+				delete m_nodes[i];
+			}
+		}
+
+		/**
+		 * Add a broker node to the cluster - returns NULL if the ID is in use
+		 */
+		broker_stub* add_node(int32_t node_id, const char* host, int32_t port)
+		{
+			if (get_node(node_id) != NULL)
+			{
+				return NULL;
+			}
+
+			broker_stub* node = new broker_stub(node_id, host, port, m_topics);
+			for (size_t i=0; i<m_nodes.size(); ++i)
+			{
+				node->add_broker_reference(m_addresses[i].node_id, m_addresses[i].host.c_str(),
+				                           m_addresses[i].port);
+				m_nodes[i]->add_broker_reference(node_id, host, port);
+			}
+
+			m_addresses.push_back(address(node_id, host, port));
+			m_nodes.push_back(node);
+			return node;
+		}
+
+		/**
+		 * Add topic with leaders and replicas assigned across the nodes
+		 *
+		 * Returns false if the topic exists or the replication factor cannot be
+		 * satisfied by the current nodes.
+		 */
+		bool add_topic(const std::string& name, int32_t num_partitions, int32_t replication_factor)
+		{
+			size_t num_nodes = m_nodes.size();
+			if ((num_partitions < 0) || (replication_factor < 1) ||
+			    (static_cast<size_t>(replication_factor) > num_nodes))
+			{
+				return false;
+			}
+
+			std::vector<int32_t> node_ids;
+			for (size_t i=0; i<num_nodes; ++i)
+			{
+				node_ids.push_back(m_nodes[i]->node_id());
+			}
+
+			// Offset the first leader by the number of topics to spread leadership
+			std::vector<partition> partitions;
+			topology::assign_partitions(num_partitions, replication_factor, node_ids,
+			                            m_topics.topics().size() % num_nodes, partitions);
+			return m_topics.adopt(name, partitions);
+		}
+
+		/**
+		 * Add topic with an explicit assignment of leaders and replicas, taking
+		 * over the partitions (only an lvalue passed is copied)
+		 */
+		bool add_topic(const std::string& name, std::vector<partition> partitions)
+		{
+			return m_topics.adopt(name, partitions);
+		}
+
+		broker_stub* get_node(int32_t node_id)
+		{
+			for (size_t i=0; i<m_nodes.size(); ++i)
+			{
+				if (m_nodes[i]->node_id() == node_id)
+				{
+					return m_nodes[i];
+				}
+			}
+			return NULL;
+		}
+
+		/**
+		 * Get the node leading a partition - returns NULL if it is unknown
+		 */
+		broker_stub* get_leader(const std::string& topic_name, size_t part)
+		{
+			const topic* top = m_topics.get(topic_name);
+			if (top == NULL)
+			{
+				return NULL;
+			}
+
+			const partition* p = top->get_partition(part);
+			if (p == NULL)
+			{
+				return NULL;
+			}
+
+			return get_node(p->leader());
+		}
+
+		const topic* get_topic(const std::string& name) const
+		{
+			return m_topics.get(name);
+		}
+
+		size_t size() const
+		{
+			return m_nodes.size();
+		}
+
+	private:
+		struct address
+		{
+			address(int32_t id, const char* h, int32_t p):
+				node_id(id),
+				host(h),
+				port(p)
+			{
+
+			}
+
+			int32_t node_id;
+			std::string host;
+			int32_t port;
+		};
+
+		cluster(const cluster&);
+		cluster& operator=(const cluster&);
+
+		topic_registry m_topics;
+		std::vector<broker_stub*> m_nodes;
+		std::vector<address> m_addresses;
+	};
+
+}
+
+#endif
@@ -0,0 +1,338 @@
+#ifndef KAFKA_BROKER_STUB_COMPACTED_VIEW_HPP_INC_
+#define KAFKA_BROKER_STUB_COMPACTED_VIEW_HPP_INC_
+
+/*
+ * Latest message per key of a compacted partition.
+ */
+
+#include "util.hpp"
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace kafka_broker_stub {
+
+	/**
+	 * Incrementally maintained view of the latest message per key
+	 *
+	 * An open addressing hash table maps each key to the offset of its latest
+	 * message, and a state per retained offset tells whether the message is
+	 * the latest of its key, i.e. survives compaction. Appends and evictions
+	 * are O(1). Tombstones (null values) stay the latest message of their key
+	 * until evicted, like they do until delete.retention.ms passed on a
+	 * broker, but the key counts as deleted.
+	 */
+	class compacted_view
+	{
+	public:
+		compacted_view():
+			m_slots(),
+			m_used(0),
+			m_removed(0),
+			m_states(),
+			m_base(0),
+			m_values(0)
+		{
+
+		}
+
+		/**
+		 * Account a message appended at offset - returns the offset of the
+		 * message it supersedes or -1. Offsets must be added without gaps.
+		 */
+		int64_t add(const std::string& key, int64_t offset, bool tombstone)
+		{
+			if (m_states.empty())
+			{
+				m_base = offset;
+			}
+
+			if (((m_used + m_removed + 1) * 10) > (m_slots.size() * 7))
+			{
+				rehash(m_used * 2 + 16);
+			}
+
+			int64_t prev = -1;
+			slot& s = insert(key);
+			if (s.offset >= 0)
+			{
+				prev = s.offset;
+				uint8_t& old = m_states[static_cast<size_t>(prev - m_base)];
+				if (old == STATE_LATEST)
+				{
+					--m_values;
+				}
+				old = STATE_SUPERSEDED;
+			}
+
+			s.offset = offset;
+			m_states.push_back(static_cast<uint8_t>(tombstone ? STATE_TOMBSTONE : STATE_LATEST));
+			if (!tombstone)
+			{
+				++m_values;
+			}
+			return prev;
+		}
+
+		/**
+		 * Account a message appended at offset that is already superseded,
+		 * e.g. a reclaimed message restored without its key
+		 */
+		void add_superseded(int64_t offset)
+		{
+			if (m_states.empty())
+			{
+				m_base = offset;
+			}
+			m_states.push_back(static_cast<uint8_t>(STATE_SUPERSEDED));
+		}
+
+		/**
+		 * Drop the oldest offset as the partition evicts its message - key is
+		 * the key of that message
+		 */
+		void pop_front(const std::string& key)
+		{
+			if (m_states.empty())
+			{
+				return;
+			}
+
+			if (m_states.front() == STATE_LATEST)
+			{
+				--m_values;
+			}
+			if (m_states.front() != STATE_SUPERSEDED)
+			{
+				remove(key);
+			}
+			m_states.pop_front();
+			++m_base;
+		}
+
+		/**
+		 * Whether the message at offset is the latest of its key - tombstones
+		 * included
+		 */
+		bool is_latest(int64_t offset) const
+		{
+			return (get_state(offset) == STATE_LATEST) || (get_state(offset) == STATE_TOMBSTONE);
+		}
+
+		bool is_tombstone(int64_t offset) const
+		{
+			return get_state(offset) == STATE_TOMBSTONE;
+		}
+
+		/**
+		 * Get the offset of the latest message with the key - -1 if none
+		 */
+		int64_t find(const std::string& key) const
+		{
+			const slot* s = lookup(key);
+			return (s == NULL) ? -1 : s->offset;
+		}
+
+		/**
+		 * Offsets of the latest values in ascending order - keys deleted by a
+		 * tombstone are left out
+		 */
+		std::vector<int64_t> values() const
+		{
+			std::vector<int64_t> offsets;
+			offsets.reserve(m_values);
+			for (size_t i=0; i<m_slots.size(); ++i)
+			{
+				if ((m_slots[i].offset >= 0) && !is_tombstone(m_slots[i].offset))
+				{
+					offsets.push_back(m_slots[i].offset);
+				}
+			}
+			std::sort(offsets.begin(), offsets.end());
+			return offsets;
+		}
+
+		/**
+		 * Number of keys with a value (not deleted by a tombstone)
+		 */
+		size_t size() const
+		{
+			return m_values;
+		}
+
+		void clear()
+		{
+			m_slots.clear();
+			m_used = 0;
+			m_removed = 0;
+			m_states.clear();
+			m_base = 0;
+			m_values = 0;
+		}
+
+	private:
+		enum state
+		{
+			STATE_SUPERSEDED = 0,
+			STATE_LATEST,
+			STATE_TOMBSTONE,
+			STATE_UNKNOWN
+		};
+
+		// Slot offsets - free slots are empty or removed
+		static const int64_t SLOT_EMPTY = -1;
+		static const int64_t SLOT_REMOVED = -2;
+
+		struct slot
+		{
+			slot():
+				hash(0),
+				offset(SLOT_EMPTY),
+				key()
+			{
+
+			}
+
+			uint64_t hash;
+			int64_t offset;
+			std::string key;
+		};
+
+		state get_state(int64_t offset) const
+		{
+			if ((offset < m_base) || (offset >= m_base + static_cast<int64_t>(m_states.size())))
+			{
+				return STATE_UNKNOWN;
+			}
+			return static_cast<state>(m_states[static_cast<size_t>(offset - m_base)]);
+		}
+
+		const slot* lookup(const std::string& key) const
+		{
+			if (m_used == 0)
+			{
+				return NULL;
+			}
+
+			uint64_t hash = util::hash_bytes(key.data(), key.size());
+			size_t mask = m_slots.size() - 1;
+			for (size_t pos = static_cast<size_t>(hash) & mask;; pos = (pos + 1) & mask)
+			{
+				const slot& s = m_slots[pos];
+				if (s.offset == SLOT_EMPTY)
+				{
+					return NULL;
+				}
+				if ((s.offset >= 0) && (s.hash == hash) && (s.key == key))
+				{
+					return &s;
+				}
+			}
+		}
+
+		/**
+		 * Find the slot of the key or claim one for it - claimed slots have a
+		 * negative offset
+		 */
+		slot& insert(const std::string& key)
+		{
+			uint64_t hash = util::hash_bytes(key.data(), key.size());
+			size_t mask = m_slots.size() - 1;
+			size_t pos = static_cast<size_t>(hash) & mask;
+			size_t free_pos = m_slots.size();
+			for (;; pos = (pos + 1) & mask)
+			{
+				slot& s = m_slots[pos];
+				if (s.offset == SLOT_EMPTY)
+				{
+					break;
+				}
+				if ((s.offset == SLOT_REMOVED) && (free_pos == m_slots.size()))
+				{
+					free_pos = pos;
+				}
+				else if ((s.offset >= 0) && (s.hash == hash) && (s.key == key))
+				{
+					return s;
+				}
+			}
+
+			// Reuse the first removed slot on the probe sequence if any
+			if (free_pos != m_slots.size())
+			{
+				pos = free_pos;
+				--m_removed;
+			}
+
+			slot& s = m_slots[pos];
+			s.hash = hash;
+			s.offset = SLOT_EMPTY;
+			s.key = key;
+			++m_used;
+			return s;
+		}
+
+		void remove(const std::string& key)
+		{
+			slot* s = const_cast<slot*>(lookup(key));
+			if (s != NULL)
+			{
+				std::string().swap(s->key);
+				s->offset = SLOT_REMOVED;
+				--m_used;
+				++m_removed;
+			}
+		}
+
+		/**
+		 * Move the used slots to a table with room for at least count keys
+		 */
+		void rehash(size_t count)
+		{
+			size_t size = 16;
+			while (size * 7 < count * 10)
+			{
+				size <<= 1;
+			}
+
+			std::vector<slot> old(size);
+			old.swap(m_slots);
+			m_removed = 0;
+
+			size_t mask = size - 1;
+			for (size_t i=0; i<old.size(); ++i)
+			{
+				if (old[i].offset < 0)
+				{
+					continue;
+				}
+
+				size_t pos = static_cast<size_t>(old[i].hash) & mask;
+				while (m_slots[pos].offset != SLOT_EMPTY)
+				{
+					pos = (pos + 1) & mask;
+				}
+
+				slot& s = m_slots[pos];
+				s.hash = old[i].hash;
+				s.offset = old[i].offset;
+				s.key.swap(old[i].key);
+			}
+		}
+
+		std::vector<slot> m_slots;
+		size_t m_used;
+		size_t m_removed;
+
+		// State of each retained offset starting at m_base (one byte each)
+		std::deque<uint8_t> m_states;
+		int64_t m_base;
+
+		// Keys with a value
+		size_t m_values;
+	};
+
+}
+
+#endif
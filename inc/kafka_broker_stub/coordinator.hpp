@@ -0,0 +1,1099 @@
+#ifndef KAFKA_BROKER_STUB_COORDINATOR_HPP_INC_
+#define KAFKA_BROKER_STUB_COORDINATOR_HPP_INC_
+
+/*
+ * In-memory consumer group coordinator.
+ *
+ * Groups go through the states of the Kafka group coordinator: a join moves
+ * the group to PREPARING_REBALANCE until all known members joined again or
+ * the rebalance timeout expired, then the generation is bumped and the group
+ * waits in COMPLETING_REBALANCE for the assignments of the leader before it
+ * becomes STABLE. Members that stop sending heartbeats for their session
+ * timeout are removed, which rebalances the group.
+ *
+ * JoinGroup and SyncGroup requests of followers wait for other members, so
+ * their responses are deferred: the coordinator hands out a
+ * deferred_response that the caller polls until the response is ready.
+ */
+
+#include "group.hpp"
+#include "timer_wheel.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <map>
+#include <pthread.h>
+#include <set>
+#include <stdexcept>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+namespace kafka_broker_stub {
+
+	/**
+	 * Response to a request that is completed later
+	 *
+	 * The owner polls it until it returns true and deletes it afterwards or
+	 * earlier to abandon the request (e.g. when the connection closes).
+	 */
+	class deferred_response
+	{
+	public:
+		virtual ~deferred_response() {}
+
+		/**
+		 * Get the response (including its size field) once it is ready -
+		 * returns false while it is not
+		 */
+		virtual bool poll(uint64_t now_ns, std::string& response) = 0;
+	};
+
+	enum group_state
+	{
+		GROUP_EMPTY = 0,
+		GROUP_PREPARING_REBALANCE,
+		GROUP_COMPLETING_REBALANCE,
+		GROUP_STABLE,
+
+		// State of groups the coordinator does not know
+		GROUP_DEAD
+	};
+
+	/**
+	 * Error codes of the group requests
+	 */
+	enum group_error
+	{
+		GROUP_ERR_NONE = 0,
+		GROUP_ERR_NOT_COORDINATOR = 16,
+		GROUP_ERR_ILLEGAL_GENERATION = 22,
+		GROUP_ERR_INCONSISTENT_PROTOCOL = 23,
+		GROUP_ERR_INVALID_GROUP_ID = 24,
+		GROUP_ERR_UNKNOWN_MEMBER_ID = 25,
+		GROUP_ERR_INVALID_SESSION_TIMEOUT = 26,
+		GROUP_ERR_REBALANCE_IN_PROGRESS = 27
+	};
+
+	/**
+	 * Groups with their members and committed offsets
+	 *
+	 * All calls are thread safe. Member IDs end in the index of the member
+	 * slot so heartbeats find their member without a lookup by name, and
+	 * session timeouts are tracked on a timer wheel that only looks at a
+	 * member when its timer expires - a heartbeat just moves the deadline.
+	 */
+	class group_coordinator
+	{
+	public:
+		group_coordinator():
+			m_mutex(),
+			m_groups(),
+			m_members(),
+			m_free(),
+			m_sessions(10000000, 1024),
+			m_expired(),
+			m_rebalancing(),
+			m_ready(),
+			m_tickets(),
+			m_next_ticket(1),
+			m_nonce(util::monotonic_ns()),
+			m_min_session_ms(6000),
+			m_max_session_ms(1800000)
+		{
+			if (pthread_mutex_init(&m_mutex, NULL) != 0)
+				throw std::runtime_error("Unable to initialize group coordinator");
+		}
+
+		~group_coordinator()
+		{
+			for (std::map<std::string, group_info*>::iterator it = m_groups.begin(); it != m_groups.end(); ++it)
+			{
+				delete it->second;
+			}
+			for (size_t i=0; i<m_members.size(); ++i)
+			{
+				delete m_members[i];
+			}
+			pthread_mutex_destroy(&m_mutex);
+		}
+
+		/**
+		 * Set the session timeouts accepted from members (default 6 s to 30 min
+		 * like a broker)
+		 */
+		void set_session_timeout_range(int32_t min_ms, int32_t max_ms)
+		{
+			pthread_mutex_lock(&m_mutex);
+			m_min_session_ms = min_ms;
+			m_max_session_ms = max_ms;
+			pthread_mutex_unlock(&m_mutex);
+		}
+
+		/**
+		 * Handle a JoinGroup request - the response is written to out or, if
+		 * the member has to wait for others, a deferred response is returned.
+		 * Without can_wait the rebalance completes at once with the members
+		 * that did not join again keeping their metadata.
+		 */
+		deferred_response* join(const group::join_request& req, uint64_t now_ns, bool can_wait, std::string& out)
+		{
+			pthread_mutex_lock(&m_mutex);
+			expire(now_ns);
+
+			member* m = NULL;
+			int16_t err = check_join(req, m);
+			if (err != GROUP_ERR_NONE)
+			{
+				write(group::join_response(req.version(), req.header().correlation_id(), err, -1, "", "",
+				                           req.member_id(), primitive::array<group::member_metadata>()), out);
+				pthread_mutex_unlock(&m_mutex);
+				return NULL;
+			}
+
+			group_info* grp = get_group(req.group_id().std_str());
+			if (m == NULL)
+			{
+				m = add_member(*grp, req.header().client_id().std_str(), now_ns);
+			}
+
+			// Take the new protocols and wait for the rebalance
+			m->session_timeout_ms = req.session_timeout();
+			m->rebalance_timeout_ms = req.rebalance_timeout();
+			m->protocols.clear();
+			for (size_t i=0; i<req.protocols().size(); ++i)
+			{
+				m->protocols.push_back(std::make_pair(req.protocols()[i].name().std_str(),
+				                                      req.protocols()[i].metadata().std_str()));
+			}
+			grp->protocol_type = req.protocol_type().std_str();
+			m->join.start(req.header().correlation_id(), req.version(), 0);
+
+			if (grp->state != GROUP_PREPARING_REBALANCE)
+			{
+				prepare_rebalance(*grp, now_ns);
+			}
+			m->joined = true;
+
+			if (all_joined(*grp) || !can_wait)
+			{
+				complete_join(*grp, now_ns);
+			}
+
+			deferred_response* deferred = NULL;
+			if (m->join.done)
+			{
+				out.swap(m->join.response);
+				m->join.reset();
+			}
+			else
+			{
+				m->join.ticket = m_next_ticket++;
+				m_tickets[m->join.ticket] = m->slot;
+				deferred = new waiter(*this, m->join.ticket);
+			}
+			pthread_mutex_unlock(&m_mutex);
+			return deferred;
+		}
+
+		/**
+		 * Handle a SyncGroup request - followers wait for the assignment of the
+		 * leader through a deferred response unless can_wait is false, which
+		 * answers them REBALANCE_IN_PROGRESS instead
+		 */
+		deferred_response* sync(const group::sync_request& req, uint64_t now_ns, bool can_wait, std::string& out)
+		{
+			pthread_mutex_lock(&m_mutex);
+			expire(now_ns);
+
+			member* m = find_member(req.group_id().std_str(), req.member_id().std_str());
+			int16_t err = GROUP_ERR_NONE;
+			if (m == NULL)
+				err = GROUP_ERR_UNKNOWN_MEMBER_ID;
+			else if (req.generation() != m->grp->generation)
+				err = GROUP_ERR_ILLEGAL_GENERATION;
+			else if (m->grp->state == GROUP_PREPARING_REBALANCE)
+				err = GROUP_ERR_REBALANCE_IN_PROGRESS;
+
+			deferred_response* deferred = NULL;
+			if (err == GROUP_ERR_NONE)
+			{
+				group_info& grp = *m->grp;
+				touch(*m, now_ns);
+				if ((grp.state == GROUP_COMPLETING_REBALANCE) && (m->member_id == grp.leader_id))
+				{
+					// The leader hands out the assignments
+					for (size_t i=0; i<req.assignments().size(); ++i)
+					{
+						member* target = find_member(grp.group_id, req.assignments()[i].member_id().std_str());
+						if ((target != NULL) && (target->grp == &grp))
+							target->assignment = req.assignments()[i].assignment().std_str();
+					}
+					grp.state = GROUP_STABLE;
+					for (size_t i=0; i<grp.members.size(); ++i)
+					{
+						member& cur = *m_members[grp.members[i]];
+						if (cur.sync.pending && (&cur != m))
+						{
+							finish(cur.sync, sync_response(cur, GROUP_ERR_NONE));
+						}
+					}
+				}
+
+				if (grp.state == GROUP_STABLE)
+				{
+					write(group::sync_response(req.version(), req.header().correlation_id(), 0,
+					                           primitive::bytearray(m->assignment)), out);
+				}
+				else if (can_wait)
+				{
+					m->sync.start(req.header().correlation_id(), req.version(), m_next_ticket++);
+					m_tickets[m->sync.ticket] = m->slot;
+					deferred = new waiter(*this, m->sync.ticket);
+				}
+				else
+				{
+					err = GROUP_ERR_REBALANCE_IN_PROGRESS;
+				}
+			}
+
+			if (err != GROUP_ERR_NONE)
+			{
+				write(group::sync_response(req.version(), req.header().correlation_id(), err, primitive::bytearray()),
+				      out);
+			}
+			pthread_mutex_unlock(&m_mutex);
+			return deferred;
+		}
+
+		/**
+		 * Handle a Heartbeat request - returns the error code
+		 */
+		int16_t heartbeat(const group::heartbeat_request& req, uint64_t now_ns)
+		{
+			pthread_mutex_lock(&m_mutex);
+			expire(now_ns);
+
+			member* m = find_member(req.group_id().std_str(), req.member_id().std_str());
+			int16_t err = GROUP_ERR_NONE;
+			if (m == NULL)
+			{
+				err = GROUP_ERR_UNKNOWN_MEMBER_ID;
+			}
+			else
+			{
+				// Members keep their session while the group rebalances
+				touch(*m, now_ns);
+				if (req.generation() != m->grp->generation)
+					err = GROUP_ERR_ILLEGAL_GENERATION;
+				else if (m->grp->state != GROUP_STABLE)
+					err = GROUP_ERR_REBALANCE_IN_PROGRESS;
+			}
+			pthread_mutex_unlock(&m_mutex);
+			return err;
+		}
+
+		/**
+		 * Handle a LeaveGroup request - returns the error code
+		 */
+		int16_t leave(const group::leave_request& req, uint64_t now_ns)
+		{
+			pthread_mutex_lock(&m_mutex);
+			expire(now_ns);
+
+			member* m = find_member(req.group_id().std_str(), req.member_id().std_str());
+			if (m != NULL)
+			{
+				remove_member(*m, now_ns);
+			}
+			pthread_mutex_unlock(&m_mutex);
+			return (m != NULL) ? GROUP_ERR_NONE : GROUP_ERR_UNKNOWN_MEMBER_ID;
+		}
+
+		/**
+		 * Handle an OffsetCommit request. Commits without a generation (-1) are
+		 * accepted for groups without members.
+		 */
+		void commit_offsets(const group::offset_commit_request& req, uint64_t now_ns, std::string& out)
+		{
+			pthread_mutex_lock(&m_mutex);
+			expire(now_ns);
+
+			int16_t err = GROUP_ERR_NONE;
+			group_info* grp = NULL;
+			if (req.group_id().size() == 0)
+			{
+				err = GROUP_ERR_INVALID_GROUP_ID;
+			}
+			else if (req.generation() < 0)
+			{
+				grp = get_group(req.group_id().std_str());
+				if (!grp->members.empty())
+					err = GROUP_ERR_UNKNOWN_MEMBER_ID;
+			}
+			else
+			{
+				member* m = find_member(req.group_id().std_str(), req.member_id().std_str());
+				if (m == NULL)
+					err = GROUP_ERR_UNKNOWN_MEMBER_ID;
+				else if (req.generation() != m->grp->generation)
+					err = GROUP_ERR_ILLEGAL_GENERATION;
+				else if (m->grp->state != GROUP_STABLE)
+					err = GROUP_ERR_REBALANCE_IN_PROGRESS;
+				else
+				{
+					grp = m->grp;
+					touch(*m, now_ns);
+				}
+			}
+
+			primitive::array<group::topic_errors> topics;
+			for (size_t i=0; i<req.topics().size(); ++i)
+			{
+				const group::commit_topic& top = req.topics()[i];
+				primitive::array<group::partition_error> partitions;
+				for (size_t k=0; k<top.partitions.size(); ++k)
+				{
+					const group::commit_partition& part = top.partitions[k];
+					if (err == GROUP_ERR_NONE)
+					{
+						committed_offset& committed = grp->offsets[top.name][part.partition];
+						committed.offset = part.offset;
+						committed.metadata = part.metadata;
+					}
+					partitions.push_back(group::partition_error(part.partition, err));
+				}
+				topics.push_back(group::topic_errors(top.name, partitions));
+			}
+			write(group::offset_commit_response(req.version(), req.header().correlation_id(), topics), out);
+			pthread_mutex_unlock(&m_mutex);
+		}
+
+		/**
+		 * Handle an OffsetFetch request - partitions without a committed offset
+		 * get offset -1
+		 */
+		void fetch_offsets(const group::offset_fetch_request& req, std::string& out)
+		{
+			pthread_mutex_lock(&m_mutex);
+			std::map<std::string, group_info*>::const_iterator it = m_groups.find(req.group_id().std_str());
+			const group_info* grp = (it != m_groups.end()) ? it->second : NULL;
+
+			primitive::array<group::topic_offsets> topics;
+			if (req.all_topics())
+			{
+				const offset_map& offsets = (grp != NULL) ? grp->offsets : empty_offsets();
+				for (offset_map::const_iterator top = offsets.begin(); top != offsets.end(); ++top)
+				{
+					primitive::array<group::partition_offset> partitions;
+					for (std::map<int32_t, committed_offset>::const_iterator part = top->second.begin();
+					     part != top->second.end(); ++part)
+					{
+						partitions.push_back(group::partition_offset(part->first, part->second.offset,
+						                                             part->second.metadata, 0));
+					}
+					topics.push_back(group::topic_offsets(top->first, partitions));
+				}
+			}
+			else
+			{
+				for (size_t i=0; i<req.topics().size(); ++i)
+				{
+					const group::offset_fetch_topic& top = req.topics()[i];
+					primitive::array<group::partition_offset> partitions;
+					for (size_t k=0; k<top.partitions().size(); ++k)
+					{
+						int32_t part = top.partitions()[k];
+						const committed_offset* committed = find_offset(grp, top.topic_name().std_str(), part);
+						partitions.push_back(group::partition_offset(part, committed ? committed->offset : -1,
+						                                             committed ? committed->metadata : "", 0));
+					}
+					topics.push_back(group::topic_offsets(top.topic_name(), partitions));
+				}
+			}
+			write(group::offset_fetch_response(req.version(), req.header().correlation_id(), topics, 0), out);
+			pthread_mutex_unlock(&m_mutex);
+		}
+
+		/**
+		 * Get the state of a group (GROUP_DEAD if unknown)
+		 */
+		group_state state(const std::string& group_id, uint64_t now_ns)
+		{
+			pthread_mutex_lock(&m_mutex);
+			expire(now_ns);
+			std::map<std::string, group_info*>::const_iterator it = m_groups.find(group_id);
+			group_state result = (it != m_groups.end()) ? it->second->state : GROUP_DEAD;
+			pthread_mutex_unlock(&m_mutex);
+			return result;
+		}
+
+		/**
+		 * Get the generation of a group (-1 if unknown)
+		 */
+		int32_t generation(const std::string& group_id) const
+		{
+			pthread_mutex_lock(&m_mutex);
+			std::map<std::string, group_info*>::const_iterator it = m_groups.find(group_id);
+			int32_t result = (it != m_groups.end()) ? it->second->generation : -1;
+			pthread_mutex_unlock(&m_mutex);
+			return result;
+		}
+
+		size_t member_count(const std::string& group_id) const
+		{
+			pthread_mutex_lock(&m_mutex);
+			std::map<std::string, group_info*>::const_iterator it = m_groups.find(group_id);
+			size_t result = (it != m_groups.end()) ? it->second->members.size() : 0;
+			pthread_mutex_unlock(&m_mutex);
+			return result;
+		}
+
+		/**
+		 * Get the offset committed by a group for a partition - returns false if
+		 * there is none
+		 */
+		bool committed(const std::string& group_id, const std::string& topic, int32_t partition,
+		               int64_t& offset) const
+		{
+			pthread_mutex_lock(&m_mutex);
+			std::map<std::string, group_info*>::const_iterator it = m_groups.find(group_id);
+			const committed_offset* committed = find_offset((it != m_groups.end()) ? it->second : NULL, topic,
+			                                                partition);
+			if (committed != NULL)
+				offset = committed->offset;
+			pthread_mutex_unlock(&m_mutex);
+			return committed != NULL;
+		}
+
+	private:
+		struct committed_offset
+		{
+			committed_offset():
+				offset(-1),
+				metadata()
+			{
+
+			}
+
+			int64_t offset;
+			std::string metadata;
+		};
+
+		typedef std::map<std::string, std::map<int32_t, committed_offset> > offset_map;
+
+		/**
+		 * Request of a member waiting for the group
+		 */
+		struct pending_request
+		{
+			pending_request():
+				pending(false),
+				done(false),
+				corr_id(0),
+				version(0),
+				ticket(0),
+				response()
+			{
+
+			}
+
+			void start(int32_t corr, int16_t ver, uint64_t tick)
+			{
+				pending = true;
+				done = false;
+				corr_id = corr;
+				version = ver;
+				ticket = tick;
+				response.clear();
+			}
+
+			void reset()
+			{
+				pending = false;
+				done = false;
+				ticket = 0;
+				response.clear();
+			}
+
+			bool pending;
+
+			// Response is ready but not collected by the caller (no ticket)
+			bool done;
+			int32_t corr_id;
+			int16_t version;
+			uint64_t ticket;
+			std::string response;
+		};
+
+		struct group_info;
+
+		struct member
+		{
+			member():
+				member_id(),
+				client_id(),
+				grp(NULL),
+				slot(0),
+				session_timeout_ms(0),
+				rebalance_timeout_ms(0),
+				deadline_ns(0),
+				timer_ns(0),
+				protocols(),
+				joined(false),
+				assignment(),
+				join(),
+				sync()
+			{
+
+			}
+
+			std::string member_id;
+			std::string client_id;
+			group_info* grp;
+			size_t slot;
+			int32_t session_timeout_ms;
+			int32_t rebalance_timeout_ms;
+
+			// Session expiry and time of the pending session timer (0 if none)
+			uint64_t deadline_ns;
+			uint64_t timer_ns;
+
+			// Supported protocols with their metadata in order of preference
+			std::vector<std::pair<std::string, std::string> > protocols;
+
+			// Joined in the current rebalance
+			bool joined;
+			std::string assignment;
+			pending_request join;
+			pending_request sync;
+
+		private:
+			member(const member&);
+			member& operator=(const member&);
+		};
+
+		struct group_info
+		{
+			explicit group_info(const std::string& id):
+				group_id(id),
+				state(GROUP_EMPTY),
+				generation(0),
+				protocol_type(),
+				protocol(),
+				leader_id(),
+				members(),
+				rebalance_deadline_ns(0),
+				offsets()
+			{
+
+			}
+
+			std::string group_id;
+			group_state state;
+			int32_t generation;
+			std::string protocol_type;
+			std::string protocol;
+			std::string leader_id;
+
+			// Member slots
+			std::vector<size_t> members;
+			uint64_t rebalance_deadline_ns;
+			offset_map offsets;
+		};
+
+		/**
+		 * Deferred response polling the coordinator for a ticket
+		 */
+		class waiter : public deferred_response
+		{
+		public:
+			waiter(group_coordinator& coordinator, uint64_t ticket):
+				m_coordinator(coordinator),
+				m_ticket(ticket)
+			{
+
+			}
+
+			~waiter()
+			{
+				m_coordinator.cancel(m_ticket);
+			}
+
+			bool poll(uint64_t now_ns, std::string& response)
+			{
+				return m_coordinator.collect(m_ticket, now_ns, response);
+			}
+
+		private:
+			waiter(const waiter&);
+			waiter& operator=(const waiter&);
+
+			group_coordinator& m_coordinator;
+			uint64_t m_ticket;
+		};
+
+		bool collect(uint64_t ticket, uint64_t now_ns, std::string& response)
+		{
+			pthread_mutex_lock(&m_mutex);
+			expire(now_ns);
+			std::map<uint64_t, std::string>::iterator it = m_ready.find(ticket);
+			bool ready = (it != m_ready.end());
+			if (ready)
+			{
+				response.swap(it->second);
+				m_ready.erase(it);
+			}
+			pthread_mutex_unlock(&m_mutex);
+			return ready;
+		}
+
+		/**
+		 * Drop a ticket - a pending request of a member stays pending but its
+		 * response is discarded
+		 */
+		void cancel(uint64_t ticket)
+		{
+			pthread_mutex_lock(&m_mutex);
+			m_ready.erase(ticket);
+			std::map<uint64_t, size_t>::iterator it = m_tickets.find(ticket);
+			if (it != m_tickets.end())
+			{
+				member* m = m_members[it->second];
+				if ((m != NULL) && (m->join.ticket == ticket))
+					m->join.ticket = 0;
+				if ((m != NULL) && (m->sync.ticket == ticket))
+					m->sync.ticket = 0;
+				m_tickets.erase(it);
+			}
+			pthread_mutex_unlock(&m_mutex);
+		}
+
+		int16_t check_join(const group::join_request& req, member*& m)
+		{
+			if (req.group_id().size() == 0)
+				return GROUP_ERR_INVALID_GROUP_ID;
+			if ((req.session_timeout() < m_min_session_ms) || (req.session_timeout() > m_max_session_ms))
+				return GROUP_ERR_INVALID_SESSION_TIMEOUT;
+
+			if (req.member_id().size() > 0)
+			{
+				m = find_member(req.group_id().std_str(), req.member_id().std_str());
+				if (m == NULL)
+					return GROUP_ERR_UNKNOWN_MEMBER_ID;
+			}
+
+			// The protocols must fit those of the other members
+			std::map<std::string, group_info*>::const_iterator it = m_groups.find(req.group_id().std_str());
+			const group_info* grp = (it != m_groups.end()) ? it->second : NULL;
+			if ((req.protocols().size() == 0) || (req.protocol_type().size() == 0))
+				return GROUP_ERR_INCONSISTENT_PROTOCOL;
+			if ((grp == NULL) || grp->members.empty() || ((grp->members.size() == 1) && (m != NULL)))
+				return GROUP_ERR_NONE;
+			if (grp->protocol_type != req.protocol_type().std_str())
+				return GROUP_ERR_INCONSISTENT_PROTOCOL;
+			for (size_t i=0; i<req.protocols().size(); ++i)
+			{
+				if (supported_by_all(*grp, req.protocols()[i].name().std_str(), m))
+					return GROUP_ERR_NONE;
+			}
+			return GROUP_ERR_INCONSISTENT_PROTOCOL;
+		}
+
+		/**
+		 * True if all members except skip support a protocol
+		 */
+		bool supported_by_all(const group_info& grp, const std::string& name, const member* skip) const
+		{
+			for (size_t i=0; i<grp.members.size(); ++i)
+			{
+				const member& cur = *m_members[grp.members[i]];
+				if ((&cur != skip) && (find_protocol(cur, name) == NULL))
+					return false;
+			}
+			return true;
+		}
+
+		static const std::string* find_protocol(const member& m, const std::string& name)
+		{
+			for (size_t i=0; i<m.protocols.size(); ++i)
+			{
+				if (m.protocols[i].first == name)
+					return &m.protocols[i].second;
+			}
+			return NULL;
+		}
+
+		group_info* get_group(const std::string& group_id)
+		{
+			std::map<std::string, group_info*>::iterator it = m_groups.find(group_id);
+			if (it != m_groups.end())
+				return it->second;
+
+			group_info* grp = new group_info(group_id);
+			m_groups[group_id] = grp;
+			return grp;
+		}
+
+		/**
+		 * Find a member by the slot index at the end of its ID
+		 */
+		member* find_member(const std::string& group_id, const std::string& member_id) const
+		{
+			size_t pos = member_id.rfind('-');
+			if ((pos == std::string::npos) || (pos + 1 >= member_id.size()))
+				return NULL;
+
+			char* end = NULL;
+			unsigned long slot = strtoul(member_id.c_str() + pos + 1, &end, 10);
+			if ((*end != '\0') || (slot >= m_members.size()))
+				return NULL;
+
+			member* m = m_members[slot];
+			if ((m == NULL) || (m->member_id != member_id) || (m->grp->group_id != group_id))
+				return NULL;
+			return m;
+		}
+
+		member* add_member(group_info& grp, const std::string& client_id, uint64_t now_ns)
+		{
+			member* m = new member();
+			if (m_free.empty())
+			{
+				m->slot = m_members.size();
+				m_members.push_back(m);
+			}
+			else
+			{
+				m->slot = m_free.back();
+				m_free.pop_back();
+				m_members[m->slot] = m;
+			}
+
+			// Client ID, a random part and the slot like "rdkafka-5f3a9c01d2e47b60-12"
+			m_nonce ^= m_nonce << 13;
+			m_nonce ^= m_nonce >> 7;
+			m_nonce ^= m_nonce << 17;
+			char suffix[48];
+			snprintf(suffix, sizeof(suffix), "-%08x%08x-%lu", static_cast<unsigned>(m_nonce >> 32),
+			         static_cast<unsigned>(m_nonce), static_cast<unsigned long>(m->slot));
+			m->member_id = client_id + suffix;
+			m->client_id = client_id;
+			m->grp = &grp;
+			m->deadline_ns = now_ns;
+			grp.members.push_back(m->slot);
+			return m;
+		}
+
+		/**
+		 * Remove a member, answering its waiting requests, and rebalance the
+		 * rest of the group
+		 */
+		void remove_member(member& m, uint64_t now_ns)
+		{
+			group_info& grp = *m.grp;
+			if (m.join.pending)
+			{
+				finish(m.join, group::join_response(m.join.version, m.join.corr_id, GROUP_ERR_UNKNOWN_MEMBER_ID, -1,
+				                                    "", "", "", primitive::array<group::member_metadata>()));
+			}
+			if (m.sync.pending)
+			{
+				finish(m.sync, sync_response(m, GROUP_ERR_UNKNOWN_MEMBER_ID));
+			}
+			if (m.join.ticket != 0)
+				m_tickets.erase(m.join.ticket);
+			if (m.sync.ticket != 0)
+				m_tickets.erase(m.sync.ticket);
+
+			grp.members.erase(std::find(grp.members.begin(), grp.members.end(), m.slot));
+			m_members[m.slot] = NULL;
+			m_free.push_back(m.slot);
+			bool leader = (m.member_id == grp.leader_id);
+			delete &m;
+
+			if (leader)
+				grp.leader_id.clear();
+
+			if (grp.state == GROUP_PREPARING_REBALANCE)
+			{
+				if (all_joined(grp))
+					complete_join(grp, now_ns);
+			}
+			else if (grp.members.empty())
+			{
+				grp.state = GROUP_EMPTY;
+				++grp.generation;
+				grp.protocol.clear();
+			}
+			else
+			{
+				prepare_rebalance(grp, now_ns);
+			}
+		}
+
+		void prepare_rebalance(group_info& grp, uint64_t now_ns)
+		{
+			// Followers waiting for assignments of the old generation retry
+			int32_t rebalance_ms = 0;
+			for (size_t i=0; i<grp.members.size(); ++i)
+			{
+				member& cur = *m_members[grp.members[i]];
+				if (cur.sync.pending)
+					finish(cur.sync, sync_response(cur, GROUP_ERR_REBALANCE_IN_PROGRESS));
+				cur.joined = false;
+				rebalance_ms = std::max(rebalance_ms, cur.rebalance_timeout_ms);
+			}
+
+			grp.state = GROUP_PREPARING_REBALANCE;
+			grp.rebalance_deadline_ns = now_ns + static_cast<uint64_t>(rebalance_ms) * 1000000;
+			m_rebalancing.insert(&grp);
+		}
+
+		bool all_joined(const group_info& grp) const
+		{
+			for (size_t i=0; i<grp.members.size(); ++i)
+			{
+				if (!m_members[grp.members[i]]->joined)
+					return false;
+			}
+			return true;
+		}
+
+		/**
+		 * Start the next generation with the members that joined and answer
+		 * their join requests
+		 */
+		void complete_join(group_info& grp, uint64_t now_ns)
+		{
+			m_rebalancing.erase(&grp);
+			++grp.generation;
+			if (grp.members.empty())
+			{
+				grp.state = GROUP_EMPTY;
+				grp.protocol.clear();
+				return;
+			}
+
+			grp.protocol = select_protocol(grp);
+			if (grp.leader_id.empty() || !is_member(grp, grp.leader_id))
+				grp.leader_id = m_members[grp.members[0]]->member_id;
+			grp.state = GROUP_COMPLETING_REBALANCE;
+
+			primitive::array<group::member_metadata> metadata;
+			for (size_t i=0; i<grp.members.size(); ++i)
+			{
+				const member& cur = *m_members[grp.members[i]];
+				const std::string* meta = find_protocol(cur, grp.protocol);
+				metadata.push_back(group::member_metadata(cur.member_id, primitive::bytearray(meta ? *meta : "")));
+			}
+
+			for (size_t i=0; i<grp.members.size(); ++i)
+			{
+				member& cur = *m_members[grp.members[i]];
+				cur.joined = false;
+				cur.assignment.clear();
+				touch(cur, now_ns);
+				if (cur.join.pending)
+				{
+					bool leader = (cur.member_id == grp.leader_id);
+					finish(cur.join, group::join_response(cur.join.version, cur.join.corr_id, GROUP_ERR_NONE,
+					                                      grp.generation, grp.protocol, grp.leader_id, cur.member_id,
+					                                      leader ? metadata : primitive::array<group::member_metadata>()));
+				}
+			}
+		}
+
+		bool is_member(const group_info& grp, const std::string& member_id) const
+		{
+			for (size_t i=0; i<grp.members.size(); ++i)
+			{
+				if (m_members[grp.members[i]]->member_id == member_id)
+					return true;
+			}
+			return false;
+		}
+
+		/**
+		 * Pick the protocol supported by all members that most members prefer
+		 */
+		std::string select_protocol(const group_info& grp) const
+		{
+			std::map<std::string, size_t> votes;
+			std::string best;
+			size_t best_votes = 0;
+			for (size_t i=0; i<grp.members.size(); ++i)
+			{
+				const member& cur = *m_members[grp.members[i]];
+				for (size_t k=0; k<cur.protocols.size(); ++k)
+				{
+					if (supported_by_all(grp, cur.protocols[k].first, NULL))
+					{
+						size_t count = ++votes[cur.protocols[k].first];
+						if (count > best_votes)
+						{
+							best = cur.protocols[k].first;
+							best_votes = count;
+						}
+						break;
+					}
+				}
+			}
+			return best;
+		}
+
+		group::sync_response sync_response(const member& m, int16_t err) const
+		{
+			return group::sync_response(m.sync.version, m.sync.corr_id, err,
+			                            primitive::bytearray(err == GROUP_ERR_NONE ? m.assignment : ""));
+		}
+
+		/**
+		 * Complete a pending request - the response goes to its ticket or stays
+		 * with the request for the caller handling it right now
+		 */
+		template <typename Response>
+		void finish(pending_request& req, const Response& resp)
+		{
+			std::string out;
+			write(resp, out);
+			if (req.ticket != 0)
+			{
+				m_ready[req.ticket].swap(out);
+				m_tickets.erase(req.ticket);
+				req.reset();
+			}
+			else
+			{
+				req.response.swap(out);
+				req.pending = false;
+				req.done = true;
+			}
+		}
+
+		/**
+		 * Restart the session of a member
+		 */
+		void touch(member& m, uint64_t now_ns)
+		{
+			m.deadline_ns = now_ns + static_cast<uint64_t>(m.session_timeout_ms) * 1000000;
+			if (m.timer_ns == 0)
+			{
+				m.timer_ns = m.deadline_ns;
+				m_sessions.schedule(static_cast<int>(m.slot), m.deadline_ns);
+			}
+		}
+
+		/**
+		 * Remove members whose session expired and complete rebalances whose
+		 * timeout passed
+		 */
+		void expire(uint64_t now_ns)
+		{
+			m_expired.clear();
+			m_sessions.expire(now_ns, m_expired);
+			for (size_t i=0; i<m_expired.size(); ++i)
+			{
+				member* m = m_members[static_cast<size_t>(m_expired[i])];
+
+				// Timers of removed members may fire for the next one in the slot
+				if ((m == NULL) || (m->timer_ns == 0) || (m->timer_ns > now_ns))
+					continue;
+
+				m->timer_ns = 0;
+				if ((m->deadline_ns > now_ns) || m->join.pending)
+				{
+					// Members waiting for a rebalance keep their session
+					if (m->deadline_ns <= now_ns)
+						m->deadline_ns = now_ns + static_cast<uint64_t>(m->session_timeout_ms) * 1000000;
+					m->timer_ns = m->deadline_ns;
+					m_sessions.schedule(static_cast<int>(m->slot), m->deadline_ns);
+				}
+				else
+				{
+					remove_member(*m, now_ns);
+				}
+			}
+
+			// Members that did not join in time are dropped
+			for (std::set<group_info*>::iterator it = m_rebalancing.begin(); it != m_rebalancing.end();)
+			{
+				group_info& grp = **it++;
+				if (grp.rebalance_deadline_ns > now_ns)
+					continue;
+
+				std::vector<member*> missing;
+				for (size_t i=0; i<grp.members.size(); ++i)
+				{
+					member* cur = m_members[grp.members[i]];
+					if (!cur->joined)
+						missing.push_back(cur);
+				}
+
+				// Removing the last one completes the join
+				for (size_t i=0; i<missing.size(); ++i)
+				{
+					remove_member(*missing[i], now_ns);
+				}
+				if (grp.state == GROUP_PREPARING_REBALANCE)
+					complete_join(grp, now_ns);
+			}
+		}
+
+		static const offset_map& empty_offsets()
+		{
+			static const offset_map empty;
+			return empty;
+		}
+
+		static const committed_offset* find_offset(const group_info* grp, const std::string& topic, int32_t partition)
+		{
+			if (grp == NULL)
+				return NULL;
+			offset_map::const_iterator top = grp->offsets.find(topic);
+			if (top == grp->offsets.end())
+				return NULL;
+			std::map<int32_t, committed_offset>::const_iterator part = top->second.find(partition);
+			return (part != top->second.end()) ? &part->second : NULL;
+		}
+
+		/**
+		 * Serialize a response with its size field
+		 */
+		template <typename Response>
+		static void write(const Response& resp, std::string& out)
+		{
+			size_t size = resp.serial_size();
+			out.resize(size + 4);
+			uint8_t* data = reinterpret_cast<uint8_t*>(&out[0]);
+			util::write_type<int32_t>(static_cast<int32_t>(size), data);
+			resp.serialize(data + 4);
+		}
+
+		group_coordinator(const group_coordinator&);
+		group_coordinator& operator=(const group_coordinator&);
+
+		mutable pthread_mutex_t m_mutex;
+		std::map<std::string, group_info*> m_groups;
+
+		// Members by slot with the free slots
+		std::vector<member*> m_members;
+		std::vector<size_t> m_free;
+
+		// Session timers by member slot
+		timer_wheel m_sessions;
+		std::vector<int> m_expired;
+		std::set<group_info*> m_rebalancing;
+
+		// Responses ready for their tickets and the member slots of pending tickets
+		std::map<uint64_t, std::string> m_ready;
+		std::map<uint64_t, size_t> m_tickets;
+		uint64_t m_next_ticket;
+		uint64_t m_nonce;
+		int32_t m_min_session_ms;
+		int32_t m_max_session_ms;
+	};
+
+}
+
+#endif
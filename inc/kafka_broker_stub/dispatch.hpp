@@ -0,0 +1,187 @@
+#ifndef KAFKA_BROKER_STUB_DISPATCH_HPP_INC_
+#define KAFKA_BROKER_STUB_DISPATCH_HPP_INC_
+
+/*
+ * Dispatch of requests to handlers by API key and version.
+ *
+ * Handlers are registered for a range of versions of an API key in a flat
+ * table holding a handler per key and version, so finding the handler of a
+ * request is a single indexed load. The built-in handlers of the broker stub
+ * are registered the same way, so custom handlers (e.g. injecting errors or
+ * implementing further APIs) can replace or wrap them.
+ */
+
+#include "util.hpp"
+#include <string>
+#include <vector>
+
+namespace kafka_broker_stub {
+
+	class deferred_response;
+	class scatter_buffer;
+
+	/**
+	 * Receiver of responses that refer to stored messages in place
+	 *
+	 * A handler passes the scattered response (with its size in front) while
+	 * it still blocks appends, so the referenced messages stay put during the
+	 * call. The sink sends what it can right away and copies what is left
+	 * before it returns. It returns false without sending anything if the
+	 * response cannot go out in order yet, e.g. behind held back responses -
+	 * the handler then adds a contiguous response instead.
+	 */
+	class response_sinkI
+	{
+	public:
+		virtual ~response_sinkI() {}
+
+		virtual bool send(scatter_buffer& response) = 0;
+	};
+
+	/**
+	 * Request passed to a handler and the results it hands back
+	 */
+	struct request_context
+	{
+		request_context(const uint8_t* d, size_t s, uint8_t* buf, size_t buf_size, std::vector<std::string>& resp,
+		                deferred_response** def, response_sinkI* snk = NULL):
+			data(d),
+			size(s),
+			api_key((s >= 2) ? util::read_type<int16_t>(d) : -1),
+			api_version((s >= 4) ? util::read_type<int16_t>(d + 2) : -1),
+			response_buf(buf),
+			response_buf_size(buf_size),
+			responses(resp),
+			throttle_ms(0),
+			deferred(def),
+			sink(snk),
+			sent_bytes(0)
+		{
+
+		}
+
+		// Request starting with its header (without the size in front)
+		const uint8_t* data;
+		size_t size;
+		int16_t api_key;
+		int16_t api_version;
+
+		// Buffer for small responses (without the size in front)
+		uint8_t* response_buf;
+		size_t response_buf_size;
+
+		// Responses with the size in front, e.g. of any size
+		std::vector<std::string>& responses;
+
+		// Time the client should back off due to a quota violation
+		uint32_t throttle_ms;
+
+		// Where to store a response that completes later - NULL if the
+		// caller cannot wait for one (see broker_stub::handle_data())
+		deferred_response** deferred;
+
+		// Where to send responses referring to stored messages - NULL if
+		// the caller only takes contiguous responses
+		response_sinkI* sink;
+
+		// Bytes of the responses handed to the sink
+		size_t sent_bytes;
+
+	private:
+		request_context(const request_context&);
+		request_context& operator=(const request_context&);
+	};
+
+	/**
+	 * Interface for request handlers
+	 */
+	class request_handlerI
+	{
+	public:
+		virtual ~request_handlerI() {}
+
+		/**
+		 * Handle a request - returns the size of a response written to
+		 * ctx.response_buf, 0 if responses were added to ctx.responses or
+		 * handed to ctx.sink or there is none, and a negative value if the request cannot be parsed
+		 * (which stops parsing the stream)
+		 */
+		virtual int handle(request_context& ctx) = 0;
+	};
+
+	/**
+	 * Table of the handlers per API key and version
+	 */
+	class handler_table
+	{
+	public:
+		// Highest API key and version handlers can be registered for
+		static const int16_t MAX_API_KEY = 127;
+		static const int16_t MAX_VERSION = 31;
+
+		handler_table():
+			m_handlers(static_cast<size_t>(MAX_API_KEY + 1) * static_cast<size_t>(MAX_VERSION + 1), NULL)
+		{
+
+		}
+
+		/**
+		 * Register handler for versions min_version to max_version of the
+		 * API key, replacing the handlers registered before - a NULL handler
+		 * removes them. Returns false if the key or a version is out of range.
+		 */
+		bool set(int16_t api_key, int16_t min_version, int16_t max_version, request_handlerI* handler)
+		{
+			if ((api_key < 0) || (api_key > MAX_API_KEY) || (min_version < 0) || (max_version > MAX_VERSION) ||
+			    (min_version > max_version))
+			{
+				return false;
+			}
+
+			for (int16_t v=min_version; v<=max_version; ++v)
+			{
+				m_handlers[index(api_key, v)] = handler;
+			}
+			return true;
+		}
+
+		/**
+		 * Get the handler of a version of an API key - NULL if there is none
+		 */
+		request_handlerI* get(int16_t api_key, int16_t api_version) const
+		{
+			if ((api_key < 0) || (api_key > MAX_API_KEY) || (api_version < 0) || (api_version > MAX_VERSION))
+			{
+				return NULL;
+			}
+			return m_handlers[index(api_key, api_version)];
+		}
+
+		/**
+		 * Highest version of the API key with a handler - -1 if there is none
+		 */
+		int16_t max_version(int16_t api_key) const
+		{
+			for (int16_t v=MAX_VERSION; v>=0; --v)
+			{
+				if (get(api_key, v) != NULL)
+				{
+					return v;
+				}
+			}
+			return -1;
+		}
+
+	private:
+		static size_t index(int16_t api_key, int16_t api_version)
+		{
+			return static_cast<size_t>(api_key) * static_cast<size_t>(MAX_VERSION + 1) +
+			       static_cast<size_t>(api_version);
+		}
+
+		std::vector<request_handlerI*> m_handlers;
+	};
+
+}
+
+#endif
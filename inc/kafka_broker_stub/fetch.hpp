@@ -0,0 +1,545 @@
+#ifndef KAFKA_BROKER_STUB_FETCH_HPP_INC_
+#define KAFKA_BROKER_STUB_FETCH_HPP_INC_
+
+/**
+ * Definitions used for handling fetch requests and responses.
+ */
+
+#include "primitive.hpp"
+#include "headers.hpp"
+
+namespace kafka_broker_stub { namespace fetch {
+
+	class partition_request : public kafka_elementI
+	{
+	public:
+		partition_request():
+			m_partition(),
+			m_fetch_offset(),
+			m_max_bytes()
+		{
+
+		}
+
+		const uint8_t* deserialize(const uint8_t* data)
+		{
+			data = m_partition.deserialize(data);
+			data = m_fetch_offset.deserialize(data);
+			data = m_max_bytes.deserialize(data);
+			return data;
+		}
+
+		const primitive::int32& partition() const
+		{
+			return m_partition;
+		}
+
+		const primitive::int64& fetch_offset() const
+		{
+			return m_fetch_offset;
+		}
+
+		const primitive::int32& max_bytes() const
+		{
+			return m_max_bytes;
+		}
+
+	private:
+		primitive::int32 m_partition;
+		primitive::int64 m_fetch_offset;
+		primitive::int32 m_max_bytes;
+	};
+
+	class topic_request : public kafka_elementI
+	{
+	public:
+		topic_request():
+			m_topic_name(),
+			m_partitions()
+		{
+
+		}
+
+		const uint8_t* deserialize(const uint8_t* data)
+		{
+			data = m_topic_name.deserialize(data);
+			return m_partitions.deserialize(data);
+		}
+
+		const primitive::string& topic_name() const
+		{
+			return m_topic_name;
+		}
+
+		const primitive::array<partition_request>& partitions() const
+		{
+			return m_partitions;
+		}
+
+	private:
+		primitive::string m_topic_name;
+		primitive::array<partition_request> m_partitions;
+	};
+
+	/**
+	 * Request in version 0 to 2 (the versions only differ in the response)
+	 */
+	class request_v0 : public kafka_elementI
+	{
+	public:
+		request_v0():
+			m_req_header(),
+			m_replica_id(),
+			m_max_wait(),
+			m_min_bytes(),
+			m_topics()
+		{
+
+		}
+
+		const uint8_t* deserialize(const uint8_t* data)
+		{
+			data = m_req_header.deserialize(data);
+			data = m_replica_id.deserialize(data);
+			data = m_max_wait.deserialize(data);
+			data = m_min_bytes.deserialize(data);
+			data = m_topics.deserialize(data);
+			return data;
+		}
+
+		const headers::request_hdr& header() const
+		{
+			return m_req_header;
+		}
+
+		const primitive::int32& replica_id() const
+		{
+			return m_replica_id;
+		}
+
+		const primitive::int32& max_wait() const
+		{
+			return m_max_wait;
+		}
+
+		const primitive::int32& min_bytes() const
+		{
+			return m_min_bytes;
+		}
+
+		const primitive::array<topic_request>& topics() const
+		{
+			return m_topics;
+		}
+
+	private:
+		headers::request_hdr m_req_header;
+		primitive::int32 m_replica_id;
+		primitive::int32 m_max_wait;
+		primitive::int32 m_min_bytes;
+		primitive::array<topic_request> m_topics;
+	};
+
+	/**
+	 * Stored message referenced by a fetch response. The strings belong to
+	 * the partition and must not change until the response is serialized.
+	 * A NULL key or value is sent as null.
+	 */
+	struct message_ref
+	{
+		message_ref(int64_t off, const std::string& k, const std::string& v, int64_t ts = -1):
+			offset(off),
+			timestamp(ts),
+			key(&k),
+			value(&v)
+		{
+
+		}
+
+		int64_t offset;
+		int64_t timestamp;
+		const std::string* key;
+		const std::string* value;
+	};
+
+	/**
+	 * Fetched data of one partition
+	 *
+	 * The messages are encoded as a message set straight from the referenced
+	 * strings, in format v0 (magic byte 0) or in format v1 (magic byte 1)
+	 * which carries the timestamps of the messages.
+	 */
+	class partition_data : public kafka_elementI
+	{
+	public:
+		partition_data():
+			m_partition(),
+			m_err_code(),
+			m_high_watermark(),
+			m_magic(0),
+			m_messages()
+		{
+
+		}
+
+		partition_data(const primitive::int32& partition, const primitive::int16& err_code,
+		               const primitive::int64& high_watermark, uint8_t magic = 0):
+			m_partition(partition),
+			m_err_code(err_code),
+			m_high_watermark(high_watermark),
+			m_magic(magic),
+			m_messages()
+		{
+
+		}
+
+		void add_message(const message_ref& msg)
+		{
+			m_messages.push_back(msg);
+		}
+
+		/**
+		 * Size of a message in the message set
+		 */
+		static size_t message_size(const message_ref& msg, uint8_t magic = 0)
+		{
+			// Offset, message size, crc, magic byte, attributes, timestamp in
+			// v1, key and value sizes
+			return 26 + ((magic > 0) ? 8 : 0) + ((msg.key != NULL) ? msg.key->size() : 0) +
+			       ((msg.value != NULL) ? msg.value->size() : 0);
+		}
+
+		uint8_t* serialize(uint8_t* data) const
+		{
+			data = m_partition.serialize(data);
+			data = m_err_code.serialize(data);
+			data = m_high_watermark.serialize(data);
+
+			util::write_type<int32_t>(static_cast<int32_t>(set_size()), data);
+			data += 4;
+			for (size_t i=0; i<m_messages.size(); ++i)
+			{
+				data = serialize_message(m_messages[i], data);
+			}
+			return data;
+		}
+
+		/**
+		 * Keys and values are referenced in place if large enough
+		 */
+		void scatter(scatter_buffer& out) const
+		{
+			uint8_t* data = out.reserve(18);
+			data = m_partition.serialize(data);
+			data = m_err_code.serialize(data);
+			data = m_high_watermark.serialize(data);
+			util::write_type<int32_t>(static_cast<int32_t>(set_size()), data);
+			for (size_t i=0; i<m_messages.size(); ++i)
+			{
+				scatter_message(m_messages[i], out);
+			}
+		}
+
+		size_t serial_size() const
+		{
+			size_t size = 0;
+			size += m_partition.serial_size();
+			size += m_err_code.serial_size();
+			size += m_high_watermark.serial_size();
+			size += 4 + set_size();
+			return size;
+		}
+
+	private:
+		size_t set_size() const
+		{
+			size_t size = 0;
+			for (size_t i=0; i<m_messages.size(); ++i)
+			{
+				size += message_size(m_messages[i], m_magic);
+			}
+			return size;
+		}
+
+		uint8_t* serialize_message(const message_ref& msg, uint8_t* data) const
+		{
+			util::write_type<int64_t>(msg.offset, data);
+			util::write_type<int32_t>(static_cast<int32_t>(message_size(msg, m_magic) - 12), data + 8);
+
+			// The crc covers the magic byte and everything after it
+			uint8_t* crc_start = data + 16;
+			uint8_t* cur = write_message_head(msg, crc_start);
+			if (msg.key != NULL)
+			{
+				memcpy(cur, msg.key->data(), msg.key->size());
+				cur += msg.key->size();
+			}
+			int32_t value_size = (msg.value == NULL) ? -1 : static_cast<int32_t>(msg.value->size());
+			util::write_type<int32_t>(value_size, cur);
+			cur += 4;
+			if (msg.value != NULL)
+			{
+				memcpy(cur, msg.value->data(), msg.value->size());
+				cur += msg.value->size();
+			}
+
+			uint32_t crc = util::crc32(crc_start, static_cast<size_t>(cur - crc_start));
+			util::write_type<uint32_t>(crc, data + 12);
+			return cur;
+		}
+
+		void scatter_message(const message_ref& msg, scatter_buffer& out) const
+		{
+			// Offset, message size, crc, magic byte, attributes, timestamp and key size
+			size_t head_size = (m_magic > 0) ? 30 : 22;
+			uint8_t* head = out.reserve(head_size);
+			util::write_type<int64_t>(msg.offset, head);
+			util::write_type<int32_t>(static_cast<int32_t>(message_size(msg, m_magic) - 12), head + 8);
+			write_message_head(msg, head + 16);
+			if (msg.key != NULL)
+			{
+				out.append(msg.key->data(), msg.key->size());
+			}
+
+			uint8_t* value_head = out.reserve(4);
+			int32_t value_size = (msg.value == NULL) ? -1 : static_cast<int32_t>(msg.value->size());
+			util::write_type<int32_t>(value_size, value_head);
+			if (msg.value != NULL)
+			{
+				out.append(msg.value->data(), msg.value->size());
+			}
+
+			// The crc covers the magic byte and everything after it
+			uint32_t crc = util::crc32(head + 16, head_size - 16);
+			if (msg.key != NULL)
+			{
+				crc = util::crc32(msg.key->data(), msg.key->size(), crc);
+			}
+			crc = util::crc32(value_head, 4, crc);
+			if (msg.value != NULL)
+			{
+				crc = util::crc32(msg.value->data(), msg.value->size(), crc);
+			}
+			util::write_type<uint32_t>(crc, head + 12);
+		}
+
+		/**
+		 * Write magic byte, attributes, the timestamp in v1 and the key size
+		 * - returns the position of the key
+		 */
+		uint8_t* write_message_head(const message_ref& msg, uint8_t* data) const
+		{
+			*data++ = m_magic;
+			*data++ = 0; // Attributes - no compression, create time
+			if (m_magic > 0)
+			{
+				util::write_type<int64_t>(msg.timestamp, data);
+				data += 8;
+			}
+			int32_t key_size = (msg.key == NULL) ? -1 : static_cast<int32_t>(msg.key->size());
+			util::write_type<int32_t>(key_size, data);
+			return data + 4;
+		}
+
+		primitive::int32 m_partition;
+		primitive::int16 m_err_code;
+		primitive::int64 m_high_watermark;
+		uint8_t m_magic;
+		std::vector<message_ref> m_messages;
+	};
+
+	class topic_data : public kafka_elementI
+	{
+	public:
+		topic_data():
+			m_topic_name(),
+			m_partitions()
+		{
+
+		}
+
+		/**
+		 * Topic without partitions - they are added in place through
+		 * partitions()
+		 */
+		topic_data(const primitive::string& topic):
+			m_topic_name(topic),
+			m_partitions()
+		{
+
+		}
+
+		topic_data(const primitive::string& topic, const primitive::array<partition_data>& partitions):
+			m_topic_name(topic),
+			m_partitions(partitions)
+		{
+
+		}
+
+		uint8_t* serialize(uint8_t* data) const
+		{
+			data = m_topic_name.serialize(data);
+			data = m_partitions.serialize(data);
+			return data;
+		}
+
+		void scatter(scatter_buffer& out) const
+		{
+			m_topic_name.scatter(out);
+			m_partitions.scatter(out);
+		}
+
+		size_t serial_size() const
+		{
+			size_t size = 0;
+			size += m_topic_name.serial_size();
+			size += m_partitions.serial_size();
+			return size;
+		}
+
+		const primitive::array<partition_data>& partitions() const
+		{
+			return m_partitions;
+		}
+
+		primitive::array<partition_data>& partitions()
+		{
+			return m_partitions;
+		}
+
+	private:
+		primitive::string m_topic_name;
+		primitive::array<partition_data> m_partitions;
+	};
+
+	class response_v0 : public kafka_elementI
+	{
+	public:
+		/**
+		 * Response without topics - they are added in place through topics()
+		 */
+		explicit response_v0(const primitive::int32& corr_id):
+			m_resp_header(corr_id),
+			m_topics()
+		{
+
+		}
+
+		response_v0(const primitive::int32& corr_id, const primitive::array<topic_data>& topics):
+			m_resp_header(corr_id),
+			m_topics(topics)
+		{
+
+		}
+
+		uint8_t* serialize(uint8_t* data) const
+		{
+			data = m_resp_header.serialize(data);
+			data = m_topics.serialize(data);
+			return data;
+		}
+
+		void scatter(scatter_buffer& out) const
+		{
+			m_resp_header.scatter(out);
+			m_topics.scatter(out);
+		}
+
+		size_t serial_size() const
+		{
+			size_t size = 0;
+			size += m_resp_header.serial_size();
+			size += m_topics.serial_size();
+			return size;
+		}
+
+		const primitive::array<topic_data>& topics() const
+		{
+			return m_topics;
+		}
+
+		primitive::array<topic_data>& topics()
+		{
+			return m_topics;
+		}
+
+	private:
+		headers::response_hdr m_resp_header;
+		primitive::array<topic_data> m_topics;
+	};
+
+	/**
+	 * Response for version 1 and 2 of the request, which starts with the time
+	 * the client was throttled due to a quota violation
+	 */
+	class response_v1 : public kafka_elementI
+	{
+	public:
+		response_v1(const primitive::int32& corr_id, const primitive::int32& throttle_time):
+			m_resp_header(corr_id),
+			m_throttle_time(throttle_time),
+			m_topics()
+		{
+
+		}
+
+		response_v1(const primitive::int32& corr_id, const primitive::int32& throttle_time,
+		            const primitive::array<topic_data>& topics):
+			m_resp_header(corr_id),
+			m_throttle_time(throttle_time),
+			m_topics(topics)
+		{
+
+		}
+
+		uint8_t* serialize(uint8_t* data) const
+		{
+			data = m_resp_header.serialize(data);
+			data = m_throttle_time.serialize(data);
+			data = m_topics.serialize(data);
+			return data;
+		}
+
+		void scatter(scatter_buffer& out) const
+		{
+			m_resp_header.scatter(out);
+			m_throttle_time.scatter(out);
+			m_topics.scatter(out);
+		}
+
+		size_t serial_size() const
+		{
+			size_t size = 0;
+			size += m_resp_header.serial_size();
+			size += m_throttle_time.serial_size();
+			size += m_topics.serial_size();
+			return size;
+		}
+
+		const primitive::array<topic_data>& topics() const
+		{
+			return m_topics;
+		}
+
+		primitive::array<topic_data>& topics()
+		{
+			return m_topics;
+		}
+
+		/**
+		 * Set once the response is charged to the quota of the client
+		 */
+		primitive::int32& throttle_time()
+		{
+			return m_throttle_time;
+		}
+
+	private:
+		headers::response_hdr m_resp_header;
+		primitive::int32 m_throttle_time;
+		primitive::array<topic_data> m_topics;
+	};
+
+}}
+
+#endif
@@ -0,0 +1,1111 @@
+#ifndef KAFKA_BROKER_STUB_GROUP_HPP_INC_
+#define KAFKA_BROKER_STUB_GROUP_HPP_INC_
+
+/**
+ * Definitions used for handling the consumer group requests and responses
+ * (FindCoordinator, JoinGroup, SyncGroup, Heartbeat, LeaveGroup, OffsetCommit
+ * and OffsetFetch).
+ *
+ * Unlike the produce definitions one class covers all supported versions of
+ * a request or response, taking the version on construction.
+ */
+
+#include "primitive.hpp"
+#include "headers.hpp"
+
+namespace kafka_broker_stub { namespace group {
+
+	/**
+	 * FindCoordinator request in version 0 and 1
+	 */
+	class find_coordinator_request : public kafka_elementI
+	{
+	public:
+		explicit find_coordinator_request(int16_t version):
+			m_version(version),
+			m_req_header(),
+			m_key(),
+			m_key_type(0)
+		{
+
+		}
+
+		const uint8_t* deserialize(const uint8_t* data)
+		{
+			data = m_req_header.deserialize(data);
+			data = m_key.deserialize(data);
+			if (m_version >= 1)
+			{
+				data = m_key_type.deserialize(data);
+			}
+			return data;
+		}
+
+		const headers::request_hdr& header() const
+		{
+			return m_req_header;
+		}
+
+		/**
+		 * Group ID (or transactional ID for key type 1)
+		 */
+		const primitive::string& key() const
+		{
+			return m_key;
+		}
+
+		const primitive::int8& key_type() const
+		{
+			return m_key_type;
+		}
+
+	private:
+		int16_t m_version;
+		headers::request_hdr m_req_header;
+		primitive::string m_key;
+		primitive::int8 m_key_type;
+	};
+
+	class find_coordinator_response : public kafka_elementI
+	{
+	public:
+		find_coordinator_response(int16_t version, const primitive::int32& corr_id, const primitive::int16& err_code,
+		                          const primitive::int32& node_id, const primitive::string& host,
+		                          const primitive::int32& port):
+			m_version(version),
+			m_resp_header(corr_id),
+			m_throttle_time(0),
+			m_err_code(err_code),
+			m_err_message(),
+			m_node_id(node_id),
+			m_host(host),
+			m_port(port)
+		{
+
+		}
+
+		uint8_t* serialize(uint8_t* data) const
+		{
+			data = m_resp_header.serialize(data);
+			if (m_version >= 1)
+			{
+				data = m_throttle_time.serialize(data);
+			}
+			data = m_err_code.serialize(data);
+			if (m_version >= 1)
+			{
+				data = m_err_message.serialize(data);
+			}
+			data = m_node_id.serialize(data);
+			data = m_host.serialize(data);
+			data = m_port.serialize(data);
+			return data;
+		}
+
+		size_t serial_size() const
+		{
+			size_t size = 0;
+			size += m_resp_header.serial_size();
+			if (m_version >= 1)
+			{
+				size += m_throttle_time.serial_size();
+				size += m_err_message.serial_size();
+			}
+			size += m_err_code.serial_size();
+			size += m_node_id.serial_size();
+			size += m_host.serial_size();
+			size += m_port.serial_size();
+			return size;
+		}
+
+	private:
+		int16_t m_version;
+		headers::response_hdr m_resp_header;
+		primitive::int32 m_throttle_time;
+		primitive::int16 m_err_code;
+		primitive::string m_err_message;
+		primitive::int32 m_node_id;
+		primitive::string m_host;
+		primitive::int32 m_port;
+	};
+
+	/**
+	 * Assignment strategy supported by a joining member with its metadata
+	 */
+	class protocol : public kafka_elementI
+	{
+	public:
+		protocol():
+			m_name(),
+			m_metadata()
+		{
+
+		}
+
+		const uint8_t* deserialize(const uint8_t* data)
+		{
+			data = m_name.deserialize(data);
+			return m_metadata.deserialize(data);
+		}
+
+		const primitive::string& name() const
+		{
+			return m_name;
+		}
+
+		const primitive::bytearray& metadata() const
+		{
+			return m_metadata;
+		}
+
+	private:
+		primitive::string m_name;
+		primitive::bytearray m_metadata;
+	};
+
+	/**
+	 * JoinGroup request in version 0 to 2
+	 */
+	class join_request : public kafka_elementI
+	{
+	public:
+		explicit join_request(int16_t version):
+			m_version(version),
+			m_req_header(),
+			m_group_id(),
+			m_session_timeout(),
+			m_rebalance_timeout(),
+			m_member_id(),
+			m_protocol_type(),
+			m_protocols()
+		{
+
+		}
+
+		const uint8_t* deserialize(const uint8_t* data)
+		{
+			data = m_req_header.deserialize(data);
+			data = m_group_id.deserialize(data);
+			data = m_session_timeout.deserialize(data);
+
+			// Version 0 uses the session timeout for rebalances
+			m_rebalance_timeout = m_session_timeout;
+			if (m_version >= 1)
+			{
+				data = m_rebalance_timeout.deserialize(data);
+			}
+			data = m_member_id.deserialize(data);
+			data = m_protocol_type.deserialize(data);
+			data = m_protocols.deserialize(data);
+			return data;
+		}
+
+		int16_t version() const
+		{
+			return m_version;
+		}
+
+		const headers::request_hdr& header() const
+		{
+			return m_req_header;
+		}
+
+		const primitive::string& group_id() const
+		{
+			return m_group_id;
+		}
+
+		const primitive::int32& session_timeout() const
+		{
+			return m_session_timeout;
+		}
+
+		const primitive::int32& rebalance_timeout() const
+		{
+			return m_rebalance_timeout;
+		}
+
+		const primitive::string& member_id() const
+		{
+			return m_member_id;
+		}
+
+		const primitive::string& protocol_type() const
+		{
+			return m_protocol_type;
+		}
+
+		const primitive::array<protocol>& protocols() const
+		{
+			return m_protocols;
+		}
+
+	private:
+		int16_t m_version;
+		headers::request_hdr m_req_header;
+		primitive::string m_group_id;
+		primitive::int32 m_session_timeout;
+		primitive::int32 m_rebalance_timeout;
+		primitive::string m_member_id;
+		primitive::string m_protocol_type;
+		primitive::array<protocol> m_protocols;
+	};
+
+	/**
+	 * Member with its metadata as sent to the group leader
+	 */
+	class member_metadata : public kafka_elementI
+	{
+	public:
+		member_metadata():
+			m_member_id(),
+			m_metadata()
+		{
+
+		}
+
+		member_metadata(const primitive::string& member_id, const primitive::bytearray& metadata):
+			m_member_id(member_id),
+			m_metadata(metadata)
+		{
+
+		}
+
+		uint8_t* serialize(uint8_t* data) const
+		{
+			data = m_member_id.serialize(data);
+			return m_metadata.serialize(data);
+		}
+
+		size_t serial_size() const
+		{
+			return m_member_id.serial_size() + m_metadata.serial_size();
+		}
+
+	private:
+		primitive::string m_member_id;
+		primitive::bytearray m_metadata;
+	};
+
+	class join_response : public kafka_elementI
+	{
+	public:
+		join_response(int16_t version, const primitive::int32& corr_id, const primitive::int16& err_code,
+		              const primitive::int32& generation, const primitive::string& protocol,
+		              const primitive::string& leader_id, const primitive::string& member_id,
+		              const primitive::array<member_metadata>& members):
+			m_version(version),
+			m_resp_header(corr_id),
+			m_throttle_time(0),
+			m_err_code(err_code),
+			m_generation(generation),
+			m_protocol(protocol),
+			m_leader_id(leader_id),
+			m_member_id(member_id),
+			m_members(members)
+		{
+
+		}
+
+		uint8_t* serialize(uint8_t* data) const
+		{
+			data = m_resp_header.serialize(data);
+			if (m_version >= 2)
+			{
+				data = m_throttle_time.serialize(data);
+			}
+			data = m_err_code.serialize(data);
+			data = m_generation.serialize(data);
+			data = m_protocol.serialize(data);
+			data = m_leader_id.serialize(data);
+			data = m_member_id.serialize(data);
+			data = m_members.serialize(data);
+			return data;
+		}
+
+		size_t serial_size() const
+		{
+			size_t size = 0;
+			size += m_resp_header.serial_size();
+			if (m_version >= 2)
+			{
+				size += m_throttle_time.serial_size();
+			}
+			size += m_err_code.serial_size();
+			size += m_generation.serial_size();
+			size += m_protocol.serial_size();
+			size += m_leader_id.serial_size();
+			size += m_member_id.serial_size();
+			size += m_members.serial_size();
+			return size;
+		}
+
+	private:
+		int16_t m_version;
+		headers::response_hdr m_resp_header;
+		primitive::int32 m_throttle_time;
+		primitive::int16 m_err_code;
+		primitive::int32 m_generation;
+		primitive::string m_protocol;
+		primitive::string m_leader_id;
+		primitive::string m_member_id;
+		primitive::array<member_metadata> m_members;
+	};
+
+	/**
+	 * Assignment of a member as sent by the group leader
+	 */
+	class member_assignment : public kafka_elementI
+	{
+	public:
+		member_assignment():
+			m_member_id(),
+			m_assignment()
+		{
+
+		}
+
+		const uint8_t* deserialize(const uint8_t* data)
+		{
+			data = m_member_id.deserialize(data);
+			return m_assignment.deserialize(data);
+		}
+
+		const primitive::string& member_id() const
+		{
+			return m_member_id;
+		}
+
+		const primitive::bytearray& assignment() const
+		{
+			return m_assignment;
+		}
+
+	private:
+		primitive::string m_member_id;
+		primitive::bytearray m_assignment;
+	};
+
+	/**
+	 * SyncGroup request in version 0 and 1
+	 */
+	class sync_request : public kafka_elementI
+	{
+	public:
+		explicit sync_request(int16_t version):
+			m_version(version),
+			m_req_header(),
+			m_group_id(),
+			m_generation(),
+			m_member_id(),
+			m_assignments()
+		{
+
+		}
+
+		const uint8_t* deserialize(const uint8_t* data)
+		{
+			data = m_req_header.deserialize(data);
+			data = m_group_id.deserialize(data);
+			data = m_generation.deserialize(data);
+			data = m_member_id.deserialize(data);
+			data = m_assignments.deserialize(data);
+			return data;
+		}
+
+		int16_t version() const
+		{
+			return m_version;
+		}
+
+		const headers::request_hdr& header() const
+		{
+			return m_req_header;
+		}
+
+		const primitive::string& group_id() const
+		{
+			return m_group_id;
+		}
+
+		const primitive::int32& generation() const
+		{
+			return m_generation;
+		}
+
+		const primitive::string& member_id() const
+		{
+			return m_member_id;
+		}
+
+		/**
+		 * Assignments of all members - only sent by the leader
+		 */
+		const primitive::array<member_assignment>& assignments() const
+		{
+			return m_assignments;
+		}
+
+	private:
+		int16_t m_version;
+		headers::request_hdr m_req_header;
+		primitive::string m_group_id;
+		primitive::int32 m_generation;
+		primitive::string m_member_id;
+		primitive::array<member_assignment> m_assignments;
+	};
+
+	class sync_response : public kafka_elementI
+	{
+	public:
+		sync_response(int16_t version, const primitive::int32& corr_id, const primitive::int16& err_code,
+		              const primitive::bytearray& assignment):
+			m_version(version),
+			m_resp_header(corr_id),
+			m_throttle_time(0),
+			m_err_code(err_code),
+			m_assignment(assignment)
+		{
+
+		}
+
+		uint8_t* serialize(uint8_t* data) const
+		{
+			data = m_resp_header.serialize(data);
+			if (m_version >= 1)
+			{
+				data = m_throttle_time.serialize(data);
+			}
+			data = m_err_code.serialize(data);
+			data = m_assignment.serialize(data);
+			return data;
+		}
+
+		size_t serial_size() const
+		{
+			size_t size = 0;
+			size += m_resp_header.serial_size();
+			if (m_version >= 1)
+			{
+				size += m_throttle_time.serial_size();
+			}
+			size += m_err_code.serial_size();
+			size += m_assignment.serial_size();
+			return size;
+		}
+
+	private:
+		int16_t m_version;
+		headers::response_hdr m_resp_header;
+		primitive::int32 m_throttle_time;
+		primitive::int16 m_err_code;
+		primitive::bytearray m_assignment;
+	};
+
+	/**
+	 * Heartbeat request in version 0 and 1
+	 */
+	class heartbeat_request : public kafka_elementI
+	{
+	public:
+		heartbeat_request():
+			m_req_header(),
+			m_group_id(),
+			m_generation(),
+			m_member_id()
+		{
+
+		}
+
+		const uint8_t* deserialize(const uint8_t* data)
+		{
+			data = m_req_header.deserialize(data);
+			data = m_group_id.deserialize(data);
+			data = m_generation.deserialize(data);
+			data = m_member_id.deserialize(data);
+			return data;
+		}
+
+		const headers::request_hdr& header() const
+		{
+			return m_req_header;
+		}
+
+		const primitive::string& group_id() const
+		{
+			return m_group_id;
+		}
+
+		const primitive::int32& generation() const
+		{
+			return m_generation;
+		}
+
+		const primitive::string& member_id() const
+		{
+			return m_member_id;
+		}
+
+	private:
+		headers::request_hdr m_req_header;
+		primitive::string m_group_id;
+		primitive::int32 m_generation;
+		primitive::string m_member_id;
+	};
+
+	/**
+	 * LeaveGroup request in version 0 and 1
+	 */
+	class leave_request : public kafka_elementI
+	{
+	public:
+		leave_request():
+			m_req_header(),
+			m_group_id(),
+			m_member_id()
+		{
+
+		}
+
+		const uint8_t* deserialize(const uint8_t* data)
+		{
+			data = m_req_header.deserialize(data);
+			data = m_group_id.deserialize(data);
+			data = m_member_id.deserialize(data);
+			return data;
+		}
+
+		const headers::request_hdr& header() const
+		{
+			return m_req_header;
+		}
+
+		const primitive::string& group_id() const
+		{
+			return m_group_id;
+		}
+
+		const primitive::string& member_id() const
+		{
+			return m_member_id;
+		}
+
+	private:
+		headers::request_hdr m_req_header;
+		primitive::string m_group_id;
+		primitive::string m_member_id;
+	};
+
+	/**
+	 * Response holding only an error code (Heartbeat and LeaveGroup)
+	 */
+	class error_response : public kafka_elementI
+	{
+	public:
+		error_response(int16_t version, const primitive::int32& corr_id, const primitive::int16& err_code):
+			m_version(version),
+			m_resp_header(corr_id),
+			m_throttle_time(0),
+			m_err_code(err_code)
+		{
+
+		}
+
+		uint8_t* serialize(uint8_t* data) const
+		{
+			data = m_resp_header.serialize(data);
+			if (m_version >= 1)
+			{
+				data = m_throttle_time.serialize(data);
+			}
+			return m_err_code.serialize(data);
+		}
+
+		size_t serial_size() const
+		{
+			size_t size = m_resp_header.serial_size() + m_err_code.serial_size();
+			if (m_version >= 1)
+			{
+				size += m_throttle_time.serial_size();
+			}
+			return size;
+		}
+
+	private:
+		int16_t m_version;
+		headers::response_hdr m_resp_header;
+		primitive::int32 m_throttle_time;
+		primitive::int16 m_err_code;
+	};
+
+	/**
+	 * Offset to commit for a partition
+	 */
+	struct commit_partition
+	{
+		commit_partition():
+			partition(0),
+			offset(0),
+			metadata()
+		{
+
+		}
+
+		int32_t partition;
+		int64_t offset;
+		std::string metadata;
+	};
+
+	struct commit_topic
+	{
+		commit_topic():
+			name(),
+			partitions()
+		{
+
+		}
+
+		std::string name;
+		std::vector<commit_partition> partitions;
+	};
+
+	/**
+	 * OffsetCommit request in version 0 to 3
+	 *
+	 * Version 0 has no generation (-1) and member ID, version 1 adds a commit
+	 * timestamp per partition (ignored) and version 2 replaces it with a
+	 * retention time (ignored).
+	 */
+	class offset_commit_request : public kafka_elementI
+	{
+	public:
+		explicit offset_commit_request(int16_t version):
+			m_version(version),
+			m_req_header(),
+			m_group_id(),
+			m_generation(-1),
+			m_member_id(),
+			m_topics()
+		{
+
+		}
+
+		const uint8_t* deserialize(const uint8_t* data)
+		{
+			data = m_req_header.deserialize(data);
+			data = m_group_id.deserialize(data);
+			if (m_version >= 1)
+			{
+				data = m_generation.deserialize(data);
+				data = m_member_id.deserialize(data);
+			}
+			if (m_version >= 2)
+			{
+				primitive::int64 retention_time;
+				data = retention_time.deserialize(data);
+			}
+
+			int32_t num_topics = util::read_type<int32_t>(data);
+			data += 4;
+			m_topics.clear();
+			for (int32_t i=0; i<num_topics; ++i)
+			{
+				m_topics.push_back(commit_topic());
+				commit_topic& top = m_topics.back();
+				primitive::string name;
+				data = name.deserialize(data);
+				top.name = name.std_str();
+
+				int32_t num_partitions = util::read_type<int32_t>(data);
+				data += 4;
+				for (int32_t k=0; k<num_partitions; ++k)
+				{
+					primitive::int32 partition;
+					primitive::int64 offset;
+					primitive::string metadata;
+					data = partition.deserialize(data);
+					data = offset.deserialize(data);
+					if (m_version == 1)
+					{
+						primitive::int64 timestamp;
+						data = timestamp.deserialize(data);
+					}
+					data = metadata.deserialize(data);
+
+					top.partitions.push_back(commit_partition());
+					top.partitions.back().partition = partition;
+					top.partitions.back().offset = offset;
+					top.partitions.back().metadata = metadata.std_str();
+				}
+			}
+			return data;
+		}
+
+		int16_t version() const
+		{
+			return m_version;
+		}
+
+		const headers::request_hdr& header() const
+		{
+			return m_req_header;
+		}
+
+		const primitive::string& group_id() const
+		{
+			return m_group_id;
+		}
+
+		const primitive::int32& generation() const
+		{
+			return m_generation;
+		}
+
+		const primitive::string& member_id() const
+		{
+			return m_member_id;
+		}
+
+		const std::vector<commit_topic>& topics() const
+		{
+			return m_topics;
+		}
+
+	private:
+		int16_t m_version;
+		headers::request_hdr m_req_header;
+		primitive::string m_group_id;
+		primitive::int32 m_generation;
+		primitive::string m_member_id;
+		std::vector<commit_topic> m_topics;
+	};
+
+	class partition_error : public kafka_elementI
+	{
+	public:
+		partition_error():
+			m_partition(),
+			m_err_code()
+		{
+
+		}
+
+		partition_error(const primitive::int32& partition, const primitive::int16& err_code):
+			m_partition(partition),
+			m_err_code(err_code)
+		{
+
+		}
+
+		uint8_t* serialize(uint8_t* data) const
+		{
+			data = m_partition.serialize(data);
+			return m_err_code.serialize(data);
+		}
+
+		size_t serial_size() const
+		{
+			return m_partition.serial_size() + m_err_code.serial_size();
+		}
+
+	private:
+		primitive::int32 m_partition;
+		primitive::int16 m_err_code;
+	};
+
+	class topic_errors : public kafka_elementI
+	{
+	public:
+		topic_errors():
+			m_topic_name(),
+			m_partitions()
+		{
+
+		}
+
+		topic_errors(const primitive::string& topic, const primitive::array<partition_error>& partitions):
+			m_topic_name(topic),
+			m_partitions(partitions)
+		{
+
+		}
+
+		uint8_t* serialize(uint8_t* data) const
+		{
+			data = m_topic_name.serialize(data);
+			return m_partitions.serialize(data);
+		}
+
+		size_t serial_size() const
+		{
+			return m_topic_name.serial_size() + m_partitions.serial_size();
+		}
+
+	private:
+		primitive::string m_topic_name;
+		primitive::array<partition_error> m_partitions;
+	};
+
+	class offset_commit_response : public kafka_elementI
+	{
+	public:
+		offset_commit_response(int16_t version, const primitive::int32& corr_id,
+		                       const primitive::array<topic_errors>& topics):
+			m_version(version),
+			m_resp_header(corr_id),
+			m_throttle_time(0),
+			m_topics(topics)
+		{
+
+		}
+
+		uint8_t* serialize(uint8_t* data) const
+		{
+			data = m_resp_header.serialize(data);
+			if (m_version >= 3)
+			{
+				data = m_throttle_time.serialize(data);
+			}
+			return m_topics.serialize(data);
+		}
+
+		size_t serial_size() const
+		{
+			size_t size = m_resp_header.serial_size() + m_topics.serial_size();
+			if (m_version >= 3)
+			{
+				size += m_throttle_time.serial_size();
+			}
+			return size;
+		}
+
+	private:
+		int16_t m_version;
+		headers::response_hdr m_resp_header;
+		primitive::int32 m_throttle_time;
+		primitive::array<topic_errors> m_topics;
+	};
+
+	class offset_fetch_topic : public kafka_elementI
+	{
+	public:
+		offset_fetch_topic():
+			m_topic_name(),
+			m_partitions()
+		{
+
+		}
+
+		const uint8_t* deserialize(const uint8_t* data)
+		{
+			data = m_topic_name.deserialize(data);
+			return m_partitions.deserialize(data);
+		}
+
+		const primitive::string& topic_name() const
+		{
+			return m_topic_name;
+		}
+
+		const primitive::array<primitive::int32>& partitions() const
+		{
+			return m_partitions;
+		}
+
+	private:
+		primitive::string m_topic_name;
+		primitive::array<primitive::int32> m_partitions;
+	};
+
+	/**
+	 * OffsetFetch request in version 0 to 3 - from version 2 on a null topic
+	 * array asks for all committed offsets of the group
+	 */
+	class offset_fetch_request : public kafka_elementI
+	{
+	public:
+		explicit offset_fetch_request(int16_t version):
+			m_version(version),
+			m_req_header(),
+			m_group_id(),
+			m_all_topics(false),
+			m_topics()
+		{
+
+		}
+
+		const uint8_t* deserialize(const uint8_t* data)
+		{
+			data = m_req_header.deserialize(data);
+			data = m_group_id.deserialize(data);
+			m_all_topics = (m_version >= 2) && (util::read_type<int32_t>(data) < 0);
+			return m_topics.deserialize(data);
+		}
+
+		int16_t version() const
+		{
+			return m_version;
+		}
+
+		const headers::request_hdr& header() const
+		{
+			return m_req_header;
+		}
+
+		const primitive::string& group_id() const
+		{
+			return m_group_id;
+		}
+
+		bool all_topics() const
+		{
+			return m_all_topics;
+		}
+
+		const primitive::array<offset_fetch_topic>& topics() const
+		{
+			return m_topics;
+		}
+
+	private:
+		int16_t m_version;
+		headers::request_hdr m_req_header;
+		primitive::string m_group_id;
+		bool m_all_topics;
+		primitive::array<offset_fetch_topic> m_topics;
+	};
+
+	class partition_offset : public kafka_elementI
+	{
+	public:
+		partition_offset():
+			m_partition(),
+			m_offset(),
+			m_metadata(),
+			m_err_code()
+		{
+
+		}
+
+		partition_offset(const primitive::int32& partition, const primitive::int64& offset,
+		                 const primitive::string& metadata, const primitive::int16& err_code):
+			m_partition(partition),
+			m_offset(offset),
+			m_metadata(metadata),
+			m_err_code(err_code)
+		{
+
+		}
+
+		uint8_t* serialize(uint8_t* data) const
+		{
+			data = m_partition.serialize(data);
+			data = m_offset.serialize(data);
+			data = m_metadata.serialize(data);
+			return m_err_code.serialize(data);
+		}
+
+		size_t serial_size() const
+		{
+			size_t size = 0;
+			size += m_partition.serial_size();
+			size += m_offset.serial_size();
+			size += m_metadata.serial_size();
+			size += m_err_code.serial_size();
+			return size;
+		}
+
+	private:
+		primitive::int32 m_partition;
+		primitive::int64 m_offset;
+		primitive::string m_metadata;
+		primitive::int16 m_err_code;
+	};
+
+	class topic_offsets : public kafka_elementI
+	{
+	public:
+		topic_offsets():
+			m_topic_name(),
+			m_partitions()
+		{
+
+		}
+
+		topic_offsets(const primitive::string& topic, const primitive::array<partition_offset>& partitions):
+			m_topic_name(topic),
+			m_partitions(partitions)
+		{
+
+		}
+
+		uint8_t* serialize(uint8_t* data) const
+		{
+			data = m_topic_name.serialize(data);
+			return m_partitions.serialize(data);
+		}
+
+		size_t serial_size() const
+		{
+			return m_topic_name.serial_size() + m_partitions.serial_size();
+		}
+
+	private:
+		primitive::string m_topic_name;
+		primitive::array<partition_offset> m_partitions;
+	};
+
+	class offset_fetch_response : public kafka_elementI
+	{
+	public:
+		offset_fetch_response(int16_t version, const primitive::int32& corr_id,
+		                      const primitive::array<topic_offsets>& topics, const primitive::int16& err_code):
+			m_version(version),
+			m_resp_header(corr_id),
+			m_throttle_time(0),
+			m_topics(topics),
+			m_err_code(err_code)
+		{
+
+		}
+
+		uint8_t* serialize(uint8_t* data) const
+		{
+			data = m_resp_header.serialize(data);
+			if (m_version >= 3)
+			{
+				data = m_throttle_time.serialize(data);
+			}
+			data = m_topics.serialize(data);
+			if (m_version >= 2)
+			{
+				data = m_err_code.serialize(data);
+			}
+			return data;
+		}
+
+		size_t serial_size() const
+		{
+			size_t size = m_resp_header.serial_size() + m_topics.serial_size();
+			if (m_version >= 3)
+			{
+				size += m_throttle_time.serial_size();
+			}
+			if (m_version >= 2)
+			{
+				size += m_err_code.serial_size();
+			}
+			return size;
+		}
+
+	private:
+		int16_t m_version;
+		headers::response_hdr m_resp_header;
+		primitive::int32 m_throttle_time;
+		primitive::array<topic_offsets> m_topics;
+		primitive::int16 m_err_code;
+	};
+
+}}
+
+#endif
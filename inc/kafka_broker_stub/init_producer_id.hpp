@@ -0,0 +1,95 @@
+#ifndef KAFKA_BROKER_STUB_INIT_PRODUCER_ID_HPP_INC_
+#define KAFKA_BROKER_STUB_INIT_PRODUCER_ID_HPP_INC_
+
+/**
+ * Definitions used for handling InitProducerId requests and responses in
+ * version 0 and 1, which share their layout.
+ */
+
+#include "primitive.hpp"
+#include "headers.hpp"
+
+namespace kafka_broker_stub { namespace init_producer_id {
+
+	class request : public kafka_elementI
+	{
+	public:
+		request():
+			m_req_header(),
+			m_transactional_id(),
+			m_transaction_timeout()
+		{
+
+		}
+
+		const uint8_t* deserialize(const uint8_t* data)
+		{
+			data = m_req_header.deserialize(data);
+			data = m_transactional_id.deserialize(data);
+			return m_transaction_timeout.deserialize(data);
+		}
+
+		const headers::request_hdr& header() const
+		{
+			return m_req_header;
+		}
+
+		/**
+		 * Transactional ID - empty if null
+		 */
+		const primitive::string& transactional_id() const
+		{
+			return m_transactional_id;
+		}
+
+		const primitive::int32& transaction_timeout() const
+		{
+			return m_transaction_timeout;
+		}
+
+	private:
+		headers::request_hdr m_req_header;
+		primitive::string m_transactional_id;
+		primitive::int32 m_transaction_timeout;
+	};
+
+	class response : public kafka_elementI
+	{
+	public:
+		response(const primitive::int32& corr_id, const primitive::int32& throttle_time,
+		         const primitive::int16& err_code, int64_t producer_id, int16_t producer_epoch):
+			m_resp_header(corr_id),
+			m_throttle_time(throttle_time),
+			m_err_code(err_code),
+			m_producer_id(producer_id),
+			m_producer_epoch(producer_epoch)
+		{
+
+		}
+
+		uint8_t* serialize(uint8_t* data) const
+		{
+			data = m_resp_header.serialize(data);
+			data = m_throttle_time.serialize(data);
+			data = m_err_code.serialize(data);
+			data = m_producer_id.serialize(data);
+			return m_producer_epoch.serialize(data);
+		}
+
+		size_t serial_size() const
+		{
+			return m_resp_header.serial_size() + m_throttle_time.serial_size() + m_err_code.serial_size() +
+			       m_producer_id.serial_size() + m_producer_epoch.serial_size();
+		}
+
+	private:
+		headers::response_hdr m_resp_header;
+		primitive::int32 m_throttle_time;
+		primitive::int16 m_err_code;
+		primitive::int64 m_producer_id;
+		primitive::int16 m_producer_epoch;
+	};
+
+}}
+
+#endif
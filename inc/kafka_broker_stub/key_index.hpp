@@ -0,0 +1,235 @@
+#ifndef KAFKA_BROKER_STUB_KEY_INDEX_HPP_INC_
+#define KAFKA_BROKER_STUB_KEY_INDEX_HPP_INC_
+
+/*
+ * Hash index from message keys to the offsets of the messages with the key.
+ */
+
+#include "util.hpp"
+#include <string>
+#include <vector>
+
+namespace kafka_broker_stub {
+
+	/**
+	 * Open addressing hash table mapping keys to ascending offsets
+	 *
+	 * Offsets are added in increasing order and removed from the front (oldest
+	 * first) which is how partitions append and evict messages. Keys without
+	 * offsets are removed from the table.
+	 */
+	class key_index
+	{
+	public:
+		key_index():
+			m_slots(),
+			m_used(0),
+			m_removed(0)
+		{
+
+		}
+
+		/**
+		 * Add offset for the key. Offsets must be added in increasing order.
+		 */
+		void add(const std::string& key, int64_t offset)
+		{
+			if (((m_used + m_removed + 1) * 10) > (m_slots.size() * 7))
+			{
+				rehash(m_used * 2 + 16);
+			}
+
+			uint64_t hash = util::hash_bytes(key.data(), key.size());
+			size_t mask = m_slots.size() - 1;
+			size_t pos = static_cast<size_t>(hash) & mask;
+			size_t free_pos = m_slots.size();
+			for (;; pos = (pos + 1) & mask)
+			{
+				slot& s = m_slots[pos];
+				if (s.state == SLOT_EMPTY)
+				{
+					break;
+				}
+				if ((s.state == SLOT_REMOVED) && (free_pos == m_slots.size()))
+				{
+					free_pos = pos;
+				}
+				else if ((s.state == SLOT_USED) && (s.hash == hash) && (s.key == key))
+				{
+					s.offsets.push_back(offset);
+					return;
+				}
+			}
+
+			// Reuse the first removed slot on the probe sequence if any
+			if (free_pos != m_slots.size())
+			{
+				pos = free_pos;
+				--m_removed;
+			}
+
+			slot& s = m_slots[pos];
+			s.state = SLOT_USED;
+			s.hash = hash;
+			s.key = key;
+			s.offsets.push_back(offset);
+			s.head = 0;
+			++m_used;
+		}
+
+		/**
+		 * Remove the oldest offset of the key if it equals the offset given
+		 */
+		void remove_first(const std::string& key, int64_t offset)
+		{
+			slot* s = lookup(key);
+			if ((s == NULL) || (s->offsets[s->head] != offset))
+			{
+				return;
+			}
+
+			++s->head;
+			if (s->head == s->offsets.size())
+			{
+				// No offsets left so release the slot
+				std::string().swap(s->key);
+				std::vector<int64_t>().swap(s->offsets);
+				s->head = 0;
+				s->state = SLOT_REMOVED;
+				--m_used;
+				++m_removed;
+			}
+			else if (s->head * 2 >= s->offsets.size())
+			{
+				s->offsets.erase(s->offsets.begin(), s->offsets.begin() + static_cast<ptrdiff_t>(s->head));
+				s->head = 0;
+			}
+		}
+
+		/**
+		 * Get the ascending offsets of the key - returns NULL if it is unknown
+		 */
+		const int64_t* find(const std::string& key, size_t& count) const
+		{
+			const slot* s = const_cast<key_index*>(this)->lookup(key);
+			if (s == NULL)
+			{
+				count = 0;
+				return NULL;
+			}
+
+			count = s->offsets.size() - s->head;
+			return &s->offsets[s->head];
+		}
+
+		/**
+		 * Number of keys in the index
+		 */
+		size_t size() const
+		{
+			return m_used;
+		}
+
+		void clear()
+		{
+			m_slots.clear();
+			m_used = 0;
+			m_removed = 0;
+		}
+
+	private:
+		enum slot_state
+		{
+			SLOT_EMPTY = 0,
+			SLOT_USED,
+			SLOT_REMOVED
+		};
+
+		struct slot
+		{
+			slot():
+				state(SLOT_EMPTY),
+				hash(0),
+				key(),
+				offsets(),
+				head(0)
+			{
+
+			}
+
+			slot_state state;
+			uint64_t hash;
+			std::string key;
+			std::vector<int64_t> offsets;
+			size_t head;
+		};
+
+		slot* lookup(const std::string& key)
+		{
+			if (m_used == 0)
+			{
+				return NULL;
+			}
+
+			uint64_t hash = util::hash_bytes(key.data(), key.size());
+			size_t mask = m_slots.size() - 1;
+			for (size_t pos = static_cast<size_t>(hash) & mask;; pos = (pos + 1) & mask)
+			{
+				slot& s = m_slots[pos];
+				if (s.state == SLOT_EMPTY)
+				{
+					return NULL;
+				}
+				if ((s.state == SLOT_USED) && (s.hash == hash) && (s.key == key))
+				{
+					return &s;
+				}
+			}
+		}
+
+		/**
+		 * Move the used slots to a table with room for at least count keys
+		 */
+		void rehash(size_t count)
+		{
+			size_t size = 16;
+			while (size * 7 < count * 10)
+			{
+				size <<= 1;
+			}
+
+			std::vector<slot> old(size);
+			old.swap(m_slots);
+			m_removed = 0;
+
+			size_t mask = size - 1;
+			for (size_t i=0; i<old.size(); ++i)
+			{
+				if (old[i].state != SLOT_USED)
+				{
+					continue;
+				}
+
+				size_t pos = static_cast<size_t>(old[i].hash) & mask;
+				while (m_slots[pos].state != SLOT_EMPTY)
+				{
+					pos = (pos + 1) & mask;
+				}
+
+				slot& s = m_slots[pos];
+				s.state = SLOT_USED;
+				s.hash = old[i].hash;
+				s.key.swap(old[i].key);
+				s.offsets.swap(old[i].offsets);
+				s.head = old[i].head;
+			}
+		}
+
+		std::vector<slot> m_slots;
+		size_t m_used;
+		size_t m_removed;
+	};
+
+}
+
+#endif
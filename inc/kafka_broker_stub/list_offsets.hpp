@@ -0,0 +1,262 @@
+#ifndef KAFKA_BROKER_STUB_LIST_OFFSETS_HPP_INC_
+#define KAFKA_BROKER_STUB_LIST_OFFSETS_HPP_INC_
+
+/**
+ * Definitions used for handling ListOffsets (formerly Offsets) requests and
+ * responses in version 0 and 1.
+ */
+
+#include "primitive.hpp"
+#include "headers.hpp"
+#include <algorithm>
+#include <vector>
+
+namespace kafka_broker_stub { namespace list_offsets {
+
+	// Special timestamps asking for the next offset and the log start offset
+	const int64_t LATEST_TIMESTAMP = -1;
+	const int64_t EARLIEST_TIMESTAMP = -2;
+
+	/**
+	 * Partition to look up - version 0 also limits the number of offsets
+	 */
+	struct partition_request
+	{
+		partition_request():
+			partition(0),
+			timestamp(0),
+			max_offsets(1)
+		{
+
+		}
+
+		int32_t partition;
+		int64_t timestamp;
+		int32_t max_offsets;
+	};
+
+	struct topic_request
+	{
+		topic_request():
+			name(),
+			partitions()
+		{
+
+		}
+
+		std::string name;
+		std::vector<partition_request> partitions;
+	};
+
+	class request : public kafka_elementI
+	{
+	public:
+		explicit request(int16_t version):
+			m_version(version),
+			m_req_header(),
+			m_replica_id(),
+			m_topics()
+		{
+
+		}
+
+		/**
+		 * The layout of the partitions depends on the version, so they are
+		 * decoded here rather than by primitive::array, reserving no more
+		 * than it would for a length read off the wire
+		 */
+		const uint8_t* deserialize(const uint8_t* data)
+		{
+			data = m_req_header.deserialize(data);
+			data = m_replica_id.deserialize(data);
+
+			primitive::int32 num_topics;
+			data = num_topics.deserialize(data);
+			m_topics.clear();
+			m_topics.reserve(primitive::reserve_count<topic_request>(num_topics));
+			for (int32_t i=0; i<num_topics; ++i)
+			{
+				m_topics.push_back(topic_request());
+				topic_request& top = m_topics.back();
+				primitive::string name;
+				data = name.deserialize(data);
+				top.name = name.std_str();
+
+				primitive::int32 num_partitions;
+				data = num_partitions.deserialize(data);
+				top.partitions.reserve(primitive::reserve_count<partition_request>(num_partitions));
+				for (int32_t k=0; k<num_partitions; ++k)
+				{
+					top.partitions.push_back(partition_request());
+					partition_request& part = top.partitions.back();
+					primitive::int32 partition;
+					primitive::int64 timestamp;
+					data = partition.deserialize(data);
+					data = timestamp.deserialize(data);
+					part.partition = partition;
+					part.timestamp = timestamp;
+					if (m_version == 0)
+					{
+						primitive::int32 max_offsets;
+						data = max_offsets.deserialize(data);
+						part.max_offsets = max_offsets;
+					}
+				}
+			}
+			return data;
+		}
+
+		int16_t version() const
+		{
+			return m_version;
+		}
+
+		const headers::request_hdr& header() const
+		{
+			return m_req_header;
+		}
+
+		const primitive::int32& replica_id() const
+		{
+			return m_replica_id;
+		}
+
+		const std::vector<topic_request>& topics() const
+		{
+			return m_topics;
+		}
+
+	private:
+		int16_t m_version;
+		headers::request_hdr m_req_header;
+		primitive::int32 m_replica_id;
+		std::vector<topic_request> m_topics;
+	};
+
+	/**
+	 * Result for a partition - version 0 sends a list of offsets, version 1
+	 * a single offset with the timestamp of its message
+	 */
+	class partition_response : public kafka_elementI
+	{
+	public:
+		partition_response():
+			m_version(0),
+			m_partition(),
+			m_err_code(),
+			m_timestamp(-1),
+			m_offset(-1)
+		{
+
+		}
+
+		partition_response(int16_t version, const primitive::int32& partition, const primitive::int16& err_code,
+		                   int64_t timestamp, int64_t offset):
+			m_version(version),
+			m_partition(partition),
+			m_err_code(err_code),
+			m_timestamp(timestamp),
+			m_offset(offset)
+		{
+
+		}
+
+		uint8_t* serialize(uint8_t* data) const
+		{
+			data = m_partition.serialize(data);
+			data = m_err_code.serialize(data);
+			if (m_version >= 1)
+			{
+				data = m_timestamp.serialize(data);
+				return m_offset.serialize(data);
+			}
+
+			// No offsets if there is none
+			primitive::int32 count(has_offset() ? 1 : 0);
+			data = count.serialize(data);
+			return has_offset() ? m_offset.serialize(data) : data;
+		}
+
+		size_t serial_size() const
+		{
+			size_t size = m_partition.serial_size() + m_err_code.serial_size();
+			if (m_version >= 1)
+				return size + m_timestamp.serial_size() + m_offset.serial_size();
+			return size + 4 + (has_offset() ? m_offset.serial_size() : 0);
+		}
+
+	private:
+		bool has_offset() const
+		{
+			return static_cast<int64_t>(m_offset) >= 0;
+		}
+
+		int16_t m_version;
+		primitive::int32 m_partition;
+		primitive::int16 m_err_code;
+		primitive::int64 m_timestamp;
+		primitive::int64 m_offset;
+	};
+
+	class topic_response : public kafka_elementI
+	{
+	public:
+		topic_response():
+			m_topic_name(),
+			m_partitions()
+		{
+
+		}
+
+		topic_response(const primitive::string& topic, const primitive::array<partition_response>& partitions):
+			m_topic_name(topic),
+			m_partitions(partitions)
+		{
+
+		}
+
+		uint8_t* serialize(uint8_t* data) const
+		{
+			data = m_topic_name.serialize(data);
+			return m_partitions.serialize(data);
+		}
+
+		size_t serial_size() const
+		{
+			return m_topic_name.serial_size() + m_partitions.serial_size();
+		}
+
+	private:
+		primitive::string m_topic_name;
+		primitive::array<partition_response> m_partitions;
+	};
+
+	class response : public kafka_elementI
+	{
+	public:
+		response(const primitive::int32& corr_id, const primitive::array<topic_response>& topics):
+			m_resp_header(corr_id),
+			m_topics(topics)
+		{
+
+		}
+
+		uint8_t* serialize(uint8_t* data) const
+		{
+			data = m_resp_header.serialize(data);
+			return m_topics.serialize(data);
+		}
+
+		size_t serial_size() const
+		{
+			return m_resp_header.serial_size() + m_topics.serial_size();
+		}
+
+	private:
+		headers::response_hdr m_resp_header;
+		primitive::array<topic_response> m_topics;
+	};
+
+}}
+
+#endif
@@ -0,0 +1,558 @@
+#ifndef KAFKA_BROKER_STUB_LOG_HPP_INC_
+#define KAFKA_BROKER_STUB_LOG_HPP_INC_
+
+/*
+ * Logging used by the broker stub.
+ *
+ * Log statements go through a logger front-end which filters on level and
+ * rate limits per message type before a fixed-size record is handed to a
+ * sink. The default sink writes synchronously to stdout. An async_sink can be
+ * put in front of any other sink to move the writing to a background thread.
+ */
+
+#include "util.hpp"
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * Statements below this level are removed at compile time
+ */
+#ifndef KAFKA_BROKER_STUB_LOG_COMPILE_LEVEL
+#define KAFKA_BROKER_STUB_LOG_COMPILE_LEVEL 0
+#endif
+
+/*
+ * Log statement checking the level before the message arguments are
+ * evaluated, e.g.
+ *
+ *   KAFKA_BROKER_STUB_LOG(logger, log::LEVEL_DEBUG, log::MSG_REQUEST)(node_id, "Got [%s]", name.c_str());
+ *
+ * Statements below KAFKA_BROKER_STUB_LOG_COMPILE_LEVEL compile to nothing,
+ * the others cost a level check unless the level is enabled.
+ */
+#define KAFKA_BROKER_STUB_LOG(logger, lvl, type) \
+	if (!(logger).enabled(lvl)) { } else (logger).make_statement(lvl, type)
+
+namespace kafka_broker_stub { namespace log {
+
+	enum level
+	{
+		LEVEL_DEBUG = 0,
+		LEVEL_INFO,
+		LEVEL_WARNING,
+		LEVEL_ERROR,
+		LEVEL_NONE
+	};
+
+	/**
+	 * Message types used for rate limiting
+	 */
+	enum message_type
+	{
+		MSG_GENERIC = 0,
+		MSG_REQUEST,
+		MSG_REQUEST_DETAIL,
+		MSG_UNKNOWN_API,
+		MSG_UNSUPPORTED_VERSION,
+		MSG_PARSE_ERROR,
+		MSG_RESPONSE_SIZE,
+		MSG_TYPE_COUNT
+	};
+
+	// Maximum length of a formatted log message (including zero termination)
+	const size_t MSG_MAX_SIZE = 256;
+
+	inline const char* level_name(level lvl)
+	{
+		switch (lvl)
+		{
+			case LEVEL_DEBUG:
+				return "DEBUG";
+			case LEVEL_INFO:
+				return "INFO";
+			case LEVEL_WARNING:
+				return "WARNING";
+			case LEVEL_ERROR:
+				return "ERROR";
+			default:
+				return "NONE";
+		}
+	}
+
+	/**
+	 * Returns true if statements at the given level are compiled in
+	 */
+	inline bool compiled_in(level lvl)
+	{
+		return static_cast<int>(lvl) >= KAFKA_BROKER_STUB_LOG_COMPILE_LEVEL;
+	}
+
+	/**
+	 * Fixed-size log record so records can be queued without allocations
+	 */
+	struct record
+	{
+		level lvl;
+		message_type type;
+		int32_t node_id;
+		uint64_t timestamp_ns;
+		char text[MSG_MAX_SIZE];
+	};
+
+	/**
+	 * Interface for log sinks
+	 */
+	class sinkI
+	{
+	public:
+		virtual ~sinkI() { };
+
+		/**
+		 * Called for every record that passed the filters of the logger
+		 */
+		virtual void write(const record& rec) = 0;
+	};
+
+	/**
+	 * Sink writing records to stdout
+	 */
+	class stdout_sink : public sinkI
+	{
+	public:
+		void write(const record& rec)
+		{
+			printf("[KafkaBrokerStub][%i][%s] %s\n", rec.node_id, level_name(rec.lvl), rec.text);
+		}
+	};
+
+	/**
+	 * Process-wide default sink
+	 */
+	inline sinkI& default_sink()
+	{
+		static stdout_sink sink;
+		return sink;
+	}
+
+	/**
+	 * Bounded lock-free multi-producer single-consumer ring buffer
+	 *
+	 * Each cell carries a sequence number telling producers and the consumer
+	 * whether it is free or filled for the current lap. Capacity is rounded up
+	 * to a power of two.
+	 */
+	template <typename T>
+	class ring_buffer
+	{
+	public:
+		explicit ring_buffer(size_t capacity):
+			m_cells(NULL),
+			m_mask(0),
+			m_head(0),
+			m_tail(0)
+		{
+			size_t size = 2;
+			while (size < capacity)
+			{
+				size <<= 1;
+			}
+
+			m_cells = new cell[size];
+			m_mask = size - 1;
+			for (size_t i=0; i<size; ++i)
+			{
+				m_cells[i].seq = i;
+			}
+		}
+
+		~ring_buffer()
+		{
+			delete[] m_cells;
+		}
+
+		/**
+		 * Push element to the buffer. Returns false if the buffer is full.
+		 */
+		bool push(const T& val)
+		{
+			size_t pos = util::atomic_load(&m_tail);
+			for (;;)
+			{
+				cell& c = m_cells[pos & m_mask];
+				size_t seq = util::atomic_load(&c.seq);
+				if (seq == pos)
+				{
+					if (util::atomic_cas(&m_tail, pos, pos + 1))
+					{
+						c.value = val;
+						util::atomic_store(&c.seq, pos + 1);
+						return true;
+					}
+					pos = util::atomic_load(&m_tail);
+				}
+				else if (seq < pos)
+				{
+					return false;
+				}
+				else
+				{
+					pos = util::atomic_load(&m_tail);
+				}
+			}
+		}
+
+		/**
+		 * Pop element from the buffer. Must only be called from one thread.
+		 * Returns false if the buffer is empty.
+		 */
+		bool pop(T& val)
+		{
+			cell& c = m_cells[m_head & m_mask];
+			if (util::atomic_load(&c.seq) != m_head + 1)
+			{
+				return false;
+			}
+
+			val = c.value;
+			util::atomic_store(&c.seq, m_head + m_mask + 1);
+			++m_head;
+			return true;
+		}
+
+		size_t capacity() const
+		{
+			return m_mask + 1;
+		}
+
+	private:
+		struct cell
+		{
+			volatile size_t seq;
+			T value;
+		};
+
+		ring_buffer(const ring_buffer&);
+		ring_buffer& operator=(const ring_buffer&);
+
+		cell* m_cells;
+		size_t m_mask;
+		size_t m_head;
+		volatile size_t m_tail;
+	};
+
+	/**
+	 * Sink that queues records in a ring buffer and forwards them to another
+	 * sink from a background thread
+	 *
+	 * Writing never blocks. If the buffer is full the record is dropped and
+	 * counted.
+	 */
+	class async_sink : public sinkI
+	{
+	public:
+		explicit async_sink(sinkI& target, size_t capacity = 1024):
+			m_target(target),
+			m_buffer(capacity),
+			m_thread(),
+			m_running(1),
+			m_dropped(0)
+		{
+			if (pthread_create(&m_thread, NULL, &async_sink::run, this) != 0)
+				throw std::runtime_error("Unable to start log thread");
+		}
+
+		~async_sink()
+		{
+			util::atomic_store(&m_running, 0);
+			pthread_join(m_thread, NULL);
+		}
+
+		void write(const record& rec)
+		{
+			if (!m_buffer.push(rec))
+			{
+				util::atomic_fetch_add(&m_dropped, static_cast<uint64_t>(1));
+			}
+		}
+
+		/**
+		 * Number of records dropped because the buffer was full
+		 */
+		uint64_t dropped() const
+		{
+			return util::atomic_load(&m_dropped);
+		}
+
+	private:
+		static void* run(void* arg)
+		{
+			static_cast<async_sink*>(arg)->drain();
+			return NULL;
+		}
+
+		void drain()
+		{
+			record rec;
+			for (;;)
+			{
+				if (m_buffer.pop(rec))
+				{
+					m_target.write(rec);
+					continue;
+				}
+
+				// Buffer is empty so stop if requested - otherwise back off
+				if (util::atomic_load(&m_running) == 0)
+				{
+					break;
+				}
+
+				struct timespec ts = { 0, 1000000 };
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		async_sink(const async_sink&);
+		async_sink& operator=(const async_sink&);
+
+		sinkI& m_target;
+		ring_buffer<record> m_buffer;
+		pthread_t m_thread;
+		volatile int m_running;
+		volatile uint64_t m_dropped;
+	};
+
+	/**
+	 * Per message type rate limiter allowing a number of messages per interval
+	 */
+	class rate_limiter
+	{
+	public:
+		rate_limiter():
+			m_limits()
+		{
+			for (size_t i=0; i<MSG_TYPE_COUNT; ++i)
+			{
+				m_limits[i].max_count = 0;
+				m_limits[i].interval_ns = 0;
+				m_limits[i].window_start = 0;
+				m_limits[i].count = 0;
+				m_limits[i].suppressed = 0;
+			}
+		}
+
+		/**
+		 * Allow max_count messages of the type per interval. Zero disables the
+		 * limit.
+		 */
+		void set_limit(message_type type, uint32_t max_count, uint32_t interval_ms)
+		{
+			limit& lim = m_limits[type];
+			lim.max_count = max_count;
+			lim.interval_ns = static_cast<uint64_t>(interval_ms) * 1000000;
+			util::atomic_store(&lim.window_start, static_cast<uint64_t>(0));
+			util::atomic_store(&lim.count, static_cast<uint32_t>(0));
+		}
+
+		/**
+		 * Returns true if a message of the type may be logged now
+		 */
+		bool allow(message_type type, uint64_t now_ns)
+		{
+			limit& lim = m_limits[type];
+			if (lim.max_count == 0)
+			{
+				return true;
+			}
+
+			// Start a new window when the current one has expired. Only the thread
+			// winning the exchange resets the counter.
+			uint64_t start = util::atomic_load(&lim.window_start);
+			if ((now_ns - start) >= lim.interval_ns)
+			{
+				if (util::atomic_cas(&lim.window_start, start, now_ns))
+				{
+					util::atomic_store(&lim.count, static_cast<uint32_t>(0));
+				}
+			}
+
+			if (util::atomic_fetch_add(&lim.count, static_cast<uint32_t>(1)) < lim.max_count)
+			{
+				return true;
+			}
+
+			util::atomic_fetch_add(&lim.suppressed, static_cast<uint64_t>(1));
+			return false;
+		}
+
+		/**
+		 * Total number of messages of the type suppressed so far
+		 */
+		uint64_t suppressed(message_type type) const
+		{
+			return util::atomic_load(&m_limits[type].suppressed);
+		}
+
+	private:
+		struct limit
+		{
+			uint32_t max_count;
+			uint64_t interval_ns;
+			volatile uint64_t window_start;
+			volatile uint32_t count;
+			volatile uint64_t suppressed;
+		};
+
+		rate_limiter(const rate_limiter&);
+		rate_limiter& operator=(const rate_limiter&);
+
+		limit m_limits[MSG_TYPE_COUNT];
+	};
+
+	class logger;
+
+	/**
+	 * Pending statement of a level and message type - made by
+	 * KAFKA_BROKER_STUB_LOG() once the level is known to be enabled
+	 */
+	class statement
+	{
+	public:
+		statement(logger& log, level lvl, message_type type):
+			m_logger(&log),
+			m_level(lvl),
+			m_type(type)
+		{
+
+		}
+
+		inline void operator()(int32_t node_id, const char* fmt, ...) const
+#ifdef __GNUC__
+			__attribute__((format(printf, 3, 4)))
+#endif
+			;
+
+	private:
+		logger* m_logger;
+		level m_level;
+		message_type m_type;
+	};
+
+	/**
+	 * Logger front-end filtering on level and rate before writing to a sink
+	 */
+	class logger
+	{
+	public:
+		logger():
+			m_sink(&default_sink()),
+			m_level(LEVEL_INFO),
+			m_limiter()
+		{
+			// Messages triggered by every frame from a misbehaving client
+			m_limiter.set_limit(MSG_UNKNOWN_API, 10, 1000);
+			m_limiter.set_limit(MSG_UNSUPPORTED_VERSION, 10, 1000);
+		}
+
+		void set_sink(sinkI& sink)
+		{
+			m_sink = &sink;
+		}
+
+		void set_level(level lvl)
+		{
+			m_level = lvl;
+		}
+
+		level get_level() const
+		{
+			return m_level;
+		}
+
+		void set_rate_limit(message_type type, uint32_t max_count, uint32_t interval_ms)
+		{
+			m_limiter.set_limit(type, max_count, interval_ms);
+		}
+
+		uint64_t suppressed(message_type type) const
+		{
+			return m_limiter.suppressed(type);
+		}
+
+		/**
+		 * Returns true if a statement at the level would currently be written
+		 */
+		bool enabled(level lvl) const
+		{
+			return compiled_in(lvl) && (lvl >= m_level);
+		}
+
+		/**
+		 * Statement for KAFKA_BROKER_STUB_LOG(), which checks the level first
+		 */
+		statement make_statement(level lvl, message_type type)
+		{
+			return statement(*this, lvl, type);
+		}
+
+		/**
+		 * Format and write a printf-style message. The arguments are evaluated
+		 * whatever the level - use KAFKA_BROKER_STUB_LOG() where they are not
+		 * free.
+		 */
+		void write(level lvl, message_type type, int32_t node_id, const char* fmt, ...)
+#ifdef __GNUC__
+			__attribute__((format(printf, 5, 6)))
+#endif
+		{
+			va_list args;
+			va_start(args, fmt);
+			vwrite(lvl, type, node_id, fmt, args);
+			va_end(args);
+		}
+
+		void vwrite(level lvl, message_type type, int32_t node_id, const char* fmt, va_list args)
+		{
+			if (!enabled(lvl))
+			{
+				return;
+			}
+
+			uint64_t now = util::monotonic_ns();
+			if (!m_limiter.allow(type, now))
+			{
+				return;
+			}
+
+			record rec;
+			rec.lvl = lvl;
+			rec.type = type;
+			rec.node_id = node_id;
+			rec.timestamp_ns = now;
+
+			vsnprintf(rec.text, sizeof(rec.text), fmt, args);
+			m_sink->write(rec);
+		}
+
+	private:
+		logger(const logger&);
+		logger& operator=(const logger&);
+
+		sinkI* m_sink;
+		level m_level;
+		rate_limiter m_limiter;
+	};
+
+	void statement::operator()(int32_t node_id, const char* fmt, ...) const
+	{
+		va_list args;
+		va_start(args, fmt);
+		m_logger->vwrite(m_level, m_type, node_id, fmt, args);
+		va_end(args);
+	}
+
+}}
+
+#endif
@@ -0,0 +1,433 @@
+#ifndef KAFKA_BROKER_STUB_LOOPBACK_HPP_INC_
+#define KAFKA_BROKER_STUB_LOOPBACK_HPP_INC_
+
+/*
+ * In-process transport for embedding a broker stub in unit tests.
+ *
+ * A loopback channel is a duplex byte stream made of two lock-free single
+ * producer single consumer queues. A client thread writes requests to and
+ * reads responses from its channel while the thread polling the transport
+ * feeds the requests to broker_stub::handle_data and queues the responses.
+ * No sockets or ports are involved so tests can run in parallel.
+ */
+
+#include "transport.hpp"
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+
+namespace kafka_broker_stub { namespace transport {
+
+	/**
+	 * Fixed size single producer single consumer byte queue
+	 *
+	 * write() must only be called from one thread and read(), peek() and
+	 * consume() from one other thread.
+	 */
+	class spsc_byte_queue
+	{
+	public:
+		/**
+		 * Make queue holding at least capacity bytes (rounded up to a power of 2)
+		 */
+		explicit spsc_byte_queue(size_t capacity):
+			m_buf(),
+			m_mask(0),
+			m_head(0),
+			m_pad(),
+			m_tail(0)
+		{
+			size_t size = 64;
+			while (size < capacity)
+			{
+				size <<= 1;
+			}
+			m_buf.resize(size);
+			m_mask = size - 1;
+		}
+
+		/**
+		 * Write as much as fits - returns the number of bytes written
+		 */
+		size_t write(const void* data, size_t size)
+		{
+			size_t tail = m_tail;
+			size_t space = capacity() - (tail - util::atomic_load(&m_head));
+			size = std::min(size, space);
+
+			const uint8_t* bytes = static_cast<const uint8_t*>(data);
+			size_t pos = tail & m_mask;
+			size_t first = std::min(size, capacity() - pos);
+			memcpy(&m_buf[pos], bytes, first);
+			memcpy(&m_buf[0], bytes + first, size - first);
+			util::atomic_store(&m_tail, tail + size);
+			return size;
+		}
+
+		/**
+		 * Get the contiguous readable bytes at the head - returns their number
+		 */
+		size_t peek(const uint8_t*& data) const
+		{
+			size_t head = m_head;
+			size_t pos = head & m_mask;
+			data = &m_buf[pos];
+			return std::min(util::atomic_load(&m_tail) - head, capacity() - pos);
+		}
+
+		/**
+		 * Release bytes read through peek()
+		 */
+		void consume(size_t size)
+		{
+			util::atomic_store(&m_head, m_head + size);
+		}
+
+		/**
+		 * Read up to size bytes - returns the number of bytes read
+		 */
+		size_t read(void* buf, size_t size)
+		{
+			uint8_t* out = static_cast<uint8_t*>(buf);
+			size_t done = 0;
+			const uint8_t* data = NULL;
+			size_t avail = 0;
+			while ((done < size) && ((avail = peek(data)) > 0))
+			{
+				size_t num = std::min(avail, size - done);
+				memcpy(out + done, data, num);
+				consume(num);
+				done += num;
+			}
+			return done;
+		}
+
+		bool empty() const
+		{
+			return util::atomic_load(&m_tail) == util::atomic_load(&m_head);
+		}
+
+		size_t capacity() const
+		{
+			return m_mask + 1;
+		}
+
+	private:
+		spsc_byte_queue(const spsc_byte_queue&);
+		spsc_byte_queue& operator=(const spsc_byte_queue&);
+
+		std::vector<uint8_t> m_buf;
+		size_t m_mask;
+
+		// Consumer and producer positions on separate cache lines
+		volatile size_t m_head;
+		char m_pad[64];
+		volatile size_t m_tail;
+	};
+
+	/**
+	 * Waits by spinning briefly, then yielding and finally sleeping
+	 */
+	class backoff
+	{
+	public:
+		backoff():
+			m_rounds(0)
+		{
+
+		}
+
+		void wait()
+		{
+			if (m_rounds < 100)
+			{
+				__sync_synchronize();
+			}
+			else if (m_rounds < 200)
+			{
+				sched_yield();
+			}
+			else
+			{
+				struct timespec ts;
+				ts.tv_sec = 0;
+				ts.tv_nsec = 50000;
+				nanosleep(&ts, NULL);
+			}
+			++m_rounds;
+		}
+
+		void reset()
+		{
+			m_rounds = 0;
+		}
+
+	private:
+		unsigned m_rounds;
+	};
+
+	/**
+	 * Client end of an in-process connection to a broker stub
+	 */
+	class loopback_channel
+	{
+	public:
+		loopback_channel(broker_stub& stub, size_t capacity):
+			m_requests(capacity),
+			m_responses(capacity),
+			m_session(stub),
+			m_closed(0)
+		{
+
+		}
+
+		/**
+		 * Queue request bytes without blocking - returns the number of bytes
+		 * queued
+		 */
+		size_t write(const void* data, size_t size)
+		{
+			return m_requests.write(data, size);
+		}
+
+		/**
+		 * Queue all bytes waiting for room at most timeout_ms milliseconds in
+		 * total - returns false on timeout or if the channel was closed
+		 */
+		bool write_all(const void* data, size_t size, int timeout_ms)
+		{
+			const uint8_t* bytes = static_cast<const uint8_t*>(data);
+			uint64_t deadline = util::monotonic_ns() + static_cast<uint64_t>(timeout_ms) * 1000000;
+			backoff wait;
+			while ((size > 0) && !closed())
+			{
+				size_t num = m_requests.write(bytes, size);
+				bytes += num;
+				size -= num;
+				if (num > 0)
+				{
+					wait.reset();
+				}
+				else if (util::monotonic_ns() > deadline)
+				{
+					return false;
+				}
+				else
+				{
+					wait.wait();
+				}
+			}
+			return size == 0;
+		}
+
+		/**
+		 * Read response bytes without blocking - returns the number of bytes
+		 * read
+		 */
+		size_t read(void* buf, size_t size)
+		{
+			return m_responses.read(buf, size);
+		}
+
+		/**
+		 * Read exactly size bytes waiting at most timeout_ms milliseconds in
+		 * total - returns false on timeout or if the channel was closed
+		 */
+		bool read_all(void* buf, size_t size, int timeout_ms)
+		{
+			uint8_t* out = static_cast<uint8_t*>(buf);
+			uint64_t deadline = util::monotonic_ns() + static_cast<uint64_t>(timeout_ms) * 1000000;
+			backoff wait;
+			while (size > 0)
+			{
+				size_t num = m_responses.read(out, size);
+				out += num;
+				size -= num;
+				if (num > 0)
+				{
+					wait.reset();
+				}
+				else if (closed() || (util::monotonic_ns() > deadline))
+				{
+					return false;
+				}
+				else
+				{
+					wait.wait();
+				}
+			}
+			return true;
+		}
+
+		/**
+		 * True once the broker side closed the channel due to an invalid
+		 * request stream
+		 */
+		bool closed() const
+		{
+			return util::atomic_load(&m_closed) != 0;
+		}
+
+	private:
+		friend class loopback_transport;
+
+		/**
+		 * Handle queued requests and queue responses - returns true if any
+		 * work was done. Called on the polling thread.
+		 */
+		bool pump()
+		{
+			if (closed())
+				return false;
+
+			if (!m_session.release(util::monotonic_ns()))
+			{
+				util::atomic_store(&m_closed, 1);
+				return true;
+			}
+			bool worked = flush();
+
+			// Only take more requests once earlier responses fit in the queue
+			const uint8_t* data = NULL;
+			size_t size = 0;
+			while (!m_session.has_output() && ((size = m_requests.peek(data)) > 0))
+			{
+				if (!m_session.receive(data, size))
+				{
+					util::atomic_store(&m_closed, 1);
+					return true;
+				}
+				m_requests.consume(size);
+				worked = true;
+				flush();
+			}
+			return worked;
+		}
+
+		/**
+		 * Move pending responses of the session to the response queue
+		 */
+		bool flush()
+		{
+			bool worked = false;
+			struct iovec iov[MAX_IOV];
+			while (m_session.has_output())
+			{
+				size_t count = m_session.fill_iovec(iov, MAX_IOV);
+				size_t written = 0;
+				for (size_t i=0; i<count; ++i)
+				{
+					size_t num = m_responses.write(iov[i].iov_base, iov[i].iov_len);
+					written += num;
+					if (num < iov[i].iov_len)
+						break;
+				}
+				if (written == 0)
+					break;
+				m_session.consumed(written);
+				worked = true;
+			}
+			return worked;
+		}
+
+		loopback_channel(const loopback_channel&);
+		loopback_channel& operator=(const loopback_channel&);
+
+		spsc_byte_queue m_requests;
+		spsc_byte_queue m_responses;
+		session m_session;
+		volatile int m_closed;
+	};
+
+	/**
+	 * Transport serving in-process loopback channels
+	 *
+	 * Channels may be opened from any thread while the transport is polled.
+	 * They live as long as the transport.
+	 */
+	class loopback_transport : public transportI
+	{
+	public:
+		explicit loopback_transport(broker_stub& stub, size_t capacity = 1 << 16):
+			m_stub(stub),
+			m_capacity(capacity),
+			m_mutex(),
+			m_channels()
+		{
+			if (pthread_mutex_init(&m_mutex, NULL) != 0)
+				throw std::runtime_error("Unable to initialize loopback transport");
+		}
+
+		~loopback_transport()
+		{
+			for (size_t i=0; i<m_channels.size(); ++i)
+			{
+				delete m_channels[i];
+			}
+			pthread_mutex_destroy(&m_mutex);
+		}
+
+		/**
+		 * Open a new channel to the stub
+		 */
+		loopback_channel& connect()
+		{
+			loopback_channel* channel = new loopback_channel(m_stub, m_capacity);
+			pthread_mutex_lock(&m_mutex);
+			m_channels.push_back(channel);
+			pthread_mutex_unlock(&m_mutex);
+			return *channel;
+		}
+
+		bool listen(const char*, int32_t)
+		{
+			return true;
+		}
+
+		/**
+		 * Pump all channels until there is work or the timeout expires
+		 */
+		int poll(int timeout_ms)
+		{
+			uint64_t deadline = util::monotonic_ns() + static_cast<uint64_t>(timeout_ms > 0 ? timeout_ms : 0) * 1000000;
+			backoff wait;
+			for (;;)
+			{
+				int handled = 0;
+				pthread_mutex_lock(&m_mutex);
+				for (size_t i=0; i<m_channels.size(); ++i)
+				{
+					if (m_channels[i]->pump())
+						++handled;
+				}
+				pthread_mutex_unlock(&m_mutex);
+
+				if ((handled > 0) || (util::monotonic_ns() >= deadline))
+					return handled;
+				wait.wait();
+			}
+		}
+
+		int32_t port() const
+		{
+			return 0;
+		}
+
+		const char* name() const
+		{
+			return "loopback";
+		}
+
+	private:
+		loopback_transport(const loopback_transport&);
+		loopback_transport& operator=(const loopback_transport&);
+
+		broker_stub& m_stub;
+		size_t m_capacity;
+		pthread_mutex_t m_mutex;
+		std::vector<loopback_channel*> m_channels;
+	};
+
+}}
+
+#endif
@@ -4,11 +4,27 @@
 #include "primitive.hpp"
 #include "metadata.hpp"
 #include "produce.hpp"
+#include "fetch.hpp"
+#include "list_offsets.hpp"
+#include "init_producer_id.hpp"
 #include "headers.hpp"
 #include "util.hpp"
+#include "log.hpp"
+#include "dispatch.hpp"
+#include "trace.hpp"
+#include "key_index.hpp"
+#include "time_index.hpp"
+#include "compacted_view.hpp"
+#include "producer_state.hpp"
+#include "observer.hpp"
+#include "worker_pool.hpp"
+#include "quota.hpp"
+#include "shaping.hpp"
+#include "coordinator.hpp"
+#include <algorithm>
 #include <list>
+#include <map>
 #include <string>
-#include <stdio.h>
 
 namespace kafka_broker_stub {
 
@@ -18,14 +34,31 @@ namespace kafka_broker_stub {
 	/**
 	 * Simple key value pair
 	 *
-	 * This is returned by the broker stub when looking up data in partitions
+	 * This is returned by the broker stub when looking up data in partitions.
+	 * The timestamp (milliseconds since epoch) is the one set by the producer
+	 * for messages in format v1 and otherwise the time the pair was appended.
+	 * Messages produced without a key or value have an empty key or value
+	 * flagged as null.
 	 */
 	class key_value_pair
 	{
 	public:
+		key_value_pair():
+			m_key(),
+			m_value(),
+			m_timestamp(0),
+			m_null_key(false),
+			m_null_value(false)
+		{
+
+		}
+
 		key_value_pair(const std::string& k, const std::string& v):
 			m_key(k),
-			m_value(v)
+			m_value(v),
+			m_timestamp(0),
+			m_null_key(false),
+			m_null_value(false)
 		{
 
 		}
@@ -35,453 +68,2554 @@ namespace kafka_broker_stub {
 			return m_key;
 		}
 
+		bool null_key() const
+		{
+			return m_null_key;
+		}
+
 		const std::string& value() const
 		{
 			return m_value;
 		}
 
+		bool null_value() const
+		{
+			return m_null_value;
+		}
+
+		int64_t timestamp() const
+		{
+			return m_timestamp;
+		}
+
+		void swap(key_value_pair& other)
+		{
+			m_key.swap(other.m_key);
+			m_value.swap(other.m_value);
+			std::swap(m_timestamp, other.m_timestamp);
+			std::swap(m_null_key, other.m_null_key);
+			std::swap(m_null_value, other.m_null_value);
+		}
+
 	private:
+		friend class partition;
+
 		std::string m_key;
 		std::string m_value;
+		int64_t m_timestamp;
+		bool m_null_key;
+		bool m_null_value;
 	};
 
 	/**
-	 * Partition that holds an array of key-value pairs
+	 * Contiguous log of key value pairs supporting removal from the head
+	 *
+	 * Removed pairs are released right away but their slots are only reclaimed
+	 * once they make up half of the array, at which point the remaining pairs
+	 * are swapped to the front. Removal is thus O(1) amortized and the capacity
+	 * stays bounded by twice the retained pairs.
+	 *
+	 * For reading, the log offers the interface of a const std::vector
+	 * (size(), operator[], front(), back(), begin() and end()), which
+	 * partition::data() returned before retention was added.
 	 */
-	class partition
+	class record_log
 	{
 	public:
-		partition(int32_t part_id, int32_t leader_id):
-			m_data(),
-			m_part_id(part_id),
-			m_leader_id(leader_id)
+		typedef std::vector<key_value_pair>::const_iterator const_iterator;
+
+		record_log():
+			m_items(),
+			m_head(0)
 		{
 
 		}
 
-		void add_data(const std::string& key, const std::string& value)
+		size_t size() const
 		{
-			key_value_pair keyval(key, value);
-			m_data.push_back(keyval);
+			return m_items.size() - m_head;
 		}
 
-		const std::vector<key_value_pair>& data() const
+		bool empty() const
 		{
-			return m_data;
+			return size() == 0;
 		}
 
-		int32_t leader() const
+		const key_value_pair& operator[] (size_t x) const
 		{
-			return m_leader_id;
+			return m_items[m_head + x];
 		}
 
-		int32_t id() const
+		key_value_pair& operator[] (size_t x)
 		{
-			return m_part_id;
+			return m_items[m_head + x];
 		}
 
-	private:
-		std::vector<key_value_pair> m_data;
-		int32_t m_part_id;
-		int32_t m_leader_id;
-	};
+		const key_value_pair& front() const
+		{
+			return m_items[m_head];
+		}
 
-	/**
-	 * Kafka topic with a name and a number of partitions
-	 */
-	class topic
-	{
-	public:
-		topic(const std::string& n, const std::vector<partition>& parts):
-			m_name(n),
-			m_partitions()
+		const key_value_pair& back() const
+		{
+			return m_items.back();
+		}
+
+		const_iterator begin() const
+		{
+			return m_items.begin() + static_cast<ptrdiff_t>(m_head);
+		}
+
+		const_iterator end() const
+		{
+			return m_items.end();
+		}
+
+		/**
+		 * Make room for a number of additional pairs
+		 *
+		 * Removed slots are only reclaimed when the pairs do not fit the
+		 * spare capacity and the removed slots make up half of the array,
+		 * otherwise the capacity grows. Appending to a log that evicts from
+		 * its head thus moves the retained pairs O(1) times per pair.
+		 */
+		void reserve(size_t count)
 		{
-			for (size_t i=0; i<parts.size(); ++i)
+			if (m_items.size() + count <= m_items.capacity())
+			{
+				return;
+			}
+
+			if (m_head >= size())
+			{
+				compact();
+			}
+			size_t needed = m_items.size() + count;
+			if (needed > m_items.capacity())
 			{
-				m_partitions.push_back(parts[i]);
+				m_items.reserve(std::max(needed, 2*m_items.capacity()));
 			}
 		}
 
-		const std::string& name() const
+		void push_back(const key_value_pair& keyval)
 		{
-			return m_name;
+			m_items.push_back(keyval);
 		}
 
-		const std::vector<partition>& partitions() const
+		/**
+		 * Change the number of pairs - new pairs are empty
+		 */
+		void resize(size_t count)
 		{
-			return m_partitions;
+			m_items.resize(m_head + count);
 		}
 
-		const partition* get_partition(size_t num) const
+		void pop_front()
 		{
-			if (num >= m_partitions.size())
+			key_value_pair empty;
+			m_items[m_head].swap(empty);
+			++m_head;
+
+			if (m_head == m_items.size())
 			{
-				return NULL;
+				m_items.clear();
+				m_head = 0;
+			}
+			else if (m_head >= m_items.size() - m_head)
+			{
+				compact();
 			}
-
-			return &m_partitions[num];
 		}
 
-		partition* get_partition_writeable(size_t num)
+	private:
+		void compact()
 		{
-			if (num >= m_partitions.size())
+			if (m_head == 0)
 			{
-				return NULL;
+				return;
 			}
 
-			return &m_partitions[num];
+			size_t count = size();
+			for (size_t i=0; i<count; ++i)
+			{
+				m_items[i].swap(m_items[m_head + i]);
+			}
+			m_items.resize(count);
+			m_head = 0;
 		}
 
-	private:
-		std::string m_name;
-		std::vector<partition> m_partitions;
+		std::vector<key_value_pair> m_items;
+		size_t m_head;
 	};
 
 	/**
-	 * Broker Stub
+	 * Retention settings for the partitions of a topic. Zero means unlimited.
+	 */
+	struct retention_policy
+	{
+		retention_policy():
+			max_bytes(0),
+			max_messages(0),
+			max_age_ms(0)
+		{
+
+		}
+
+		retention_policy(uint64_t bytes, uint64_t messages, int64_t age_ms):
+			max_bytes(bytes),
+			max_messages(messages),
+			max_age_ms(age_ms)
+		{
+
+		}
+
+		// Maximum number of key and value bytes
+		uint64_t max_bytes;
+
+		// Maximum number of messages
+		uint64_t max_messages;
+
+		// Maximum age of messages in milliseconds
+		int64_t max_age_ms;
+	};
+
+	/**
+	 * Result of looking up a message in a partition
 	 *
-	 * This stub implements the necessary function to parse the kafka wire
-	 * protocol.
+	 * The record is NULL if no message was found. It points into the partition
+	 * and is only valid until the partition is modified.
 	 */
-	class broker_stub
+	struct record_view
+	{
+		record_view():
+			partition(-1),
+			offset(-1),
+			record(NULL)
+		{
+
+		}
+
+		record_view(int32_t part, int64_t off, const key_value_pair* rec):
+			partition(part),
+			offset(off),
+			record(rec)
+		{
+
+		}
+
+		int32_t partition;
+		int64_t offset;
+		const key_value_pair* record;
+	};
+
+	// Flags of records held as lazy data (see partition::set_lazy_data())
+	const uint8_t LAZY_TOMBSTONE = 0x01;  // Tombstone of a compacted partition
+	const uint8_t LAZY_RECLAIMED = 0x02;  // Superseded message released by compaction
+	const uint8_t LAZY_NULL_KEY = 0x04;   // Message without a key
+	const uint8_t LAZY_NULL_VALUE = 0x08; // Message without a value
+
+	/**
+	 * Partition that holds an array of key-value pairs
+	 *
+	 * Unless specified the leader is the only replica and the in-sync replica
+	 * set equals the replicas.
+	 *
+	 * Messages violating the retention policy are removed from the head of the
+	 * partition when data is appended. Offsets keep increasing, the offset of
+	 * data()[0] is log_start_offset().
+	 *
+	 * Lookups by key scan the retained messages unless the key index is
+	 * enabled, in which case the index is kept up to date on append and
+	 * eviction. Lookups by time always use a sparse time index.
+	 *
+	 * Record batches of idempotent producers are checked against the
+	 * sequences of the last batches of the producer before they are appended.
+	 *
+	 * Partitions of compacted topics maintain the latest message per key on
+	 * append, so lookups and fetches see the partition as compacted.
+	 */
+	class partition
 	{
 	public:
-		broker_stub(int32_t nodeId, const char* host, int32_t port):
-			m_node_id(nodeId),
-			m_topics(),
-			m_brokers(),
-			m_broker_ids()
+		partition(int32_t part_id, int32_t leader_id):
+			m_data(),
+			m_part_id(part_id),
+			m_leader_id(leader_id),
+			m_replicas(1, leader_id),
+			m_isr(1, leader_id),
+			m_lazy(),
+			m_retention(),
+			m_log_start(0),
+			m_bytes(0),
+			m_index(),
+			m_indexed(false),
+			m_time_index(),
+			m_producers(),
+			m_compacted(),
+			m_compacting(false),
+			m_reclaim(false)
 		{
-			m_broker_ids.push_back(nodeId);
-			m_brokers.push_back(metadata::broker(nodeId, host, port));
+
+		}
+
+		partition(int32_t part_id, int32_t leader_id, const std::vector<int32_t>& replicas):
+			m_data(),
+			m_part_id(part_id),
+			m_leader_id(leader_id),
+			m_replicas(replicas),
+			m_isr(replicas),
+			m_lazy(),
+			m_retention(),
+			m_log_start(0),
+			m_bytes(0),
+			m_index(),
+			m_indexed(false),
+			m_time_index(),
+			m_producers(),
+			m_compacted(),
+			m_compacting(false),
+			m_reclaim(false)
+		{
+
 		}
 
 		/**
-		 * Add topic to the broker stub
+		 * Append a message with a timestamp in milliseconds since epoch - a
+		 * negative timestamp means now
 		 */
-		bool add_topic(const std::string& name, const std::vector<partition>& partitions)
+		void add_data(const std::string& key, const std::string& value, int64_t timestamp = -1)
 		{
-			topic top(name, partitions);
-			m_topics.push_back(top);
-			return true;
+			materialize();
+			int64_t now = util::wallclock_ms();
+			key_value_pair keyval(key, value);
+			keyval.m_timestamp = (timestamp >= 0) ? timestamp : now;
+			m_data.push_back(keyval);
+			m_bytes += key.size() + value.size();
+			index_from(m_data.size() - 1);
+			time_index_from(m_data.size() - 1);
+			compact_from(m_data.size() - 1);
+			enforce_retention(now);
 		}
 
 		/**
-		 * Add reference to another broker
-		 *
-		 * This could e.g. be the address of another broker stub instance
+		 * Append a message with a null value, which deletes the key from
+		 * compacted partitions. Elsewhere it is a message without a value.
 		 */
-	   bool add_broker_reference(int32_t nodeId, const char* host, int32_t port)
+		void add_tombstone(const std::string& key, int64_t timestamp = -1)
 		{
-			m_brokers.push_back(metadata::broker(nodeId, host, port));
-			return true;
+			materialize();
+			int64_t now = util::wallclock_ms();
+			key_value_pair keyval(key, std::string());
+			keyval.m_timestamp = (timestamp >= 0) ? timestamp : now;
+			keyval.m_null_value = true;
+			m_data.push_back(keyval);
+			m_bytes += key.size();
+			index_from(m_data.size() - 1);
+			time_index_from(m_data.size() - 1);
+			compact(m_data.size() - 1, true);
+			enforce_retention(now);
 		}
 
 		/**
-		 * Get topic with specified name
+		 * Append a decoded message set and return the offset of its first message
+		 *
+		 * Capacity is reserved once for the whole set and the messages are
+		 * constructed in place. Keys and values are still stored as strings
+		 * of their own, so each key or value longer than the short string
+		 * buffer of std::string costs an allocation. Either all messages are
+		 * appended or, if an allocation fails, none of them. Messages without
+		 * a timestamp get the time of the append.
 		 */
-		const topic* get_topic(const std::string& name) const
+		int64_t add_data(const produce::message_set& messages)
 		{
-			for (size_t i=0; i<m_topics.size(); i++)
+			materialize();
+			int64_t base_offset = next_offset();
+			size_t base = m_data.size();
+			m_data.reserve(messages.size());
+
+			int64_t now = util::wallclock_ms();
+			try
+			{
+				m_data.resize(base + messages.size());
+				for (size_t i=0; i<messages.size(); ++i)
+				{
+					const produce::message_view& msg = messages[i];
+					key_value_pair& keyval = m_data[base + i];
+					if (msg.key != NULL)
+						keyval.m_key.assign(reinterpret_cast<const char*>(msg.key), msg.key_size);
+					keyval.m_null_key = (msg.key == NULL);
+					keyval.m_null_value = (msg.value == NULL);
+					if (msg.value != NULL)
+						keyval.m_value.assign(reinterpret_cast<const char*>(msg.value), msg.value_size);
+					keyval.m_timestamp = (msg.timestamp >= 0) ? msg.timestamp : now;
+				}
+			}
+			catch (...)
+			{
+				m_data.resize(base);
+				throw;
+			}
+
+			m_bytes += messages.payload_size();
+			index_from(base);
+			time_index_from(base);
+			for (size_t i=0; m_compacting && (i<messages.size()); ++i)
 			{
-				if (m_topics[i].name() == name)
+				compact(base + i, messages[i].value == NULL);
+			}
+			for (size_t i=0; i<messages.batch_count(); ++i)
+			{
+				const produce::batch_view& batch = messages.batch(i);
+				if ((batch.producer_id >= 0) && (batch.count > 0))
 				{
-					return &m_topics[i];
+					m_producers.add(batch.producer_id, batch.producer_epoch, batch.base_sequence,
+					                last_sequence(batch), base_offset + static_cast<int64_t>(batch.first));
 				}
 			}
-			return NULL;
+			enforce_retention(now);
+			return base_offset;
 		}
 
 		/**
-		 * Parse data and return number of bytes read
+		 * Check the record batch of an idempotent producer before it is
+		 * appended - returns 0 or the error code to answer with. If the batch
+		 * was appended before offset is set to the offset it got then.
 		 */
-		int handle_data(const uint8_t* data, size_t total_size, std::vector<std::string>& responses)
+		int16_t check_producer(const produce::message_set& messages, int64_t& offset) const
 		{
-			// If message size is under 4 bytes we cannot parse anything
-			if ((data == NULL) || (total_size < 4))
-				return 0;
-
-			// Keep track of end address of message
-			const uint8_t* msg_end = data + total_size;
-			const uint8_t* cur_data = data;
-
-			// Loop over messages until we reach end
-			int bytes_read = 0;
-			while ((cur_data + 4) < msg_end)
+			offset = -1;
+			for (size_t i=0; i<messages.batch_count(); ++i)
 			{
-				// Read message size
-				int32_t msg_size = util::read_type<int32_t>(cur_data);
-				if (msg_size < 4)
+				const produce::batch_view& batch = messages.batch(i);
+				if ((batch.producer_id < 0) || (batch.count == 0))
 				{
-					printf("[KafkaBrokerStub][%i] Error message size < 4\n", m_node_id);
-					return -1;
+					continue;
 				}
 
-				// Check if we have received enough bytes to parse message
-				if ((cur_data + static_cast<size_t>(msg_size+4)) > msg_end)
+				// Like brokers only one batch per partition is accepted - 2 = corrupt message
+				if (messages.batch_count() > 1)
 				{
-					// We need more of the input strem to parse this packet so return
-					// and wait for next call
-					return bytes_read;
-				}
-
-				// Dump msg
-				// for (int32_t i=0; i<msg_size+4; i++)
-				// {
-				// 	printf("%02X ", cur_data[i]);
-				// }
-				// printf("\n");
-
-				// Skip over message size
-				cur_data += 4;
-
-				// Prepare response buffer
-				int response_size = 0;
-				uint8_t response_buf[RESP_MAX_SIZE];
-				memset(response_buf, 0, sizeof(response_buf));
-
-				// Read api key and handle message accordingly
-				int16_t api_key = util::read_type<int16_t>(cur_data);
-				int16_t api_version = util::read_type<int16_t>(cur_data+2);
-				switch (api_key)
-				{
-					case 0:
-						response_size = handle_produce_request(cur_data, api_version, response_buf+4, RESP_MAX_SIZE-4);
-						break;
-					case 3:
-						response_size = handle_metadata_request(cur_data, api_version, response_buf+4, RESP_MAX_SIZE-4);
-						break;
-					default:
-						printf("[KafkaBrokerStub][%i] Got unknown API key [%i]\n", m_node_id, api_key);
-						break;
+					return 2;
 				}
 
-				if (response_size < 0)
+				switch (m_producers.check(batch.producer_id, batch.producer_epoch, batch.base_sequence,
+				                          last_sequence(batch), offset))
 				{
-					printf("[KafkaBrokerStub][%i] Error during parsing [%i]\n", m_node_id, response_size);
-					return -1;
+					case SEQUENCE_OUT_OF_ORDER:
+						// 45 = out of order sequence number
+						return 45;
+					case SEQUENCE_FENCED:
+						// 47 = invalid producer epoch
+						return 47;
+					case SEQUENCE_UNKNOWN_PRODUCER:
+						// 59 = unknown producer ID
+						return 59;
+					default:
+						return 0;
 				}
+			}
+			return 0;
+		}
 
-				// Write size in head of response buffer
-				if (response_size > 0)
-				{
-					util::write_type<int32_t>(response_size, response_buf);
-					responses.push_back(std::string(reinterpret_cast<const char*>(response_buf),
-						                             static_cast<size_t>(response_size)+4));
-				}
+		/**
+		 * Producers that appended to the partition
+		 */
+		const producer_table& producers() const
+		{
+			return m_producers;
+		}
 
-				// Update how many bytes we parsed
-				bytes_read += msg_size + 4;
+		/**
+		 * Replace the producer state, e.g. when restoring a snapshot
+		 */
+		void set_producers(const producer_table& producers)
+		{
+			m_producers = producers;
+		}
 
-				// Jump to next message
-				cur_data += msg_size;
-			}
+		/**
+		 * Offset the next message appended will get
+		 */
+		int64_t next_offset() const
+		{
+			return m_log_start + static_cast<int64_t>(m_data.size() + m_lazy.count);
+		}
 
-			return bytes_read;
+		/**
+		 * Offset of the first message retained
+		 */
+		int64_t log_start_offset() const
+		{
+			return m_log_start;
 		}
 
-	private:
+		/**
+		 * Number of key and value bytes retained
+		 */
+		uint64_t size_bytes() const
+		{
+			materialize();
+			return m_bytes;
+		}
 
-		int handle_metadata_request(const uint8_t* data, int16_t api_version, uint8_t* resp_buf,
-			                         size_t resp_size)
+		/**
+		 * Retained messages starting at log_start_offset() - used like a
+		 * const std::vector, but cannot be bound to one
+		 */
+		const record_log& data() const
 		{
-			// We only support metadata response version 0
-			if (api_version != 0)
-			{
-				printf("[KafkaBrokerStub][%i] Received metadata request with unsupported API version [%i]\n",
-					    m_node_id, api_version);
-				return 0;
-			}
+			materialize();
+			return m_data;
+		}
 
-			// Deserialize request
-			metadata::request_v0 req;
-			req.deserialize(data);
-			printf("[KafkaBrokerStub][%i] Got metadata request from [%s] with corr. ID [%i]\n",
-				    m_node_id, req.header().client_id().c_str(),
-				    static_cast<int>(req.header().correlation_id()));
+		const retention_policy& retention() const
+		{
+			return m_retention;
+		}
 
-			// Prepare list of topics for response
-			primitive::array<metadata::topic> topics;
+		void set_retention(const retention_policy& policy)
+		{
+			m_retention = policy;
+		}
+
+		/**
+		 * Remove messages from the head until the retention policy is satisfied
+		 */
+		void enforce_retention(int64_t now_ms)
+		{
+			materialize();
+			while (!m_data.empty() && violates_retention(now_ms))
+			{
+				const key_value_pair& front = m_data.front();
+				m_bytes -= front.key().size() + front.value().size();
+				if (m_indexed)
+				{
+					m_index.remove_first(front.key(), m_log_start);
+				}
+				if (m_compacting)
+				{
+					m_compacted.pop_front(front.key());
+				}
+				m_data.pop_front();
+				++m_log_start;
+			}
+			m_time_index.truncate_front(m_log_start);
+		}
+
+		/**
+		 * Let the partition hold records that are only decoded on first access
+		 *
+		 * The records are stored as a timestamp and a byte of LAZY_* flags
+		 * followed by a length-prefixed key and a length-prefixed value (see
+		 * snapshot.hpp). The key index and compaction are rebuilt from the
+		 * records as they are decoded, so they are enabled before. The buffer
+		 * must outlive the partition. Existing data and producer state are
+		 * replaced.
+		 */
+		void set_lazy_data(const uint8_t* records, size_t size, size_t count, int64_t log_start_offset)
+		{
+			m_data.resize(0);
+			m_bytes = 0;
+			m_index.clear();
+			m_time_index.clear();
+			m_producers.clear();
+			m_compacted.clear();
+			m_log_start = log_start_offset;
+			m_lazy.records = records;
+			m_lazy.size = size;
+			m_lazy.count = count;
+		}
+
+		int32_t leader() const
+		{
+			return m_leader_id;
+		}
+
+		int32_t id() const
+		{
+			return m_part_id;
+		}
+
+		const std::vector<int32_t>& replicas() const
+		{
+			return m_replicas;
+		}
+
+		const std::vector<int32_t>& isr() const
+		{
+			return m_isr;
+		}
+
+		void set_isr(const std::vector<int32_t>& isr)
+		{
+			m_isr = isr;
+		}
+
+		/**
+		 * Index the keys of the partition so lookups by key do not have to
+		 * scan the messages. Costs memory for every distinct retained key.
+		 */
+		void enable_key_index()
+		{
+			if (!m_indexed)
+			{
+				m_indexed = true;
+				index_from(0);
+			}
+		}
+
+		bool key_index_enabled() const
+		{
+			return m_indexed;
+		}
+
+		/**
+		 * Treat the partition as compacted: only the latest message per key is
+		 * visible to fetches and value lookups. With reclaim the key and value
+		 * of superseded messages are released as soon as they are superseded
+		 * (their offsets and timestamps stay), bounding memory by the number
+		 * of keys. Messages appended before had no tombstones.
+		 */
+		void enable_compaction(bool reclaim = false)
+		{
+			materialize();
+			if (!m_compacting)
+			{
+				m_compacting = true;
+				compact_from(0);
+			}
+
+			if (reclaim && !m_reclaim)
+			{
+				m_reclaim = true;
+				for (size_t i=0; i<m_data.size(); ++i)
+				{
+					if (!m_compacted.is_latest(m_log_start + static_cast<int64_t>(i)))
+					{
+						reclaim_message(i);
+					}
+				}
+			}
+		}
+
+		bool compaction_enabled() const
+		{
+			return m_compacting;
+		}
+
+		bool reclaim_enabled() const
+		{
+			return m_reclaim;
+		}
+
+		/**
+		 * Latest message per key - empty unless compaction is enabled
+		 */
+		const compacted_view& compacted() const
+		{
+			materialize();
+			return m_compacted;
+		}
+
+		/**
+		 * Get the message at an offset - the record is NULL if the offset is
+		 * not retained
+		 */
+		record_view at_offset(int64_t offset) const
+		{
+			materialize();
+			if ((offset < m_log_start) || (offset >= next_offset()))
+			{
+				return record_view();
+			}
+
+			return record_view(m_part_id, offset, &m_data[static_cast<size_t>(offset - m_log_start)]);
+		}
+
+		/**
+		 * Get the latest message with the key - the record is NULL if none
+		 */
+		record_view find_last(const std::string& key) const
+		{
+			materialize();
+			if (m_compacting)
+			{
+				return at_offset(m_compacted.find(key));
+			}
+			if (m_indexed)
+			{
+				size_t count = 0;
+				const int64_t* offsets = m_index.find(key, count);
+				return (count == 0) ? record_view() : at_offset(offsets[count - 1]);
+			}
+
+			for (size_t i=m_data.size(); i>0; --i)
+			{
+				if (m_data[i - 1].key() == key)
+				{
+					return record_view(m_part_id, m_log_start + static_cast<int64_t>(i - 1), &m_data[i - 1]);
+				}
+			}
+			return record_view();
+		}
+
+		/**
+		 * Get the latest value of the key in a compacted partition - the record
+		 * is NULL if the key has none or was deleted by a tombstone
+		 */
+		record_view find_value(const std::string& key) const
+		{
+			materialize();
+			int64_t offset = m_compacted.find(key);
+			return m_compacted.is_tombstone(offset) ? record_view() : at_offset(offset);
+		}
+
+		/**
+		 * Get the latest value of every key of a compacted partition in offset
+		 * order - keys deleted by a tombstone are left out
+		 */
+		std::vector<record_view> compacted_data() const
+		{
+			materialize();
+			std::vector<int64_t> offsets = m_compacted.values();
+			std::vector<record_view> result;
+			result.reserve(offsets.size());
+			for (size_t i=0; i<offsets.size(); ++i)
+			{
+				result.push_back(at_offset(offsets[i]));
+			}
+			return result;
+		}
+
+		/**
+		 * Get the offsets of all messages with the key in ascending order
+		 */
+		std::vector<int64_t> find_all(const std::string& key) const
+		{
+			materialize();
+			if (m_indexed)
+			{
+				size_t count = 0;
+				const int64_t* offsets = m_index.find(key, count);
+				return std::vector<int64_t>(offsets, offsets + count);
+			}
+
+			std::vector<int64_t> offsets;
+			for (size_t i=0; i<m_data.size(); ++i)
+			{
+				if (m_data[i].key() == key)
+				{
+					offsets.push_back(m_log_start + static_cast<int64_t>(i));
+				}
+			}
+			return offsets;
+		}
+
+		/**
+		 * Get the first message with a timestamp at or after the given one -
+		 * the record is NULL if none. Timestamps need not increase with the
+		 * offsets, but the lookup is fastest when they do.
+		 */
+		record_view find_time(int64_t timestamp) const
+		{
+			materialize();
+			int64_t start = std::max(m_time_index.lookup(timestamp), m_log_start);
+			for (size_t i=static_cast<size_t>(start - m_log_start); i<m_data.size(); ++i)
+			{
+				if (m_data[i].timestamp() >= timestamp)
+				{
+					return record_view(m_part_id, m_log_start + static_cast<int64_t>(i), &m_data[i]);
+				}
+			}
+			return record_view();
+		}
+
+	private:
+		/**
+		 * Records not decoded yet
+		 */
+		struct lazy_data
+		{
+			const uint8_t* records;
+			size_t size;
+			size_t count;
+		};
+
+		bool violates_retention(int64_t now_ms) const
+		{
+			if ((m_retention.max_messages > 0) && (m_data.size() > m_retention.max_messages))
+				return true;
+			if ((m_retention.max_bytes > 0) && (m_bytes > m_retention.max_bytes))
+				return true;
+			if ((m_retention.max_age_ms > 0) && ((now_ms - m_data.front().timestamp()) > m_retention.max_age_ms))
+				return true;
+			return false;
+		}
+
+		/**
+		 * Decode lazy records into the data array. Decoding stops at the first
+		 * record exceeding the buffer.
+		 */
+		void materialize() const
+		{
+			if (m_lazy.records == NULL)
+			{
+				return;
+			}
+
+			const uint8_t* cur = m_lazy.records;
+			const uint8_t* end = m_lazy.records + m_lazy.size;
+			m_data.reserve(m_lazy.count);
+			std::vector<uint8_t> flags;
+			flags.reserve(m_lazy.count);
+			for (size_t i=0; i<m_lazy.count; ++i)
+			{
+				if ((end - cur) < 13)
+					break;
+				int64_t timestamp = util::read_type<int64_t>(cur);
+				uint8_t record_flags = cur[8];
+				size_t key_size = util::read_type<uint32_t>(cur + 9);
+				if (static_cast<size_t>(end - cur - 13) < key_size)
+					break;
+				const uint8_t* key = cur + 13;
+				cur = key + key_size;
+
+				if ((end - cur) < 4)
+					break;
+				size_t value_size = util::read_type<uint32_t>(cur);
+				if (static_cast<size_t>(end - cur - 4) < value_size)
+					break;
+				const uint8_t* value = cur + 4;
+				cur = value + value_size;
+
+				m_data.resize(m_data.size() + 1);
+				key_value_pair& keyval = m_data[m_data.size() - 1];
+				keyval.m_key.assign(reinterpret_cast<const char*>(key), key_size);
+				keyval.m_value.assign(reinterpret_cast<const char*>(value), value_size);
+				keyval.m_timestamp = timestamp;
+				keyval.m_null_key = ((record_flags & LAZY_NULL_KEY) != 0);
+				keyval.m_null_value = ((record_flags & LAZY_NULL_VALUE) != 0);
+				m_bytes += key_size + value_size;
+				flags.push_back(record_flags);
+			}
+
+			m_lazy.records = NULL;
+			m_lazy.size = 0;
+			m_lazy.count = 0;
+			time_index_from(0);
+
+			// Reclaimed messages lost their keys and only keep their offsets
+			for (size_t i=0; i<m_data.size(); ++i)
+			{
+				if ((flags[i] & LAZY_RECLAIMED) != 0)
+				{
+					if (m_compacting)
+						m_compacted.add_superseded(m_log_start + static_cast<int64_t>(i));
+					continue;
+				}
+				if (m_indexed)
+					m_index.add(m_data[i].key(), m_log_start + static_cast<int64_t>(i));
+				compact(i, (flags[i] & LAZY_TOMBSTONE) != 0);
+			}
+		}
+
+		/**
+		 * Add the messages from position first and on to the key index
+		 */
+		void index_from(size_t first) const
+		{
+			if (!m_indexed)
+			{
+				return;
+			}
+
+			for (size_t i=first; i<m_data.size(); ++i)
+			{
+				m_index.add(m_data[i].key(), m_log_start + static_cast<int64_t>(i));
+			}
+		}
+
+		/**
+		 * Add the messages from position first and on to the compacted view
+		 */
+		void compact_from(size_t first) const
+		{
+			for (size_t i=first; m_compacting && (i<m_data.size()); ++i)
+			{
+				compact(i, false);
+			}
+		}
+
+		void compact(size_t pos, bool tombstone) const
+		{
+			if (!m_compacting)
+			{
+				return;
+			}
+
+			int64_t prev = m_compacted.add(m_data[pos].key(), m_log_start + static_cast<int64_t>(pos), tombstone);
+			if (m_reclaim && (prev >= 0))
+			{
+				reclaim_message(static_cast<size_t>(prev - m_log_start));
+			}
+		}
+
+		/**
+		 * Release the key and value of a superseded message
+		 */
+		void reclaim_message(size_t pos) const
+		{
+			key_value_pair& keyval = m_data[pos];
+			m_bytes -= keyval.key().size() + keyval.value().size();
+			if (m_indexed)
+			{
+				m_index.remove_first(keyval.key(), m_log_start + static_cast<int64_t>(pos));
+			}
+			std::string().swap(keyval.m_key);
+			std::string().swap(keyval.m_value);
+		}
+
+		static int32_t last_sequence(const produce::batch_view& batch)
+		{
+			return producer_table::next_sequence(batch.base_sequence, static_cast<int32_t>(batch.count) - 1);
+		}
+
+		/**
+		 * Add the timestamps of the messages from position first and on to the
+		 * time index
+		 */
+		void time_index_from(size_t first) const
+		{
+			for (size_t i=first; i<m_data.size(); ++i)
+			{
+				m_time_index.add(m_data[i].timestamp(), m_log_start + static_cast<int64_t>(i));
+			}
+		}
+
+		mutable record_log m_data;
+		int32_t m_part_id;
+		int32_t m_leader_id;
+		std::vector<int32_t> m_replicas;
+		std::vector<int32_t> m_isr;
+		mutable lazy_data m_lazy;
+		retention_policy m_retention;
+		int64_t m_log_start;
+		mutable uint64_t m_bytes;
+		mutable key_index m_index;
+		bool m_indexed;
+		mutable time_index m_time_index;
+		producer_table m_producers;
+		mutable compacted_view m_compacted;
+		bool m_compacting;
+		bool m_reclaim;
+	};
+
+	/**
+	 * Kafka topic with a name and a number of partitions
+	 */
+	class topic
+	{
+	public:
+		/**
+		 * Make a topic taking over the partitions, which are only copied if
+		 * an lvalue is passed
+		 */
+		topic(const std::string& n, std::vector<partition> parts):
+			m_name(n),
+			m_partitions()
+		{
+			m_partitions.swap(parts);
+		}
+
+		const std::string& name() const
+		{
+			return m_name;
+		}
+
+		const std::vector<partition>& partitions() const
+		{
+			return m_partitions;
+		}
+
+		const partition* get_partition(size_t num) const
+		{
+			if (num >= m_partitions.size())
+			{
+				return NULL;
+			}
+
+			return &m_partitions[num];
+		}
+
+		partition* get_partition_writeable(size_t num)
+		{
+			if (num >= m_partitions.size())
+			{
+				return NULL;
+			}
+
+			return &m_partitions[num];
+		}
+
+		/**
+		 * Set the retention policy of all partitions
+		 */
+		void set_retention(const retention_policy& policy)
+		{
+			for (size_t i=0; i<m_partitions.size(); ++i)
+			{
+				m_partitions[i].set_retention(policy);
+			}
+		}
+
+		/**
+		 * Enable the key index of all partitions
+		 */
+		void enable_key_index()
+		{
+			for (size_t i=0; i<m_partitions.size(); ++i)
+			{
+				m_partitions[i].enable_key_index();
+			}
+		}
+
+		/**
+		 * Treat all partitions as compacted (see partition::enable_compaction)
+		 */
+		void enable_compaction(bool reclaim = false)
+		{
+			for (size_t i=0; i<m_partitions.size(); ++i)
+			{
+				m_partitions[i].enable_compaction(reclaim);
+			}
+		}
+
+		/**
+		 * Get the message with the key and the latest timestamp in any
+		 * partition - the record is NULL if none
+		 */
+		record_view find_last(const std::string& key) const
+		{
+			record_view result;
+			for (size_t i=0; i<m_partitions.size(); ++i)
+			{
+				record_view found = m_partitions[i].find_last(key);
+				if ((found.record != NULL) &&
+				    ((result.record == NULL) || (found.record->timestamp() > result.record->timestamp())))
+				{
+					result = found;
+				}
+			}
+			return result;
+		}
+
+	private:
+		friend class topic_registry;
+
+		std::string m_name;
+		std::vector<partition> m_partitions;
+	};
+
+	/**
+	 * Collection of topics
+	 *
+	 * Each broker stub owns a registry by default but a registry can also be
+	 * shared by several stubs (see cluster.hpp). Note that a shared registry is
+	 * not synchronized so the stubs sharing it must not handle data concurrently.
+	 */
+	class topic_registry
+	{
+	public:
+		topic_registry():
+			m_topics(),
+			m_index(),
+			m_mappings()
+		{
+
+		}
+
+		~topic_registry()
+		{
+			for (size_t i=0; i<m_mappings.size(); ++i)
+			{
+				delete m_mappings[i];
+			}
+		}
+
+		/**
+		 * Take ownership of a mapped file holding lazy partition data so it
+		 * lives as long as the topics
+		 */
+		void add_mapping(util::mapped_file* file)
+		{
+			m_mappings.push_back(file);
+		}
+
+		/**
+		 * Add topic - returns false if a topic with the name already exists.
+		 * The partitions are taken over like adopt() does, so only an lvalue
+		 * passed is copied.
+		 */
+		bool add(const std::string& name, std::vector<partition> partitions)
+		{
+			return adopt(name, partitions);
+		}
+
+		/**
+		 * Add topic taking over the partitions without copying them. The vector
+		 * is left empty. Returns false if a topic with the name already exists.
+		 */
+		bool adopt(const std::string& name, std::vector<partition>& partitions)
+		{
+			topic* top = add_empty(name);
+			if (top == NULL)
+			{
+				return false;
+			}
+
+			top->m_partitions.swap(partitions);
+			return true;
+		}
+
+		/**
+		 * Reserve room for a number of additional topics. Used before registering
+		 * many topics so the topic array does not grow (and copy) repeatedly.
+		 */
+		void reserve(size_t num_topics)
+		{
+			m_topics.reserve(m_topics.size() + num_topics);
+		}
+
+		const topic* get(const std::string& name) const
+		{
+			std::map<std::string, size_t>::const_iterator it = m_index.find(name);
+			if (it == m_index.end())
+			{
+				return NULL;
+			}
+			return &m_topics[it->second];
+		}
+
+		topic* get_writeable(const std::string& name)
+		{
+			std::map<std::string, size_t>::const_iterator it = m_index.find(name);
+			if (it == m_index.end())
+			{
+				return NULL;
+			}
+			return &m_topics[it->second];
+		}
+
+		const std::vector<topic>& topics() const
+		{
+			return m_topics;
+		}
+
+	private:
+		topic* add_empty(const std::string& name)
+		{
+			if (m_index.find(name) != m_index.end())
+			{
+				return NULL;
+			}
+
+			m_topics.push_back(topic(name, std::vector<partition>()));
+			try
+			{
+				m_index.insert(std::make_pair(name, m_topics.size() - 1));
+			}
+			catch (...)
+			{
+				m_topics.pop_back();
+				throw;
+			}
+			return &m_topics.back();
+		}
+
+		topic_registry(const topic_registry&);
+		topic_registry& operator=(const topic_registry&);
+
+		std::vector<topic> m_topics;
+		std::map<std::string, size_t> m_index;
+		std::vector<util::mapped_file*> m_mappings;
+	};
+
+	/**
+	 * Broker Stub
+	 *
+	 * This stub implements the necessary function to parse the kafka wire
+	 * protocol.
+	 */
+	class broker_stub
+	{
+	public:
+		broker_stub(int32_t nodeId, const char* host, int32_t port):
+			m_node_id(nodeId),
+			m_own_topics(),
+			m_topics(&m_own_topics),
+			m_brokers(),
+			m_broker_ids(),
+			m_log(),
+			m_tracer(nodeId),
+			m_notifier(),
+			m_scatter(),
+			m_workers(NULL),
+			m_parallel_bytes(0),
+			m_quotas(),
+			m_shaping(),
+			m_groups(),
+			m_producer_ids(nodeId),
+			m_handlers(),
+			m_builtin_handlers()
+		{
+			m_broker_ids.push_back(nodeId);
+			m_brokers.push_back(metadata::broker(nodeId, host, port));
+			add_builtin_handlers();
+		}
+
+		/**
+		 * Make a broker stub serving topics from a registry shared with other
+		 * stubs. The registry must outlive the stub.
+		 */
+		broker_stub(int32_t nodeId, const char* host, int32_t port, topic_registry& topics):
+			m_node_id(nodeId),
+			m_own_topics(),
+			m_topics(&topics),
+			m_brokers(),
+			m_broker_ids(),
+			m_log(),
+			m_tracer(nodeId),
+			m_notifier(),
+			m_scatter(),
+			m_workers(NULL),
+			m_parallel_bytes(0),
+			m_quotas(),
+			m_shaping(),
+			m_groups(),
+			m_producer_ids(nodeId),
+			m_handlers(),
+			m_builtin_handlers()
+		{
+			m_broker_ids.push_back(nodeId);
+			m_brokers.push_back(metadata::broker(nodeId, host, port));
+			add_builtin_handlers();
+		}
+
+		~broker_stub()
+		{
+			delete m_workers;
+			for (size_t i=0; i<m_builtin_handlers.size(); ++i)
+			{
+				delete m_builtin_handlers[i];
+			}
+		}
+
+		/**
+		 * Spread produce requests holding records for several partitions and
+		 * at least min_bytes of record data over num_threads extra threads.
+		 * Zero threads handles all requests on the calling thread.
+		 */
+		void set_worker_threads(size_t num_threads, size_t min_bytes = 64 * 1024)
+		{
+			delete m_workers;
+			m_workers = NULL;
+			if (num_threads > 0)
+			{
+				m_workers = new worker_pool(num_threads);
+			}
+			m_parallel_bytes = min_bytes;
+		}
+
+		/**
+		 * Handle versions min_version to max_version of the API key with a
+		 * custom handler instead of the built-in one, e.g. to inject errors or
+		 * to serve further APIs. A NULL handler removes the handlers of the
+		 * versions. Handlers are called on the thread calling handle_data()
+		 * and must outlive the stub. Returns false if the key or a version is
+		 * out of range (see handler_table).
+		 */
+		bool set_handler(int16_t api_key, int16_t min_version, int16_t max_version, request_handlerI* handler)
+		{
+			return m_handlers.set(api_key, min_version, max_version, handler);
+		}
+
+		/**
+		 * Get the handler of a version of the API key - NULL if there is none.
+		 * Custom handlers can keep the built-in handler to delegate to it.
+		 */
+		request_handlerI* get_handler(int16_t api_key, int16_t api_version) const
+		{
+			return m_handlers.get(api_key, api_version);
+		}
+
+		/**
+		 * Add topic to the broker stub - returns false if it already exists.
+		 * The partitions are taken over, so only an lvalue passed is copied.
+		 */
+		bool add_topic(const std::string& name, std::vector<partition> partitions)
+		{
+			return m_topics->adopt(name, partitions);
+		}
+
+		/**
+		 * Add topic taking over the partitions without copying them - the
+		 * vector is left empty. Returns false if the topic already exists.
+		 */
+		bool adopt_topic(const std::string& name, std::vector<partition>& partitions)
+		{
+			return m_topics->adopt(name, partitions);
+		}
+
+		/**
+		 * Set retention policy of a topic - returns false if it does not exist
+		 */
+		bool set_retention(const std::string& name, const retention_policy& policy)
+		{
+			topic* top = get_topic_writeable(name);
+			if (top == NULL)
+			{
+				return false;
+			}
+
+			top->set_retention(policy);
+			return true;
+		}
+
+		/**
+		 * Add reference to another broker
+		 *
+		 * This could e.g. be the address of another broker stub instance
+		 */
+	   bool add_broker_reference(int32_t nodeId, const char* host, int32_t port)
+		{
+			m_brokers.push_back(metadata::broker(nodeId, host, port));
+			return true;
+		}
+
+		/**
+		 * Get topic with specified name
+		 */
+		const topic* get_topic(const std::string& name) const
+		{
+			return m_topics->get(name);
+		}
+
+		int32_t node_id() const
+		{
+			return m_node_id;
+		}
+
+		/**
+		 * Get the brokers known by the stub (the stub itself first)
+		 */
+		const primitive::array<metadata::broker>& brokers() const
+		{
+			return m_brokers;
+		}
+
+		/**
+		 * Get the registry holding the topics of the stub
+		 */
+		topic_registry& get_topic_registry()
+		{
+			return *m_topics;
+		}
+
+		const topic_registry& get_topic_registry() const
+		{
+			return *m_topics;
+		}
+
+		/**
+		 * Get the logger of the stub, e.g. to change level, rate limits or sink
+		 */
+		log::logger& get_logger()
+		{
+			return m_log;
+		}
+
+		/**
+		 * Get the request tracer of the stub, e.g. to enable it or export spans
+		 */
+		trace::tracer& get_tracer()
+		{
+			return m_tracer;
+		}
+
+		/**
+		 * Get the client quotas of the stub, e.g. to limit the produce rate
+		 */
+		quota_manager& get_quotas()
+		{
+			return m_quotas;
+		}
+
+		/**
+		 * Get the network shaping applied by the transports, e.g. to add
+		 * latency to all connections
+		 */
+		network_shaper& get_shaping()
+		{
+			return m_shaping;
+		}
+
+		/**
+		 * Get the consumer groups coordinated by the stub, e.g. to check
+		 * committed offsets
+		 */
+		group_coordinator& get_groups()
+		{
+			return m_groups;
+		}
+
+		/**
+		 * Get the node ID of the broker coordinating a group - groups are spread
+		 * over the known brokers by the hash of their ID
+		 */
+		int32_t coordinator_id(const std::string& group_id) const
+		{
+			return coordinator(group_id).node_id();
+		}
+
+		/**
+		 * Register observer called on the thread handling produce requests
+		 * after data is appended to a topic. An empty topic name matches all
+		 * topics and a negative partition all partitions. The observer must
+		 * outlive the registration. Observers can be added and removed while
+		 * requests are served, but not from within on_append().
+		 */
+		void add_observer(append_observerI& observer, const std::string& topic = std::string(),
+		                  int32_t part = -1)
+		{
+			m_notifier.subscribe(observer, topic, part);
+		}
+
+		void remove_observer(append_observerI& observer)
+		{
+			m_notifier.unsubscribe(observer);
+		}
+
+		/**
+		 * Block until a total of count messages have been appended to the
+		 * partition or the timeout in milliseconds expires. Returns false on
+		 * timeout. Only appends made through this stub wake the waiter.
+		 */
+		bool wait_for(const std::string& topic, int32_t part, size_t count, int64_t timeout_ms)
+		{
+			return wait_until(topic, part, offset_reached(static_cast<int64_t>(count)), timeout_ms);
+		}
+
+		/**
+		 * Block until pred(const partition&) returns true or the timeout in
+		 * milliseconds expires. Returns false on timeout. The predicate is
+		 * evaluated after each append through this stub while appends are
+		 * blocked so it may safely inspect the partition.
+		 */
+		template <typename Pred>
+		bool wait_until(const std::string& topic, int32_t part, Pred pred, int64_t timeout_ms)
+		{
+			return m_notifier.wait(partition_predicate<Pred>(*m_topics, topic, part, pred), timeout_ms);
+		}
+
+		/**
+		 * Parse data and return number of bytes read
+		 */
+		int handle_data(const uint8_t* data, size_t total_size, std::vector<std::string>& responses)
+		{
+			return handle_data(data, total_size, responses, NULL);
+		}
+
+		/**
+		 * Parse data and return number of bytes read. For each response added
+		 * the milliseconds it should be held back due to a quota violation are
+		 * added to delays_ms (always 0 unless the quotas delay responses).
+		 */
+		int handle_data(const uint8_t* data, size_t total_size, std::vector<std::string>& responses,
+		                std::vector<uint32_t>* delays_ms)
+		{
+			return handle_data(data, total_size, responses, delays_ms, NULL);
+		}
+
+		/**
+		 * Parse data and return number of bytes read, allowing responses to be
+		 * deferred. Group requests that wait for other members (JoinGroup and
+		 * SyncGroup) store a deferred response in *deferred and end parsing
+		 * after their request - the caller must poll it and not pass further
+		 * requests until it completed, so responses stay in order. Without
+		 * deferred such requests are answered right away.
+		 */
+		int handle_data(const uint8_t* data, size_t total_size, std::vector<std::string>& responses,
+		                std::vector<uint32_t>* delays_ms, deferred_response** deferred)
+		{
+			return handle_data(data, total_size, responses, delays_ms, deferred, NULL);
+		}
+
+		/**
+		 * Parse data and return number of bytes read, sending fetch responses
+		 * to sink where possible. These refer to the fetched messages instead
+		 * of copying them into a contiguous response and are handed over
+		 * while appends are blocked (see response_sinkI). Responses sent to
+		 * the sink are not added to responses.
+		 */
+		int handle_data(const uint8_t* data, size_t total_size, std::vector<std::string>& responses,
+		                std::vector<uint32_t>* delays_ms, deferred_response** deferred, response_sinkI* sink)
+		{
+			// If message size is under 4 bytes we cannot parse anything
+			if ((data == NULL) || (total_size < 4))
+				return 0;
+
+			// Keep track of end address of message
+			const uint8_t* msg_end = data + total_size;
+			const uint8_t* cur_data = data;
+
+			// Loop over messages until we reach end
+			int bytes_read = 0;
+			while ((cur_data + 4) < msg_end)
+			{
+				// Read message size
+				int32_t msg_size = util::read_type<int32_t>(cur_data);
+				if (msg_size < 4)
+				{
+					KAFKA_BROKER_STUB_LOG(m_log, log::LEVEL_ERROR, log::MSG_PARSE_ERROR)(m_node_id, "Error message size < 4");
+					return -1;
+				}
+
+				// Check if we have received enough bytes to parse message
+				if ((cur_data + static_cast<size_t>(msg_size+4)) > msg_end)
+				{
+					// We need more of the input strem to parse this packet so return
+					// and wait for next call
+					return bytes_read;
+				}
+
+				// Dump msg
+				// for (int32_t i=0; i<msg_size+4; i++)
+				// {
+				// 	printf("%02X ", cur_data[i]);
+				// }
+				// printf("\n");
+
+				// Skip over message size
+				cur_data += 4;
+
+				// Span of the whole request including framing
+				trace::span request_span(m_tracer, "request");
+				request_span.set_request(cur_data, static_cast<size_t>(msg_size));
+
+				// Prepare response buffer
+				int response_size = 0;
+				uint8_t response_buf[RESP_MAX_SIZE];
+				memset(response_buf, 0, sizeof(response_buf));
+
+				// Look up the handler of the API key and version
+				request_context ctx(cur_data, static_cast<size_t>(msg_size), response_buf+4, RESP_MAX_SIZE-4,
+				                    responses, deferred, sink);
+				size_t num_responses = responses.size();
+				{
+					trace::span handle_span(m_tracer, "handle");
+					request_handlerI* handler = m_handlers.get(ctx.api_key, ctx.api_version);
+					if (handler != NULL)
+					{
+						response_size = handler->handle(ctx);
+					}
+					else if (m_handlers.max_version(ctx.api_key) >= 0)
+					{
+						KAFKA_BROKER_STUB_LOG(m_log, log::LEVEL_WARNING, log::MSG_UNSUPPORTED_VERSION)(m_node_id,
+							"Received request with API key [%i] and unsupported API version [%i]",
+							ctx.api_key, ctx.api_version);
+					}
+					else
+					{
+						KAFKA_BROKER_STUB_LOG(m_log, log::LEVEL_WARNING, log::MSG_UNKNOWN_API)(m_node_id,
+							"Got unknown API key [%i]", ctx.api_key);
+					}
+				}
+
+				if (response_size < 0)
+				{
+					KAFKA_BROKER_STUB_LOG(m_log, log::LEVEL_ERROR, log::MSG_PARSE_ERROR)(m_node_id,
+						"Error during parsing [%i]", response_size);
+					return -1;
+				}
+
+				// Write size in head of response buffer
+				if (response_size > 0)
+				{
+					util::write_type<int32_t>(response_size, response_buf);
+					responses.push_back(std::string(reinterpret_cast<const char*>(response_buf),
+						                             static_cast<size_t>(response_size)+4));
+				}
+
+				if (request_span.active())
+				{
+					size_t bytes = ctx.sent_bytes;
+					for (size_t i=num_responses; i<responses.size(); ++i)
+					{
+						bytes += responses[i].size();
+					}
+					request_span.set_response_bytes(bytes);
+				}
+
+				if (delays_ms != NULL)
+				{
+					uint32_t delay = m_quotas.delay_responses() ? ctx.throttle_ms : 0;
+					delays_ms->resize(delays_ms->size() + responses.size() - num_responses, delay);
+				}
+
+				// Update how many bytes we parsed
+				bytes_read += msg_size + 4;
+
+				// Jump to next message
+				cur_data += msg_size;
+
+				// Following requests wait for the deferred response
+				if ((deferred != NULL) && (*deferred != NULL))
+					break;
+			}
+
+			return bytes_read;
+		}
+
+	private:
+
+		int handle_metadata_request(request_context& ctx)
+		{
+			// Deserialize request
+			metadata::request_v0 req;
+			decode(req, ctx.data);
+			KAFKA_BROKER_STUB_LOG(m_log, log::LEVEL_DEBUG, log::MSG_REQUEST)(m_node_id,
+				"Got metadata request from [%s] with corr. ID [%i]",
+				req.header().client_id().c_str(), static_cast<int>(req.header().correlation_id()));
+
+			// The topic metadata is built in place in the response
+			metadata::response_v0 resp(req.header().correlation_id(), m_brokers);
+			primitive::array<metadata::topic>& topics = resp.topics();
 
 			// Insert metadata in topic array - if array is empty all topics were requested
 			if (req.topics().size() == 0)
 			{
-				printf("[KafkaBrokerStub][%i] - Request for all topics\n", m_node_id);
-				for (size_t i=0; i<m_topics.size(); i++)
+				KAFKA_BROKER_STUB_LOG(m_log, log::LEVEL_DEBUG, log::MSG_REQUEST_DETAIL)(m_node_id, "- Request for all topics");
+				const std::vector<topic>& all_topics = m_topics->topics();
+				topics.reserve(all_topics.size());
+				for (size_t i=0; i<all_topics.size(); i++)
+				{
+					topics.push_back(metadata::topic(0, all_topics[i].name()));
+					add_partition_metadata(all_topics[i], topics.back().partitions());
+				}
+			}
+			else
+			{
+				topics.reserve(req.topics().size());
+				for (size_t i=0; i<req.topics().size(); i++)
+				{
+					KAFKA_BROKER_STUB_LOG(m_log, log::LEVEL_DEBUG, log::MSG_REQUEST_DETAIL)(m_node_id,
+						"- Request for topic [%s]", req.topics()[i].c_str());
+					add_topic_metadata(req.topics()[i], topics);
+				}
+			}
+
+			// Metadata of many topics exceeds the response buffer, so it is
+			// serialized straight into a response of its own
+			size_t msg_size = resp.serial_size();
+			if (msg_size > ctx.response_buf_size)
+			{
+				ctx.responses.push_back(std::string());
+				serialize_response(resp, ctx.responses.back());
+				return 0;
+			}
+
+			// Serialize response into response buffer
+			trace::span serialize_span(m_tracer, "serialize");
+			resp.serialize(ctx.response_buf);
+			return static_cast<int>(msg_size);
+		}
+
+		int handle_produce_request(request_context& ctx)
+		{
+			// Deserialize request
+			produce::request_v0 req(ctx.api_version);
+			decode(req, ctx.data);
+
+			// Make a job per partition record in request order. Records for the
+			// same partition are chained so they are appended in order by the
+			// same task.
+			size_t num_records = 0;
+			for (size_t i=0; i<req.topic_records().size(); i++)
+			{
+				num_records += req.topic_records()[i].partition_records().size();
+			}
+			std::vector<produce_job> jobs;
+			jobs.reserve(num_records);
+			std::vector<size_t> tasks;
+			std::map<const partition*, size_t> last_job;
+			size_t total_bytes = 0;
+			size_t request_bytes = 0;
+			for (size_t i=0; i<req.topic_records().size(); i++)
+			{
+				const produce::topic_record& topic_record = req.topic_records()[i];
+				topic* top = get_topic_writeable(topic_record.topic_name().c_str());
+				const primitive::array<produce::partition_record>& partition_records = topic_record.partition_records();
+				for (size_t k=0; k<partition_records.size(); k++)
+				{
+					const produce::partition_record& record = partition_records[k];
+					produce_job job(top, record);
+					request_bytes += record.record().size();
+
+					// Check if the requested topic and partition exist - 3 = unknown topic or partition
+					partition* part = NULL;
+					if ((top == NULL) || (record.partition() < 0) ||
+					    ((part = top->get_partition_writeable(static_cast<size_t>(record.partition()))) == NULL))
+					{
+						job.error = 3;
+					}
+					// Only the leader accepts data - 6 = not leader for partition
+					else if (part->leader() != m_node_id)
+					{
+						job.error = 6;
+					}
+					else
+					{
+						job.part = part;
+						total_bytes += record.record().size();
+						std::map<const partition*, size_t>::iterator prev = last_job.find(part);
+						if (prev == last_job.end())
+						{
+							tasks.push_back(jobs.size());
+						}
+						else
+						{
+							jobs[prev->second].next = jobs.size();
+						}
+						last_job[part] = jobs.size();
+					}
+					jobs.push_back(job);
+				}
+			}
+
+			// Decode and append the records holding the notifier lock so waiters
+			// see the appends of the request at once. Partitions are independent
+			// so large requests are spread over the worker pool.
+			{
+				append_notifier::scoped_lock lock(m_notifier);
+				produce_batch batch(jobs, tasks, m_tracer);
+				if ((m_workers != NULL) && (tasks.size() > 1) && (total_bytes >= m_parallel_bytes))
+				{
+					m_workers->run(tasks.size(), &broker_stub::run_produce_task, &batch);
+				}
+				else
 				{
-					// Loop over partitions and generate metadata array
-					primitive::array<metadata::partition> partitions;
-					for (size_t k=0; k < m_topics[i].partitions().size(); ++k)
+					for (size_t t=0; t<tasks.size(); ++t)
 					{
-						int32_t id = m_topics[i].partitions()[k].id();
-						int32_t leader_id = m_topics[i].partitions()[k].leader();
-						primitive::array<primitive::int32> replicas;
-						replicas.push_back(leader_id);
-
-						//Err code, Id, leader id, array of replicas, array of isr (in-sync replica set)
-						partitions.push_back(metadata::partition(0, id, leader_id, replicas, replicas));
+						run_produce_task(&batch, t);
 					}
-					topics.push_back(metadata::topic(0, m_topics[i].name().c_str(), partitions));
 				}
 			}
+
+			// Charge the records to the produce quota of the client
+			ctx.throttle_ms = m_quotas.charge(QUOTA_PRODUCE, req.header().client_id().std_str(), request_bytes);
+
+			// Make response - version 1 and on report the throttle time
+			if (ctx.api_version == 0)
+			{
+				produce::response_v0 resp(req.header().correlation_id());
+				add_produce_results(req, jobs, ctx.api_version, resp.topic_results());
+				return write_response(resp, ctx.response_buf, ctx.response_buf_size);
+			}
+			produce::response_v1 resp(req.header().correlation_id(), static_cast<int32_t>(ctx.throttle_ms));
+			add_produce_results(req, jobs, ctx.api_version, resp.topic_results());
+			return write_response(resp, ctx.response_buf, ctx.response_buf_size);
+		}
+
+		int handle_fetch_request(request_context& ctx)
+		{
+			// Deserialize request
+			fetch::request_v0 req;
+			decode(req, ctx.data);
+			KAFKA_BROKER_STUB_LOG(m_log, log::LEVEL_DEBUG, log::MSG_REQUEST)(m_node_id,
+				"Got fetch request from [%s] with corr. ID [%i]",
+				req.header().client_id().c_str(), static_cast<int>(req.header().correlation_id()));
+
+			// The response refers to the stored messages, so appends are
+			// blocked until it is serialized or sent. Fetches are answered
+			// right away without waiting for min_bytes.
+			append_notifier::scoped_lock lock(m_notifier);
+
+			// Make response - version 1 and on report the throttle time. The
+			// response is charged to the fetch quota of the client with the
+			// size field in front.
+			if (ctx.api_version == 0)
+			{
+				fetch::response_v0 resp(req.header().correlation_id());
+				add_fetch_topics(req, ctx.api_version, resp.topics());
+				ctx.throttle_ms = m_quotas.charge(QUOTA_FETCH, req.header().client_id().std_str(), 4 + resp.serial_size());
+				send_fetch_response(resp, ctx);
+			}
 			else
 			{
-				for (size_t i=0; i<req.topics().size(); i++)
+				// The throttle time is part of the charged size whatever its value
+				fetch::response_v1 resp(req.header().correlation_id(), 0);
+				add_fetch_topics(req, ctx.api_version, resp.topics());
+				ctx.throttle_ms = m_quotas.charge(QUOTA_FETCH, req.header().client_id().std_str(), 4 + resp.serial_size());
+				resp.throttle_time() = static_cast<int32_t>(ctx.throttle_ms);
+				send_fetch_response(resp, ctx);
+			}
+			return 0;
+		}
+
+		/**
+		 * Send a fetch response referring to the fetched messages to the sink
+		 * of the request or add it as a contiguous response. Responses delayed
+		 * by a quota are always contiguous as they are held back. Called with
+		 * appends blocked, which also guards the scatter buffer.
+		 */
+		template <typename Response>
+		void send_fetch_response(const Response& resp, request_context& ctx)
+		{
+			if ((ctx.sink != NULL) && ((ctx.throttle_ms == 0) || !m_quotas.delay_responses()))
+			{
+				trace::span serialize_span(m_tracer, "serialize");
+				m_scatter.clear();
+				util::write_type<int32_t>(static_cast<int32_t>(resp.serial_size()), m_scatter.reserve(4));
+				resp.scatter(m_scatter);
+				size_t size = m_scatter.size();
+				if (ctx.sink->send(m_scatter))
 				{
-					printf("[KafkaBrokerStub][%i] - Request for topic [%s]\n",
-						    m_node_id, req.topics()[i].c_str());
-					topics.push_back(get_topic_metadata(req.topics()[i]));
+					ctx.sent_bytes += size;
+					return;
 				}
 			}
+			ctx.responses.push_back(std::string());
+			serialize_response(resp, ctx.responses.back());
+		}
 
-			// Make response
-			metadata::response_v0 resp(req.header().correlation_id(), m_brokers, topics);
-
-			// Check response size
-			size_t msg_size = resp.serial_size();
-			if (msg_size > resp_size)
+		/**
+		 * Handle the consumer group requests (API keys 8 to 14). Responses are
+		 * written straight to the response list unless the coordinator defers
+		 * them.
+		 */
+		int handle_group_request(request_context& ctx)
+		{
+			static const char* const names[] = {"offset commit", "offset fetch", "find coordinator", "join group",
+			                                    "heartbeat", "leave group", "sync group"};
+			const uint8_t* data = ctx.data;
+			int16_t api_key = ctx.api_key;
+			int16_t api_version = ctx.api_version;
+			deferred_response** deferred = ctx.deferred;
+			size_t index = static_cast<size_t>(api_key - 8);
+
+			headers::request_hdr header;
+			decode(header, data);
+			KAFKA_BROKER_STUB_LOG(m_log, log::LEVEL_DEBUG, log::MSG_REQUEST)(m_node_id,
+				"Got %s request from [%s] with corr. ID [%i]",
+				names[index], header.client_id().c_str(), static_cast<int>(header.correlation_id()));
+
+			uint64_t now = util::monotonic_ns();
+			std::string out;
+			deferred_response* waiting = NULL;
+			switch (api_key)
 			{
-				printf("[KafkaBrokerStub][%i] Response buffer too small\n", m_node_id);
-				return 0;
+				case 8:
+				{
+					group::offset_commit_request req(api_version);
+					decode(req, data);
+					if (is_coordinator(req.group_id().std_str()))
+					{
+						m_groups.commit_offsets(req, now, out);
+					}
+					else
+					{
+						primitive::array<group::topic_errors> topics;
+						for (size_t i=0; i<req.topics().size(); ++i)
+						{
+							primitive::array<group::partition_error> partitions;
+							for (size_t k=0; k<req.topics()[i].partitions.size(); ++k)
+							{
+								partitions.push_back(group::partition_error(req.topics()[i].partitions[k].partition,
+								                                            GROUP_ERR_NOT_COORDINATOR));
+							}
+							topics.push_back(group::topic_errors(req.topics()[i].name, partitions));
+						}
+						serialize_response(group::offset_commit_response(api_version, header.correlation_id(), topics),
+						                   out);
+					}
+					break;
+				}
+				case 9:
+				{
+					group::offset_fetch_request req(api_version);
+					decode(req, data);
+					if (is_coordinator(req.group_id().std_str()))
+					{
+						m_groups.fetch_offsets(req, out);
+					}
+					else
+					{
+						// Version 0 and 1 only have errors per partition
+						primitive::array<group::topic_offsets> topics;
+						for (size_t i=0; (api_version < 2) && (i<req.topics().size()); ++i)
+						{
+							primitive::array<group::partition_offset> partitions;
+							for (size_t k=0; k<req.topics()[i].partitions().size(); ++k)
+							{
+								partitions.push_back(group::partition_offset(req.topics()[i].partitions()[k], -1, "",
+								                                             GROUP_ERR_NOT_COORDINATOR));
+							}
+							topics.push_back(group::topic_offsets(req.topics()[i].topic_name(), partitions));
+						}
+						serialize_response(group::offset_fetch_response(api_version, header.correlation_id(), topics,
+						                                                GROUP_ERR_NOT_COORDINATOR), out);
+					}
+					break;
+				}
+				case 10:
+				{
+					group::find_coordinator_request req(api_version);
+					decode(req, data);
+					const metadata::broker& node = coordinator(req.key().std_str());
+					serialize_response(group::find_coordinator_response(api_version, header.correlation_id(), 0,
+					                                                    node.node_id(), node.host(), node.port()), out);
+					break;
+				}
+				case 11:
+				{
+					group::join_request req(api_version);
+					decode(req, data);
+					if (is_coordinator(req.group_id().std_str()))
+					{
+						waiting = m_groups.join(req, now, deferred != NULL, out);
+					}
+					else
+					{
+						serialize_response(group::join_response(api_version, header.correlation_id(),
+						                                        GROUP_ERR_NOT_COORDINATOR, -1, "", "", req.member_id(),
+						                                        primitive::array<group::member_metadata>()), out);
+					}
+					break;
+				}
+				case 12:
+				{
+					group::heartbeat_request req;
+					decode(req, data);
+					int16_t err = is_coordinator(req.group_id().std_str()) ? m_groups.heartbeat(req, now) :
+					              static_cast<int16_t>(GROUP_ERR_NOT_COORDINATOR);
+					serialize_response(group::error_response(api_version, header.correlation_id(), err), out);
+					break;
+				}
+				case 13:
+				{
+					group::leave_request req;
+					decode(req, data);
+					int16_t err = is_coordinator(req.group_id().std_str()) ? m_groups.leave(req, now) :
+					              static_cast<int16_t>(GROUP_ERR_NOT_COORDINATOR);
+					serialize_response(group::error_response(api_version, header.correlation_id(), err), out);
+					break;
+				}
+				case 14:
+				default:
+				{
+					group::sync_request req(api_version);
+					decode(req, data);
+					if (is_coordinator(req.group_id().std_str()))
+					{
+						waiting = m_groups.sync(req, now, deferred != NULL, out);
+					}
+					else
+					{
+						serialize_response(group::sync_response(api_version, header.correlation_id(),
+						                                        GROUP_ERR_NOT_COORDINATOR, primitive::bytearray()), out);
+					}
+					break;
+				}
 			}
 
-			// Serialize response into response buffer
-			resp.serialize(resp_buf);
-			return msg_size;
+			if (waiting != NULL)
+			{
+				*deferred = waiting;
+			}
+			else
+			{
+				ctx.responses.push_back(std::string());
+				ctx.responses.back().swap(out);
+			}
+			return 0;
 		}
 
-		int handle_produce_request(const uint8_t* data, int16_t api_version, uint8_t* resp_buf, size_t resp_size)
+		/**
+		 * Get the broker coordinating a group
+		 */
+		const metadata::broker& coordinator(const std::string& group_id) const
 		{
-			// We only support produce in version 0
-			if (api_version != 0)
+			// Order by node ID so all stubs knowing the same brokers agree
+			std::vector<std::pair<int32_t, size_t> > nodes;
+			for (size_t i=0; i<m_brokers.size(); ++i)
 			{
-				printf("[KafkaBrokerStub][%i] Received produce request with unsupported API version [%i]\n",
-					    m_node_id, api_version);
-				return 0;
+				nodes.push_back(std::make_pair(static_cast<int32_t>(m_brokers[i].node_id()), i));
 			}
+			std::sort(nodes.begin(), nodes.end());
+			nodes.erase(std::unique(nodes.begin(), nodes.end(), same_node), nodes.end());
 
-			// Deserialize request
-			produce::request_v0 req;
-			req.deserialize(data);
+			uint64_t hash = util::hash_bytes(group_id.data(), group_id.size());
+			return m_brokers[nodes[static_cast<size_t>(hash % nodes.size())].second];
+		}
 
-			// Prepare topic result array for response
-			primitive::array<produce::topic_result> topic_results;
+		static bool same_node(const std::pair<int32_t, size_t>& a, const std::pair<int32_t, size_t>& b)
+		{
+			return a.first == b.first;
+		}
 
-			// Handle topic records
-			for (size_t i=0; i<req.topic_records().size(); i++)
-			{
-				// Prepare partition result array for response
-				primitive::array<produce::partition_result> partition_results;
+		bool is_coordinator(const std::string& group_id) const
+		{
+			return coordinator(group_id).node_id() == m_node_id;
+		}
 
-				// Get topic record from array in request
-				produce::topic_record topic_record = req.topic_records()[i];
+		int handle_init_producer_id_request(request_context& ctx)
+		{
+			// Deserialize request
+			init_producer_id::request req;
+			decode(req, ctx.data);
+			KAFKA_BROKER_STUB_LOG(m_log, log::LEVEL_DEBUG, log::MSG_REQUEST)(m_node_id,
+				"Got init producer ID request from [%s] with corr. ID [%i]",
+				req.header().client_id().c_str(), static_cast<int>(req.header().correlation_id()));
+
+			int64_t producer_id = -1;
+			int16_t epoch = -1;
+			m_producer_ids.init(req.transactional_id().std_str(), producer_id, epoch);
+			return write_response(init_producer_id::response(req.header().correlation_id(), 0, 0, producer_id, epoch),
+			                      ctx.response_buf, ctx.response_buf_size);
+		}
 
-				// Check if the requested topic exists
-				topic* top = get_topic_writeable(topic_record.topic_name().c_str());
-				if (top == NULL)
+		int handle_list_offsets_request(request_context& ctx)
+		{
+			// Deserialize request
+			list_offsets::request req(ctx.api_version);
+			decode(req, ctx.data);
+			KAFKA_BROKER_STUB_LOG(m_log, log::LEVEL_DEBUG, log::MSG_REQUEST)(m_node_id,
+				"Got list offsets request from [%s] with corr. ID [%i]",
+				req.header().client_id().c_str(), static_cast<int>(req.header().correlation_id()));
+
+			// The lookups read the partitions so appends are blocked meanwhile
+			append_notifier::scoped_lock lock(m_notifier);
+			primitive::array<list_offsets::topic_response> topics;
+			for (size_t i=0; i<req.topics().size(); i++)
+			{
+				const list_offsets::topic_request& topic_req = req.topics()[i];
+				const topic* top = m_topics->get(topic_req.name);
+				primitive::array<list_offsets::partition_response> partitions;
+				for (size_t k=0; k<topic_req.partitions.size(); k++)
 				{
-					// ToDo: Pushback error to results
-					continue;
+					partitions.push_back(list_partition_offset(top, ctx.api_version, topic_req.partitions[k]));
 				}
+				topics.push_back(list_offsets::topic_response(topic_req.name, partitions));
+			}
 
-				// Pull partition records out of the topic record from the request
-				// (we are looping over topic records)
-				primitive::array<produce::partition_record> partition_records = topic_record.partition_records();
-				for (size_t k=0; k<partition_records.size(); k++)
-				{
-					// For each partition record pull out the raw message with key value pair
-					produce::partition_record record = partition_records[i];
+			std::string out;
+			serialize_response(list_offsets::response(req.header().correlation_id(), topics), out);
+			ctx.responses.push_back(std::string());
+			ctx.responses.back().swap(out);
+			return 0;
+		}
 
-					// Check if the requested partitions exists
-					partition* part = top->get_partition_writeable(static_cast<size_t>(record.partition()));
-					if (part == NULL)
-					{
-						// ToDo: Pushback error to results
-						continue;
-					}
+		/**
+		 * Look up the offset of a partition for a timestamp. Version 0 returns
+		 * the same single offset as version 1 (if any) rather than the base
+		 * offsets of log segments, which the stub does not have.
+		 */
+		list_offsets::partition_response list_partition_offset(const topic* top, int16_t api_version,
+		                                                       const list_offsets::partition_request& req)
+		{
+			// 3 = unknown topic or partition
+			const partition* part = NULL;
+			if ((top == NULL) || (req.partition < 0) ||
+			    ((part = top->get_partition(static_cast<size_t>(req.partition))) == NULL))
+			{
+				return list_offsets::partition_response(api_version, req.partition, 3, -1, -1);
+			}
 
-					// Extract the produce message from the bytearray in the record
-					primitive::bytearray raw_record = record.record();
+			// 6 = not leader for partition
+			if (part->leader() != m_node_id)
+			{
+				return list_offsets::partition_response(api_version, req.partition, 6, -1, -1);
+			}
 
-					// The produce messages are concatenated in a special array
-					const uint8_t* cur_msg_start = raw_record.data();
-					const uint8_t* last_msg_end = cur_msg_start + raw_record.size();
-					while (cur_msg_start < last_msg_end)
-					{
-						produce::message msg;
-						cur_msg_start = msg.deserialize(cur_msg_start);
+			if ((api_version == 0) && (req.max_offsets <= 0))
+			{
+				return list_offsets::partition_response(api_version, req.partition, 0, -1, -1);
+			}
 
-						// Write the message to our "database"
-						part->add_data(msg.key().std_str(), msg.value().std_str());
-					}
+			if (req.timestamp == list_offsets::LATEST_TIMESTAMP)
+			{
+				return list_offsets::partition_response(api_version, req.partition, 0, -1, part->next_offset());
+			}
+			if (req.timestamp == list_offsets::EARLIEST_TIMESTAMP)
+			{
+				return list_offsets::partition_response(api_version, req.partition, 0, -1, part->log_start_offset());
+			}
+
+			// First message at or after the timestamp - none found is not an error
+			record_view found = part->find_time(req.timestamp);
+			if (found.record == NULL)
+			{
+				return list_offsets::partition_response(api_version, req.partition, 0, -1, -1);
+			}
+			return list_offsets::partition_response(api_version, req.partition, 0, found.record->timestamp(),
+			                                        found.offset);
+		}
 
-					// Append "success" result to partition result array
-					partition_results.push_back(produce::partition_result(record.partition(), 0, 0));
+		/**
+		 * Fill the fetched partitions of the requested topics in place
+		 */
+		void add_fetch_topics(const fetch::request_v0& req, int16_t api_version,
+		                      primitive::array<fetch::topic_data>& topics)
+		{
+			// Version 2 and on carry the timestamps in message format v1
+			uint8_t magic = (api_version >= 2) ? 1 : 0;
+			topics.reserve(req.topics().size());
+			for (size_t i=0; i<req.topics().size(); i++)
+			{
+				const fetch::topic_request& topic_req = req.topics()[i];
+				const topic* top = m_topics->get(topic_req.topic_name().std_str());
+				topics.push_back(fetch::topic_data(topic_req.topic_name()));
+				primitive::array<fetch::partition_data>& partitions = topics.back().partitions();
+				partitions.reserve(topic_req.partitions().size());
+				for (size_t k=0; k<topic_req.partitions().size(); k++)
+				{
+					fetch_partition(top, topic_req.partitions()[k], magic, partitions.emplace_back());
 				}
+			}
+		}
+
+		/**
+		 * Collect the messages of a partition from the fetch offset on up to
+		 * the maximum number of bytes. The first message is always included
+		 * so clients do not get stuck on messages larger than the maximum.
+		 */
+		void fetch_partition(const topic* top, const fetch::partition_request& req, uint8_t magic,
+		                     fetch::partition_data& result)
+		{
+			// 3 = unknown topic or partition
+			const partition* part = NULL;
+			if ((top == NULL) || (req.partition() < 0) ||
+			    ((part = top->get_partition(static_cast<size_t>(req.partition()))) == NULL))
+			{
+				result = fetch::partition_data(req.partition(), 3, -1);
+				return;
+			}
+
+			// 6 = not leader for partition
+			if (part->leader() != m_node_id)
+			{
+				result = fetch::partition_data(req.partition(), 6, -1);
+				return;
+			}
 
-				// Append results to topic result array
-				topic_results.push_back(produce::topic_result(topic_record.topic_name(), partition_results));
+			// 1 = offset out of range
+			int64_t offset = req.fetch_offset();
+			int64_t high_watermark = part->next_offset();
+			if ((offset < part->log_start_offset()) || (offset > high_watermark))
+			{
+				result = fetch::partition_data(req.partition(), 1, high_watermark);
+				return;
+			}
+
+			result = fetch::partition_data(req.partition(), 0, high_watermark, magic);
+			const record_log& records = part->data();
+			size_t max_bytes = (req.max_bytes() > 0) ? static_cast<size_t>(static_cast<int32_t>(req.max_bytes())) : 0;
+			size_t bytes = 0;
+			// Compacted partitions skip superseded messages and send tombstones with null values
+			const compacted_view* compacted = part->compaction_enabled() ? &part->compacted() : NULL;
+			for (size_t i=static_cast<size_t>(offset - part->log_start_offset()); i<records.size(); ++i)
+			{
+				int64_t msg_offset = part->log_start_offset() + static_cast<int64_t>(i);
+				if ((compacted != NULL) && !compacted->is_latest(msg_offset))
+					continue;
+				fetch::message_ref msg(msg_offset, records[i].key(), records[i].value(), records[i].timestamp());
+				if (records[i].null_key())
+					msg.key = NULL;
+				if (records[i].null_value() || ((compacted != NULL) && compacted->is_tombstone(msg_offset)))
+					msg.value = NULL;
+				size_t msg_size = fetch::partition_data::message_size(msg, magic);
+				bytes += msg_size;
+				if ((bytes > max_bytes) && (bytes > msg_size))
+					break;
+				result.add_message(msg);
 			}
+		}
 
-			// Make response
-			produce::response_v0 resp(req.header().correlation_id(), topic_results);
+		/**
+		 * Deserialize a request within a trace span
+		 */
+		template <typename Request>
+		const uint8_t* decode(Request& req, const uint8_t* data)
+		{
+			trace::span decode_span(m_tracer, "decode");
+			return req.deserialize(data);
+		}
 
+		/**
+		 * Serialize a response into the response buffer - returns the size
+		 * written or 0 if it does not fit
+		 */
+		template <typename Response>
+		int write_response(const Response& resp, uint8_t* resp_buf, size_t resp_size)
+		{
 			// Check response size
 			size_t msg_size = resp.serial_size();
 			if (msg_size > resp_size)
 			{
-				printf("[KafkaBrokerStub][%i] Response buffer too small\n", m_node_id);
+				KAFKA_BROKER_STUB_LOG(m_log, log::LEVEL_ERROR, log::MSG_RESPONSE_SIZE)(m_node_id, "Response buffer too small");
 				return 0;
 			}
 
 			// Serialize response into response buffer
+			trace::span serialize_span(m_tracer, "serialize");
 			resp.serialize(resp_buf);
-			return msg_size;
+			return static_cast<int>(msg_size);
+		}
+
+		/**
+		 * Serialize a response of any size with its size in front into out
+		 */
+		template <typename Response>
+		void serialize_response(const Response& resp, std::string& out)
+		{
+			trace::span serialize_span(m_tracer, "serialize");
+			size_t msg_size = resp.serial_size();
+			out.resize(msg_size + 4);
+			uint8_t* buf = reinterpret_cast<uint8_t*>(&out[0]);
+			util::write_type<int32_t>(static_cast<int32_t>(msg_size), buf);
+			resp.serialize(buf + 4);
 		}
 
-		metadata::topic get_topic_metadata(const primitive::string& name)
+		/**
+		 * Partition record of a produce request with the result of appending it
+		 */
+		struct produce_job
+		{
+			produce_job(topic* t, const produce::partition_record& rec):
+				top(t),
+				part(NULL),
+				record(&rec),
+				error(0),
+				offset(-1),
+				count(0),
+				next(0)
+			{
+
+			}
+
+			produce_job(const produce_job& other):
+				top(other.top),
+				part(other.part),
+				record(other.record),
+				error(other.error),
+				offset(other.offset),
+				count(other.count),
+				next(other.next)
+			{
+
+			}
+
+			produce_job& operator=(const produce_job& other)
+			{
+				top = other.top;
+				part = other.part;
+				record = other.record;
+				error = other.error;
+				offset = other.offset;
+				count = other.count;
+				next = other.next;
+				return *this;
+			}
+
+			topic* top;
+			partition* part;
+			const produce::partition_record* record;
+			int16_t error;
+			int64_t offset;
+			size_t count;
+			size_t next;  // Next job for the same partition or 0
+		};
+
+		/**
+		 * Jobs of a produce request and the first job of each partition
+		 */
+		struct produce_batch
+		{
+			produce_batch(std::vector<produce_job>& j, const std::vector<size_t>& t, trace::tracer& tr):
+				jobs(j),
+				tasks(t),
+				tracer(tr)
+			{
+
+			}
+
+			std::vector<produce_job>& jobs;
+			const std::vector<size_t>& tasks;
+			trace::tracer& tracer;
+		};
+
+		/**
+		 * Decode and append the chain of jobs for one partition
+		 */
+		static void run_produce_task(void* ctx, size_t index)
 		{
-			for (size_t i=0; i<m_topics.size(); i++)
+			produce_batch& batch = *static_cast<produce_batch*>(ctx);
+			size_t cur = batch.tasks[index];
+			do
 			{
-				if (m_topics[i].name() == name.std_str())
+				trace::span append_span(batch.tracer, "append");
+				produce_job& job = batch.jobs[cur];
+
+				// The produce messages are concatenated in a message set in the record
+				const primitive::bytearray& raw_record = job.record->record();
+				produce::message_set messages;
+				bool decoded = false;
+				{
+					trace::span decode_span(batch.tracer, "decode_records");
+					decoded = messages.deserialize(raw_record.data(), raw_record.size());
+				}
+				if (!decoded)
+				{
+					// 76 = unsupported compression type, 2 = corrupt message
+					job.error = messages.compressed() ? 76 : 2;
+				}
+				// Batches appended before are answered with their offset
+				else if ((job.error = job.part->check_producer(messages, job.offset)) != 0)
+				{
+					job.offset = -1;
+				}
+				else if (job.offset < 0)
 				{
-					// Loop over partitions and generate metadata array
-					primitive::array<metadata::partition> partitions;
-					for (size_t k=0; k < m_topics[i].partitions().size(); ++k)
+					try
+					{
+						job.offset = job.part->add_data(messages);
+						job.count = messages.size();
+					}
+					catch (...)
 					{
-						int32_t id = m_topics[i].partitions()[k].id();
-						int32_t leader_id = m_topics[i].partitions()[k].leader();
-						primitive::array<primitive::int32> replicas;
-						replicas.push_back(leader_id);
+						// -1 = unknown server error (append is rolled back)
+						job.error = -1;
+					}
+				}
+				cur = job.next;
+			} while (cur != 0);
+		}
 
-						//Err code, Id, leader id, array of replicas, array of isr (in-sync replica set)
-						partitions.push_back(metadata::partition(0, id, leader_id, replicas, replicas));
+		/**
+		 * Let observers and waiters know about the appends of a produce request
+		 * and fill its results per topic in place
+		 */
+		void add_produce_results(const produce::request_v0& req, const std::vector<produce_job>& jobs, int16_t api_version,
+		                         primitive::array<produce::topic_result>& topic_results)
+		{
+			topic_results.reserve(req.topic_records().size());
+			size_t job = 0;
+			for (size_t i=0; i<req.topic_records().size(); i++)
+			{
+				const produce::topic_record& topic_record = req.topic_records()[i];
+				topic_results.push_back(produce::topic_result(topic_record.topic_name()));
+				primitive::array<produce::partition_result>& partition_results = topic_results.back().partition_results();
+				partition_results.reserve(topic_record.partition_records().size());
+				for (size_t k=0; k<topic_record.partition_records().size(); k++, job++)
+				{
+					const produce_job& cur = jobs[job];
+					if ((cur.error == 0) && (cur.count > 0))
+					{
+						m_notifier.notify(cur.top->name(), *cur.part, cur.record->partition(), cur.offset, cur.count);
+					}
+					else if (cur.error != 0)
+					{
+						KAFKA_BROKER_STUB_LOG(m_log, log::LEVEL_DEBUG, log::MSG_REQUEST_DETAIL)(m_node_id,
+							"- Produce to [%s] partition [%i] failed with error [%i]",
+							topic_record.topic_name().c_str(), static_cast<int>(cur.record->partition()),
+							static_cast<int>(cur.error));
 					}
-					return metadata::topic(0, name.c_str(), partitions);
+					partition_results.push_back(produce::partition_result(cur.record->partition(), cur.error, cur.offset,
+					                                                      api_version));
 				}
+			}
+		}
 
+		/**
+		 * Append the metadata of a requested topic
+		 */
+		void add_topic_metadata(const primitive::string& name, primitive::array<metadata::topic>& topics)
+		{
+			const topic* top = m_topics->get(name.std_str());
+			if (top == NULL)
+			{
+				// 3 = unknown topic or partition
+				topics.push_back(metadata::topic(3, name));
+				return;
 			}
 
-			// 3 = unknown topic or partition
-			return metadata::topic(3, name.c_str(), primitive::array<metadata::partition>());
+			topics.push_back(metadata::topic(0, name));
+			add_partition_metadata(*top, topics.back().partitions());
 		}
 
-		topic* get_topic_writeable(const std::string& name)
+		/**
+		 * Fill the partition metadata of a topic in place
+		 */
+		void add_partition_metadata(const topic& top, primitive::array<metadata::partition>& partitions)
 		{
-			for (size_t i=0; i<m_topics.size(); i++)
+			partitions.reserve(top.partitions().size());
+			for (size_t k=0; k < top.partitions().size(); ++k)
 			{
-				if (m_topics[i].name() == name)
+				//Err code, Id, leader id, array of replicas, array of isr (in-sync replica set)
+				const partition& part = top.partitions()[k];
+				partitions.push_back(metadata::partition(0, part.id(), part.leader()));
+				metadata::partition& entry = partitions.back();
+
+				entry.replicas().reserve(part.replicas().size());
+				for (size_t r=0; r<part.replicas().size(); ++r)
 				{
-					return &m_topics[i];
+					entry.replicas().push_back(part.replicas()[r]);
 				}
+
+				entry.isr().reserve(part.isr().size());
+				for (size_t r=0; r<part.isr().size(); ++r)
+				{
+					entry.isr().push_back(part.isr()[r]);
+				}
+			}
+		}
+
+		topic* get_topic_writeable(const std::string& name)
+		{
+			return m_topics->get_writeable(name);
+		}
+
+		/**
+		 * Predicate true once the partition has reached an offset
+		 */
+		struct offset_reached
+		{
+			explicit offset_reached(int64_t off):
+				offset(off)
+			{
+
+			}
+
+			bool operator()(const partition& part) const
+			{
+				return part.next_offset() >= offset;
+			}
+
+			int64_t offset;
+		};
+
+		/**
+		 * Adapt a partition predicate to the notifier by looking up the
+		 * partition on every evaluation as it may not exist yet
+		 */
+		template <typename Pred>
+		class partition_predicate
+		{
+		public:
+			partition_predicate(const topic_registry& topics, const std::string& name, int32_t part, Pred pred):
+				m_topics(topics),
+				m_name(name),
+				m_part(part),
+				m_pred(pred)
+			{
+
+			}
+
+			bool operator()()
+			{
+				const topic* top = m_topics.get(m_name);
+				const partition* part = (top == NULL || m_part < 0) ? NULL :
+				                        top->get_partition(static_cast<size_t>(m_part));
+				return (part != NULL) && m_pred(*part);
+			}
+
+		private:
+			const topic_registry& m_topics;
+			const std::string& m_name;
+			int32_t m_part;
+			Pred m_pred;
+		};
+
+		/**
+		 * Handler calling a built-in handler method of the stub
+		 */
+		class builtin_handler : public request_handlerI
+		{
+		public:
+			typedef int (broker_stub::*method)(request_context&);
+
+			builtin_handler(broker_stub& stub, method m):
+				m_stub(stub),
+				m_method(m)
+			{
+
+			}
+
+			int handle(request_context& ctx)
+			{
+				return (m_stub.*m_method)(ctx);
 			}
-			return NULL;
+
+		private:
+			builtin_handler(const builtin_handler&);
+			builtin_handler& operator=(const builtin_handler&);
+
+			broker_stub& m_stub;
+			method m_method;
+		};
+
+		void add_builtin_handler(int16_t api_key, int16_t min_version, int16_t max_version,
+		                         builtin_handler::method m)
+		{
+			m_builtin_handlers.push_back(new builtin_handler(*this, m));
+			m_handlers.set(api_key, min_version, max_version, m_builtin_handlers.back());
+		}
+
+		/**
+		 * Register the handlers of the supported APIs and versions
+		 */
+		void add_builtin_handlers()
+		{
+			add_builtin_handler(0, 0, 3, &broker_stub::handle_produce_request);
+			add_builtin_handler(1, 0, 2, &broker_stub::handle_fetch_request);
+			add_builtin_handler(2, 0, 1, &broker_stub::handle_list_offsets_request);
+			add_builtin_handler(3, 0, 0, &broker_stub::handle_metadata_request);
+
+			// OffsetCommit, OffsetFetch, FindCoordinator, JoinGroup, Heartbeat,
+			// LeaveGroup and SyncGroup
+			add_builtin_handler(8, 0, 3, &broker_stub::handle_group_request);
+			add_builtin_handler(9, 0, 3, &broker_stub::handle_group_request);
+			add_builtin_handler(10, 0, 1, &broker_stub::handle_group_request);
+			add_builtin_handler(11, 0, 2, &broker_stub::handle_group_request);
+			add_builtin_handler(12, 0, 1, &broker_stub::handle_group_request);
+			add_builtin_handler(13, 0, 1, &broker_stub::handle_group_request);
+			add_builtin_handler(14, 0, 1, &broker_stub::handle_group_request);
+
+			add_builtin_handler(22, 0, 1, &broker_stub::handle_init_producer_id_request);
 		}
 
+		broker_stub(const broker_stub&);
+		broker_stub& operator=(const broker_stub&);
+
 		int32_t m_node_id;
-		std::vector<topic> m_topics;
+		topic_registry m_own_topics;
+		topic_registry* m_topics;
 		primitive::array<metadata::broker> m_brokers;
 		primitive::array<primitive::int32> m_broker_ids;
+		log::logger m_log;
+		trace::tracer m_tracer;
+		append_notifier m_notifier;
+
+		// Fetch response handed to a response sink (guarded by the notifier)
+		scatter_buffer m_scatter;
+		worker_pool* m_workers;
+		size_t m_parallel_bytes;
+		quota_manager m_quotas;
+		network_shaper m_shaping;
+		group_coordinator m_groups;
+		producer_ids m_producer_ids;
+		handler_table m_handlers;
+		std::vector<builtin_handler*> m_builtin_handlers;
 	};
 
 }
@@ -87,6 +87,21 @@ namespace kafka_broker_stub { namespace metadata {
 			return size;
 		}
 
+		const primitive::int32& node_id() const
+		{
+			return m_node_id;
+		}
+
+		const primitive::string& host() const
+		{
+			return m_host;
+		}
+
+		const primitive::int32& port() const
+		{
+			return m_port;
+		}
+
 	private:
 		primitive::int32 m_node_id;
 		primitive::string m_host;
@@ -109,6 +124,20 @@ namespace kafka_broker_stub { namespace metadata {
 
 		}
 
+		/**
+		 * Partition without replicas - they are added in place through
+		 * replicas() and isr()
+		 */
+		partition(const primitive::int16& err_code, const primitive::int32& id, const primitive::int32& leader):
+			m_err_code(err_code),
+			m_id(id),
+			m_leader(leader),
+			m_replicas(),
+			m_isr()
+		{
+
+		}
+
 		partition(const primitive::int16& err_code, const primitive::int32& id,
 					 const primitive::int32& leader, const primitive::array<primitive::int32>& replicas,
 					 const primitive::array<primitive::int32>& isr):
@@ -141,6 +170,26 @@ namespace kafka_broker_stub { namespace metadata {
 			return size;
 		}
 
+		const primitive::array<primitive::int32>& replicas() const
+		{
+			return m_replicas;
+		}
+
+		primitive::array<primitive::int32>& replicas()
+		{
+			return m_replicas;
+		}
+
+		const primitive::array<primitive::int32>& isr() const
+		{
+			return m_isr;
+		}
+
+		primitive::array<primitive::int32>& isr()
+		{
+			return m_isr;
+		}
+
 	private:
 		primitive::int16 m_err_code;
 		primitive::int32 m_id;
@@ -163,6 +212,18 @@ namespace kafka_broker_stub { namespace metadata {
 
 		}
 
+		/**
+		 * Topic without partitions - they are added in place through
+		 * partitions()
+		 */
+		topic(const primitive::int16& err_code, const primitive::string& tname):
+			m_err_code(err_code),
+			m_name(tname),
+			m_partitions()
+		{
+
+		}
+
 		topic(const primitive::int16& err_code, const primitive::string& tname,
 			   const primitive::array<partition>& partitions):
 			m_err_code(err_code),
@@ -192,6 +253,16 @@ namespace kafka_broker_stub { namespace metadata {
 			return m_name;
 		}
 
+		const primitive::array<partition>& partitions() const
+		{
+			return m_partitions;
+		}
+
+		primitive::array<partition>& partitions()
+		{
+			return m_partitions;
+		}
+
 	private:
 		primitive::int16 m_err_code;
 		primitive::string m_name;
@@ -213,6 +284,17 @@ namespace kafka_broker_stub { namespace metadata {
 
 		}
 
+		/**
+		 * Response without topics - they are added in place through topics()
+		 */
+		response_v0(primitive::int32 corr_id, const primitive::array<broker>& brokers):
+			m_resp_header(corr_id),
+			m_brokers(brokers),
+			m_topics()
+		{
+
+		}
+
 		response_v0(primitive::int32 corr_id, const primitive::array<broker>& brokers, const primitive::array<topic>& topics):
 			m_resp_header(corr_id),
 			m_brokers(brokers),
@@ -238,6 +320,16 @@ namespace kafka_broker_stub { namespace metadata {
 			return size;
 		}
 
+		const primitive::array<topic>& topics() const
+		{
+			return m_topics;
+		}
+
+		primitive::array<topic>& topics()
+		{
+			return m_topics;
+		}
+
 	private:
 		headers::response_hdr m_resp_header;
 		primitive::array<broker> m_brokers;
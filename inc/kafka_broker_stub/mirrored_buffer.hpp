@@ -0,0 +1,267 @@
+#ifndef KAFKA_BROKER_STUB_MIRRORED_BUFFER_HPP_INC_
+#define KAFKA_BROKER_STUB_MIRRORED_BUFFER_HPP_INC_
+
+/*
+ * Receive buffer for byte streams fed to broker_stub::handle_data.
+ *
+ * The buffer is a ring whose pages are mapped twice in a row, so both the
+ * free space and the unread bytes are always contiguous in memory even when
+ * they wrap around the end of the ring. Received data can thus be read
+ * directly into the buffer and frames split over several reads are handed
+ * to handle_data in place, without moving the unconsumed tail.
+ */
+
+#include "util.hpp"
+#include <algorithm>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace kafka_broker_stub {
+
+	/**
+	 * Ring buffer mapped twice with a plain buffer as fallback
+	 *
+	 * If the pages cannot be mapped twice (no memfd or mmap fails) the buffer
+	 * works on a plain array instead and moves the unread bytes to the front
+	 * before data is written.
+	 */
+	class mirrored_buffer
+	{
+	public:
+		/**
+		 * Make buffer holding at least capacity bytes (rounded up to pages).
+		 * Mirroring can be turned off to use the plain buffer.
+		 */
+		explicit mirrored_buffer(size_t capacity = 1 << 16, bool mirror = true):
+			m_map(),
+			m_plain(),
+			m_head(0),
+			m_used(0)
+		{
+			allocate(capacity, mirror);
+		}
+
+		~mirrored_buffer()
+		{
+			release();
+		}
+
+		/**
+		 * Start of the unread bytes
+		 */
+		const uint8_t* read_ptr() const
+		{
+			return base() + m_head;
+		}
+
+		size_t readable() const
+		{
+			return m_used;
+		}
+
+		/**
+		 * Release bytes from the start of the unread bytes
+		 */
+		void consume(size_t size)
+		{
+			m_used -= size;
+			m_head += size;
+			if (m_used == 0)
+			{
+				m_head = 0;
+			}
+			else if (mirrored() && (m_head >= capacity()))
+			{
+				m_head -= capacity();
+			}
+		}
+
+		/**
+		 * Start of the free space - writable() bytes can be written here
+		 */
+		uint8_t* write_ptr()
+		{
+			if (!mirrored())
+			{
+				// Plain buffer - move the unread bytes to the front. The end
+				// is returned when full, so no element past it is indexed.
+				if (m_head > 0)
+				{
+					memmove(base(), base() + m_head, m_used);
+					m_head = 0;
+				}
+				return base() + m_used;
+			}
+
+			size_t pos = m_head + m_used;
+			if (pos >= capacity())
+			{
+				pos -= capacity();
+			}
+			return m_map.base + pos;
+		}
+
+		size_t writable() const
+		{
+			return capacity() - m_used;
+		}
+
+		/**
+		 * Mark bytes written at write_ptr() as readable
+		 */
+		void commit(size_t size)
+		{
+			m_used += size;
+		}
+
+		/**
+		 * Append bytes growing the buffer if needed
+		 */
+		void append(const uint8_t* data, size_t size)
+		{
+			reserve(size);
+			memcpy(write_ptr(), data, size);
+			commit(size);
+		}
+
+		/**
+		 * Make room for at least size more bytes, moving the unread bytes to
+		 * a larger buffer if needed
+		 */
+		void reserve(size_t size)
+		{
+			if (writable() >= size)
+			{
+				return;
+			}
+
+			mirrored_buffer bigger(std::max(2 * capacity(), m_used + size), mirrored());
+			memcpy(bigger.write_ptr(), read_ptr(), m_used);
+			bigger.commit(m_used);
+			swap(bigger);
+		}
+
+		size_t capacity() const
+		{
+			return mirrored() ? m_map.size : m_plain.size();
+		}
+
+		/**
+		 * True if the pages are mapped twice
+		 */
+		bool mirrored() const
+		{
+			return m_map.base != NULL;
+		}
+
+		void swap(mirrored_buffer& other)
+		{
+			std::swap(m_map, other.m_map);
+			m_plain.swap(other.m_plain);
+			std::swap(m_head, other.m_head);
+			std::swap(m_used, other.m_used);
+		}
+
+	private:
+		struct mapping
+		{
+			uint8_t* base;
+			size_t size;
+		};
+
+		uint8_t* base()
+		{
+			return mirrored() ? m_map.base : &m_plain[0];
+		}
+
+		const uint8_t* base() const
+		{
+			return mirrored() ? m_map.base : &m_plain[0];
+		}
+
+		/**
+		 * Map a shared memory file twice in a reserved range of twice its size
+		 */
+		void allocate(size_t capacity, bool mirror)
+		{
+			size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+			size_t size = ((std::max(capacity, static_cast<size_t>(1)) + page - 1) / page) * page;
+
+			int fd = mirror ? open_memory_file() : -1;
+			if ((fd >= 0) && (ftruncate(fd, static_cast<off_t>(size)) == 0))
+			{
+				void* range = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (range != MAP_FAILED)
+				{
+					uint8_t* base = static_cast<uint8_t*>(range);
+					if ((mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == base) &&
+					    (mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == base + size))
+					{
+						m_map.base = base;
+						m_map.size = size;
+					}
+					else
+					{
+						munmap(range, 2 * size);
+					}
+				}
+			}
+			if (fd >= 0)
+			{
+				close(fd);
+			}
+
+			if (!mirrored())
+			{
+				m_plain.resize(size);
+			}
+		}
+
+		void release()
+		{
+			if (mirrored())
+			{
+				munmap(m_map.base, 2 * m_map.size);
+				m_map.base = NULL;
+				m_map.size = 0;
+			}
+		}
+
+		/**
+		 * Get an unlinked file descriptor backed by memory - returns -1 on
+		 * failure
+		 */
+		static int open_memory_file()
+		{
+#ifdef SYS_memfd_create
+			int fd = static_cast<int>(syscall(SYS_memfd_create, "kafka_broker_stub", 1U /* MFD_CLOEXEC */));
+			if (fd >= 0)
+			{
+				return fd;
+			}
+#endif
+			char path[] = "/tmp/kafka_broker_stub_XXXXXX";
+			int tmp = mkstemp(path);
+			if (tmp >= 0)
+			{
+				unlink(path);
+			}
+			return tmp;
+		}
+
+		mirrored_buffer(const mirrored_buffer&);
+		mirrored_buffer& operator=(const mirrored_buffer&);
+
+		mapping m_map;
+		std::vector<uint8_t> m_plain;
+		size_t m_head;
+		size_t m_used;
+	};
+
+}
+
+#endif
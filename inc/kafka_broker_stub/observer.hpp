@@ -0,0 +1,244 @@
+#ifndef KAFKA_BROKER_STUB_OBSERVER_HPP_INC_
+#define KAFKA_BROKER_STUB_OBSERVER_HPP_INC_
+
+/*
+ * Notification of data appended to partitions.
+ *
+ * Observers are called on the thread handling the produce request and may be
+ * subscribed and unsubscribed while requests are served. Threads
+ * waiting for data sleep on a condition variable that is signalled after
+ * every append so they wake as soon as the data has landed.
+ */
+
+#include "util.hpp"
+#include <pthread.h>
+#include <errno.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace kafka_broker_stub {
+
+	class partition;
+
+	/**
+	 * Interface for observers of appended data
+	 */
+	class append_observerI
+	{
+	public:
+		virtual ~append_observerI() {}
+
+		/**
+		 * Called after count messages were appended to the partition of the
+		 * topic starting at base_offset
+		 */
+		virtual void on_append(const std::string& topic, const partition& part, int64_t base_offset,
+		                       size_t count) = 0;
+	};
+
+	/**
+	 * Registry of append observers plus a condition variable for waiters
+	 *
+	 * Appends made while holding the lock of the notifier (see scoped_lock)
+	 * are consistent with the predicates evaluated by wait() which run under
+	 * the same lock. The subscriptions have a lock of their own which is held
+	 * while observers are called, so once unsubscribe() returns the observer
+	 * is no longer called. Observers must thus not subscribe or unsubscribe
+	 * from on_append().
+	 */
+	class append_notifier
+	{
+	public:
+		append_notifier():
+			m_mutex(),
+			m_cond(),
+			m_subscription_mutex(),
+			m_subscriptions()
+		{
+			pthread_condattr_t attr;
+			pthread_condattr_init(&attr);
+			pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+			int ret = pthread_cond_init(&m_cond, &attr);
+			pthread_condattr_destroy(&attr);
+			if ((ret != 0) || (pthread_mutex_init(&m_mutex, NULL) != 0) ||
+			    (pthread_mutex_init(&m_subscription_mutex, NULL) != 0))
+				throw std::runtime_error("Unable to initialize append notifier");
+		}
+
+		~append_notifier()
+		{
+			pthread_cond_destroy(&m_cond);
+			pthread_mutex_destroy(&m_mutex);
+			pthread_mutex_destroy(&m_subscription_mutex);
+		}
+
+		/**
+		 * Lock held while in scope
+		 */
+		class scoped_lock
+		{
+		public:
+			explicit scoped_lock(append_notifier& notifier):
+				m_notifier(notifier)
+			{
+				pthread_mutex_lock(&m_notifier.m_mutex);
+			}
+
+			~scoped_lock()
+			{
+				pthread_mutex_unlock(&m_notifier.m_mutex);
+			}
+
+		private:
+			scoped_lock(const scoped_lock&);
+			scoped_lock& operator=(const scoped_lock&);
+
+			append_notifier& m_notifier;
+		};
+
+		/**
+		 * Register observer for appends to a topic - an empty topic name
+		 * matches all topics and a negative partition all partitions
+		 */
+		void subscribe(append_observerI& observer, const std::string& topic, int32_t part)
+		{
+			mutex_guard guard(m_subscription_mutex);
+			m_subscriptions.push_back(subscription(observer, topic, part));
+		}
+
+		/**
+		 * Remove all registrations of the observer
+		 */
+		void unsubscribe(append_observerI& observer)
+		{
+			mutex_guard guard(m_subscription_mutex);
+			size_t kept = 0;
+			for (size_t i=0; i<m_subscriptions.size(); ++i)
+			{
+				if (m_subscriptions[i].observer != &observer)
+				{
+					m_subscriptions[kept++] = m_subscriptions[i];
+				}
+			}
+			m_subscriptions.erase(m_subscriptions.begin() + static_cast<ptrdiff_t>(kept), m_subscriptions.end());
+		}
+
+		/**
+		 * Call the matching observers and wake up waiters. Must be called
+		 * without holding the lock.
+		 */
+		void notify(const std::string& topic, const partition& part, int32_t part_id, int64_t base_offset,
+		            size_t count)
+		{
+			{
+				mutex_guard guard(m_subscription_mutex);
+				for (size_t i=0; i<m_subscriptions.size(); ++i)
+				{
+					const subscription& sub = m_subscriptions[i];
+					if ((sub.topic.empty() || (sub.topic == topic)) && ((sub.part < 0) || (sub.part == part_id)))
+					{
+						sub.observer->on_append(topic, part, base_offset, count);
+					}
+				}
+			}
+
+			pthread_mutex_lock(&m_mutex);
+			pthread_cond_broadcast(&m_cond);
+			pthread_mutex_unlock(&m_mutex);
+		}
+
+		/**
+		 * Wait until pred() returns true or the timeout in milliseconds
+		 * expires - returns the last result of pred(). The predicate is
+		 * evaluated with the lock held.
+		 */
+		template <typename Pred>
+		bool wait(Pred pred, int64_t timeout_ms)
+		{
+			uint64_t deadline = util::monotonic_ns() +
+			                    static_cast<uint64_t>(timeout_ms > 0 ? timeout_ms : 0) * 1000000;
+			struct timespec ts;
+			ts.tv_sec = static_cast<time_t>(deadline / 1000000000);
+			ts.tv_nsec = static_cast<long>(deadline % 1000000000);
+
+			scoped_lock lock(*this);
+			bool done = pred();
+			while (!done)
+			{
+				int ret = pthread_cond_timedwait(&m_cond, &m_mutex, &ts);
+				done = pred();
+				if (ret == ETIMEDOUT)
+					break;
+			}
+			return done;
+		}
+
+	private:
+		/**
+		 * Lock of a mutex held while in scope
+		 */
+		class mutex_guard
+		{
+		public:
+			explicit mutex_guard(pthread_mutex_t& mutex):
+				m_mutex(mutex)
+			{
+				pthread_mutex_lock(&m_mutex);
+			}
+
+			~mutex_guard()
+			{
+				pthread_mutex_unlock(&m_mutex);
+			}
+
+		private:
+			mutex_guard(const mutex_guard&);
+			mutex_guard& operator=(const mutex_guard&);
+
+			pthread_mutex_t& m_mutex;
+		};
+
+		struct subscription
+		{
+			subscription(append_observerI& obs, const std::string& t, int32_t p):
+				observer(&obs),
+				topic(t),
+				part(p)
+			{
+
+			}
+
+			subscription(const subscription& other):
+				observer(other.observer),
+				topic(other.topic),
+				part(other.part)
+			{
+
+			}
+
+			subscription& operator=(const subscription& other)
+			{
+				observer = other.observer;
+				topic = other.topic;
+				part = other.part;
+				return *this;
+			}
+
+			append_observerI* observer;
+			std::string topic;
+			int32_t part;
+		};
+
+		append_notifier(const append_notifier&);
+		append_notifier& operator=(const append_notifier&);
+
+		pthread_mutex_t m_mutex;
+		pthread_cond_t m_cond;
+		pthread_mutex_t m_subscription_mutex;
+		std::vector<subscription> m_subscriptions;
+	};
+
+}
+
+#endif
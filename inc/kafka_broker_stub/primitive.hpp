@@ -2,8 +2,12 @@
 #define KAFKA_BROKER_STUB_PRIMITIVE_HPP_INC_
 
 #include "util.hpp"
+#include "scatter.hpp"
+#include <algorithm>
+#include <new>
 #include <string>
 #include <vector>
+#include <utility>
 #include <stdint.h>
 #include <stdexcept>
 #include <string.h>
@@ -49,6 +53,16 @@ namespace kafka_broker_stub {
 			throw std::runtime_error("Serial_size() function not implemented");
 		}
 
+		/**
+		 * Append the serialized element to out. By default it is serialized
+		 * into the arena of out - elements holding large payloads override
+		 * this to reference them in place.
+		 */
+		virtual void scatter(scatter_buffer& out) const
+		{
+			serialize(out.reserve(serial_size()));
+		}
+
 	};
 
 	namespace primitive {
@@ -240,6 +254,11 @@ namespace kafka_broker_stub {
 			{
 			}
 
+			string(const std::string& value):
+				m_value(value)
+			{
+			}
+
 			const uint8_t* deserialize(const uint8_t* data)
 			{
 				int16_t length = util::read_type<int16_t>(data);
@@ -267,6 +286,13 @@ namespace kafka_broker_stub {
 				return data + m_value.size();
 			}
 
+			void scatter(scatter_buffer& out) const
+			{
+				int16 length(m_value.size());
+				length.serialize(out.reserve(2));
+				out.append(m_value.data(), m_value.size());
+			}
+
 			size_t serial_size() const
 			{
 				return size()+2;
@@ -303,6 +329,11 @@ namespace kafka_broker_stub {
 		public:
 			bytearray(): m_value() { }
 
+			explicit bytearray(const std::string& value):
+				m_value(value)
+			{
+			}
+
 			const uint8_t* deserialize(const uint8_t* start)
 			{
 				int32_t length = util::read_type<int32_t>(start);
@@ -330,6 +361,13 @@ namespace kafka_broker_stub {
 				return dest + m_value.size();
 			}
 
+			void scatter(scatter_buffer& out) const
+			{
+				int32 length(m_value.size());
+				length.serialize(out.reserve(4));
+				out.append(m_value.data(), m_value.size());
+			}
+
 			size_t serial_size() const
 			{
 				return size() + 4;
@@ -362,19 +400,145 @@ namespace kafka_broker_stub {
 			std::string m_value;
 		};
 
+		// Bytes of elements an array keeps inline before allocating
+		const size_t ARRAY_INLINE_BYTES = 64;
+
+		// Bytes reserved at most for the elements of a decoded array length,
+		// as the length is read before the elements are known to be there
+		const size_t ARRAY_MAX_RESERVE_BYTES = 1 << 16;
+
+		/**
+		 * Number of elements of type T to reserve for an array length read
+		 * off the wire
+		 */
+		template <typename T>
+		size_t reserve_count(int32_t length)
+		{
+			size_t count = (length > 0) ? static_cast<size_t>(length) : 0;
+			size_t limit = (sizeof(T) < ARRAY_MAX_RESERVE_BYTES) ? ARRAY_MAX_RESERVE_BYTES / sizeof(T) : 1;
+			return (count < limit) ? count : limit;
+		}
+
 		/**
 		 *	Kafka array primitive. Stored as four bytes describing the number of
 		 * elements in the array followed by the elements.
+		 *
+		 * Small arrays of small elements (e.g. the replicas of a partition)
+		 * keep their elements inline and only allocate once they outgrow
+		 * ARRAY_INLINE_BYTES. Element types larger than that, such as
+		 * composites holding arrays themselves, are always on the heap, so
+		 * nesting arrays does not nest inline buffers.
 		 */
 		template <typename T>
 		class array : public kafka_elementI
 		{
 		public:
-			array(): m_value() { }
+			// Elements kept without a heap allocation
+			static const size_t INLINE_CAPACITY = ARRAY_INLINE_BYTES / sizeof(T);
+
+			array():
+				m_data(inline_data()),
+				m_size(0),
+				m_capacity(INLINE_CAPACITY),
+				m_inline()
+			{
+
+			}
+
+			array(const array& other):
+				kafka_elementI(other),
+				m_data(inline_data()),
+				m_size(0),
+				m_capacity(INLINE_CAPACITY),
+				m_inline()
+			{
+				try
+				{
+					append(other);
+				}
+				catch (...)
+				{
+					clear();
+					release();
+					throw;
+				}
+			}
+
+#if __cplusplus >= 201103L
+			/**
+			 * Take over the elements of another array, which is left empty
+			 */
+			array(array&& other):
+				kafka_elementI(other),
+				m_data(inline_data()),
+				m_size(0),
+				m_capacity(INLINE_CAPACITY),
+				m_inline()
+			{
+				swap(other);
+			}
+
+			array& operator=(array&& other)
+			{
+				if (this != &other)
+				{
+					clear();
+					swap(other);
+				}
+				return *this;
+			}
+#endif
+
+			~array()
+			{
+				clear();
+				release();
+			}
+
+			array& operator=(const array& other)
+			{
+				if (this != &other)
+				{
+					clear();
+					append(other);
+				}
+				return *this;
+			}
+
+			/**
+			 * Exchange the elements with another array - arrays holding
+			 * their elements on the heap hand over the allocation
+			 */
+			void swap(array& other)
+			{
+				if (this == &other)
+					return;
+
+				if (!is_inline() && !other.is_inline())
+				{
+					std::swap(m_data, other.m_data);
+					std::swap(m_size, other.m_size);
+					std::swap(m_capacity, other.m_capacity);
+				}
+				else if (is_inline() && other.is_inline())
+				{
+					array tmp(other);
+					other = *this;
+					*this = tmp;
+				}
+				else if (is_inline())
+				{
+					take_heap(other);
+				}
+				else
+				{
+					other.take_heap(*this);
+				}
+			}
 
 			const uint8_t* deserialize(const uint8_t* data)
 			{
-				m_value.clear();
+				clear();
 
 				// Read the length of the array
 				int32_t length = util::read_type<int32_t>(data);
@@ -382,12 +546,11 @@ namespace kafka_broker_stub {
 				// Move to array start
 				data += 4;
 
-				// Loop over array
+				// Decode the elements in place
+				reserve(reserve_count<T>(length));
 				for (int32_t i=0; i<length; i++)
 				{
-					T arrElement;
-					data = arrElement.deserialize(data);
-					m_value.push_back(arrElement);
+					data = emplace_back().deserialize(data);
 				}
 
 				return data;
@@ -396,24 +559,34 @@ namespace kafka_broker_stub {
 			uint8_t* serialize(uint8_t* data) const
 			{
 				// Write array length
-				int32 length(m_value.size());
+				int32 length(m_size);
 				data = length.serialize(data);
 
 				// Write array content
-				size_t arr_size = m_value.size();
-				for (size_t i=0; i<arr_size; ++i)
+				for (size_t i=0; i<m_size; ++i)
 				{
-					data = m_value[i].serialize(data);
+					data = m_data[i].serialize(data);
 				}
 				return data;
 			}
 
+			void scatter(scatter_buffer& out) const
+			{
+				int32 length(m_size);
+				length.serialize(out.reserve(4));
+				for (size_t i=0; i<m_size; ++i)
+				{
+					m_data[i].scatter(out);
+				}
+			}
+
 			size_t serial_size() const
 			{
+				// Elements such as composites with strings differ in size
 				size_t arr_size = 4; // Empty array
-				if (m_value.size() > 0)
+				for (size_t i=0; i<m_size; ++i)
 				{
-					arr_size += (m_value[0].serial_size() * m_value.size());
+					arr_size += m_data[i].serial_size();
 				}
 				return arr_size;
 			}
@@ -423,23 +596,267 @@ namespace kafka_broker_stub {
 			 */
 			size_t size() const
 			{
-				return m_value.size();
+				return m_size;
+			}
+
+			size_t capacity() const
+			{
+				return m_capacity;
 			}
 
 			const T& operator[] (size_t x) const
 			{
-				 return m_value[x];
+				 return m_data[x];
+			}
+
+			T& operator[] (size_t x)
+			{
+				 return m_data[x];
+			}
+
+			const T& back() const
+			{
+				return m_data[m_size - 1];
+			}
+
+			T& back()
+			{
+				return m_data[m_size - 1];
 			}
 
 			void push_back(const T& val)
 			{
-				m_value.push_back(val);
+				if (m_size < m_capacity)
+				{
+					new (m_data + m_size) T(val);
+				}
+				else
+				{
+					// Construct the element before moving the others as it
+					// may be one of them
+					size_t capacity = grown_capacity();
+					T* data = allocate(capacity);
+					try
+					{
+						new (data + m_size) T(val);
+					}
+					catch (...)
+					{
+						::operator delete(data);
+						throw;
+					}
+					relocate(data, capacity, 1);
+				}
+				++m_size;
+			}
+
+#if __cplusplus >= 201103L
+			/**
+			 * Append an element taking over its contents, e.g. the arrays of
+			 * a composite element built as temporary
+			 */
+			void push_back(T&& val)
+			{
+				if (m_size < m_capacity)
+				{
+					new (m_data + m_size) T(std::move(val));
+				}
+				else
+				{
+					size_t capacity = grown_capacity();
+					T* data = allocate(capacity);
+					try
+					{
+						new (data + m_size) T(std::move(val));
+					}
+					catch (...)
+					{
+						::operator delete(data);
+						throw;
+					}
+					relocate(data, capacity, 1);
+				}
+				++m_size;
+			}
+#endif
+
+			/**
+			 * Append a default constructed element and return it, so it can
+			 * be filled in place instead of being copied in
+			 */
+			T& emplace_back()
+			{
+				if (m_size == m_capacity)
+				{
+					reserve(grown_capacity());
+				}
+				new (m_data + m_size) T();
+				return m_data[m_size++];
+			}
+
+			/**
+			 * Make room for count elements in total
+			 */
+			void reserve(size_t count)
+			{
+				if (count > m_capacity)
+				{
+					relocate(allocate(count), count, 0);
+				}
+			}
+
+			/**
+			 * Remove all elements, keeping the capacity
+			 */
+			void clear()
+			{
+				for (size_t i=0; i<m_size; ++i)
+				{
+					m_data[i].~T();
+				}
+				m_size = 0;
 			}
 
 		private:
-			std::vector<T> m_value;
+			// Inline storage aligned for any element type
+			union storage
+			{
+				// Left uninitialized, the elements are constructed in place
+				storage() { }
+
+				uint8_t bytes[(INLINE_CAPACITY > 0) ? INLINE_CAPACITY * sizeof(T) : 1];
+				long double align_ld;
+				int64_t align_i64;
+				void* align_ptr;
+			};
+
+			T* inline_data()
+			{
+				return static_cast<T*>(static_cast<void*>(m_inline.bytes));
+			}
+
+			const T* inline_data() const
+			{
+				return static_cast<const T*>(static_cast<const void*>(m_inline.bytes));
+			}
+
+			bool is_inline() const
+			{
+				return m_data == inline_data();
+			}
+
+			size_t grown_capacity() const
+			{
+				return (m_capacity > 0) ? m_capacity * 2 : 1;
+			}
+
+			static T* allocate(size_t count)
+			{
+				return static_cast<T*>(::operator new(count * sizeof(T)));
+			}
+
+			/**
+			 * Move the elements to newly allocated data with room for capacity
+			 * elements, of which extra past the elements are set already.
+			 * Before C++11 the elements are copied. If an element throws, the
+			 * array keeps its data, though elements moved so far may be empty.
+			 */
+			void relocate(T* data, size_t capacity, size_t extra)
+			{
+				size_t done = 0;
+				try
+				{
+					for (; done<m_size; ++done)
+					{
+#if __cplusplus >= 201103L
+						new (data + done) T(std::move(m_data[done]));
+#else
+						new (data + done) T(m_data[done]);
+#endif
+					}
+				}
+				catch (...)
+				{
+					for (size_t i=0; i<done; ++i)
+					{
+						data[i].~T();
+					}
+					for (size_t i=0; i<extra; ++i)
+					{
+						data[m_size + i].~T();
+					}
+					::operator delete(data);
+					throw;
+				}
+
+				size_t size = m_size;
+				clear();
+				release();
+				m_data = data;
+				m_size = size;
+				m_capacity = capacity;
+			}
+
+			void release()
+			{
+				if (!is_inline())
+				{
+					::operator delete(m_data);
+					m_data = inline_data();
+					m_capacity = INLINE_CAPACITY;
+				}
+			}
+
+			/**
+			 * Take the heap allocation of other and give it the inline
+			 * elements in exchange
+			 */
+			void take_heap(array& other)
+			{
+				T* heap = other.m_data;
+				size_t size = other.m_size;
+				size_t capacity = other.m_capacity;
+				other.m_data = other.inline_data();
+				other.m_size = 0;
+				other.m_capacity = INLINE_CAPACITY;
+				try
+				{
+					other.append(*this);
+				}
+				catch (...)
+				{
+					other.clear();
+					other.m_data = heap;
+					other.m_size = size;
+					other.m_capacity = capacity;
+					throw;
+				}
+
+				clear();
+				m_data = heap;
+				m_size = size;
+				m_capacity = capacity;
+			}
+
+			void append(const array& other)
+			{
+				reserve(m_size + other.m_size);
+				for (size_t i=0; i<other.m_size; ++i)
+				{
+					new (m_data + m_size) T(other.m_data[i]);
+					++m_size;
+				}
+			}
+
+			T* m_data;
+			size_t m_size;
+			size_t m_capacity;
+			storage m_inline;
 		};
 
+		template <typename T>
+		const size_t array<T>::INLINE_CAPACITY;
+
 	}
 }
 
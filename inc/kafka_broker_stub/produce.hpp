@@ -19,6 +19,7 @@ namespace kafka_broker_stub { namespace produce {
 			m_crc(),
 			m_magicbyte(),
 			m_attributes(),
+			m_timestamp(-1),
 			m_key(),
 			m_value()
 		{
@@ -32,6 +33,10 @@ namespace kafka_broker_stub { namespace produce {
 			data = m_crc.deserialize(data);
 			data = m_magicbyte.deserialize(data);
 			data = m_attributes.deserialize(data);
+			if (m_magicbyte > 0)
+			{
+				data = m_timestamp.deserialize(data);
+			}
 			data = m_key.deserialize(data);
 			data = m_value.deserialize(data);
 			return data;
@@ -62,6 +67,14 @@ namespace kafka_broker_stub { namespace produce {
 			return m_attributes;
 		}
 
+		/**
+		 * Timestamp of messages in format v1 (-1 for format v0)
+		 */
+		const primitive::int64& timestamp() const
+		{
+			return m_timestamp;
+		}
+
 		const primitive::bytearray& key() const
 		{
 			return m_key;
@@ -78,10 +91,311 @@ namespace kafka_broker_stub { namespace produce {
 		primitive::int32 m_crc;
 		primitive::int8 m_magicbyte;
 		primitive::int8 m_attributes;
+		primitive::int64 m_timestamp;
 		primitive::bytearray m_key;
 		primitive::bytearray m_value;
 	};
 
+	/**
+	 * View of the key and value of a message inside a raw message set. The
+	 * pointers refer to the buffer the set was decoded from and are NULL for
+	 * null keys and values.
+	 */
+	struct message_view
+	{
+		// Milliseconds since epoch - -1 for messages in format v0
+		int64_t timestamp;
+		const uint8_t* key;
+		size_t key_size;
+		const uint8_t* value;
+		size_t value_size;
+	};
+
+	/**
+	 * Producer fields of a record batch (message format v2) and the messages
+	 * of the set it holds
+	 */
+	struct batch_view
+	{
+		int64_t producer_id;  // -1 if the producer is not idempotent
+		int16_t producer_epoch;
+		int32_t base_sequence;
+		size_t first;
+		size_t count;
+	};
+
+	/**
+	 * Message set decoded from the raw bytes of a partition record
+	 *
+	 * Uncompressed messages in format v0 and v1 (magic byte 0 and 1) and
+	 * uncompressed record batches (magic byte 2) are accepted. Unlike message the key and
+	 * value are not copied. The set only refers to them so it must not
+	 * outlive the buffer it was decoded from. Record headers are skipped.
+	 */
+	class message_set
+	{
+	public:
+		message_set():
+			m_messages(),
+			m_batches(),
+			m_payload_size(0),
+			m_compressed(false)
+		{
+
+		}
+
+		/**
+		 * Decode all messages in the buffer - returns false if a message
+		 * exceeds the buffer or is compressed
+		 */
+		bool deserialize(const uint8_t* data, size_t size)
+		{
+			m_messages.clear();
+			m_batches.clear();
+			m_payload_size = 0;
+			m_compressed = false;
+
+			const uint8_t* end = data + size;
+			while (data < end)
+			{
+				// Offset, message size, crc, magic byte, attributes and key size
+				if ((end - data) < 26)
+				{
+					return false;
+				}
+
+				int32_t msg_size = util::read_type<int32_t>(data + 8);
+				if ((msg_size < 14) || ((end - data - 12) < msg_size))
+				{
+					return false;
+				}
+
+				if (util::read_type<int8_t>(data + 16) >= 2)
+				{
+					if (!deserialize_batch(data, data + 12 + msg_size))
+					{
+						return false;
+					}
+					data += 12 + msg_size;
+					continue;
+				}
+
+				// Compressed wrapper messages are not supported
+				if ((util::read_type<int8_t>(data + 17) & 0x07) != 0)
+				{
+					m_compressed = true;
+					return false;
+				}
+
+				// Magic byte 1 adds a timestamp after the attributes
+				const uint8_t* msg_end = data + 12 + msg_size;
+				const uint8_t* cur = data + 18;
+				message_view view;
+				view.timestamp = -1;
+				if (util::read_type<int8_t>(data + 16) > 0)
+				{
+					if (msg_size < 22)
+					{
+						return false;
+					}
+					view.timestamp = util::read_type<int64_t>(cur);
+					cur += 8;
+				}
+
+				if (!read_bytes(cur, msg_end, view.key, view.key_size) ||
+				    !read_bytes(cur, msg_end, view.value, view.value_size))
+				{
+					return false;
+				}
+
+				m_payload_size += view.key_size + view.value_size;
+				m_messages.push_back(view);
+				data = msg_end;
+			}
+
+			return true;
+		}
+
+		size_t size() const
+		{
+			return m_messages.size();
+		}
+
+		const message_view& operator[] (size_t x) const
+		{
+			return m_messages[x];
+		}
+
+		/**
+		 * Total number of key and value bytes in the set
+		 */
+		size_t payload_size() const
+		{
+			return m_payload_size;
+		}
+
+		/**
+		 * Number of record batches - 0 for messages in format v0 and v1
+		 */
+		size_t batch_count() const
+		{
+			return m_batches.size();
+		}
+
+		const batch_view& batch(size_t x) const
+		{
+			return m_batches[x];
+		}
+
+		/**
+		 * True if the last deserialize failed on a compressed message or batch
+		 */
+		bool compressed() const
+		{
+			return m_compressed;
+		}
+
+	private:
+		/**
+		 * Decode a record batch ending at end
+		 */
+		bool deserialize_batch(const uint8_t* data, const uint8_t* end)
+		{
+			// Batch header up to and including the record count
+			if ((end - data) < 61)
+			{
+				return false;
+			}
+
+			// Compressed batches are not supported
+			if ((util::read_type<int16_t>(data + 21) & 0x07) != 0)
+			{
+				m_compressed = true;
+				return false;
+			}
+
+			int64_t first_timestamp = util::read_type<int64_t>(data + 27);
+			batch_view batch;
+			batch.producer_id = util::read_type<int64_t>(data + 43);
+			batch.producer_epoch = util::read_type<int16_t>(data + 51);
+			batch.base_sequence = util::read_type<int32_t>(data + 53);
+			batch.first = m_messages.size();
+			batch.count = 0;
+
+			int32_t num_records = util::read_type<int32_t>(data + 57);
+			const uint8_t* cur = data + 61;
+			for (int32_t i=0; i<num_records; ++i)
+			{
+				// Length, attributes, timestamp delta and offset delta
+				int64_t length = 0;
+				int64_t timestamp_delta = 0;
+				int64_t unused = 0;
+				if (!read_varint(cur, end, length) || (length < 1) || ((end - cur) < length))
+				{
+					return false;
+				}
+				const uint8_t* record_end = cur + length;
+				++cur;
+				if (!read_varint(cur, record_end, timestamp_delta) || !read_varint(cur, record_end, unused))
+				{
+					return false;
+				}
+
+				message_view view;
+				view.timestamp = first_timestamp + timestamp_delta;
+				if (!read_varbytes(cur, record_end, view.key, view.key_size) ||
+				    !read_varbytes(cur, record_end, view.value, view.value_size))
+				{
+					return false;
+				}
+
+				m_payload_size += view.key_size + view.value_size;
+				m_messages.push_back(view);
+				cur = record_end;
+			}
+
+			batch.count = m_messages.size() - batch.first;
+			m_batches.push_back(batch);
+			return true;
+		}
+
+		/**
+		 * Read a zigzag encoded variable length integer
+		 */
+		static bool read_varint(const uint8_t*& cur, const uint8_t* end, int64_t& out)
+		{
+			uint64_t value = 0;
+			for (int shift=0; shift<64; shift+=7)
+			{
+				if (cur >= end)
+				{
+					return false;
+				}
+				uint8_t byte = *cur++;
+				value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+				if ((byte & 0x80) == 0)
+				{
+					out = static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+					return true;
+				}
+			}
+			return false;
+		}
+
+		static bool read_varbytes(const uint8_t*& cur, const uint8_t* end, const uint8_t*& out, size_t& out_size)
+		{
+			int64_t length = 0;
+			if (!read_varint(cur, end, length))
+			{
+				return false;
+			}
+			out = (length < 0) ? NULL : cur;
+			out_size = 0;
+
+			// Negative length means null
+			if (length > 0)
+			{
+				if ((end - cur) < length)
+				{
+					return false;
+				}
+				out_size = static_cast<size_t>(length);
+				cur += length;
+			}
+			return true;
+		}
+
+		static bool read_bytes(const uint8_t*& cur, const uint8_t* end, const uint8_t*& out, size_t& out_size)
+		{
+			if ((end - cur) < 4)
+			{
+				return false;
+			}
+
+			int32_t length = util::read_type<int32_t>(cur);
+			cur += 4;
+			out = (length < 0) ? NULL : cur;
+			out_size = 0;
+
+			// Negative length means null
+			if (length > 0)
+			{
+				if ((end - cur) < length)
+				{
+					return false;
+				}
+				out_size = static_cast<size_t>(length);
+				cur += length;
+			}
+			return true;
+		}
+
+		std::vector<message_view> m_messages;
+		std::vector<batch_view> m_batches;
+		size_t m_payload_size;
+		bool m_compressed;
+	};
+
 	class partition_record : public kafka_elementI
 	{
 	public:
@@ -145,11 +459,16 @@ namespace kafka_broker_stub { namespace produce {
 		primitive::array<partition_record> m_partition_records;
 	};
 
+	/**
+	 * Request in version 0 to 3 - version 3 adds the transactional ID
+	 */
 	class request_v0 : public kafka_elementI
 	{
 	public:
-		request_v0():
+		explicit request_v0(int16_t version = 0):
+			m_version(version),
 			m_req_header(),
+			m_transactional_id(),
 			m_acks(),
 			m_timeout(),
 			m_topic_records()
@@ -160,6 +479,10 @@ namespace kafka_broker_stub { namespace produce {
 		const uint8_t* deserialize(const uint8_t* data)
 		{
 			data = m_req_header.deserialize(data);
+			if (m_version >= 3)
+			{
+				data = m_transactional_id.deserialize(data);
+			}
 			data = m_acks.deserialize(data);
 			data = m_timeout.deserialize(data);
 			data = m_topic_records.deserialize(data);
@@ -171,6 +494,14 @@ namespace kafka_broker_stub { namespace produce {
 			return m_req_header;
 		}
 
+		/**
+		 * Transactional ID - empty if null or before version 3
+		 */
+		const primitive::string& transactional_id() const
+		{
+			return m_transactional_id;
+		}
+
 		const primitive::int16& acks() const
 		{
 			return m_acks;
@@ -187,28 +518,38 @@ namespace kafka_broker_stub { namespace produce {
 		}
 
 	private:
+		int16_t m_version;
 		headers::request_hdr m_req_header;
+		primitive::string m_transactional_id;
 		primitive::int16 m_acks;
 		primitive::int32 m_timeout;
 		primitive::array<topic_record> m_topic_records;
 	};
 
+	/**
+	 * Result for one partition - from version 2 on the result carries the
+	 * log append time, which is -1 as the stub keeps the create time
+	 */
 	class partition_result : public kafka_elementI
 	{
 	public:
 		partition_result():
 			m_partition(),
 			m_err_code(),
-			m_offset()
+			m_offset(),
+			m_timestamp(-1),
+			m_version(0)
 		{
 
 		}
 
 		partition_result(const primitive::int32& partition, const primitive::int16& err_code,
-			              const primitive::int64& offset):
+			              const primitive::int64& offset, int16_t version = 0):
 			m_partition(partition),
 			m_err_code(err_code),
-			m_offset(offset)
+			m_offset(offset),
+			m_timestamp(-1),
+			m_version(version)
 		{
 
 		}
@@ -218,6 +559,10 @@ namespace kafka_broker_stub { namespace produce {
 			data = m_partition.serialize(data);
 			data = m_err_code.serialize(data);
 			data = m_offset.serialize(data);
+			if (m_version >= 2)
+			{
+				data = m_timestamp.serialize(data);
+			}
 			return data;
 		}
 
@@ -227,6 +572,10 @@ namespace kafka_broker_stub { namespace produce {
 			size += m_partition.serial_size();
 			size += m_err_code.serial_size();
 			size += m_offset.serial_size();
+			if (m_version >= 2)
+			{
+				size += m_timestamp.serial_size();
+			}
 			return size;
 		}
 
@@ -234,6 +583,8 @@ namespace kafka_broker_stub { namespace produce {
 		primitive::int32 m_partition;
 		primitive::int16 m_err_code;
 		primitive::int64 m_offset;
+		primitive::int64 m_timestamp;
+		int16_t m_version;
 	};
 
 	class topic_result : public kafka_elementI
@@ -246,6 +597,17 @@ namespace kafka_broker_stub { namespace produce {
 
 		}
 
+		/**
+		 * Result without partitions - they are added in place through
+		 * partition_results()
+		 */
+		topic_result(const primitive::string& topic):
+			m_topic_name(topic),
+			m_part_results()
+		{
+
+		}
+
 		topic_result(const primitive::string& topic, const primitive::array<partition_result>& part_results):
 			m_topic_name(topic),
 			m_part_results(part_results)
@@ -268,6 +630,16 @@ namespace kafka_broker_stub { namespace produce {
 			return size;
 		}
 
+		const primitive::array<partition_result>& partition_results() const
+		{
+			return m_part_results;
+		}
+
+		primitive::array<partition_result>& partition_results()
+		{
+			return m_part_results;
+		}
+
 	private:
 		primitive::string m_topic_name;
 		primitive::array<partition_result> m_part_results;
@@ -276,10 +648,20 @@ namespace kafka_broker_stub { namespace produce {
 	class response_v0 : public kafka_elementI
 	{
 	public:
+		/**
+		 * Response without topics - they are added in place through
+		 * topic_results()
+		 */
+		explicit response_v0(const primitive::int32& corr_id):
+			m_resp_header(corr_id),
+			m_topic_results()
+		{
+
+		}
+
 		response_v0(const primitive::int32& corr_id, const primitive::array<topic_result>& topic_results):
 			m_resp_header(corr_id),
 			m_topic_results(topic_results)
-			// m_throttle_time(0)
 		{
 
 		}
@@ -288,7 +670,6 @@ namespace kafka_broker_stub { namespace produce {
 		{
 			data = m_resp_header.serialize(data);
 			data = m_topic_results.serialize(data);
-			// data = m_throttle_time.serialize(data);
 			return data;
 		}
 
@@ -297,14 +678,79 @@ namespace kafka_broker_stub { namespace produce {
 			size_t size = 0;
 			size += m_resp_header.serial_size();
 			size += m_topic_results.serial_size();
-			// size += m_throttle_time.serial_size();
 			return size;
 		}
 
+		const primitive::array<topic_result>& topic_results() const
+		{
+			return m_topic_results;
+		}
+
+		primitive::array<topic_result>& topic_results()
+		{
+			return m_topic_results;
+		}
+
+	private:
+		headers::response_hdr m_resp_header;
+		primitive::array<topic_result> m_topic_results;
+	};
+
+	/**
+	 * Response for version 1 to 3 of the request, which adds the time the
+	 * client was throttled due to a quota violation
+	 */
+	class response_v1 : public kafka_elementI
+	{
+	public:
+		response_v1(const primitive::int32& corr_id, const primitive::int32& throttle_time):
+			m_resp_header(corr_id),
+			m_topic_results(),
+			m_throttle_time(throttle_time)
+		{
+
+		}
+
+		response_v1(const primitive::int32& corr_id, const primitive::array<topic_result>& topic_results,
+		            const primitive::int32& throttle_time):
+			m_resp_header(corr_id),
+			m_topic_results(topic_results),
+			m_throttle_time(throttle_time)
+		{
+
+		}
+
+		uint8_t* serialize(uint8_t* data) const
+		{
+			data = m_resp_header.serialize(data);
+			data = m_topic_results.serialize(data);
+			data = m_throttle_time.serialize(data);
+			return data;
+		}
+
+		size_t serial_size() const
+		{
+			size_t size = 0;
+			size += m_resp_header.serial_size();
+			size += m_topic_results.serial_size();
+			size += m_throttle_time.serial_size();
+			return size;
+		}
+
+		const primitive::array<topic_result>& topic_results() const
+		{
+			return m_topic_results;
+		}
+
+		primitive::array<topic_result>& topic_results()
+		{
+			return m_topic_results;
+		}
+
 	private:
 		headers::response_hdr m_resp_header;
 		primitive::array<topic_result> m_topic_results;
-		// primitive::int32 m_throttle_time;
+		primitive::int32 m_throttle_time;
 	};
 
 }}
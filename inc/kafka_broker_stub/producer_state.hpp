@@ -0,0 +1,366 @@
+#ifndef KAFKA_BROKER_STUB_PRODUCER_STATE_HPP_INC_
+#define KAFKA_BROKER_STUB_PRODUCER_STATE_HPP_INC_
+
+/*
+ * State of idempotent producers - producer ID allocation and the sequence
+ * numbers of the batches appended to a partition.
+ */
+
+#include "util.hpp"
+#include <pthread.h>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace kafka_broker_stub {
+
+	/**
+	 * Outcome of checking the sequence of a batch against the producer state
+	 */
+	enum sequence_result
+	{
+		SEQUENCE_OK = 0,
+		SEQUENCE_DUPLICATE,         // Appended before - answer with the earlier offset
+		SEQUENCE_OUT_OF_ORDER,      // Gap or reordering in the sequence
+		SEQUENCE_UNKNOWN_PRODUCER,  // First batch of an unknown producer does not start at 0
+		SEQUENCE_FENCED             // Epoch older than the latest epoch of the producer
+	};
+
+	/**
+	 * Open addressing hash table mapping producer IDs to the latest epoch and
+	 * the sequences of the last five batches appended, like brokers keep per
+	 * partition. Slots are fixed size so tracking a producer costs no
+	 * allocations beyond growing the table, and producers are never removed.
+	 */
+	class producer_table
+	{
+	public:
+		// Batches remembered per producer for duplicate detection
+		static const size_t CACHED_BATCHES = 5;
+
+		producer_table():
+			m_slots(),
+			m_used(0)
+		{
+
+		}
+
+		/**
+		 * Check a batch with the sequences first_seq to last_seq - for
+		 * duplicates offset is set to the base offset of the earlier append
+		 */
+		sequence_result check(int64_t producer_id, int16_t epoch, int32_t first_seq, int32_t last_seq,
+		                      int64_t& offset) const
+		{
+			const slot* s = lookup(producer_id);
+			if (s == NULL)
+			{
+				return (first_seq == 0) ? SEQUENCE_OK : SEQUENCE_UNKNOWN_PRODUCER;
+			}
+			if (epoch < s->epoch)
+			{
+				return SEQUENCE_FENCED;
+			}
+			if (epoch > s->epoch)
+			{
+				// A new epoch restarts the sequence
+				return (first_seq == 0) ? SEQUENCE_OK : SEQUENCE_OUT_OF_ORDER;
+			}
+
+			for (size_t i=0; i<s->count; ++i)
+			{
+				const batch& b = s->batches[i];
+				if ((b.first_seq == first_seq) && (b.last_seq == last_seq))
+				{
+					offset = b.offset;
+					return SEQUENCE_DUPLICATE;
+				}
+			}
+
+			const batch& last = s->batches[(s->head + s->count - 1) % CACHED_BATCHES];
+			return (first_seq == next_sequence(last.last_seq, 1)) ? SEQUENCE_OK : SEQUENCE_OUT_OF_ORDER;
+		}
+
+		/**
+		 * Remember an appended batch - must have passed check()
+		 */
+		void add(int64_t producer_id, int16_t epoch, int32_t first_seq, int32_t last_seq, int64_t offset)
+		{
+			if (((m_used + 1) * 10) > (m_slots.size() * 7))
+			{
+				rehash(m_used * 2 + 16);
+			}
+
+			slot& s = insert(producer_id);
+			if ((s.count == 0) || (epoch != s.epoch))
+			{
+				s.epoch = epoch;
+				s.head = 0;
+				s.count = 0;
+			}
+
+			// Replace the oldest batch once all are in use
+			batch& b = s.batches[(s.head + s.count) % CACHED_BATCHES];
+			if (s.count < CACHED_BATCHES)
+			{
+				++s.count;
+			}
+			else
+			{
+				s.head = (s.head + 1) % CACHED_BATCHES;
+			}
+			b.first_seq = first_seq;
+			b.last_seq = last_seq;
+			b.offset = offset;
+		}
+
+		/**
+		 * Sequence of the record count'th after the given one - sequences wrap
+		 * to 0 after the largest int32
+		 */
+		static int32_t next_sequence(int32_t seq, int32_t count)
+		{
+			int64_t next = static_cast<int64_t>(seq) + count;
+			const int64_t limit = static_cast<int64_t>(0x7FFFFFFF) + 1;
+			return static_cast<int32_t>((next >= limit) ? (next - limit) : next);
+		}
+
+		/**
+		 * Number of producers tracked
+		 */
+		size_t size() const
+		{
+			return m_used;
+		}
+
+		void clear()
+		{
+			m_slots.clear();
+			m_used = 0;
+		}
+
+		/**
+		 * Batch remembered for a producer
+		 */
+		struct entry
+		{
+			int64_t producer_id;
+			int16_t epoch;
+			int32_t first_seq;
+			int32_t last_seq;
+			int64_t offset;
+		};
+
+		/**
+		 * Get the remembered batches of all producers, each producer's oldest
+		 * batch first, so adding them in order rebuilds the table
+		 */
+		void entries(std::vector<entry>& out) const
+		{
+			out.clear();
+			for (size_t i=0; i<m_slots.size(); ++i)
+			{
+				const slot& s = m_slots[i];
+				for (size_t k=0; (s.producer_id >= 0) && (k<s.count); ++k)
+				{
+					const batch& b = s.batches[(s.head + k) % CACHED_BATCHES];
+					entry e;
+					e.producer_id = s.producer_id;
+					e.epoch = s.epoch;
+					e.first_seq = b.first_seq;
+					e.last_seq = b.last_seq;
+					e.offset = b.offset;
+					out.push_back(e);
+				}
+			}
+		}
+
+	private:
+		struct batch
+		{
+			int32_t first_seq;
+			int32_t last_seq;
+			int64_t offset;
+		};
+
+		struct slot
+		{
+			slot():
+				producer_id(-1),
+				epoch(0),
+				head(0),
+				count(0),
+				batches()
+			{
+
+			}
+
+			int64_t producer_id;  // -1 if empty
+			int16_t epoch;
+			size_t head;
+			size_t count;
+			batch batches[CACHED_BATCHES];
+		};
+
+		static size_t hash(int64_t producer_id)
+		{
+			return static_cast<size_t>(util::hash_bytes(&producer_id, sizeof(producer_id)));
+		}
+
+		const slot* lookup(int64_t producer_id) const
+		{
+			if (m_used == 0)
+			{
+				return NULL;
+			}
+
+			size_t mask = m_slots.size() - 1;
+			for (size_t pos = hash(producer_id) & mask;; pos = (pos + 1) & mask)
+			{
+				const slot& s = m_slots[pos];
+				if (s.producer_id < 0)
+				{
+					return NULL;
+				}
+				if (s.producer_id == producer_id)
+				{
+					return &s;
+				}
+			}
+		}
+
+		slot& insert(int64_t producer_id)
+		{
+			size_t mask = m_slots.size() - 1;
+			size_t pos = hash(producer_id) & mask;
+			while ((m_slots[pos].producer_id >= 0) && (m_slots[pos].producer_id != producer_id))
+			{
+				pos = (pos + 1) & mask;
+			}
+
+			if (m_slots[pos].producer_id < 0)
+			{
+				m_slots[pos].producer_id = producer_id;
+				++m_used;
+			}
+			return m_slots[pos];
+		}
+
+		/**
+		 * Move the slots to a table with room for at least count producers
+		 */
+		void rehash(size_t count)
+		{
+			size_t size = 16;
+			while (size * 7 < count * 10)
+			{
+				size <<= 1;
+			}
+
+			std::vector<slot> old(size);
+			old.swap(m_slots);
+			size_t mask = size - 1;
+			for (size_t i=0; i<old.size(); ++i)
+			{
+				if (old[i].producer_id < 0)
+				{
+					continue;
+				}
+
+				size_t pos = hash(old[i].producer_id) & mask;
+				while (m_slots[pos].producer_id >= 0)
+				{
+					pos = (pos + 1) & mask;
+				}
+				m_slots[pos] = old[i];
+			}
+		}
+
+		std::vector<slot> m_slots;
+		size_t m_used;
+	};
+
+	/**
+	 * Hands out producer IDs for InitProducerId requests
+	 *
+	 * IDs start with the node ID in the upper 32 bits so the stubs of a
+	 * cluster never hand out the same ID. A transactional ID keeps its
+	 * producer ID and gets the next epoch on every init, which fences older
+	 * producers using it.
+	 */
+	class producer_ids
+	{
+	public:
+		explicit producer_ids(int32_t node_id):
+			m_mutex(),
+			m_base(static_cast<int64_t>(node_id & 0x7FFFFFFF) << 32),
+			m_next(0),
+			m_transactional()
+		{
+			if (pthread_mutex_init(&m_mutex, NULL) != 0)
+			{
+				throw std::runtime_error("Failed to initialize producer ID mutex");
+			}
+		}
+
+		~producer_ids()
+		{
+			pthread_mutex_destroy(&m_mutex);
+		}
+
+		/**
+		 * Get the producer ID and epoch for a producer - an empty
+		 * transactional ID gets a new ID with epoch 0
+		 */
+		void init(const std::string& transactional_id, int64_t& producer_id, int16_t& epoch)
+		{
+			pthread_mutex_lock(&m_mutex);
+			if (transactional_id.empty())
+			{
+				producer_id = m_base + m_next++;
+				epoch = 0;
+			}
+			else
+			{
+				std::map<std::string, id_epoch>::iterator it = m_transactional.find(transactional_id);
+				if (it == m_transactional.end())
+				{
+					it = m_transactional.insert(std::make_pair(transactional_id, id_epoch(m_base + m_next++))).first;
+				}
+				else
+				{
+					++it->second.epoch;
+				}
+				producer_id = it->second.producer_id;
+				epoch = it->second.epoch;
+			}
+			pthread_mutex_unlock(&m_mutex);
+		}
+
+	private:
+		struct id_epoch
+		{
+			explicit id_epoch(int64_t id):
+				producer_id(id),
+				epoch(0)
+			{
+
+			}
+
+			int64_t producer_id;
+			int16_t epoch;
+		};
+
+		pthread_mutex_t m_mutex;
+		int64_t m_base;
+		int64_t m_next;
+		std::map<std::string, id_epoch> m_transactional;
+
+		producer_ids(const producer_ids&);
+		const producer_ids& operator=(const producer_ids&);
+	};
+
+}
+
+#endif
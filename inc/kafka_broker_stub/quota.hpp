@@ -0,0 +1,385 @@
+#ifndef KAFKA_BROKER_STUB_QUOTA_HPP_INC_
+#define KAFKA_BROKER_STUB_QUOTA_HPP_INC_
+
+/*
+ * Client quotas for simulating broker throttling.
+ *
+ * Like a Kafka broker the stub can limit the produce and fetch byte rates per
+ * client ID. Requests exceeding a quota are still handled, but the response
+ * carries the time the client should back off (throttle_time_ms) and can
+ * optionally be held back for that time as brokers before Kafka 2.0 do.
+ *
+ * The stub does not authenticate clients, so all requests come from the same
+ * (anonymous) user and the user quota is shared by all clients.
+ */
+
+#include "util.hpp"
+#include <algorithm>
+#include <pthread.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace kafka_broker_stub {
+
+	enum quota_type
+	{
+		QUOTA_PRODUCE = 0,
+		QUOTA_FETCH,
+		QUOTA_TYPE_COUNT
+	};
+
+	/**
+	 * Byte rate limit that can be charged from several threads without locks
+	 *
+	 * Instead of a token count the bucket keeps the time at which it is full
+	 * again (generic cell rate algorithm). Charging bytes moves that time
+	 * forward with a single compare-and-swap, and a client is over quota
+	 * while it lies more than the burst ahead of the current time.
+	 */
+	class token_bucket
+	{
+	public:
+		token_bucket():
+			m_ns_per_kb(0),
+			m_burst_ns(0),
+			m_full_at(0)
+		{
+
+		}
+
+		/**
+		 * Set the rate in bytes per second (0 means unlimited) and the burst
+		 * allowed in milliseconds at that rate
+		 */
+		void configure(uint64_t bytes_per_sec, uint64_t burst_ms)
+		{
+			uint64_t ns_per_kb = 0;
+			if (bytes_per_sec > 0)
+			{
+				ns_per_kb = std::max(static_cast<uint64_t>(1),
+				                     static_cast<uint64_t>(1024) * 1000000000 / bytes_per_sec);
+			}
+			util::atomic_store(&m_burst_ns, burst_ms * 1000000);
+			util::atomic_store(&m_ns_per_kb, ns_per_kb);
+		}
+
+		bool limited() const
+		{
+			return util::atomic_load(&m_ns_per_kb) != 0;
+		}
+
+		/**
+		 * Charge bytes at time now_ns - returns the milliseconds the client
+		 * has to be throttled to get back within the rate (0 if it is within)
+		 */
+		uint32_t charge(size_t bytes, uint64_t now_ns)
+		{
+			uint64_t ns_per_kb = util::atomic_load(&m_ns_per_kb);
+			if (ns_per_kb == 0)
+				return 0;
+
+			uint64_t cost = (bytes / 1024) * ns_per_kb + ((bytes % 1024) * ns_per_kb) / 1024;
+			uint64_t prev = 0;
+			uint64_t next = 0;
+			do
+			{
+				prev = util::atomic_load(&m_full_at);
+				next = std::max(prev, now_ns) + cost;
+			} while (!util::atomic_cas(&m_full_at, prev, next));
+
+			uint64_t allowed = now_ns + util::atomic_load(&m_burst_ns);
+			if (next <= allowed)
+				return 0;
+			return static_cast<uint32_t>(std::min(static_cast<uint64_t>(0x7FFFFFFF), (next - allowed + 999999) / 1000000));
+		}
+
+	private:
+		volatile uint64_t m_ns_per_kb;
+		volatile uint64_t m_burst_ns;
+		volatile uint64_t m_full_at;
+	};
+
+	/**
+	 * Produce and fetch quotas per client ID and for the anonymous user
+	 *
+	 * Configuration takes a lock, charging does not unless a client ID is seen
+	 * for the first time while a default quota is set. Client buckets live
+	 * as long as the manager.
+	 */
+	class quota_manager
+	{
+	public:
+		quota_manager():
+			m_mutex(),
+			m_table(NULL),
+			m_tables(),
+			m_clients(),
+			m_defaults(),
+			m_user(),
+			m_burst_ms(1000),
+			m_active(0),
+			m_delay(0)
+		{
+			if (pthread_mutex_init(&m_mutex, NULL) != 0)
+				throw std::runtime_error("Unable to initialize quota manager");
+			m_tables.push_back(new client_table(16));
+			m_table = m_tables.back();
+		}
+
+		~quota_manager()
+		{
+			for (size_t i=0; i<m_clients.size(); ++i)
+			{
+				delete m_clients[i];
+			}
+			for (size_t i=0; i<m_tables.size(); ++i)
+			{
+				delete m_tables[i];
+			}
+			pthread_mutex_destroy(&m_mutex);
+		}
+
+		/**
+		 * Limit the byte rate of a client ID - 0 removes the limit so the
+		 * default quota applies again
+		 */
+		void set_client_quota(quota_type type, const std::string& client_id, uint64_t bytes_per_sec)
+		{
+			pthread_mutex_lock(&m_mutex);
+			client* c = find(client_id);
+			if (c == NULL)
+			{
+				c = add(client_id);
+			}
+			c->own_rate[type] = bytes_per_sec;
+			configure(*c, type);
+			update_active();
+			pthread_mutex_unlock(&m_mutex);
+		}
+
+		/**
+		 * Limit the byte rate of each client ID without a quota of its own -
+		 * 0 removes the limit
+		 */
+		void set_default_quota(quota_type type, uint64_t bytes_per_sec)
+		{
+			pthread_mutex_lock(&m_mutex);
+			m_defaults[type] = bytes_per_sec;
+			for (size_t i=0; i<m_clients.size(); ++i)
+			{
+				configure(*m_clients[i], type);
+			}
+			update_active();
+			pthread_mutex_unlock(&m_mutex);
+		}
+
+		/**
+		 * Limit the byte rate of all clients together - 0 removes the limit
+		 */
+		void set_user_quota(quota_type type, uint64_t bytes_per_sec)
+		{
+			pthread_mutex_lock(&m_mutex);
+			m_user[type].configure(bytes_per_sec, m_burst_ms);
+			update_active();
+			pthread_mutex_unlock(&m_mutex);
+		}
+
+		/**
+		 * Set the burst allowed above the rate in milliseconds at the rate
+		 * (default 1000) - applies to quotas set afterwards
+		 */
+		void set_burst_ms(uint64_t burst_ms)
+		{
+			pthread_mutex_lock(&m_mutex);
+			m_burst_ms = burst_ms;
+			pthread_mutex_unlock(&m_mutex);
+		}
+
+		/**
+		 * Hold back throttled responses for the throttle time instead of only
+		 * reporting it in the response
+		 */
+		void set_delay_responses(bool delay)
+		{
+			util::atomic_store(&m_delay, delay ? 1 : 0);
+		}
+
+		bool delay_responses() const
+		{
+			return util::atomic_load(&m_delay) != 0;
+		}
+
+		/**
+		 * Charge bytes to the quotas of a client - returns the throttle time
+		 * in milliseconds (0 if the client is within its quotas)
+		 */
+		uint32_t charge(quota_type type, const std::string& client_id, size_t bytes)
+		{
+			if (util::atomic_load(&m_active) == 0)
+				return 0;
+
+			uint64_t now = util::monotonic_ns();
+			uint32_t throttle = m_user[type].charge(bytes, now);
+
+			client* c = find(client_id);
+			if ((c == NULL) && (util::atomic_load(&m_defaults[type]) > 0))
+			{
+				pthread_mutex_lock(&m_mutex);
+				c = find(client_id);
+				if (c == NULL)
+				{
+					c = add(client_id);
+				}
+				pthread_mutex_unlock(&m_mutex);
+			}
+
+			if (c != NULL)
+			{
+				throttle = std::max(throttle, c->buckets[type].charge(bytes, now));
+			}
+			return throttle;
+		}
+
+	private:
+		struct client
+		{
+			explicit client(const std::string& id):
+				client_id(id),
+				hash(util::hash_bytes(id.data(), id.size())),
+				own_rate(),
+				buckets()
+			{
+
+			}
+
+			std::string client_id;
+			uint64_t hash;
+
+			// Rate configured for the client - 0 means the default applies
+			uint64_t own_rate[QUOTA_TYPE_COUNT];
+			token_bucket buckets[QUOTA_TYPE_COUNT];
+		};
+
+		/**
+		 * Open addressing table of clients. Slots are filled in place and the
+		 * table is replaced by a larger one when half full. Replaced tables
+		 * are kept since readers may still probe them.
+		 */
+		struct client_table
+		{
+			explicit client_table(size_t capacity):
+				slots(capacity, static_cast<client*>(NULL)),
+				count(0)
+			{
+
+			}
+
+			std::vector<client*> slots;
+			size_t count;
+		};
+
+		client* find(const std::string& client_id) const
+		{
+			const client_table* table = util::atomic_load(&m_table);
+			uint64_t hash = util::hash_bytes(client_id.data(), client_id.size());
+			size_t mask = table->slots.size() - 1;
+			for (size_t pos = static_cast<size_t>(hash) & mask; ; pos = (pos + 1) & mask)
+			{
+				client* c = util::atomic_load(&table->slots[pos]);
+				if (c == NULL)
+					return NULL;
+				if ((c->hash == hash) && (c->client_id == client_id))
+					return c;
+			}
+		}
+
+		/**
+		 * Add a client with the default rates - called with the lock held
+		 */
+		client* add(const std::string& client_id)
+		{
+			client* c = new client(client_id);
+			for (size_t i=0; i<QUOTA_TYPE_COUNT; ++i)
+			{
+				configure(*c, static_cast<quota_type>(i));
+			}
+			m_clients.push_back(c);
+
+			client_table* table = m_table;
+			if (2 * (table->count + 1) > table->slots.size())
+			{
+				client_table* bigger = new client_table(2 * table->slots.size());
+				for (size_t i=0; i<table->slots.size(); ++i)
+				{
+					if (table->slots[i] != NULL)
+						insert(*bigger, table->slots[i]);
+				}
+				m_tables.push_back(bigger);
+				insert(*bigger, c);
+				util::atomic_store(&m_table, bigger);
+			}
+			else
+			{
+				insert(*table, c);
+			}
+			return c;
+		}
+
+		static void insert(client_table& table, client* c)
+		{
+			size_t mask = table.slots.size() - 1;
+			size_t pos = static_cast<size_t>(c->hash) & mask;
+			while (table.slots[pos] != NULL)
+			{
+				pos = (pos + 1) & mask;
+			}
+			util::atomic_store(&table.slots[pos], c);
+			++table.count;
+		}
+
+		void configure(client& c, quota_type type)
+		{
+			uint64_t rate = (c.own_rate[type] > 0) ? c.own_rate[type] : m_defaults[type];
+			c.buckets[type].configure(rate, m_burst_ms);
+		}
+
+		/**
+		 * Let charge() skip all work while no quota is set
+		 */
+		void update_active()
+		{
+			int active = 0;
+			for (size_t i=0; i<QUOTA_TYPE_COUNT; ++i)
+			{
+				if ((m_defaults[i] > 0) || m_user[i].limited())
+					active = 1;
+			}
+			for (size_t i=0; (i<m_clients.size()) && (active == 0); ++i)
+			{
+				for (size_t k=0; k<QUOTA_TYPE_COUNT; ++k)
+				{
+					if (m_clients[i]->own_rate[k] > 0)
+						active = 1;
+				}
+			}
+			util::atomic_store(&m_active, active);
+		}
+
+		quota_manager(const quota_manager&);
+		quota_manager& operator=(const quota_manager&);
+
+		pthread_mutex_t m_mutex;
+		client_table* volatile m_table;
+		std::vector<client_table*> m_tables;
+		std::vector<client*> m_clients;
+		volatile uint64_t m_defaults[QUOTA_TYPE_COUNT];
+		token_bucket m_user[QUOTA_TYPE_COUNT];
+		uint64_t m_burst_ms;
+		volatile int m_active;
+		volatile int m_delay;
+	};
+
+}
+
+#endif
@@ -0,0 +1,274 @@
+#ifndef KAFKA_BROKER_STUB_SCATTER_HPP_INC_
+#define KAFKA_BROKER_STUB_SCATTER_HPP_INC_
+
+/*
+ * Scatter-gather output of serialized elements.
+ *
+ * Instead of serializing a response into one contiguous buffer, elements can
+ * append themselves to a scatter buffer (see kafka_elementI::scatter()). Small
+ * parts such as sizes and headers are written to an arena owned by the
+ * buffer while large payloads are referenced where they are stored. The
+ * resulting iovec list can be passed straight to writev or sendmsg - the
+ * referenced payloads must not change until it has been sent.
+ *
+ * The fetch handler scatters its response into a buffer like this and hands
+ * it to the response sink of the request (see dispatch.hpp) while appends
+ * are blocked. The epoll and io_uring transports send it to the socket right
+ * away and only copy the part the socket does not take (see copy_to()).
+ */
+
+#include "util.hpp"
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <string.h>
+#include <sys/uio.h>
+
+namespace kafka_broker_stub {
+
+	/**
+	 * Arena and list of the byte ranges making up serialized output
+	 *
+	 * Arena chunks are never moved, so pointers handed out by reserve() stay
+	 * valid until clear(). Consecutive arena writes are merged into one entry.
+	 */
+	class scatter_buffer
+	{
+	public:
+		// Payloads of at least this many bytes are referenced in place
+		static const size_t DEFAULT_MIN_REFERENCE = 256;
+
+		// Size of the arena chunks (larger reservations get their own chunk)
+		static const size_t DEFAULT_CHUNK_SIZE = 4096;
+
+		explicit scatter_buffer(size_t min_reference = DEFAULT_MIN_REFERENCE,
+		                        size_t chunk_size = DEFAULT_CHUNK_SIZE):
+			m_min_reference(min_reference),
+			m_chunk_size(chunk_size),
+			m_chunks(),
+			m_capacities(),
+			m_chunk(0),
+			m_used(0),
+			m_iov(),
+			m_front(0),
+			m_front_pos(0),
+			m_size(0),
+			m_referenced(0)
+		{
+
+		}
+
+		~scatter_buffer()
+		{
+			for (size_t i=0; i<m_chunks.size(); ++i)
+			{
+				delete[] m_chunks[i];
+			}
+		}
+
+		/**
+		 * Reserve size bytes of the arena at the end of the output - the
+		 * returned memory must be filled before the output is sent
+		 */
+		uint8_t* reserve(size_t size)
+		{
+			if (m_chunks.empty() || (m_used + size > m_capacities[m_chunk]))
+			{
+				next_chunk(size);
+			}
+
+			uint8_t* data = m_chunks[m_chunk] + m_used;
+			m_used += size;
+			add(data, size);
+			return data;
+		}
+
+		/**
+		 * Append bytes to the output - copied to the arena if smaller than
+		 * the reference threshold and referenced in place otherwise
+		 */
+		void append(const void* data, size_t size)
+		{
+			if (size < m_min_reference)
+			{
+				if (size > 0)
+				{
+					memcpy(reserve(size), data, size);
+				}
+				return;
+			}
+			reference(data, size);
+		}
+
+		/**
+		 * Append bytes to the output by reference - they must not change
+		 * until the output is sent
+		 */
+		void reference(const void* data, size_t size)
+		{
+			add(const_cast<void*>(data), size);
+			m_referenced += size;
+		}
+
+		/**
+		 * Number of bytes left to send
+		 */
+		size_t size() const
+		{
+			return m_size;
+		}
+
+		/**
+		 * Number of bytes appended by reference
+		 */
+		size_t referenced() const
+		{
+			return m_referenced;
+		}
+
+		bool empty() const
+		{
+			return m_size == 0;
+		}
+
+		/**
+		 * Number of byte ranges left to send
+		 */
+		size_t count() const
+		{
+			return m_iov.size() - m_front;
+		}
+
+		/**
+		 * Describe up to max byte ranges left to send - returns the number of
+		 * entries filled
+		 */
+		size_t fill_iovec(struct iovec* iov, size_t max) const
+		{
+			size_t count = 0;
+			for (size_t i=m_front; (i < m_iov.size()) && (count < max); ++i, ++count)
+			{
+				size_t skip = (count == 0) ? m_front_pos : 0;
+				iov[count].iov_base = static_cast<uint8_t*>(m_iov[i].iov_base) + skip;
+				iov[count].iov_len = m_iov[i].iov_len - skip;
+			}
+			return count;
+		}
+
+		/**
+		 * Drop bytes that have been sent from the front of the output
+		 */
+		void consumed(size_t bytes)
+		{
+			while ((bytes > 0) && (m_front < m_iov.size()))
+			{
+				size_t left = m_iov[m_front].iov_len - m_front_pos;
+				if (bytes < left)
+				{
+					m_front_pos += bytes;
+					m_size -= bytes;
+					return;
+				}
+
+				bytes -= left;
+				m_size -= left;
+				++m_front;
+				m_front_pos = 0;
+			}
+		}
+
+		/**
+		 * Append the bytes left to send to out, e.g. for transports that
+		 * need contiguous responses
+		 */
+		void copy_to(std::string& out) const
+		{
+			out.reserve(out.size() + m_size);
+			for (size_t i=m_front; i<m_iov.size(); ++i)
+			{
+				size_t skip = (i == m_front) ? m_front_pos : 0;
+				out.append(static_cast<const char*>(m_iov[i].iov_base) + skip, m_iov[i].iov_len - skip);
+			}
+		}
+
+		/**
+		 * Drop the output, keeping the arena for reuse
+		 */
+		void clear()
+		{
+			m_chunk = 0;
+			m_used = 0;
+			m_iov.clear();
+			m_front = 0;
+			m_front_pos = 0;
+			m_size = 0;
+			m_referenced = 0;
+		}
+
+	private:
+		scatter_buffer(const scatter_buffer&);
+		scatter_buffer& operator=(const scatter_buffer&);
+
+		/**
+		 * Continue in a chunk with room for size bytes
+		 */
+		void next_chunk(size_t size)
+		{
+			if (!m_chunks.empty())
+			{
+				++m_chunk;
+			}
+
+			// Reuse a chunk kept by clear() if it is large enough
+			if ((m_chunk < m_chunks.size()) && (m_capacities[m_chunk] >= size))
+			{
+				m_used = 0;
+				return;
+			}
+
+			size_t capacity = (size > m_chunk_size) ? size : m_chunk_size;
+			m_chunks.insert(m_chunks.begin() + static_cast<ptrdiff_t>(m_chunk), new uint8_t[capacity]);
+			m_capacities.insert(m_capacities.begin() + static_cast<ptrdiff_t>(m_chunk), capacity);
+			m_used = 0;
+		}
+
+		void add(void* data, size_t size)
+		{
+			if (size == 0)
+				return;
+
+			m_size += size;
+			if ((m_iov.size() > m_front) &&
+			    (static_cast<uint8_t*>(m_iov.back().iov_base) + m_iov.back().iov_len == data))
+			{
+				m_iov.back().iov_len += size;
+				return;
+			}
+
+			struct iovec iov;
+			iov.iov_base = data;
+			iov.iov_len = size;
+			m_iov.push_back(iov);
+		}
+
+		size_t m_min_reference;
+		size_t m_chunk_size;
+
+		// Arena chunks, the one written to and the bytes used in it
+		std::vector<uint8_t*> m_chunks;
+		std::vector<size_t> m_capacities;
+		size_t m_chunk;
+		size_t m_used;
+
+		// Byte ranges with the first one not sent completely
+		std::vector<struct iovec> m_iov;
+		size_t m_front;
+		size_t m_front_pos;
+
+		size_t m_size;
+		size_t m_referenced;
+	};
+
+}
+
+#endif
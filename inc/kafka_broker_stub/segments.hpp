@@ -0,0 +1,454 @@
+#ifndef KAFKA_BROKER_STUB_SEGMENTS_HPP_INC_
+#define KAFKA_BROKER_STUB_SEGMENTS_HPP_INC_
+
+/*
+ * Export of partitions in the on-disk format of Kafka brokers.
+ *
+ * A partition is written to a directory <topic>-<partition> as segments
+ * named after the offset of their first record, zero padded to 20 digits:
+ *
+ *   .log        record batches in message format v2 (magic 2)
+ *   .index      sparse offset index, int32 offset relative to the segment
+ *               and int32 position of the batch in the .log file
+ *   .timeindex  sparse time index, int64 timestamp and int32 relative offset
+ *
+ * Indexes get an entry whenever more than index_interval_bytes were written
+ * to the log since the last one, like brokers do, so the files can be
+ * inspected and verified with kafka-dump-log.sh. Batches carry no producer
+ * state and are not compressed. Compacted partitions only export the latest
+ * message per key, leaving gaps in the offsets.
+ */
+
+#include "snapshot.hpp"
+#include <errno.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <string>
+
+namespace kafka_broker_stub { namespace segments {
+
+	struct options
+	{
+		options():
+			segment_bytes(1 << 30),
+			index_interval_bytes(4096),
+			batch_bytes(1 << 14)
+		{
+
+		}
+
+		// Maximum size of a .log file - a new segment is rolled beyond it
+		uint64_t segment_bytes;
+
+		// Log bytes between index entries
+		uint64_t index_interval_bytes;
+
+		// Records are grouped into batches of about this size
+		size_t batch_bytes;
+	};
+
+	/**
+	 * Record batch in message format v2 under construction
+	 */
+	class batch_builder
+	{
+	public:
+		// Size of the batch header preceding the records
+		static const size_t HEADER_SIZE = 61;
+
+		batch_builder():
+			m_records(),
+			m_count(0),
+			m_base_offset(0),
+			m_last_offset(0),
+			m_first_timestamp(0),
+			m_max_timestamp(-1)
+		{
+
+		}
+
+		/**
+		 * Append a record - a NULL key or value is written as null, a null
+		 * value being a tombstone
+		 */
+		void add(int64_t offset, int64_t timestamp, const std::string* key, const std::string* value)
+		{
+			if (m_count == 0)
+			{
+				m_base_offset = offset;
+				m_first_timestamp = timestamp;
+				m_max_timestamp = timestamp;
+			}
+
+			std::string record;
+			record.push_back('\0');  // Attributes
+			put_varint(record, timestamp - m_first_timestamp);
+			put_varint(record, offset - m_base_offset);
+			put_bytes(record, key);
+			put_bytes(record, value);
+			put_varint(record, 0);  // Headers
+
+			put_varint(m_records, static_cast<int64_t>(record.size()));
+			m_records.append(record);
+
+			m_last_offset = offset;
+			m_max_timestamp = std::max(m_max_timestamp, timestamp);
+			++m_count;
+		}
+
+		/**
+		 * Write the complete batch to out
+		 */
+		void build(std::string& out) const
+		{
+			out.clear();
+			out.reserve(HEADER_SIZE + m_records.size());
+			put_int<int64_t>(out, m_base_offset);
+			put_int<int32_t>(out, static_cast<int32_t>(HEADER_SIZE - 12 + m_records.size()));
+			put_int<int32_t>(out, -1);  // Partition leader epoch
+			put_int<int8_t>(out, 2);    // Magic
+			put_int<uint32_t>(out, 0);  // CRC, filled in below
+			put_int<int16_t>(out, 0);   // Attributes: no compression, create time
+			put_int<int32_t>(out, static_cast<int32_t>(m_last_offset - m_base_offset));
+			put_int<int64_t>(out, m_first_timestamp);
+			put_int<int64_t>(out, m_max_timestamp);
+			put_int<int64_t>(out, -1);  // Producer ID
+			put_int<int16_t>(out, -1);  // Producer epoch
+			put_int<int32_t>(out, -1);  // Base sequence
+			put_int<int32_t>(out, static_cast<int32_t>(m_count));
+			out.append(m_records);
+
+			// The CRC-32C covers everything from the attributes on
+			uint8_t crc[4];
+			util::write_type<uint32_t>(util::crc32c(out.data() + 21, out.size() - 21), crc);
+			out.replace(17, 4, reinterpret_cast<const char*>(crc), 4);
+		}
+
+		/**
+		 * Size of the batch once built
+		 */
+		size_t size() const
+		{
+			return HEADER_SIZE + m_records.size();
+		}
+
+		size_t count() const
+		{
+			return m_count;
+		}
+
+		int64_t base_offset() const
+		{
+			return m_base_offset;
+		}
+
+		int64_t last_offset() const
+		{
+			return m_last_offset;
+		}
+
+		int64_t max_timestamp() const
+		{
+			return m_max_timestamp;
+		}
+
+		void clear()
+		{
+			m_records.clear();
+			m_count = 0;
+			m_base_offset = 0;
+			m_last_offset = 0;
+			m_first_timestamp = 0;
+			m_max_timestamp = -1;
+		}
+
+	private:
+		template <typename T>
+		static void put_int(std::string& out, T val)
+		{
+			uint8_t raw[sizeof(T)];
+			util::write_type<T>(val, raw);
+			out.append(reinterpret_cast<const char*>(raw), sizeof(raw));
+		}
+
+		/**
+		 * Append a zigzag encoded variable length integer
+		 */
+		static void put_varint(std::string& out, int64_t val)
+		{
+			uint64_t zigzag = (static_cast<uint64_t>(val) << 1) ^ static_cast<uint64_t>(val >> 63);
+			while (zigzag >= 0x80)
+			{
+				out.push_back(static_cast<char>((zigzag & 0x7F) | 0x80));
+				zigzag >>= 7;
+			}
+			out.push_back(static_cast<char>(zigzag));
+		}
+
+		static void put_bytes(std::string& out, const std::string* bytes)
+		{
+			if (bytes == NULL)
+			{
+				put_varint(out, -1);
+				return;
+			}
+			put_varint(out, static_cast<int64_t>(bytes->size()));
+			out.append(*bytes);
+		}
+
+		std::string m_records;
+		size_t m_count;
+		int64_t m_base_offset;
+		int64_t m_last_offset;
+		int64_t m_first_timestamp;
+		int64_t m_max_timestamp;
+	};
+
+	/**
+	 * Name of a segment file - the base offset zero padded to 20 digits
+	 */
+	inline std::string file_name(int64_t base_offset, const char* suffix)
+	{
+		std::ostringstream name;
+		name << std::setw(20) << std::setfill('0') << base_offset << suffix;
+		return name.str();
+	}
+
+	/**
+	 * Create a directory unless it exists - returns false on failure
+	 */
+	inline bool make_dir(const std::string& path)
+	{
+		return (mkdir(path.c_str(), 0755) == 0) || (errno == EEXIST);
+	}
+
+	/**
+	 * Writer of the log and index files of one segment
+	 *
+	 * All files are written sequentially through 64 KiB buffers, so the
+	 * writer is too large for the stack.
+	 */
+	class segment_writer
+	{
+	public:
+		segment_writer(const std::string& dir, int64_t base_offset, uint64_t index_interval_bytes):
+			m_base_offset(base_offset),
+			m_log(dir + "/" + file_name(base_offset, ".log")),
+			m_index(dir + "/" + file_name(base_offset, ".index")),
+			m_time_index(dir + "/" + file_name(base_offset, ".timeindex")),
+			m_interval(index_interval_bytes),
+			m_position(0),
+			m_since_index(0),
+			m_max_timestamp(-1),
+			m_offset_of_max(base_offset),
+			m_last_time_entry(-1)
+		{
+
+		}
+
+		/**
+		 * Append a built batch and index it if the interval passed
+		 */
+		void append(const batch_builder& batch, const std::string& bytes)
+		{
+			if (batch.max_timestamp() > m_max_timestamp)
+			{
+				m_max_timestamp = batch.max_timestamp();
+				m_offset_of_max = batch.last_offset();
+			}
+
+			if (m_since_index > m_interval)
+			{
+				m_index.write_int<int32_t>(relative(batch.last_offset()));
+				m_index.write_int<int32_t>(static_cast<int32_t>(m_position));
+				append_time_entry();
+				m_since_index = 0;
+			}
+
+			m_log.write(bytes.data(), bytes.size());
+			m_position += bytes.size();
+			m_since_index += bytes.size();
+		}
+
+		/**
+		 * Whether a record at offset can be stored in the segment - relative
+		 * offsets are int32
+		 */
+		bool covers(int64_t offset) const
+		{
+			return (offset - m_base_offset) <= static_cast<int64_t>(0x7FFFFFFF);
+		}
+
+		/**
+		 * Size of the .log file
+		 */
+		uint64_t size() const
+		{
+			return m_position;
+		}
+
+		/**
+		 * Write the final time index entry and close the files - returns
+		 * false if any write failed
+		 */
+		bool close()
+		{
+			append_time_entry();
+			bool ok = m_log.close();
+			ok = m_index.close() && ok;
+			return m_time_index.close() && ok;
+		}
+
+	private:
+		int32_t relative(int64_t offset) const
+		{
+			return static_cast<int32_t>(offset - m_base_offset);
+		}
+
+		/**
+		 * Time index entries only grow, so the largest timestamp so far is
+		 * only indexed when it changed
+		 */
+		void append_time_entry()
+		{
+			if (m_max_timestamp > m_last_time_entry)
+			{
+				m_time_index.write_int<int64_t>(m_max_timestamp);
+				m_time_index.write_int<int32_t>(relative(m_offset_of_max));
+				m_last_time_entry = m_max_timestamp;
+			}
+		}
+
+		int64_t m_base_offset;
+		snapshot::file_writer m_log;
+		snapshot::file_writer m_index;
+		snapshot::file_writer m_time_index;
+		uint64_t m_interval;
+		uint64_t m_position;
+		uint64_t m_since_index;
+
+		// Largest timestamp in the segment and the last offset of its batch
+		int64_t m_max_timestamp;
+		int64_t m_offset_of_max;
+		int64_t m_last_time_entry;
+
+		segment_writer(const segment_writer&);
+		segment_writer& operator=(const segment_writer&);
+	};
+
+	/**
+	 * Write the retained messages of the partition as segments to the
+	 * directory, which is created if missing - returns false if a file
+	 * cannot be written
+	 *
+	 * An empty partition gets an empty segment at its next offset like an
+	 * empty log on a broker.
+	 */
+	inline bool export_partition(const partition& part, const std::string& dir, const options& opts = options())
+	{
+		if (!make_dir(dir))
+		{
+			return false;
+		}
+
+		const record_log& data = part.data();
+		const compacted_view* compacted = part.compaction_enabled() ? &part.compacted() : NULL;
+
+		bool ok = true;
+		segment_writer* segment = NULL;
+		batch_builder batch;
+		std::string bytes;
+		size_t pos = 0;
+		while (ok && (pos < data.size()))
+		{
+			// Gather records until the batch is full
+			batch.clear();
+			for (; (pos < data.size()) && (batch.size() < opts.batch_bytes); ++pos)
+			{
+				int64_t offset = part.log_start_offset() + static_cast<int64_t>(pos);
+				if ((compacted != NULL) && !compacted->is_latest(offset))
+				{
+					continue;
+				}
+				if ((batch.count() > 0) && ((offset - batch.base_offset()) > static_cast<int64_t>(0x7FFFFFFF)))
+				{
+					break;
+				}
+
+				const key_value_pair& msg = data[pos];
+				bool null_value = msg.null_value() || ((compacted != NULL) && compacted->is_tombstone(offset));
+				batch.add(offset, msg.timestamp(), msg.null_key() ? NULL : &msg.key(), null_value ? NULL : &msg.value());
+			}
+			if (batch.count() == 0)
+			{
+				break;
+			}
+
+			// Roll a new segment when the batch does not fit
+			if ((segment != NULL) && ((segment->size() + batch.size() > opts.segment_bytes) ||
+			                          !segment->covers(batch.last_offset())))
+			{
+				ok = segment->close();
+				delete segment;
+				segment = NULL;
+			}
+			if (segment == NULL)
+			{
+				segment = new segment_writer(dir, batch.base_offset(), opts.index_interval_bytes);
+			}
+
+			batch.build(bytes);
+			segment->append(batch, bytes);
+		}
+
+		if (segment == NULL)
+		{
+			int64_t base = data.empty() ? part.next_offset() : part.log_start_offset();
+			segment = new segment_writer(dir, base, opts.index_interval_bytes);
+		}
+		ok = segment->close() && ok;
+		delete segment;
+		return ok;
+	}
+
+	/**
+	 * Write all partitions of the topic to <log_dir>/<topic>-<partition>
+	 */
+	inline bool export_topic(const topic& top, const std::string& log_dir, const options& opts = options())
+	{
+		if (!make_dir(log_dir))
+		{
+			return false;
+		}
+
+		bool ok = true;
+		const std::vector<partition>& partitions = top.partitions();
+		for (size_t i=0; ok && (i<partitions.size()); ++i)
+		{
+			std::ostringstream dir;
+			dir << log_dir << "/" << top.name() << "-" << partitions[i].id();
+			ok = export_partition(partitions[i], dir.str(), opts);
+		}
+		return ok;
+	}
+
+	/**
+	 * Write all topics of the stub to the log directory like a broker with
+	 * log.dirs set to it
+	 */
+	inline bool export_stub(const broker_stub& stub, const std::string& log_dir, const options& opts = options())
+	{
+		bool ok = make_dir(log_dir);
+		const std::vector<topic>& topics = stub.get_topic_registry().topics();
+		for (size_t i=0; ok && (i<topics.size()); ++i)
+		{
+			ok = export_topic(topics[i], log_dir, opts);
+		}
+		return ok;
+	}
+
+}}
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef KAFKA_BROKER_STUB_SERVER_HPP_INC_
+#define KAFKA_BROKER_STUB_SERVER_HPP_INC_
+
+/*
+ * Serve a broker stub over TCP.
+ *
+ * open_transport() picks io_uring when it is compiled in and the kernel
+ * supports it and falls back to epoll otherwise.
+ */
+
+#include "transport.hpp"
+#include "uring.hpp"
+
+namespace kafka_broker_stub { namespace transport {
+
+	enum backend
+	{
+		BACKEND_AUTO = 0,
+		BACKEND_EPOLL,
+		BACKEND_IO_URING
+	};
+
+	/**
+	 * Make a transport for the stub listening on host and port (0 picks a
+	 * free port) - returns NULL if the requested backend is unavailable or
+	 * the address cannot be bound. The caller owns the transport.
+	 */
+	inline transportI* open_transport(broker_stub& stub, const char* host, int32_t port,
+	                                  backend which = BACKEND_AUTO)
+	{
+#ifdef KAFKA_BROKER_STUB_HAS_IO_URING
+		if (which != BACKEND_EPOLL)
+		{
+			uring_transport* uring = new uring_transport(stub);
+			if (uring->listen(host, port))
+				return uring;
+
+			delete uring;
+			if (which == BACKEND_IO_URING)
+				return NULL;
+			KAFKA_BROKER_STUB_LOG(stub.get_logger(), log::LEVEL_INFO, log::MSG_GENERIC)(stub.node_id(),
+				"io_uring unavailable - falling back to epoll");
+		}
+#else
+		if (which == BACKEND_IO_URING)
+			return NULL;
+#endif
+
+		epoll_transport* epoll = new epoll_transport(stub);
+		if (epoll->listen(host, port))
+			return epoll;
+
+		delete epoll;
+		return NULL;
+	}
+
+}}
+
+#endif
@@ -0,0 +1,350 @@
+#ifndef KAFKA_BROKER_STUB_SHAPING_HPP_INC_
+#define KAFKA_BROKER_STUB_SHAPING_HPP_INC_
+
+/*
+ * Network shaping for the connections of the transports.
+ *
+ * On loopback requests and responses arrive in microseconds. To see how
+ * clients behave on slower networks the transports can shape each
+ * connection like a link with a limited bandwidth, a latency and jitter in
+ * both directions. Received bytes are handed to the broker stub and
+ * responses are sent only once they would have crossed such a link. Bytes
+ * are never reordered, as on a TCP connection.
+ *
+ * Profiles are set on the network_shaper of the broker stub for all
+ * connections or per client ID and can be changed at any time.
+ */
+
+#include "util.hpp"
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <pthread.h>
+#include <stdexcept>
+#include <string>
+
+namespace kafka_broker_stub {
+
+	enum jitter_distribution
+	{
+		// Uniform between -jitter and +jitter
+		JITTER_UNIFORM = 0,
+
+		// Normal with a standard deviation of jitter
+		JITTER_NORMAL,
+
+		// Heavy tailed (Pareto with shape 3) only adding delay, on average jitter
+		JITTER_PARETO
+	};
+
+	/**
+	 * Properties of the link between a client and the broker, applied to
+	 * each direction on its own
+	 */
+	struct link_profile
+	{
+		link_profile():
+			bytes_per_sec(0),
+			latency_us(0),
+			jitter_us(0),
+			distribution(JITTER_UNIFORM)
+		{
+
+		}
+
+		/**
+		 * True if the profile changes anything
+		 */
+		bool active() const
+		{
+			return (bytes_per_sec > 0) || (latency_us > 0) || (jitter_us > 0);
+		}
+
+		// Bandwidth - 0 means unlimited
+		uint64_t bytes_per_sec;
+
+		// One way delay, so the round trip time is twice the latency
+		uint32_t latency_us;
+
+		// Variation of the delay (never below 0)
+		uint32_t jitter_us;
+		jitter_distribution distribution;
+	};
+
+	/**
+	 * Link profiles of all connections, shared by the transports
+	 */
+	class network_shaper
+	{
+	public:
+		network_shaper():
+			m_mutex(),
+			m_default(),
+			m_clients(),
+			m_generation(0),
+			m_active(0),
+			m_seed(1)
+		{
+			if (pthread_mutex_init(&m_mutex, NULL) != 0)
+				throw std::runtime_error("Unable to initialize network shaper");
+		}
+
+		~network_shaper()
+		{
+			pthread_mutex_destroy(&m_mutex);
+		}
+
+		/**
+		 * Set the profile of connections without a client profile
+		 */
+		void set_default_profile(const link_profile& profile)
+		{
+			pthread_mutex_lock(&m_mutex);
+			m_default = profile;
+			changed();
+			pthread_mutex_unlock(&m_mutex);
+		}
+
+		/**
+		 * Set the profile of connections of a client ID - taken from the
+		 * header of the first request of a connection
+		 */
+		void set_client_profile(const std::string& client_id, const link_profile& profile)
+		{
+			pthread_mutex_lock(&m_mutex);
+			m_clients[client_id] = profile;
+			changed();
+			pthread_mutex_unlock(&m_mutex);
+		}
+
+		void remove_client_profile(const std::string& client_id)
+		{
+			pthread_mutex_lock(&m_mutex);
+			m_clients.erase(client_id);
+			changed();
+			pthread_mutex_unlock(&m_mutex);
+		}
+
+		/**
+		 * Seed the jitter of connections opened afterwards, for reproducible
+		 * runs
+		 */
+		void set_seed(uint64_t seed)
+		{
+			util::atomic_store(&m_seed, seed);
+		}
+
+		/**
+		 * Get the profile of a client ID
+		 */
+		link_profile profile(const std::string& client_id) const
+		{
+			pthread_mutex_lock(&m_mutex);
+			std::map<std::string, link_profile>::const_iterator it = m_clients.find(client_id);
+			link_profile profile = (it != m_clients.end()) ? it->second : m_default;
+			pthread_mutex_unlock(&m_mutex);
+			return profile;
+		}
+
+		/**
+		 * Incremented on each change of the profiles
+		 */
+		unsigned generation() const
+		{
+			return util::atomic_load(&m_generation);
+		}
+
+		/**
+		 * True if any profile is active
+		 */
+		bool active() const
+		{
+			return util::atomic_load(&m_active) != 0;
+		}
+
+		/**
+		 * Get a seed for the jitter of a new connection
+		 */
+		uint64_t next_seed()
+		{
+			return util::atomic_fetch_add(&m_seed, (static_cast<uint64_t>(0x9e3779b9) << 32) | 0x7f4a7c15);
+		}
+
+	private:
+		void changed()
+		{
+			int active = m_default.active() ? 1 : 0;
+			for (std::map<std::string, link_profile>::const_iterator it = m_clients.begin();
+			     (it != m_clients.end()) && (active == 0); ++it)
+			{
+				if (it->second.active())
+					active = 1;
+			}
+			util::atomic_store(&m_active, active);
+			util::atomic_fetch_add(&m_generation, 1u);
+		}
+
+		network_shaper(const network_shaper&);
+		network_shaper& operator=(const network_shaper&);
+
+		mutable pthread_mutex_t m_mutex;
+		link_profile m_default;
+		std::map<std::string, link_profile> m_clients;
+		volatile unsigned m_generation;
+		volatile int m_active;
+		volatile uint64_t m_seed;
+	};
+
+	enum link_direction
+	{
+		// From the client to the broker
+		LINK_IN = 0,
+
+		// From the broker to the client
+		LINK_OUT,
+		LINK_DIRECTION_COUNT
+	};
+
+	/**
+	 * Link state of one connection, used from the thread of its transport
+	 *
+	 * Each direction is modelled as a queue of bytes that leave the sender
+	 * at the bandwidth and then take the latency plus jitter to arrive.
+	 * Arrival times never go backwards, so later bytes are not delivered
+	 * before earlier ones even if they drew less jitter.
+	 */
+	class link_shaper
+	{
+	public:
+		explicit link_shaper(network_shaper& shaper):
+			m_shaper(shaper),
+			m_client_id(),
+			m_profile(),
+			m_generation(shaper.generation() - 1),
+			m_rng(shaper.next_seed() | 1),
+			m_free_at(),
+			m_last_due()
+		{
+
+		}
+
+		/**
+		 * Use the profile of a client ID from now on
+		 */
+		void identify(const std::string& client_id)
+		{
+			m_client_id = client_id;
+			m_generation = m_shaper.generation() - 1;
+		}
+
+		/**
+		 * True if the link delays anything - picks up profile changes
+		 */
+		bool active()
+		{
+			if (!m_shaper.active())
+				return m_profile.active() && refresh();
+			return refresh();
+		}
+
+		/**
+		 * Get the time at which bytes sent in a direction at now_ns arrive
+		 */
+		uint64_t schedule(link_direction dir, size_t bytes, uint64_t now_ns)
+		{
+			refresh();
+			uint64_t sent = now_ns;
+			if (m_profile.bytes_per_sec > 0)
+			{
+				// Bytes queue behind those still being sent
+				sent = std::max(m_free_at[dir], now_ns) + transmit_ns(bytes);
+				m_free_at[dir] = sent;
+			}
+
+			uint64_t due = std::max(sent + delay_ns(), m_last_due[dir]);
+			m_last_due[dir] = due;
+			return due;
+		}
+
+		const link_profile& profile() const
+		{
+			return m_profile;
+		}
+
+	private:
+		/**
+		 * Reload the profile if it changed - returns true if it is active
+		 */
+		bool refresh()
+		{
+			unsigned generation = m_shaper.generation();
+			if (generation != m_generation)
+			{
+				m_profile = m_shaper.profile(m_client_id);
+				m_generation = generation;
+			}
+			return m_profile.active();
+		}
+
+		uint64_t transmit_ns(size_t bytes) const
+		{
+			uint64_t rate = m_profile.bytes_per_sec;
+			return (bytes / rate) * 1000000000 + ((bytes % rate) * 1000000000) / rate;
+		}
+
+		uint64_t delay_ns()
+		{
+			double delay = static_cast<double>(m_profile.latency_us);
+			double jitter = static_cast<double>(m_profile.jitter_us);
+			if (jitter > 0)
+			{
+				switch (m_profile.distribution)
+				{
+					case JITTER_NORMAL:
+					{
+						// Box-Muller transform
+						double u1 = 1.0 - uniform();
+						double u2 = uniform();
+						delay += jitter * std::sqrt(-2.0 * std::log(u1)) * std::cos(6.283185307179586 * u2);
+						break;
+					}
+					case JITTER_PARETO:
+						// Lomax distribution with shape 3 and mean jitter
+						delay += 2.0 * jitter * (std::pow(1.0 - uniform(), -1.0 / 3.0) - 1.0);
+						break;
+					case JITTER_UNIFORM:
+					default:
+						delay += jitter * (2.0 * uniform() - 1.0);
+						break;
+				}
+			}
+			return (delay > 0) ? static_cast<uint64_t>(delay * 1000.0) : 0;
+		}
+
+		/**
+		 * Uniform random number in [0, 1) from a xorshift64* generator
+		 */
+		double uniform()
+		{
+			m_rng ^= m_rng >> 12;
+			m_rng ^= m_rng << 25;
+			m_rng ^= m_rng >> 27;
+			uint64_t value = m_rng * ((static_cast<uint64_t>(0x2545f491) << 32) | 0x4f6cdd1d);
+			return static_cast<double>(value >> 11) / 9007199254740992.0;
+		}
+
+		link_shaper(const link_shaper&);
+		link_shaper& operator=(const link_shaper&);
+
+		network_shaper& m_shaper;
+		std::string m_client_id;
+		link_profile m_profile;
+		unsigned m_generation;
+		uint64_t m_rng;
+		uint64_t m_free_at[LINK_DIRECTION_COUNT];
+		uint64_t m_last_due[LINK_DIRECTION_COUNT];
+	};
+
+}
+
+#endif
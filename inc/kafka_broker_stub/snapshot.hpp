@@ -0,0 +1,455 @@
+#ifndef KAFKA_BROKER_STUB_SNAPSHOT_HPP_INC_
+#define KAFKA_BROKER_STUB_SNAPSHOT_HPP_INC_
+
+/*
+ * Binary snapshots of the state of a broker stub.
+ *
+ * All integers are stored in network byte order. The layout is
+ *
+ *   magic "KBSS", int32 version
+ *   int32 broker count, per broker: int32 id, int16 length + host, int32 port
+ *   int32 topic count, per topic:
+ *     int16 length + name, int32 partition count, per partition:
+ *       int32 id, int32 leader, int32 count + replica ids, int32 count + isr ids,
+ *       int64 max bytes, int64 max messages, int64 max age (retention),
+ *       int64 log start offset, uint8 mode (MODE_* flags),
+ *       int32 producer batch count, per batch: int64 producer id, int16 epoch,
+ *         int32 first sequence, int32 last sequence, int64 offset,
+ *       int64 record count, int64 record bytes, records
+ *
+ * where each record is an int64 timestamp, an uint8 of LAZY_* flags, an
+ * uint32 length + key and an uint32 length + value. Restoring maps the file
+ * and lets partitions decode their records on first access, so only
+ * partitions that are actually used are materialized. The key index and the
+ * compacted view are rebuilt as the records are decoded.
+ */
+
+#include "main.hpp"
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+namespace kafka_broker_stub { namespace snapshot {
+
+	const uint8_t MAGIC[4] = { 'K', 'B', 'S', 'S' };
+	const int32_t VERSION = 3;
+
+	// Partition modes
+	const uint8_t MODE_KEY_INDEX = 0x01;
+	const uint8_t MODE_COMPACTION = 0x02;
+	const uint8_t MODE_RECLAIM = 0x04;
+
+	/**
+	 * Buffered writer of big-endian integers and raw bytes to a file
+	 */
+	class file_writer
+	{
+	public:
+		explicit file_writer(const std::string& path):
+			m_file(fopen(path.c_str(), "wb")),
+			m_buf(),
+			m_used(0),
+			m_ok(m_file != NULL)
+		{
+
+		}
+
+		~file_writer()
+		{
+			close();
+		}
+
+		template <typename T>
+		void write_int(T val)
+		{
+			uint8_t raw[sizeof(T)];
+			util::write_type<T>(val, raw);
+			write(raw, sizeof(raw));
+		}
+
+		void write(const void* data, size_t size)
+		{
+			if (!m_ok)
+			{
+				return;
+			}
+
+			// Large chunks bypass the buffer
+			if (size > sizeof(m_buf) - m_used)
+			{
+				flush();
+				if (size >= sizeof(m_buf))
+				{
+					m_ok = m_ok && (fwrite(data, 1, size, m_file) == size);
+					return;
+				}
+			}
+
+			memcpy(m_buf + m_used, data, size);
+			m_used += size;
+		}
+
+		/**
+		 * Flush and close the file - returns false if any write failed
+		 */
+		bool close()
+		{
+			if (m_file != NULL)
+			{
+				flush();
+				m_ok = (fclose(m_file) == 0) && m_ok;
+				m_file = NULL;
+			}
+			return m_ok;
+		}
+
+	private:
+		void flush()
+		{
+			if (m_ok && (m_used > 0))
+			{
+				m_ok = (fwrite(m_buf, 1, m_used, m_file) == m_used);
+			}
+			m_used = 0;
+		}
+
+		file_writer(const file_writer&);
+		file_writer& operator=(const file_writer&);
+
+		FILE* m_file;
+		uint8_t m_buf[1 << 16];
+		size_t m_used;
+		bool m_ok;
+	};
+
+	/**
+	 * Bounds-checked reader of big-endian integers from a buffer
+	 */
+	class buffer_reader
+	{
+	public:
+		buffer_reader(const uint8_t* data, size_t size):
+			m_cur(data),
+			m_end(data + size),
+			m_ok(true)
+		{
+
+		}
+
+		template <typename T>
+		T read_int()
+		{
+			if (!has(sizeof(T)))
+			{
+				return 0;
+			}
+
+			T val = util::read_type<T>(m_cur);
+			m_cur += sizeof(T);
+			return val;
+		}
+
+		/**
+		 * Skip bytes and return pointer to the first one - NULL if exceeding
+		 */
+		const uint8_t* skip(size_t size)
+		{
+			if (!has(size))
+			{
+				return NULL;
+			}
+
+			const uint8_t* start = m_cur;
+			m_cur += size;
+			return start;
+		}
+
+		std::string read_string()
+		{
+			int16_t length = read_int<int16_t>();
+			const uint8_t* data = skip(length > 0 ? static_cast<size_t>(length) : 0);
+			if (data == NULL)
+			{
+				return std::string();
+			}
+			return std::string(reinterpret_cast<const char*>(data), length > 0 ? static_cast<size_t>(length) : 0);
+		}
+
+		std::vector<int32_t> read_ids()
+		{
+			std::vector<int32_t> ids;
+			int32_t count = read_int<int32_t>();
+			if ((count < 0) || !has(static_cast<size_t>(count) * 4))
+			{
+				m_ok = false;
+				return ids;
+			}
+
+			ids.reserve(static_cast<size_t>(count));
+			for (int32_t i=0; i<count; ++i)
+			{
+				ids.push_back(read_int<int32_t>());
+			}
+			return ids;
+		}
+
+		bool ok() const
+		{
+			return m_ok;
+		}
+
+	private:
+		bool has(size_t size)
+		{
+			if (m_ok && (static_cast<size_t>(m_end - m_cur) >= size))
+			{
+				return true;
+			}
+
+			m_ok = false;
+			return false;
+		}
+
+		const uint8_t* m_cur;
+		const uint8_t* m_end;
+		bool m_ok;
+	};
+
+	inline void write_string(file_writer& out, const std::string& str)
+	{
+		out.write_int<int16_t>(static_cast<int16_t>(str.size()));
+		out.write(str.data(), str.size());
+	}
+
+	inline void write_ids(file_writer& out, const std::vector<int32_t>& ids)
+	{
+		out.write_int<int32_t>(static_cast<int32_t>(ids.size()));
+		for (size_t i=0; i<ids.size(); ++i)
+		{
+			out.write_int<int32_t>(ids[i]);
+		}
+	}
+
+	/**
+	 * Save brokers, topics, partitions and stored records of the stub to a
+	 * file - returns false if the file cannot be written
+	 */
+	inline bool save(const broker_stub& stub, const std::string& path)
+	{
+		file_writer out(path);
+		out.write(MAGIC, sizeof(MAGIC));
+		out.write_int<int32_t>(VERSION);
+
+		const primitive::array<metadata::broker>& brokers = stub.brokers();
+		out.write_int<int32_t>(static_cast<int32_t>(brokers.size()));
+		for (size_t i=0; i<brokers.size(); ++i)
+		{
+			out.write_int<int32_t>(brokers[i].node_id());
+			write_string(out, brokers[i].host().std_str());
+			out.write_int<int32_t>(brokers[i].port());
+		}
+
+		const std::vector<topic>& topics = stub.get_topic_registry().topics();
+		out.write_int<int32_t>(static_cast<int32_t>(topics.size()));
+		for (size_t i=0; i<topics.size(); ++i)
+		{
+			write_string(out, topics[i].name());
+
+			const std::vector<partition>& partitions = topics[i].partitions();
+			out.write_int<int32_t>(static_cast<int32_t>(partitions.size()));
+			for (size_t k=0; k<partitions.size(); ++k)
+			{
+				const partition& part = partitions[k];
+				out.write_int<int32_t>(part.id());
+				out.write_int<int32_t>(part.leader());
+				write_ids(out, part.replicas());
+				write_ids(out, part.isr());
+				out.write_int<int64_t>(static_cast<int64_t>(part.retention().max_bytes));
+				out.write_int<int64_t>(static_cast<int64_t>(part.retention().max_messages));
+				out.write_int<int64_t>(part.retention().max_age_ms);
+				out.write_int<int64_t>(part.log_start_offset());
+
+				uint8_t mode = 0;
+				mode |= part.key_index_enabled() ? MODE_KEY_INDEX : 0;
+				mode |= part.compaction_enabled() ? MODE_COMPACTION : 0;
+				mode |= part.reclaim_enabled() ? MODE_RECLAIM : 0;
+				out.write_int<uint8_t>(mode);
+
+				std::vector<producer_table::entry> producers;
+				part.producers().entries(producers);
+				out.write_int<int32_t>(static_cast<int32_t>(producers.size()));
+				for (size_t p=0; p<producers.size(); ++p)
+				{
+					out.write_int<int64_t>(producers[p].producer_id);
+					out.write_int<int16_t>(producers[p].epoch);
+					out.write_int<int32_t>(producers[p].first_seq);
+					out.write_int<int32_t>(producers[p].last_seq);
+					out.write_int<int64_t>(producers[p].offset);
+				}
+
+				// Size of the records so restoring can skip them without decoding
+				const record_log& data = part.data();
+				const compacted_view& compacted = part.compacted();
+				uint64_t bytes = 17 * data.size() + part.size_bytes();
+
+				out.write_int<int64_t>(static_cast<int64_t>(data.size()));
+				out.write_int<int64_t>(static_cast<int64_t>(bytes));
+				for (size_t r=0; r<data.size(); ++r)
+				{
+					int64_t offset = part.log_start_offset() + static_cast<int64_t>(r);
+					uint8_t flags = data[r].null_key() ? LAZY_NULL_KEY : 0;
+					flags |= data[r].null_value() ? LAZY_NULL_VALUE : 0;
+					if (part.compaction_enabled())
+					{
+						flags |= compacted.is_tombstone(offset) ? LAZY_TOMBSTONE : 0;
+						flags |= (part.reclaim_enabled() && !compacted.is_latest(offset)) ? LAZY_RECLAIMED : 0;
+					}
+
+					out.write_int<int64_t>(data[r].timestamp());
+					out.write_int<uint8_t>(flags);
+					out.write_int<uint32_t>(static_cast<uint32_t>(data[r].key().size()));
+					out.write(data[r].key().data(), data[r].key().size());
+					out.write_int<uint32_t>(static_cast<uint32_t>(data[r].value().size()));
+					out.write(data[r].value().data(), data[r].value().size());
+				}
+			}
+		}
+
+		return out.close();
+	}
+
+	/**
+	 * Restore a snapshot into the stub
+	 *
+	 * The brokers of the snapshot other than the stub itself are added as
+	 * broker references and the topics are added to the registry of the stub.
+	 * Records are decoded lazily from the mapped file. Returns false, leaving
+	 * the stub untouched, if the file is invalid or a topic already exists.
+	 */
+	inline bool restore(broker_stub& stub, const std::string& path)
+	{
+		util::mapped_file* file = new util::mapped_file();
+		if (!file->open(path.c_str()) || (file->size() < 8) ||
+		    (memcmp(file->data(), MAGIC, sizeof(MAGIC)) != 0))
+		{
+			delete file;
+			return false;
+		}
+
+		buffer_reader in(file->data() + sizeof(MAGIC), file->size() - sizeof(MAGIC));
+		if (in.read_int<int32_t>() != VERSION)
+		{
+			delete file;
+			return false;
+		}
+
+		// Parse everything before touching the stub
+		std::vector<metadata::broker> brokers;
+		int32_t num_brokers = in.read_int<int32_t>();
+		for (int32_t i=0; in.ok() && (i<num_brokers); ++i)
+		{
+			int32_t id = in.read_int<int32_t>();
+			std::string host = in.read_string();
+			int32_t port = in.read_int<int32_t>();
+			brokers.push_back(metadata::broker(id, host.c_str(), port));
+		}
+
+		std::vector<std::string> names;
+		std::vector<std::vector<partition> > topics;
+		int32_t num_topics = in.read_int<int32_t>();
+		for (int32_t i=0; in.ok() && (i<num_topics); ++i)
+		{
+			names.push_back(in.read_string());
+			if (stub.get_topic(names.back()) != NULL)
+			{
+				delete file;
+				return false;
+			}
+
+			topics.push_back(std::vector<partition>());
+			std::vector<partition>& partitions = topics.back();
+			int32_t num_partitions = in.read_int<int32_t>();
+			for (int32_t k=0; in.ok() && (k<num_partitions); ++k)
+			{
+				int32_t id = in.read_int<int32_t>();
+				int32_t leader = in.read_int<int32_t>();
+				std::vector<int32_t> replicas = in.read_ids();
+				std::vector<int32_t> isr = in.read_ids();
+				retention_policy policy;
+				policy.max_bytes = static_cast<uint64_t>(in.read_int<int64_t>());
+				policy.max_messages = static_cast<uint64_t>(in.read_int<int64_t>());
+				policy.max_age_ms = in.read_int<int64_t>();
+				int64_t log_start = in.read_int<int64_t>();
+				uint8_t mode = in.read_int<uint8_t>();
+
+				producer_table producers;
+				int32_t num_batches = in.read_int<int32_t>();
+				for (int32_t p=0; in.ok() && (p<num_batches); ++p)
+				{
+					int64_t producer_id = in.read_int<int64_t>();
+					int16_t epoch = in.read_int<int16_t>();
+					int32_t first_seq = in.read_int<int32_t>();
+					int32_t last_seq = in.read_int<int32_t>();
+					int64_t offset = in.read_int<int64_t>();
+					if (in.ok())
+					{
+						producers.add(producer_id, epoch, first_seq, last_seq, offset);
+					}
+				}
+
+				int64_t count = in.read_int<int64_t>();
+				int64_t bytes = in.read_int<int64_t>();
+				if ((count < 0) || (bytes < 0) || (log_start < 0))
+				{
+					delete file;
+					return false;
+				}
+
+				const uint8_t* records = in.skip(static_cast<size_t>(bytes));
+				partitions.push_back(partition(id, leader, replicas));
+				partition& part = partitions.back();
+				part.set_isr(isr);
+				part.set_retention(policy);
+
+				// Enabled while still empty so decoding the records rebuilds them
+				if ((mode & MODE_KEY_INDEX) != 0)
+				{
+					part.enable_key_index();
+				}
+				if ((mode & MODE_COMPACTION) != 0)
+				{
+					part.enable_compaction((mode & MODE_RECLAIM) != 0);
+				}
+				part.set_lazy_data(records, static_cast<size_t>(bytes), static_cast<size_t>(count), log_start);
+				part.set_producers(producers);
+			}
+		}
+
+		if (!in.ok())
+		{
+			delete file;
+			return false;
+		}
+
+		for (size_t i=0; i<brokers.size(); ++i)
+		{
+			if (brokers[i].node_id() != stub.node_id())
+			{
+				stub.add_broker_reference(brokers[i].node_id(), brokers[i].host().c_str(), brokers[i].port());
+			}
+		}
+
+		topic_registry& registry = stub.get_topic_registry();
+		registry.reserve(names.size());
+		for (size_t i=0; i<names.size(); ++i)
+		{
+			registry.adopt(names[i], topics[i]);
+		}
+
+		stub.get_topic_registry().add_mapping(file);
+		return true;
+	}
+
+}}
+
+#endif
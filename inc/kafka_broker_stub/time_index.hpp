@@ -0,0 +1,134 @@
+#ifndef KAFKA_BROKER_STUB_TIME_INDEX_HPP_INC_
+#define KAFKA_BROKER_STUB_TIME_INDEX_HPP_INC_
+
+/*
+ * Sparse index from message timestamps to offsets.
+ */
+
+#include "util.hpp"
+#include <algorithm>
+#include <deque>
+
+namespace kafka_broker_stub {
+
+	/**
+	 * Sparse time index of a partition like the .timeindex files of Kafka
+	 *
+	 * Every interval messages an entry with the largest timestamp appended so
+	 * far and the offset of the first message with it is added, if the
+	 * largest timestamp grew since the last entry. Entries are thus ascending
+	 * in both timestamp and offset, and all messages before the offset of an
+	 * entry have smaller timestamps. A lookup finds the entry to start
+	 * scanning from with a binary search, so only up to interval messages are
+	 * scanned when timestamps increase with the offsets. Entries are removed
+	 * from the front as messages are evicted.
+	 */
+	class time_index
+	{
+	public:
+		explicit time_index(size_t interval = 64):
+			m_entries(),
+			m_interval(interval > 0 ? interval : 1),
+			m_max_timestamp(-1),
+			m_max_offset(-1),
+			m_pending(0)
+		{
+
+		}
+
+		/**
+		 * Account an appended message. Offsets must be added in increasing order.
+		 */
+		void add(int64_t timestamp, int64_t offset)
+		{
+			if ((m_max_offset < 0) || (timestamp > m_max_timestamp))
+			{
+				m_max_timestamp = timestamp;
+				m_max_offset = offset;
+			}
+
+			if ((++m_pending >= m_interval) &&
+			    (m_entries.empty() || (m_max_timestamp > m_entries.back().timestamp)))
+			{
+				m_entries.push_back(entry(m_max_timestamp, m_max_offset));
+				m_pending = 0;
+			}
+		}
+
+		/**
+		 * Get the offset to scan from for the first message with a timestamp at
+		 * or after the given one - returns -1 to scan from the first message
+		 */
+		int64_t lookup(int64_t timestamp) const
+		{
+			// Last entry with a timestamp at or before the given one
+			std::deque<entry>::const_iterator it = std::upper_bound(m_entries.begin(), m_entries.end(),
+			                                                        timestamp, before);
+			return (it == m_entries.begin()) ? -1 : (it - 1)->offset;
+		}
+
+		/**
+		 * Drop entries of offsets before the log start offset
+		 */
+		void truncate_front(int64_t log_start)
+		{
+			while (!m_entries.empty() && (m_entries.front().offset < log_start))
+			{
+				m_entries.pop_front();
+			}
+		}
+
+		void clear()
+		{
+			m_entries.clear();
+			m_max_timestamp = -1;
+			m_max_offset = -1;
+			m_pending = 0;
+		}
+
+		size_t size() const
+		{
+			return m_entries.size();
+		}
+
+		/**
+		 * Largest timestamp added (-1 if none)
+		 */
+		int64_t max_timestamp() const
+		{
+			return m_max_timestamp;
+		}
+
+	private:
+		struct entry
+		{
+			entry(int64_t ts, int64_t off):
+				timestamp(ts),
+				offset(off)
+			{
+
+			}
+
+			int64_t timestamp;
+			int64_t offset;
+		};
+
+		static bool before(int64_t timestamp, const entry& e)
+		{
+			return timestamp < e.timestamp;
+		}
+
+		std::deque<entry> m_entries;
+		size_t m_interval;
+
+		// Largest timestamp so far with the offset it first appeared at
+		int64_t m_max_timestamp;
+		int64_t m_max_offset;
+
+		// Messages added since the last entry
+		size_t m_pending;
+	};
+
+}
+
+#endif
@@ -0,0 +1,206 @@
+#ifndef KAFKA_BROKER_STUB_TIMER_WHEEL_HPP_INC_
+#define KAFKA_BROKER_STUB_TIMER_WHEEL_HPP_INC_
+
+/*
+ * Hashed timer wheel for the timers of the transports.
+ */
+
+#include "util.hpp"
+#include <algorithm>
+#include <vector>
+
+namespace kafka_broker_stub {
+
+	/**
+	 * Timers identified by an integer (e.g. a socket) due at monotonic times
+	 *
+	 * Timers are hashed by their tick into a fixed number of slots, so
+	 * scheduling is constant time and expiring only visits the slots of the
+	 * ticks passed since the last call. Timers further ahead than one turn of
+	 * the wheel stay in their slot until their turn comes. Owners ignore
+	 * timers they no longer need when they expire, or cancel them if the ID
+	 * is about to be reused (e.g. a closed socket).
+	 */
+	class timer_wheel
+	{
+	public:
+		/**
+		 * Make wheel with ticks of tick_ns nanoseconds and a number of slots
+		 * (rounded up to a power of 2)
+		 */
+		explicit timer_wheel(uint64_t tick_ns = 1000000, size_t slots = 256):
+			m_slots(),
+			m_mask(0),
+			m_tick_ns(tick_ns),
+			m_tick(0),
+			m_count(0)
+		{
+			size_t size = 1;
+			while (size < slots)
+			{
+				size <<= 1;
+			}
+			m_slots.resize(size);
+			m_mask = size - 1;
+		}
+
+		/**
+		 * Add a timer expiring at due_ns - timers already due expire on the
+		 * next call to expire()
+		 */
+		void schedule(int id, uint64_t due_ns)
+		{
+			uint64_t tick = std::max(m_tick, (due_ns + m_tick_ns - 1) / m_tick_ns);
+			m_slots[static_cast<size_t>(tick) & m_mask].push_back(timer(id, due_ns));
+			++m_count;
+		}
+
+		/**
+		 * Remove the timers of an ID - visits every timer, so meant for rare
+		 * events such as closing a connection
+		 */
+		void cancel(int id)
+		{
+			for (size_t i=0; (i < m_slots.size()) && (m_count > 0); ++i)
+			{
+				std::vector<timer>& slot = m_slots[i];
+				for (size_t k=0; k<slot.size();)
+				{
+					if (slot[k].id == id)
+					{
+						slot[k] = slot.back();
+						slot.pop_back();
+						--m_count;
+					}
+					else
+					{
+						++k;
+					}
+				}
+			}
+		}
+
+		bool empty() const
+		{
+			return m_count == 0;
+		}
+
+		size_t size() const
+		{
+			return m_count;
+		}
+
+		/**
+		 * Shorten a poll timeout in milliseconds (negative for none) so it ends
+		 * when the next timer is due
+		 */
+		int timeout(uint64_t now_ns, int timeout_ms) const
+		{
+			if (m_count == 0)
+				return timeout_ms;
+
+			uint64_t next = next_due();
+			int wait = (next > now_ns) ? static_cast<int>(std::min(static_cast<uint64_t>(0x7FFFFFFF),
+			                                                       (next - now_ns + 999999) / 1000000)) : 0;
+			return ((timeout_ms < 0) || (wait < timeout_ms)) ? wait : timeout_ms;
+		}
+
+		/**
+		 * Remove the timers due at now_ns and append their IDs to ids
+		 */
+		void expire(uint64_t now_ns, std::vector<int>& ids)
+		{
+			uint64_t now_tick = now_ns / m_tick_ns;
+			if (m_count > 0)
+			{
+				// Visit each slot at most once when more than a turn has passed
+				uint64_t first = m_tick;
+				if ((now_tick >= first) && (now_tick - first > m_mask))
+					first = now_tick - m_mask;
+				for (uint64_t tick = first; tick <= now_tick; ++tick)
+				{
+					expire_slot(m_slots[static_cast<size_t>(tick) & m_mask], now_ns, ids);
+				}
+			}
+			m_tick = std::max(m_tick, now_tick);
+		}
+
+	private:
+		struct timer
+		{
+			timer(int i, uint64_t due):
+				id(i),
+				due_ns(due)
+			{
+
+			}
+
+			int id;
+			uint64_t due_ns;
+		};
+
+		void expire_slot(std::vector<timer>& slot, uint64_t now_ns, std::vector<int>& ids)
+		{
+			for (size_t i=0; i<slot.size();)
+			{
+				if (slot[i].due_ns <= now_ns)
+				{
+					ids.push_back(slot[i].id);
+					slot[i] = slot.back();
+					slot.pop_back();
+					--m_count;
+				}
+				else
+				{
+					++i;
+				}
+			}
+		}
+
+		/**
+		 * Due time of the earliest timer - scans the slots of one turn and
+		 * only looks at all timers if none is due within it
+		 */
+		uint64_t next_due() const
+		{
+			for (uint64_t tick = m_tick; tick <= m_tick + m_mask; ++tick)
+			{
+				const std::vector<timer>& slot = m_slots[static_cast<size_t>(tick) & m_mask];
+				bool found = false;
+				uint64_t next = 0;
+				for (size_t i=0; i<slot.size(); ++i)
+				{
+					if ((slot[i].due_ns <= tick * m_tick_ns) && (!found || (slot[i].due_ns < next)))
+					{
+						next = slot[i].due_ns;
+						found = true;
+					}
+				}
+				if (found)
+					return next;
+			}
+
+			uint64_t next = ~static_cast<uint64_t>(0);
+			for (size_t s=0; s<m_slots.size(); ++s)
+			{
+				for (size_t i=0; i<m_slots[s].size(); ++i)
+				{
+					next = std::min(next, m_slots[s][i].due_ns);
+				}
+			}
+			return next;
+		}
+
+		std::vector<std::vector<timer> > m_slots;
+		size_t m_mask;
+		uint64_t m_tick_ns;
+
+		// Last tick expired - visited again by the next call as timers already
+		// due are added to it
+		uint64_t m_tick;
+		size_t m_count;
+	};
+
+}
+
+#endif
@@ -0,0 +1,328 @@
+#ifndef KAFKA_BROKER_STUB_TOPOLOGY_HPP_INC_
+#define KAFKA_BROKER_STUB_TOPOLOGY_HPP_INC_
+
+/*
+ * Declarative description of brokers and topics.
+ *
+ * A topology is described in a simple line-based text format
+ *
+ *   # Comment
+ *   broker <node id> <host> <port>
+ *   topic <name> <partitions> [replication factor]
+ *
+ * Partition leaders and replicas are assigned round-robin across the brokers
+ * in the order they are listed. Applying a topology to a broker stub
+ * registers all topics in one pass.
+ */
+
+#include "main.hpp"
+#include <sstream>
+#include <fstream>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace kafka_broker_stub { namespace topology {
+
+	struct broker_spec
+	{
+		broker_spec(int32_t id, const std::string& h, int32_t p):
+			node_id(id),
+			host(h),
+			port(p)
+		{
+
+		}
+
+		int32_t node_id;
+		std::string host;
+		int32_t port;
+	};
+
+	struct topic_spec
+	{
+		topic_spec(const std::string& n, int32_t parts, int32_t rf):
+			name(n),
+			partitions(parts),
+			replication_factor(rf)
+		{
+
+		}
+
+		std::string name;
+		int32_t partitions;
+		int32_t replication_factor;
+	};
+
+	/**
+	 * Statistics about applying a topology
+	 */
+	struct load_stats
+	{
+		load_stats():
+			topics(0),
+			partitions(0),
+			elapsed_ns(0)
+		{
+
+		}
+
+		size_t topics;
+		size_t partitions;
+		uint64_t elapsed_ns;
+	};
+
+	/**
+	 * Make partitions with leaders and replicas assigned round-robin across the
+	 * brokers, starting with the broker at index start
+	 */
+	inline void assign_partitions(int32_t num_partitions, int32_t replication_factor,
+	                              const std::vector<int32_t>& broker_ids, size_t start,
+	                              std::vector<partition>& partitions)
+	{
+		size_t num_brokers = broker_ids.size();
+		partitions.reserve(partitions.size() + static_cast<size_t>(num_partitions));
+		for (int32_t p=0; p<num_partitions; ++p)
+		{
+			size_t leader_idx = (start + static_cast<size_t>(p)) % num_brokers;
+			std::vector<int32_t> replicas;
+			replicas.reserve(static_cast<size_t>(replication_factor));
+			for (int32_t r=0; r<replication_factor; ++r)
+			{
+				replicas.push_back(broker_ids[(leader_idx + static_cast<size_t>(r)) % num_brokers]);
+			}
+			partitions.push_back(partition(p, replicas[0], replicas));
+		}
+	}
+
+	/**
+	 * Parsed topology
+	 */
+	class description
+	{
+	public:
+		description():
+			m_brokers(),
+			m_topics(),
+			m_error()
+		{
+
+		}
+
+		/**
+		 * Parse topology text - returns false on the first invalid line, see
+		 * error() for details
+		 */
+		bool parse(const std::string& text)
+		{
+			std::istringstream in(text);
+			std::string line;
+			size_t line_num = 0;
+			while (std::getline(in, line))
+			{
+				++line_num;
+				if (!parse_line(line))
+				{
+					std::ostringstream err;
+					err << "Invalid topology line " << line_num << ": " << line;
+					m_error = err.str();
+					return false;
+				}
+			}
+			return true;
+		}
+
+		/**
+		 * Parse topology file - returns false if it cannot be read or is invalid
+		 */
+		bool load_file(const std::string& path)
+		{
+			std::ifstream file(path.c_str());
+			if (!file)
+			{
+				m_error = "Unable to open " + path;
+				return false;
+			}
+
+			std::ostringstream text;
+			text << file.rdbuf();
+			return parse(text.str());
+		}
+
+		void add_broker(int32_t node_id, const std::string& host, int32_t port)
+		{
+			m_brokers.push_back(broker_spec(node_id, host, port));
+		}
+
+		void add_topic(const std::string& name, int32_t partitions, int32_t replication_factor)
+		{
+			m_topics.push_back(topic_spec(name, partitions, replication_factor));
+		}
+
+		const std::vector<broker_spec>& brokers() const
+		{
+			return m_brokers;
+		}
+
+		const std::vector<topic_spec>& topics() const
+		{
+			return m_topics;
+		}
+
+		const std::string& error() const
+		{
+			return m_error;
+		}
+
+	private:
+		bool parse_line(const std::string& line)
+		{
+			std::istringstream in(line);
+			std::string keyword;
+			if (!(in >> keyword) || (keyword[0] == '#'))
+			{
+				return true;
+			}
+
+			if (keyword == "broker")
+			{
+				int32_t node_id = 0;
+				std::string host;
+				int32_t port = 0;
+				if (!(in >> node_id >> host >> port) || has_more(in))
+				{
+					return false;
+				}
+				add_broker(node_id, host, port);
+				return true;
+			}
+
+			if (keyword == "topic")
+			{
+				std::string name;
+				int32_t partitions = 0;
+				int32_t replication_factor = 1;
+				if (!(in >> name >> partitions) || (partitions < 0))
+				{
+					return false;
+				}
+				if (!(in >> replication_factor))
+				{
+					// Replication factor is optional
+					if (!in.eof())
+					{
+						return false;
+					}
+					replication_factor = 1;
+				}
+				if ((replication_factor < 1) || has_more(in))
+				{
+					return false;
+				}
+				add_topic(name, partitions, replication_factor);
+				return true;
+			}
+
+			return false;
+		}
+
+		static bool has_more(std::istringstream& in)
+		{
+			std::string rest;
+			return static_cast<bool>(in >> rest);
+		}
+
+		std::vector<broker_spec> m_brokers;
+		std::vector<topic_spec> m_topics;
+		std::string m_error;
+	};
+
+	/**
+	 * Register the brokers and topics of a topology with a broker stub
+	 *
+	 * Brokers other than the stub itself are added as broker references. If the
+	 * topology lists no brokers the stub leads all partitions. The topic index
+	 * and partition storage are built in one pass with reserved capacity.
+	 * Returns false, leaving the stub untouched, if a replication factor
+	 * exceeds the number of brokers, a topic already exists or the topology
+	 * lists a topic more than once. Also returns false if a topic could not
+	 * be registered after all, in which case stats counts the ones that were.
+	 */
+	inline bool apply(const description& desc, broker_stub& stub, load_stats* stats = NULL)
+	{
+		uint64_t start_ns = util::monotonic_ns();
+
+		std::vector<int32_t> broker_ids;
+		for (size_t i=0; i<desc.brokers().size(); ++i)
+		{
+			broker_ids.push_back(desc.brokers()[i].node_id);
+		}
+		if (broker_ids.empty())
+		{
+			broker_ids.push_back(stub.node_id());
+		}
+
+		// Validate before touching the stub
+		const std::vector<topic_spec>& topics = desc.topics();
+		std::set<std::string> names;
+		for (size_t i=0; i<topics.size(); ++i)
+		{
+			if ((static_cast<size_t>(topics[i].replication_factor) > broker_ids.size()) ||
+			    (stub.get_topic(topics[i].name) != NULL) || !names.insert(topics[i].name).second)
+			{
+				KAFKA_BROKER_STUB_LOG(stub.get_logger(), log::LEVEL_ERROR, log::MSG_GENERIC)(stub.node_id(),
+					"Rejected topology - topic [%s] exists, is listed twice or has too many replicas", topics[i].name.c_str());
+				return false;
+			}
+		}
+
+		for (size_t i=0; i<desc.brokers().size(); ++i)
+		{
+			const broker_spec& broker = desc.brokers()[i];
+			if (broker.node_id != stub.node_id())
+			{
+				stub.add_broker_reference(broker.node_id, broker.host.c_str(), broker.port);
+			}
+		}
+
+		topic_registry& registry = stub.get_topic_registry();
+		registry.reserve(topics.size());
+
+		load_stats result;
+		bool complete = true;
+		std::vector<partition> partitions;
+		for (size_t i=0; i<topics.size(); ++i)
+		{
+			assign_partitions(topics[i].partitions, topics[i].replication_factor, broker_ids,
+			                  i % broker_ids.size(), partitions);
+			size_t num_partitions = partitions.size();
+			if (registry.adopt(topics[i].name, partitions))
+			{
+				++result.topics;
+				result.partitions += num_partitions;
+			}
+			else
+			{
+				KAFKA_BROKER_STUB_LOG(stub.get_logger(), log::LEVEL_ERROR, log::MSG_GENERIC)(stub.node_id(),
+					"Failed to register topic [%s]", topics[i].name.c_str());
+				complete = false;
+			}
+			partitions.clear();
+		}
+
+		result.elapsed_ns = util::monotonic_ns() - start_ns;
+		KAFKA_BROKER_STUB_LOG(stub.get_logger(), log::LEVEL_INFO, log::MSG_GENERIC)(stub.node_id(),
+			"Registered [%lu] topics with [%lu] partitions in [%lu] us",
+			static_cast<unsigned long>(result.topics),
+			static_cast<unsigned long>(result.partitions),
+			static_cast<unsigned long>(result.elapsed_ns / 1000));
+		if (stats != NULL)
+		{
+			*stats = result;
+		}
+		return complete;
+	}
+
+}}
+
+#endif
@@ -0,0 +1,431 @@
+#ifndef KAFKA_BROKER_STUB_TRACE_HPP_INC_
+#define KAFKA_BROKER_STUB_TRACE_HPP_INC_
+
+/*
+ * Tracing of the time spent handling requests.
+ *
+ * Spans are timed with the time stamp counter and recorded into a ring
+ * buffer per thread, so tracing costs no locks or system calls on the
+ * request path. The span of a request carries the API key, version,
+ * correlation ID, client ID and the request and response sizes; the spans
+ * of its phases (handling, decoding, serializing, appending) nest inside it.
+ * Recorded spans are exported as Chrome trace events, which can be opened
+ * in chrome://tracing or Perfetto.
+ *
+ * Tracing is off until enabled at runtime and is removed at compile time by
+ * defining KAFKA_BROKER_STUB_TRACE_ENABLED to 0.
+ */
+
+#include "util.hpp"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef KAFKA_BROKER_STUB_TRACE_ENABLED
+#define KAFKA_BROKER_STUB_TRACE_ENABLED 1
+#endif
+
+namespace kafka_broker_stub { namespace trace {
+
+	/**
+	 * Returns true if tracing is compiled in
+	 */
+	inline bool compiled_in()
+	{
+		return KAFKA_BROKER_STUB_TRACE_ENABLED != 0;
+	}
+
+	// Maximum length of a client ID kept with a span (including zero termination)
+	const size_t CLIENT_ID_MAX_SIZE = 24;
+
+	/**
+	 * Recorded span - 64 bytes. Spans of phases have an api_key of -1.
+	 */
+	struct event
+	{
+		event():
+			name(NULL),
+			start(0),
+			end(0),
+			api_key(-1),
+			api_version(0),
+			correlation_id(0),
+			request_bytes(0),
+			response_bytes(0),
+			client_id()
+		{
+
+		}
+
+		const char* name;  // Must be a string literal
+		uint64_t start;    // Time stamp counter ticks
+		uint64_t end;
+		int16_t api_key;
+		int16_t api_version;
+		int32_t correlation_id;
+		uint32_t request_bytes;
+		uint32_t response_bytes;
+		char client_id[CLIENT_ID_MAX_SIZE];
+	};
+
+	/**
+	 * Ring buffer of the spans recorded by one thread - the oldest spans are
+	 * overwritten once it is full
+	 */
+	class thread_buffer
+	{
+	public:
+		thread_buffer(size_t capacity, int32_t tid):
+			m_events(capacity),
+			m_written(0),
+			m_tid(tid)
+		{
+
+		}
+
+		void record(const event& ev)
+		{
+			uint64_t written = m_written;
+			m_events[static_cast<size_t>(written % m_events.size())] = ev;
+			util::atomic_store(&m_written, written + 1);
+		}
+
+		/**
+		 * Copy the retained spans, oldest first
+		 */
+		void copy(std::vector<event>& out) const
+		{
+			uint64_t written = util::atomic_load(&m_written);
+			uint64_t first = (written > m_events.size()) ? written - m_events.size() : 0;
+			for (uint64_t i=first; i<written; ++i)
+			{
+				out.push_back(m_events[static_cast<size_t>(i % m_events.size())]);
+			}
+		}
+
+		void clear()
+		{
+			util::atomic_store(&m_written, static_cast<uint64_t>(0));
+		}
+
+		int32_t tid() const
+		{
+			return m_tid;
+		}
+
+	private:
+		std::vector<event> m_events;
+		volatile uint64_t m_written;
+		int32_t m_tid;
+	};
+
+	/**
+	 * Owner of the span buffers of all threads
+	 *
+	 * A thread gets its buffer on its first span and keeps it after it
+	 * exits, so its spans can still be exported. Exporting and clearing while
+	 * other threads record spans may return spans being overwritten, so they
+	 * should be done after the traffic of interest.
+	 */
+	class tracer
+	{
+	public:
+		/**
+		 * Make a tracer whose spans are exported with the process ID pid
+		 * (e.g. the node ID of a stub) and keep the last events_per_thread
+		 * spans of each thread
+		 */
+		explicit tracer(int32_t pid, size_t events_per_thread = 16384):
+			m_mutex(),
+			m_key(),
+			m_has_key(false),
+			m_enabled(0),
+			m_pid(pid),
+			m_capacity(std::max(events_per_thread, static_cast<size_t>(1))),
+			m_buffers(),
+			m_start_tsc(util::tsc()),
+			m_start_ns(util::monotonic_ns())
+		{
+			if (pthread_mutex_init(&m_mutex, NULL) != 0)
+			{
+				throw std::runtime_error("Failed to initialize tracer mutex");
+			}
+		}
+
+		~tracer()
+		{
+			if (m_has_key)
+			{
+				pthread_key_delete(m_key);
+			}
+			for (size_t i=0; i<m_buffers.size(); ++i)
+			{
+				delete m_buffers[i];
+			}
+			pthread_mutex_destroy(&m_mutex);
+		}
+
+		/**
+		 * Start or stop recording spans - the thread specific buffer key is
+		 * only allocated when first enabled
+		 */
+		void enable(bool on)
+		{
+			if (!compiled_in())
+			{
+				return;
+			}
+
+			pthread_mutex_lock(&m_mutex);
+			if (on && !m_has_key)
+			{
+				if (pthread_key_create(&m_key, NULL) != 0)
+				{
+					pthread_mutex_unlock(&m_mutex);
+					throw std::runtime_error("Failed to create tracer key");
+				}
+				m_has_key = true;
+			}
+			pthread_mutex_unlock(&m_mutex);
+			util::atomic_store(&m_enabled, on ? 1 : 0);
+		}
+
+		bool enabled() const
+		{
+			return compiled_in() && (util::atomic_load(&m_enabled) != 0);
+		}
+
+		/**
+		 * Record a span into the buffer of the calling thread
+		 */
+		void record(const event& ev)
+		{
+			thread_buffer* buf = static_cast<thread_buffer*>(pthread_getspecific(m_key));
+			if (buf == NULL)
+			{
+				pthread_mutex_lock(&m_mutex);
+				buf = new thread_buffer(m_capacity, static_cast<int32_t>(m_buffers.size() + 1));
+				m_buffers.push_back(buf);
+				pthread_mutex_unlock(&m_mutex);
+				pthread_setspecific(m_key, buf);
+			}
+			buf->record(ev);
+		}
+
+		/**
+		 * Drop all recorded spans
+		 */
+		void clear()
+		{
+			pthread_mutex_lock(&m_mutex);
+			for (size_t i=0; i<m_buffers.size(); ++i)
+			{
+				m_buffers[i]->clear();
+			}
+			pthread_mutex_unlock(&m_mutex);
+		}
+
+		/**
+		 * Number of spans retained over all threads
+		 */
+		size_t size() const
+		{
+			std::vector<event> events;
+			pthread_mutex_lock(&m_mutex);
+			for (size_t i=0; i<m_buffers.size(); ++i)
+			{
+				m_buffers[i]->copy(events);
+			}
+			pthread_mutex_unlock(&m_mutex);
+			return events.size();
+		}
+
+		/**
+		 * Export the retained spans as Chrome trace event JSON - timestamps
+		 * are microseconds since the tracer was made
+		 */
+		std::string chrome_json() const
+		{
+			// Calibrate the counter over the lifetime of the tracer
+			uint64_t ticks = util::tsc() - m_start_tsc;
+			uint64_t ns = util::monotonic_ns() - m_start_ns;
+			double us_per_tick = (ticks > 0) ? (static_cast<double>(ns) / 1000.0) / static_cast<double>(ticks) : 0.0;
+
+			std::string out("{\"traceEvents\":[");
+			bool first = true;
+			pthread_mutex_lock(&m_mutex);
+			for (size_t i=0; i<m_buffers.size(); ++i)
+			{
+				std::vector<event> events;
+				m_buffers[i]->copy(events);
+				for (size_t k=0; k<events.size(); ++k)
+				{
+					if (!first)
+					{
+						out += ",";
+					}
+					first = false;
+					append_event(out, events[k], m_buffers[i]->tid(), us_per_tick);
+				}
+			}
+			pthread_mutex_unlock(&m_mutex);
+			out += "],\"displayTimeUnit\":\"ns\"}";
+			return out;
+		}
+
+		/**
+		 * Write chrome_json() to a file - returns false if it cannot be written
+		 */
+		bool save_chrome_json(const std::string& path) const
+		{
+			FILE* file = fopen(path.c_str(), "wb");
+			if (file == NULL)
+			{
+				return false;
+			}
+
+			std::string json = chrome_json();
+			bool ok = fwrite(json.data(), 1, json.size(), file) == json.size();
+			return (fclose(file) == 0) && ok;
+		}
+
+	private:
+		void append_event(std::string& out, const event& ev, int32_t tid, double us_per_tick) const
+		{
+			char buf[256];
+			double ts = static_cast<double>(ev.start - m_start_tsc) * us_per_tick;
+			double dur = static_cast<double>(ev.end - ev.start) * us_per_tick;
+			snprintf(buf, sizeof(buf), "{\"name\":\"%s\",\"cat\":\"kafka\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+			         "\"pid\":%d,\"tid\":%d", ev.name, ts, dur, static_cast<int>(m_pid), static_cast<int>(tid));
+			out += buf;
+
+			if (ev.api_key >= 0)
+			{
+				snprintf(buf, sizeof(buf), ",\"args\":{\"api_key\":%d,\"api_version\":%d,\"correlation_id\":%d,"
+				         "\"request_bytes\":%u,\"response_bytes\":%u,\"client_id\":\"",
+				         static_cast<int>(ev.api_key), static_cast<int>(ev.api_version),
+				         static_cast<int>(ev.correlation_id), static_cast<unsigned>(ev.request_bytes),
+				         static_cast<unsigned>(ev.response_bytes));
+				out += buf;
+				append_escaped(out, ev.client_id);
+				out += "\"}";
+			}
+			out += "}";
+		}
+
+		static void append_escaped(std::string& out, const char* str)
+		{
+			for (; *str != '\0'; ++str)
+			{
+				unsigned char c = static_cast<unsigned char>(*str);
+				if ((c == '"') || (c == '\\'))
+				{
+					out += '\\';
+					out += *str;
+				}
+				else if (c < 0x20)
+				{
+					char esc[8];
+					snprintf(esc, sizeof(esc), "\\u%04x", static_cast<unsigned>(c));
+					out += esc;
+				}
+				else
+				{
+					out += *str;
+				}
+			}
+		}
+
+		tracer(const tracer&);
+		tracer& operator=(const tracer&);
+
+		mutable pthread_mutex_t m_mutex;
+		pthread_key_t m_key;
+		bool m_has_key;
+		volatile int m_enabled;
+		int32_t m_pid;
+		size_t m_capacity;
+		std::vector<thread_buffer*> m_buffers;
+		uint64_t m_start_tsc;
+		uint64_t m_start_ns;
+	};
+
+	/**
+	 * Scoped span - recorded when it goes out of scope if the tracer was
+	 * enabled when it was made
+	 */
+	class span
+	{
+	public:
+		span(tracer& t, const char* name):
+			m_tracer(t.enabled() ? &t : NULL),
+			m_event()
+		{
+			if (m_tracer != NULL)
+			{
+				m_event.name = name;
+				m_event.start = util::tsc();
+			}
+		}
+
+		~span()
+		{
+			if (m_tracer != NULL)
+			{
+				m_event.end = util::tsc();
+				m_tracer->record(m_event);
+			}
+		}
+
+		bool active() const
+		{
+			return m_tracer != NULL;
+		}
+
+		/**
+		 * Take API key, version, correlation ID and client ID from the
+		 * request of size bytes (without the size in front of it)
+		 */
+		void set_request(const uint8_t* data, size_t size)
+		{
+			if ((m_tracer == NULL) || (size < 4))
+			{
+				return;
+			}
+
+			m_event.api_key = util::read_type<int16_t>(data);
+			m_event.api_version = util::read_type<int16_t>(data + 2);
+			m_event.request_bytes = static_cast<uint32_t>(size);
+			if (size < 10)
+			{
+				return;
+			}
+
+			m_event.correlation_id = util::read_type<int32_t>(data + 4);
+			int16_t length = util::read_type<int16_t>(data + 8);
+			size_t copy = (length > 0) ? std::min(static_cast<size_t>(length), size - 10) : 0;
+			copy = std::min(copy, CLIENT_ID_MAX_SIZE - 1);
+			memcpy(m_event.client_id, data + 10, copy);
+			m_event.client_id[copy] = '\0';
+		}
+
+		void set_response_bytes(size_t size)
+		{
+			m_event.response_bytes = static_cast<uint32_t>(size);
+		}
+
+	private:
+		span(const span&);
+		span& operator=(const span&);
+
+		tracer* m_tracer;
+		event m_event;
+	};
+
+}}
+
+#endif
@@ -0,0 +1,829 @@
+#ifndef KAFKA_BROKER_STUB_TRANSPORT_HPP_INC_
+#define KAFKA_BROKER_STUB_TRANSPORT_HPP_INC_
+
+/*
+ * TCP transport for a broker stub.
+ *
+ * A transport accepts client connections, feeds the received bytes to
+ * broker_stub::handle_data and sends the responses back. Transports are
+ * single threaded - all work happens in poll() on the calling thread and
+ * serve() runs the event loop until stopped. See server.hpp for choosing
+ * between the network backends and loopback.hpp for in-process channels.
+ */
+
+#include "main.hpp"
+#include "mirrored_buffer.hpp"
+#include "scatter.hpp"
+#include "timer_wheel.hpp"
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+namespace kafka_broker_stub { namespace transport {
+
+	/**
+	 * Interface for transport backends
+	 */
+	class transportI
+	{
+	public:
+		virtual ~transportI() {}
+
+		/**
+		 * Start listening on host and port - port 0 picks a free port. Returns
+		 * false if the backend is unavailable or the address cannot be bound.
+		 */
+		virtual bool listen(const char* host, int32_t port) = 0;
+
+		/**
+		 * Handle network events waiting at most timeout_ms milliseconds for
+		 * the first one. Returns the number of events handled or -1 on error.
+		 */
+		virtual int poll(int timeout_ms) = 0;
+
+		/**
+		 * Port listened on
+		 */
+		virtual int32_t port() const = 0;
+
+		virtual const char* name() const = 0;
+	};
+
+	/**
+	 * Handle events until *running becomes zero (set from another thread with
+	 * util::atomic_store) - returns false if the transport failed
+	 */
+	inline bool serve(transportI& transport, const volatile int* running)
+	{
+		while (util::atomic_load(running) != 0)
+		{
+			if (transport.poll(100) < 0)
+				return false;
+		}
+		return true;
+	}
+
+	// Interval for polling deferred responses
+	const uint64_t DEFERRED_POLL_NS = 1000000;
+
+	// Maximum number of response buffers sent with one call
+	const size_t MAX_IOV = 64;
+
+	/**
+	 * Byte stream of one client connection
+	 *
+	 * Data can be received directly into the mirrored receive buffer of the
+	 * session (recv_buffer() and received()) or passed in from elsewhere
+	 * (receive()). Either way incomplete requests stay in place in the
+	 * buffer until the rest arrives, and the buffer grows to hold requests
+	 * larger than it. Responses are queued in a deque so the memory of queued
+	 * responses does not move while the backend is sending them.
+	 *
+	 * Received bytes and responses can be held back until a due time, either
+	 * by the network shaping of the stub (see shaping.hpp) or for a quota
+	 * violation. Like a Kafka broker the session handles no further requests
+	 * until a response delayed by a quota is released. Responses the stub
+	 * defers (JoinGroup and SyncGroup waiting for the group) block further
+	 * requests the same way and are polled every DEFERRED_POLL_NS. The
+	 * backend calls release() once release_time() has passed.
+	 *
+	 * Once the backend set the socket, fetch responses are sent to it with
+	 * sendmsg straight from the fetched messages while the stub blocks
+	 * appends, as long as nothing is queued or held back in front of them.
+	 * Only the part the socket does not take right away is copied and queued.
+	 */
+	class session : public response_sinkI
+	{
+	public:
+		explicit session(broker_stub& stub):
+			m_stub(stub),
+			m_socket(-1),
+			m_in(),
+			m_ready(0),
+			m_arrivals(),
+			m_responses(),
+			m_out(),
+			m_out_pos(0),
+			m_delays(),
+			m_held(),
+			m_muted_until(0),
+			m_link(stub.get_shaping()),
+			m_identified(false),
+			m_deferred(NULL),
+			m_poll_at(0)
+		{
+
+		}
+
+		~session()
+		{
+			delete m_deferred;
+		}
+
+		/**
+		 * Set the connected socket responses can be sent to right away
+		 */
+		void set_socket(int fd)
+		{
+			m_socket = fd;
+		}
+
+		/**
+		 * Send a response referring to stored data to the socket, copying
+		 * the part not sent - returns false if responses are in front of it
+		 * or it must cross the shaped link (see response_sinkI)
+		 */
+		bool send(scatter_buffer& response)
+		{
+			if ((m_socket < 0) || !m_responses.empty() || !m_out.empty() || !m_held.empty() || m_link.active())
+				return false;
+
+			struct iovec iov[MAX_IOV];
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			while (!response.empty())
+			{
+				msg.msg_iovlen = response.fill_iovec(iov, MAX_IOV);
+				ssize_t ret = sendmsg(m_socket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+				if (ret < 0)
+				{
+					if (errno == EINTR)
+						continue;
+
+					// The backend sends the rest and sees any error
+					break;
+				}
+				response.consumed(static_cast<size_t>(ret));
+			}
+
+			if (!response.empty())
+			{
+				m_out.push_back(std::string());
+				response.copy_to(m_out.back());
+			}
+			return true;
+		}
+
+		/**
+		 * Get free space to receive data into - pass the number of bytes
+		 * written to received()
+		 */
+		uint8_t* recv_buffer(size_t& size)
+		{
+			if (m_in.writable() == 0)
+			{
+				m_in.reserve(1);
+			}
+			size = m_in.writable();
+			return m_in.write_ptr();
+		}
+
+		/**
+		 * Handle bytes written to the receive buffer - returns false if the
+		 * stream is invalid and the connection should be closed
+		 */
+		bool received(size_t size)
+		{
+			m_in.commit(size);
+			arrived(size);
+			return process();
+		}
+
+		/**
+		 * Handle received bytes - returns false if the stream is invalid and
+		 * the connection should be closed. Complete requests are handled
+		 * straight from the data when nothing is buffered or held back.
+		 */
+		bool receive(const uint8_t* data, size_t size)
+		{
+			if ((m_in.readable() == 0) && (m_muted_until == 0) && (m_deferred == NULL) && !shaped())
+			{
+				if (!m_identified)
+					identify(data, size);
+				int used = m_stub.handle_data(data, size, m_responses, &m_delays, &m_deferred, this);
+				if (used < 0)
+					return false;
+				queue_responses();
+				deferred_started();
+				data += used;
+				size -= static_cast<size_t>(used);
+				if (size == 0)
+					return true;
+			}
+
+			m_in.append(data, size);
+			arrived(size);
+			return process();
+		}
+
+		bool has_output() const
+		{
+			return !m_out.empty();
+		}
+
+		/**
+		 * Monotonic time in nanoseconds when the next held back bytes or
+		 * response are due - 0 if nothing is held back
+		 */
+		uint64_t release_time() const
+		{
+			uint64_t due = m_held.empty() ? 0 : m_held.front().due_ns;
+			if (!m_arrivals.empty() && ((due == 0) || (m_arrivals.front().due_ns < due)))
+				due = m_arrivals.front().due_ns;
+			if ((m_deferred != NULL) && ((due == 0) || (m_poll_at < due)))
+				due = m_poll_at;
+			return due;
+		}
+
+		/**
+		 * Queue held back responses for sending and hand held back bytes to
+		 * the stub once they are due - returns false if the stream is invalid
+		 * and the connection should be closed
+		 */
+		bool release(uint64_t now_ns)
+		{
+			if (m_held.empty() && m_arrivals.empty() && (m_deferred == NULL))
+				return true;
+
+			// Requests behind a deferred response are handled once it completes
+			if ((m_deferred != NULL) && (m_poll_at <= now_ns))
+			{
+				m_responses.push_back(std::string());
+				if (m_deferred->poll(now_ns, m_responses.back()))
+				{
+					delete m_deferred;
+					m_deferred = NULL;
+					m_poll_at = 0;
+					m_delays.push_back(0);
+					queue_responses();
+				}
+				else
+				{
+					m_responses.pop_back();
+					m_poll_at = now_ns + DEFERRED_POLL_NS;
+				}
+			}
+
+			while (!m_held.empty() && (m_held.front().due_ns <= now_ns))
+			{
+				m_out.push_back(std::string());
+				m_out.back().swap(m_held.front().data);
+				m_held.pop_front();
+			}
+			if (m_muted_until <= now_ns)
+				m_muted_until = 0;
+			return process();
+		}
+
+		/**
+		 * Describe up to max queued response buffers - returns the number of
+		 * entries filled
+		 */
+		size_t fill_iovec(struct iovec* iov, size_t max) const
+		{
+			size_t count = 0;
+			for (std::deque<std::string>::const_iterator it = m_out.begin(); (it != m_out.end()) && (count < max);
+			     ++it, ++count)
+			{
+				size_t skip = (count == 0) ? m_out_pos : 0;
+				iov[count].iov_base = const_cast<char*>(it->data() + skip);
+				iov[count].iov_len = it->size() - skip;
+			}
+			return count;
+		}
+
+		/**
+		 * Drop bytes that have been sent from the front of the queue
+		 */
+		void consumed(size_t bytes)
+		{
+			while ((bytes > 0) && !m_out.empty())
+			{
+				size_t left = m_out.front().size() - m_out_pos;
+				if (bytes < left)
+				{
+					m_out_pos += bytes;
+					return;
+				}
+
+				bytes -= left;
+				m_out.pop_front();
+				m_out_pos = 0;
+			}
+		}
+
+	private:
+		/**
+		 * Bytes received or a response held back until a due time
+		 */
+		struct arrival
+		{
+			arrival(size_t num, uint64_t due):
+				bytes(num),
+				due_ns(due)
+			{
+
+			}
+
+			size_t bytes;
+			uint64_t due_ns;
+		};
+
+		struct held_response
+		{
+			explicit held_response(uint64_t due):
+				data(),
+				due_ns(due)
+			{
+
+			}
+
+			std::string data;
+			uint64_t due_ns;
+		};
+
+		/**
+		 * True if received bytes may have to be held back - the profile of a
+		 * connection is only known once the first request header arrived
+		 */
+		bool shaped()
+		{
+			if (!m_identified && m_stub.get_shaping().active())
+				return true;
+			return m_link.active();
+		}
+
+		/**
+		 * Account bytes appended to the receive buffer - shaped bytes are only
+		 * handed to the stub once they crossed the link
+		 */
+		void arrived(size_t size)
+		{
+			if (!m_identified)
+				identify(m_in.read_ptr(), m_in.readable());
+
+			if (m_arrivals.empty() && !m_link.active())
+			{
+				m_ready += size;
+				return;
+			}
+			m_arrivals.push_back(arrival(size, m_link.schedule(LINK_IN, size, util::monotonic_ns())));
+		}
+
+		/**
+		 * Pick the link profile by the client ID of the first request once its
+		 * header is complete - data starts at that request. Connections stay
+		 * unidentified until then, also while no profile is active, so they
+		 * pick up client profiles configured later.
+		 */
+		void identify(const uint8_t* data, size_t size)
+		{
+			// Size, API key, version, correlation ID and client ID length
+			const size_t fixed = 14;
+			if (size < fixed)
+				return;
+
+			int16_t len = util::read_type<int16_t>(data + 12);
+			size_t id_size = (len > 0) ? static_cast<size_t>(len) : 0;
+			if (size < fixed + id_size)
+				return;
+
+			m_link.identify(std::string(reinterpret_cast<const char*>(data + fixed), id_size));
+			m_identified = true;
+		}
+
+		bool process()
+		{
+			if (!m_arrivals.empty())
+			{
+				uint64_t now = util::monotonic_ns();
+				while (!m_arrivals.empty() && (m_arrivals.front().due_ns <= now))
+				{
+					m_ready += m_arrivals.front().bytes;
+					m_arrivals.pop_front();
+				}
+			}
+
+			// Requests wait while a throttled or deferred response is held back
+			if ((m_muted_until != 0) || (m_deferred != NULL))
+				return true;
+
+			int used = m_stub.handle_data(m_in.read_ptr(), m_ready, m_responses, &m_delays, &m_deferred, this);
+			if (used < 0)
+				return false;
+			m_in.consume(static_cast<size_t>(used));
+			m_ready -= static_cast<size_t>(used);
+			queue_responses();
+			deferred_started();
+
+			// Make room for the whole of a partially received request
+			if (m_in.readable() >= 4)
+			{
+				int32_t msg_size = util::read_type<int32_t>(m_in.read_ptr());
+				size_t needed = static_cast<size_t>(msg_size) + 4;
+				if ((msg_size > 0) && (needed > m_in.readable()))
+				{
+					m_in.reserve(needed - m_in.readable());
+				}
+			}
+			return true;
+		}
+
+		/**
+		 * Schedule the first poll of a response the stub deferred
+		 */
+		void deferred_started()
+		{
+			if ((m_deferred != NULL) && (m_poll_at == 0))
+				m_poll_at = util::monotonic_ns() + DEFERRED_POLL_NS;
+		}
+
+		void queue_responses()
+		{
+			bool shaped = !m_responses.empty() && m_link.active();
+			uint64_t now = (shaped || !m_held.empty() || (m_muted_until != 0)) ? util::monotonic_ns() : 0;
+			for (size_t i=0; i<m_responses.size(); ++i)
+			{
+				uint64_t due = shaped ? m_link.schedule(LINK_OUT, m_responses[i].size(), now) : 0;
+				if (m_delays[i] > 0)
+				{
+					if (now == 0)
+						now = util::monotonic_ns();
+					due = std::max(due, now + static_cast<uint64_t>(m_delays[i]) * 1000000);
+					m_muted_until = std::max(m_muted_until, due);
+				}
+
+				// Responses stay in order behind held back ones
+				if (!m_held.empty())
+					due = std::max(due, m_held.back().due_ns);
+
+				if ((due == 0) || ((due <= now) && m_held.empty()))
+				{
+					m_out.push_back(std::string());
+					m_out.back().swap(m_responses[i]);
+				}
+				else
+				{
+					m_held.push_back(held_response(due));
+					m_held.back().data.swap(m_responses[i]);
+				}
+			}
+			m_responses.clear();
+			m_delays.clear();
+		}
+
+		session(const session&);
+		session& operator=(const session&);
+
+		broker_stub& m_stub;
+
+		// Socket to send responses referring to stored data to (-1 if none)
+		int m_socket;
+		mirrored_buffer m_in;
+
+		// Received bytes at the front of the buffer that crossed the link
+		size_t m_ready;
+		std::deque<arrival> m_arrivals;
+
+		std::vector<std::string> m_responses;
+		std::deque<std::string> m_out;
+		size_t m_out_pos;
+		std::vector<uint32_t> m_delays;
+		std::deque<held_response> m_held;
+
+		// Release time of the last response delayed by a quota
+		uint64_t m_muted_until;
+		link_shaper m_link;
+		bool m_identified;
+
+		// Response the next requests wait for and the time to poll it next
+		deferred_response* m_deferred;
+		uint64_t m_poll_at;
+	};
+
+	/**
+	 * Put the release of the bytes a connection holds back on the timer wheel
+	 * if they are due earlier than scheduled so far. Connections are indexed
+	 * by socket and remember the scheduled time in release_at, which is reset
+	 * when the timer expires. The timers of a socket are cancelled when it is
+	 * closed, so they do not fire for the next connection reusing it.
+	 */
+	template <typename Connection>
+	void schedule_release(timer_wheel& timers, int fd, Connection& conn)
+	{
+		uint64_t due = conn.sess.release_time();
+		if ((due != 0) && ((conn.release_at == 0) || (due < conn.release_at)))
+		{
+			conn.release_at = due;
+			timers.schedule(fd, due);
+		}
+	}
+
+	/**
+	 * Open a listening TCP socket - returns the socket or -1 on failure
+	 */
+	inline int open_listener(const char* host, int32_t port, bool nonblocking)
+	{
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(static_cast<uint16_t>(port));
+		if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+			return -1;
+
+		int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0), 0);
+		if (fd < 0)
+			return -1;
+
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if ((bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) || (::listen(fd, 128) != 0))
+		{
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	/**
+	 * Get the local port of a socket - returns -1 on failure
+	 */
+	inline int32_t local_port(int fd)
+	{
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		if (getsockname(fd, reinterpret_cast<struct sockaddr*>(&addr), &len) != 0)
+			return -1;
+		return ntohs(addr.sin_port);
+	}
+
+	/**
+	 * Disable Nagle so small responses are sent right away
+	 */
+	inline void set_nodelay(int fd)
+	{
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+
+	/**
+	 * Readiness based transport using epoll and non-blocking sockets
+	 */
+	class epoll_transport : public transportI
+	{
+	public:
+		explicit epoll_transport(broker_stub& stub):
+			m_stub(stub),
+			m_epoll(-1),
+			m_listen(-1),
+			m_port(-1),
+			m_conns(),
+			m_timers(),
+			m_due()
+		{
+
+		}
+
+		~epoll_transport()
+		{
+			for (size_t fd=0; fd<m_conns.size(); ++fd)
+			{
+				if (m_conns[fd] != NULL)
+				{
+					close(static_cast<int>(fd));
+					delete m_conns[fd];
+				}
+			}
+			if (m_listen >= 0)
+				close(m_listen);
+			if (m_epoll >= 0)
+				close(m_epoll);
+		}
+
+		bool listen(const char* host, int32_t port)
+		{
+			m_epoll = epoll_create1(EPOLL_CLOEXEC);
+			m_listen = open_listener(host, port, true);
+			if ((m_epoll < 0) || (m_listen < 0) || !watch(EPOLL_CTL_ADD, m_listen, EPOLLIN))
+				return false;
+
+			m_port = local_port(m_listen);
+			return true;
+		}
+
+		int poll(int timeout_ms)
+		{
+			struct epoll_event events[64];
+			int num = epoll_wait(m_epoll, events, 64, m_timers.timeout(util::monotonic_ns(), timeout_ms));
+			if (num < 0)
+				return (errno == EINTR) ? 0 : -1;
+
+			for (int i=0; i<num; ++i)
+			{
+				if (events[i].data.fd == m_listen)
+				{
+					accept_all();
+				}
+				else
+				{
+					handle(events[i].data.fd, events[i].events);
+				}
+			}
+			release_due();
+			return num;
+		}
+
+		int32_t port() const
+		{
+			return m_port;
+		}
+
+		const char* name() const
+		{
+			return "epoll";
+		}
+
+	private:
+		struct connection
+		{
+			explicit connection(broker_stub& stub):
+				sess(stub),
+				writing(false),
+				release_at(0)
+			{
+
+			}
+
+			session sess;
+
+			// Waiting for the socket to become writable
+			bool writing;
+
+			// Time of the timer releasing held back data (0 if none)
+			uint64_t release_at;
+		};
+
+		bool watch(int op, int fd, uint32_t events)
+		{
+			struct epoll_event ev;
+			memset(&ev, 0, sizeof(ev));
+			ev.events = events;
+			ev.data.fd = fd;
+			return epoll_ctl(m_epoll, op, fd, &ev) == 0;
+		}
+
+		void accept_all()
+		{
+			for (;;)
+			{
+				int fd = accept4(m_listen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+				if (fd < 0)
+					return;
+
+				set_nodelay(fd);
+				size_t idx = static_cast<size_t>(fd);
+				if (idx >= m_conns.size())
+					m_conns.resize(idx + 1, NULL);
+				m_conns[idx] = new connection(m_stub);
+				m_conns[idx]->sess.set_socket(fd);
+				if (!watch(EPOLL_CTL_ADD, fd, EPOLLIN))
+					drop(fd);
+			}
+		}
+
+		void handle(int fd, uint32_t events)
+		{
+			connection* conn = m_conns[static_cast<size_t>(fd)];
+			if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			{
+				// Read until the socket is drained
+				for (;;)
+				{
+					size_t size = 0;
+					uint8_t* buf = conn->sess.recv_buffer(size);
+					ssize_t ret = read(fd, buf, size);
+					if (ret > 0)
+					{
+						if (!conn->sess.received(static_cast<size_t>(ret)))
+						{
+							drop(fd);
+							return;
+						}
+						continue;
+					}
+					if ((ret == 0) || ((errno != EAGAIN) && (errno != EINTR)))
+					{
+						drop(fd);
+						return;
+					}
+					if (errno != EINTR)
+						break;
+				}
+			}
+
+			if (!flush(fd, conn))
+			{
+				drop(fd);
+				return;
+			}
+
+			schedule_release(m_timers, fd, *conn);
+		}
+
+		/**
+		 * Release the data held back by connections whose timers expired
+		 */
+		void release_due()
+		{
+			if (m_timers.empty())
+				return;
+
+			uint64_t now = util::monotonic_ns();
+			m_due.clear();
+			m_timers.expire(now, m_due);
+			for (size_t i=0; i<m_due.size(); ++i)
+			{
+				int fd = m_due[i];
+				connection* conn = m_conns[static_cast<size_t>(fd)];
+				if (conn == NULL)
+					continue;
+
+				conn->release_at = 0;
+				if (!conn->sess.release(now) || !flush(fd, conn))
+				{
+					drop(fd);
+					continue;
+				}
+				schedule_release(m_timers, fd, *conn);
+			}
+		}
+
+		/**
+		 * Send queued responses and watch for writability if the socket buffer
+		 * is full - returns false on error
+		 */
+		bool flush(int fd, connection* conn)
+		{
+			struct iovec iov[MAX_IOV];
+			while (conn->sess.has_output())
+			{
+				size_t count = conn->sess.fill_iovec(iov, MAX_IOV);
+				ssize_t ret = writev(fd, iov, static_cast<int>(count));
+				if (ret < 0)
+				{
+					if (errno == EINTR)
+						continue;
+					if (errno != EAGAIN)
+						return false;
+					break;
+				}
+				conn->sess.consumed(static_cast<size_t>(ret));
+			}
+
+			bool want_write = conn->sess.has_output();
+			if (want_write != conn->writing)
+			{
+				conn->writing = want_write;
+				return watch(EPOLL_CTL_MOD, fd, want_write ? (EPOLLIN | EPOLLOUT) : EPOLLIN);
+			}
+			return true;
+		}
+
+		void drop(int fd)
+		{
+			// The socket may be reused by the next connection
+			m_timers.cancel(fd);
+			epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, NULL);
+			close(fd);
+			delete m_conns[static_cast<size_t>(fd)];
+			m_conns[static_cast<size_t>(fd)] = NULL;
+		}
+
+		epoll_transport(const epoll_transport&);
+		epoll_transport& operator=(const epoll_transport&);
+
+		broker_stub& m_stub;
+		int m_epoll;
+		int m_listen;
+		int32_t m_port;
+		std::vector<connection*> m_conns;
+
+		// Releases of held back data by socket
+		timer_wheel m_timers;
+		std::vector<int> m_due;
+	};
+
+}}
+
+#endif
@@ -0,0 +1,591 @@
+#ifndef KAFKA_BROKER_STUB_URING_HPP_INC_
+#define KAFKA_BROKER_STUB_URING_HPP_INC_
+
+/*
+ * Completion based transport using io_uring.
+ *
+ * Connections are accepted with a multishot accept and read with a multishot
+ * receive selecting buffers from a ring of provided buffers, so receiving
+ * costs no system call per read. Responses are sent with one gathering
+ * sendmsg per connection at a time, which keeps them in order and handles
+ * short sends. Fetch responses that nothing is queued in front of are sent
+ * with a direct sendmsg from the fetched messages first (see
+ * transport::session). Submission and completion are batched into one
+ * io_uring_enter per poll.
+ *
+ * The ring is set up through the raw system calls (no liburing). Support is
+ * compiled in when <linux/io_uring.h> provides multishot receive (Linux 6.0)
+ * unless KAFKA_BROKER_STUB_NO_IO_URING is defined. When the kernel rejects
+ * the setup, listen() returns false and an epoll transport can be used
+ * instead (see server.hpp).
+ */
+
+#include "transport.hpp"
+
+#if !defined(KAFKA_BROKER_STUB_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT
+#define KAFKA_BROKER_STUB_HAS_IO_URING 1
+#endif
+#endif
+#endif
+
+#ifdef KAFKA_BROKER_STUB_HAS_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+namespace kafka_broker_stub { namespace transport {
+
+#ifdef KAFKA_BROKER_STUB_HAS_IO_URING
+
+	class uring_transport : public transportI
+	{
+	public:
+		explicit uring_transport(broker_stub& stub, unsigned entries = 256):
+			m_stub(stub),
+			m_entries(entries),
+			m_ring_fd(-1),
+			m_listen(-1),
+			m_port(-1),
+			m_sq(),
+			m_cq(),
+			m_mem(),
+			m_pending(0),
+			m_failed(false),
+			m_conns(),
+			m_timers(),
+			m_due()
+		{
+
+		}
+
+		~uring_transport()
+		{
+			for (size_t fd=0; fd<m_conns.size(); ++fd)
+			{
+				if (m_conns[fd] != NULL)
+				{
+					close(static_cast<int>(fd));
+					delete m_conns[fd];
+				}
+			}
+			if (m_listen >= 0)
+				close(m_listen);
+			if (m_ring_fd >= 0)
+				close(m_ring_fd);
+			unmap(m_mem.ring, m_mem.ring_size);
+			unmap(m_mem.sqes, m_mem.sqes_size);
+			unmap(m_mem.buf_ring, m_mem.buf_ring_size);
+			unmap(m_mem.bufs, m_mem.bufs_size);
+		}
+
+		bool listen(const char* host, int32_t port)
+		{
+			if (!setup_ring() || !setup_buffers())
+				return false;
+
+			m_listen = open_listener(host, port, false);
+			if (m_listen < 0)
+				return false;
+
+			m_port = local_port(m_listen);
+			return arm_accept() && (submit(0, 0) >= 0);
+		}
+
+		int poll(int timeout_ms)
+		{
+			if (submit(1, m_timers.timeout(util::monotonic_ns(), timeout_ms)) < 0)
+				return -1;
+
+			// Reap completions - handling them queues new submissions
+			int handled = 0;
+			unsigned head = *m_cq.head;
+			while (head != util::atomic_load(m_cq.tail))
+			{
+				const struct io_uring_cqe& cqe = m_cq.cqes[head & *m_cq.mask];
+				complete(cqe.user_data, cqe.res, cqe.flags);
+				++head;
+				++handled;
+				util::atomic_store(m_cq.head, head);
+			}
+			release_due();
+
+			// Send responses right away
+			if (m_failed || ((m_pending > 0) && (submit(0, 0) < 0)))
+				return -1;
+			return handled;
+		}
+
+		int32_t port() const
+		{
+			return m_port;
+		}
+
+		const char* name() const
+		{
+			return "io_uring";
+		}
+
+	private:
+		enum operation
+		{
+			OP_ACCEPT = 1,
+			OP_RECV,
+			OP_SEND
+		};
+
+		// Number and size of the provided receive buffers
+		static const unsigned NUM_BUFS = 64;
+		static const unsigned BUF_SIZE = 16384;
+
+		struct connection
+		{
+			explicit connection(broker_stub& stub):
+				sess(stub),
+				msg(),
+				iov(),
+				receiving(false),
+				sending(false),
+				closing(false),
+				release_at(0)
+			{
+
+			}
+
+			session sess;
+			struct msghdr msg;
+			struct iovec iov[MAX_IOV];
+			bool receiving;
+			bool sending;
+			bool closing;
+
+			// Time of the timer releasing held back data (0 if none)
+			uint64_t release_at;
+		};
+
+		/**
+		 * Pointers into the mapped submission queue ring
+		 */
+		struct sq_ring
+		{
+			volatile unsigned* head;
+			volatile unsigned* tail;
+			unsigned* mask;
+			struct io_uring_sqe* sqes;
+		};
+
+		/**
+		 * Pointers into the mapped completion queue ring
+		 */
+		struct cq_ring
+		{
+			volatile unsigned* head;
+			volatile unsigned* tail;
+			unsigned* mask;
+			struct io_uring_cqe* cqes;
+		};
+
+		/**
+		 * Memory mapped for the rings and the provided buffers
+		 */
+		struct mappings
+		{
+			uint8_t* ring;
+			size_t ring_size;
+			void* sqes;
+			size_t sqes_size;
+			struct io_uring_buf* buf_ring;
+			size_t buf_ring_size;
+			uint8_t* bufs;
+			size_t bufs_size;
+		};
+
+		static void unmap(void* addr, size_t size)
+		{
+			if (addr != NULL)
+				munmap(addr, size);
+		}
+
+		static void* map(size_t size, int fd, off_t offset)
+		{
+			void* addr = (fd < 0) ?
+			             mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) :
+			             mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+			return (addr == MAP_FAILED) ? NULL : addr;
+		}
+
+		static uint64_t encode(operation op, int fd)
+		{
+			return (static_cast<uint64_t>(op) << 32) | static_cast<uint32_t>(fd);
+		}
+
+		bool setup_ring()
+		{
+			struct io_uring_params params;
+			memset(&params, 0, sizeof(params));
+			m_ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, m_entries, &params));
+			if ((m_ring_fd < 0) || !(params.features & IORING_FEAT_SINGLE_MMAP) ||
+			    !(params.features & IORING_FEAT_EXT_ARG))
+				return false;
+
+			size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+			size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+			m_mem.ring_size = std::max(sq_size, cq_size);
+			m_mem.ring = static_cast<uint8_t*>(map(m_mem.ring_size, m_ring_fd, IORING_OFF_SQ_RING));
+			m_mem.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+			m_mem.sqes = map(m_mem.sqes_size, m_ring_fd, IORING_OFF_SQES);
+			if ((m_mem.ring == NULL) || (m_mem.sqes == NULL))
+				return false;
+
+			m_sq.head = reinterpret_cast<unsigned*>(m_mem.ring + params.sq_off.head);
+			m_sq.tail = reinterpret_cast<unsigned*>(m_mem.ring + params.sq_off.tail);
+			m_sq.mask = reinterpret_cast<unsigned*>(m_mem.ring + params.sq_off.ring_mask);
+			m_sq.sqes = static_cast<struct io_uring_sqe*>(m_mem.sqes);
+			m_cq.head = reinterpret_cast<unsigned*>(m_mem.ring + params.cq_off.head);
+			m_cq.tail = reinterpret_cast<unsigned*>(m_mem.ring + params.cq_off.tail);
+			m_cq.mask = reinterpret_cast<unsigned*>(m_mem.ring + params.cq_off.ring_mask);
+			m_cq.cqes = reinterpret_cast<struct io_uring_cqe*>(m_mem.ring + params.cq_off.cqes);
+
+			// Submission queue entries are used in order
+			unsigned* array = reinterpret_cast<unsigned*>(m_mem.ring + params.sq_off.array);
+			for (unsigned i=0; i<params.sq_entries; ++i)
+			{
+				array[i] = i;
+			}
+			return true;
+		}
+
+		/**
+		 * Register the ring of provided buffers the receives pick from
+		 */
+		bool setup_buffers()
+		{
+			m_mem.buf_ring_size = NUM_BUFS * sizeof(struct io_uring_buf);
+			m_mem.buf_ring = static_cast<struct io_uring_buf*>(map(m_mem.buf_ring_size, -1, 0));
+			m_mem.bufs_size = NUM_BUFS * BUF_SIZE;
+			m_mem.bufs = static_cast<uint8_t*>(map(m_mem.bufs_size, -1, 0));
+			if ((m_mem.buf_ring == NULL) || (m_mem.bufs == NULL))
+				return false;
+
+			struct io_uring_buf_reg reg;
+			memset(&reg, 0, sizeof(reg));
+			reg.ring_addr = reinterpret_cast<uintptr_t>(m_mem.buf_ring);
+			reg.ring_entries = NUM_BUFS;
+			reg.bgid = 0;
+			if (syscall(__NR_io_uring_register, m_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+				return false;
+
+			for (unsigned i=0; i<NUM_BUFS; ++i)
+			{
+				recycle(static_cast<uint16_t>(i));
+			}
+			return true;
+		}
+
+		/**
+		 * Hand a receive buffer back to the kernel
+		 *
+		 * The ring is addressed as an array of io_uring_buf with the tail in the
+		 * reserved field of the first entry. struct io_uring_buf_ring is not
+		 * used as its flexible array member is laid out differently in C++.
+		 */
+		void recycle(uint16_t bid)
+		{
+			volatile uint16_t* tail = &m_mem.buf_ring[0].resv;
+			uint16_t cur = *tail;
+			struct io_uring_buf& buf = m_mem.buf_ring[cur & (NUM_BUFS - 1)];
+			buf.addr = reinterpret_cast<uintptr_t>(m_mem.bufs + static_cast<size_t>(bid) * BUF_SIZE);
+			buf.len = BUF_SIZE;
+			buf.bid = bid;
+			util::atomic_store(tail, static_cast<uint16_t>(cur + 1));
+		}
+
+		/**
+		 * Get a cleared submission queue entry, submitting queued entries
+		 * first while the queue is full - returns NULL if the kernel takes
+		 * none of them, as the entry would overwrite one not submitted yet
+		 */
+		struct io_uring_sqe* get_sqe()
+		{
+			unsigned tail = *m_sq.tail;
+			while (tail - util::atomic_load(m_sq.head) >= m_entries)
+			{
+				unsigned pending = m_pending;
+				if ((submit(0, 0) < 0) || (m_pending == pending))
+					return NULL;
+			}
+
+			struct io_uring_sqe* sqe = &m_sq.sqes[tail & *m_sq.mask];
+			memset(sqe, 0, sizeof(*sqe));
+			return sqe;
+		}
+
+		void push_sqe()
+		{
+			util::atomic_store(m_sq.tail, *m_sq.tail + 1);
+			++m_pending;
+		}
+
+		/**
+		 * Submit queued entries and wait for min_complete completions or the
+		 * timeout - returns -1 on error
+		 */
+		int submit(unsigned min_complete, int timeout_ms)
+		{
+			struct __kernel_timespec ts;
+			ts.tv_sec = timeout_ms / 1000;
+			ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+
+			struct io_uring_getevents_arg arg;
+			memset(&arg, 0, sizeof(arg));
+			arg.ts = reinterpret_cast<uintptr_t>(&ts);
+
+			unsigned flags = IORING_ENTER_EXT_ARG;
+			if ((min_complete > 0) && (timeout_ms != 0))
+				flags |= IORING_ENTER_GETEVENTS;
+			if (timeout_ms < 0)
+				arg.ts = 0;
+
+			long ret = syscall(__NR_io_uring_enter, m_ring_fd, m_pending, min_complete, flags, &arg, sizeof(arg));
+			if (ret < 0)
+				return ((errno == ETIME) || (errno == EINTR)) ? 0 : -1;
+
+			m_pending -= static_cast<unsigned>(ret);
+			return 0;
+		}
+
+		/**
+		 * Arm the multishot accept - returns false if it cannot be queued
+		 */
+		bool arm_accept()
+		{
+			struct io_uring_sqe* sqe = get_sqe();
+			if (sqe == NULL)
+				return false;
+
+			sqe->opcode = IORING_OP_ACCEPT;
+			sqe->fd = m_listen;
+			sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+			sqe->accept_flags = SOCK_CLOEXEC;
+			sqe->user_data = encode(OP_ACCEPT, m_listen);
+			push_sqe();
+			return true;
+		}
+
+		/**
+		 * Arm the multishot receive of a connection - the connection is shut
+		 * down if it cannot be queued
+		 */
+		void arm_recv(int fd, connection* conn)
+		{
+			struct io_uring_sqe* sqe = get_sqe();
+			if (sqe == NULL)
+			{
+				shutdown_connection(fd, conn);
+				return;
+			}
+
+			sqe->opcode = IORING_OP_RECV;
+			sqe->fd = fd;
+			sqe->ioprio = IORING_RECV_MULTISHOT;
+			sqe->flags = IOSQE_BUFFER_SELECT;
+			sqe->buf_group = 0;
+			sqe->user_data = encode(OP_RECV, fd);
+			push_sqe();
+			conn->receiving = true;
+		}
+
+		/**
+		 * Send the queued responses of a connection - the connection is shut
+		 * down if the send cannot be queued
+		 */
+		void send(int fd, connection* conn)
+		{
+			struct io_uring_sqe* sqe = get_sqe();
+			if (sqe == NULL)
+			{
+				shutdown_connection(fd, conn);
+				return;
+			}
+
+			conn->msg.msg_iov = conn->iov;
+			conn->msg.msg_iovlen = conn->sess.fill_iovec(conn->iov, MAX_IOV);
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = fd;
+			sqe->addr = reinterpret_cast<uintptr_t>(&conn->msg);
+			sqe->msg_flags = MSG_NOSIGNAL;
+			sqe->user_data = encode(OP_SEND, fd);
+			push_sqe();
+			conn->sending = true;
+		}
+
+		void complete(uint64_t user_data, int32_t res, uint32_t flags)
+		{
+			int fd = static_cast<int>(static_cast<uint32_t>(user_data));
+			switch (static_cast<operation>(user_data >> 32))
+			{
+				case OP_ACCEPT:
+					if (res >= 0)
+						add_connection(res);
+					if (!(flags & IORING_CQE_F_MORE) && !arm_accept())
+						m_failed = true;
+					break;
+				case OP_RECV:
+					received(fd, res, flags);
+					break;
+				case OP_SEND:
+					sent(fd, res);
+					break;
+				default:
+					break;
+			}
+		}
+
+		void add_connection(int fd)
+		{
+			set_nodelay(fd);
+			size_t idx = static_cast<size_t>(fd);
+			if (idx >= m_conns.size())
+				m_conns.resize(idx + 1, NULL);
+			m_conns[idx] = new connection(m_stub);
+			m_conns[idx]->sess.set_socket(fd);
+			arm_recv(fd, m_conns[idx]);
+			release_if_idle(fd, m_conns[idx]);
+		}
+
+		void received(int fd, int32_t res, uint32_t flags)
+		{
+			connection* conn = m_conns[static_cast<size_t>(fd)];
+			if (!(flags & IORING_CQE_F_MORE))
+				conn->receiving = false;
+
+			if (flags & IORING_CQE_F_BUFFER)
+			{
+				uint16_t bid = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+				if ((res > 0) && !conn->closing &&
+				    !conn->sess.receive(m_mem.bufs + static_cast<size_t>(bid) * BUF_SIZE, static_cast<size_t>(res)))
+				{
+					shutdown_connection(fd, conn);
+				}
+				recycle(bid);
+			}
+
+			if ((res == 0) || ((res < 0) && (res != -ENOBUFS)))
+			{
+				shutdown_connection(fd, conn);
+			}
+			else if (!conn->receiving && !conn->closing)
+			{
+				// Multishot receive ended, e.g. as buffers ran out
+				arm_recv(fd, conn);
+			}
+
+			if (!conn->sending && conn->sess.has_output() && !conn->closing)
+				send(fd, conn);
+			if (!conn->closing)
+				schedule_release(m_timers, fd, *conn);
+			release_if_idle(fd, conn);
+		}
+
+		/**
+		 * Release the data held back by connections whose timers expired
+		 */
+		void release_due()
+		{
+			if (m_timers.empty())
+				return;
+
+			uint64_t now = util::monotonic_ns();
+			m_due.clear();
+			m_timers.expire(now, m_due);
+			for (size_t i=0; i<m_due.size(); ++i)
+			{
+				int fd = m_due[i];
+				connection* conn = m_conns[static_cast<size_t>(fd)];
+				if ((conn == NULL) || conn->closing)
+					continue;
+
+				conn->release_at = 0;
+				if (!conn->sess.release(now))
+				{
+					shutdown_connection(fd, conn);
+					continue;
+				}
+				if (!conn->sending && conn->sess.has_output())
+					send(fd, conn);
+				if (!conn->closing)
+					schedule_release(m_timers, fd, *conn);
+				release_if_idle(fd, conn);
+			}
+		}
+
+		void sent(int fd, int32_t res)
+		{
+			connection* conn = m_conns[static_cast<size_t>(fd)];
+			conn->sending = false;
+			if (res < 0)
+			{
+				shutdown_connection(fd, conn);
+			}
+			else
+			{
+				conn->sess.consumed(static_cast<size_t>(res));
+				if (conn->sess.has_output() && !conn->closing)
+					send(fd, conn);
+			}
+			release_if_idle(fd, conn);
+		}
+
+		/**
+		 * Stop the connection - the multishot receive terminates on shutdown
+		 */
+		void shutdown_connection(int fd, connection* conn)
+		{
+			if (!conn->closing)
+			{
+				conn->closing = true;
+				::shutdown(fd, SHUT_RDWR);
+			}
+		}
+
+		void release_if_idle(int fd, connection* conn)
+		{
+			if (conn->closing && !conn->receiving && !conn->sending)
+			{
+				// The socket may be reused by the next connection
+				m_timers.cancel(fd);
+				close(fd);
+				delete conn;
+				m_conns[static_cast<size_t>(fd)] = NULL;
+			}
+		}
+
+		uring_transport(const uring_transport&);
+		uring_transport& operator=(const uring_transport&);
+
+		broker_stub& m_stub;
+		unsigned m_entries;
+		int m_ring_fd;
+		int m_listen;
+		int32_t m_port;
+		sq_ring m_sq;
+		cq_ring m_cq;
+		mappings m_mem;
+		unsigned m_pending;
+
+		// Set once the accept cannot be armed again
+		bool m_failed;
+		std::vector<connection*> m_conns;
+
+		// Releases of held back data by socket
+		timer_wheel m_timers;
+		std::vector<int> m_due;
+	};
+
+#endif
+
+}}
+
+#endif
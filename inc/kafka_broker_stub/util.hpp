@@ -4,6 +4,11 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdexcept>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 namespace kafka_broker_stub { namespace util {
 
@@ -52,6 +57,234 @@ namespace kafka_broker_stub { namespace util {
 	   (*tmp) = byte_swap(&val);
 	}
 
+	/**
+	 * Helper function templates for atomic access to integral types shared
+	 * between threads (full memory barriers through the GCC __sync builtins)
+	 */
+	template <typename T>
+	inline T atomic_load(const volatile T* ptr)
+	{
+		T val = *ptr;
+		__sync_synchronize();
+		return val;
+	}
+
+	template <typename T>
+	inline void atomic_store(volatile T* ptr, T val)
+	{
+		__sync_synchronize();
+		*ptr = val;
+		__sync_synchronize();
+	}
+
+	template <typename T>
+	inline bool atomic_cas(volatile T* ptr, T expected, T desired)
+	{
+		return __sync_bool_compare_and_swap(ptr, expected, desired);
+	}
+
+	template <typename T>
+	inline T atomic_fetch_add(volatile T* ptr, T val)
+	{
+		return __sync_fetch_and_add(ptr, val);
+	}
+
+	/**
+	 * Monotonic clock in nanoseconds
+	 */
+	inline uint64_t monotonic_ns()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return static_cast<uint64_t>(ts.tv_sec) * static_cast<uint64_t>(1000000000) + static_cast<uint64_t>(ts.tv_nsec);
+	}
+
+	/**
+	 * Time stamp counter of the CPU, monotonic_ns() where there is none.
+	 * Ticks must be calibrated against monotonic_ns() to get durations.
+	 */
+	inline uint64_t tsc()
+	{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+		uint32_t lo;
+		uint32_t hi;
+		__asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+		return (static_cast<uint64_t>(hi) << 32) | lo;
+#elif defined(__GNUC__) && defined(__aarch64__)
+		uint64_t val;
+		__asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(val));
+		return val;
+#else
+		return monotonic_ns();
+#endif
+	}
+
+	/**
+	 * Wall clock in milliseconds since epoch
+	 */
+	inline int64_t wallclock_ms()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		return static_cast<int64_t>(ts.tv_sec) * 1000 + static_cast<int64_t>(ts.tv_nsec / 1000000);
+	}
+
+	/**
+	 * 64-bit FNV-1a hash of a byte range
+	 */
+	inline uint64_t hash_bytes(const void* data, size_t size)
+	{
+		const uint64_t prime = (static_cast<uint64_t>(1) << 40) | 0x1b3;
+		uint64_t hash = (static_cast<uint64_t>(0xcbf29ce4) << 32) | 0x84222325;
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		for (size_t i=0; i<size; ++i)
+		{
+			hash ^= bytes[i];
+			hash *= prime;
+		}
+		return hash;
+	}
+
+	/**
+	 * CRC-32 (IEEE, as used in Kafka message format v0 and v1) of a byte
+	 * range. Pass the result of a previous call as crc to continue it.
+	 */
+	inline uint32_t crc32(const void* data, size_t size, uint32_t crc = 0)
+	{
+		static uint32_t table[256];
+		static volatile int ready = 0;
+		if (atomic_load(&ready) == 0)
+		{
+			for (uint32_t i=0; i<256; ++i)
+			{
+				uint32_t c = i;
+				for (int k=0; k<8; ++k)
+				{
+					c = (c & 1) ? (0xEDB88320U ^ (c >> 1)) : (c >> 1);
+				}
+				table[i] = c;
+			}
+			atomic_store(&ready, 1);
+		}
+
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		crc = ~crc;
+		for (size_t i=0; i<size; ++i)
+		{
+			crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+		}
+		return ~crc;
+	}
+
+	/**
+	 * CRC-32C (Castagnoli, as used in record batches of message format v2)
+	 * of a byte range. Pass the result of a previous call as crc to continue it.
+	 */
+	inline uint32_t crc32c(const void* data, size_t size, uint32_t crc = 0)
+	{
+		static uint32_t table[256];
+		static volatile int ready = 0;
+		if (atomic_load(&ready) == 0)
+		{
+			for (uint32_t i=0; i<256; ++i)
+			{
+				uint32_t c = i;
+				for (int k=0; k<8; ++k)
+				{
+					c = (c & 1) ? (0x82F63B78U ^ (c >> 1)) : (c >> 1);
+				}
+				table[i] = c;
+			}
+			atomic_store(&ready, 1);
+		}
+
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		crc = ~crc;
+		for (size_t i=0; i<size; ++i)
+		{
+			crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+		}
+		return ~crc;
+	}
+
+	/**
+	 * Read-only memory mapping of a file
+	 */
+	class mapped_file
+	{
+	public:
+		mapped_file():
+			m_data(NULL),
+			m_size(0)
+		{
+
+		}
+
+		~mapped_file()
+		{
+			close();
+		}
+
+		/**
+		 * Map the file - returns false if it cannot be opened or mapped
+		 */
+		bool open(const char* path)
+		{
+			close();
+
+			int fd = ::open(path, O_RDONLY);
+			if (fd < 0)
+			{
+				return false;
+			}
+
+			struct stat st;
+			if ((fstat(fd, &st) != 0) || (st.st_size <= 0))
+			{
+				::close(fd);
+				return false;
+			}
+
+			void* addr = mmap(NULL, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			::close(fd);
+			if (addr == MAP_FAILED)
+			{
+				return false;
+			}
+
+			m_data = static_cast<const uint8_t*>(addr);
+			m_size = static_cast<size_t>(st.st_size);
+			return true;
+		}
+
+		void close()
+		{
+			if (m_data != NULL)
+			{
+				munmap(const_cast<uint8_t*>(m_data), m_size);
+				m_data = NULL;
+				m_size = 0;
+			}
+		}
+
+		const uint8_t* data() const
+		{
+			return m_data;
+		}
+
+		size_t size() const
+		{
+			return m_size;
+		}
+
+	private:
+		mapped_file(const mapped_file&);
+		mapped_file& operator=(const mapped_file&);
+
+		const uint8_t* m_data;
+		size_t m_size;
+	};
+
 }}
 
 #endif
@@ -0,0 +1,175 @@
+#ifndef KAFKA_BROKER_STUB_WORKER_POOL_HPP_INC_
+#define KAFKA_BROKER_STUB_WORKER_POOL_HPP_INC_
+
+/*
+ * Fixed pool of threads running independent tasks of a batch in parallel.
+ */
+
+#include "util.hpp"
+#include <pthread.h>
+#include <stdexcept>
+#include <vector>
+
+namespace kafka_broker_stub {
+
+	/**
+	 * Pool of worker threads executing a batch of indexed tasks
+	 *
+	 * run() hands out the task indices through an atomic counter to the
+	 * workers and the calling thread and returns once all tasks are done.
+	 * Only one batch runs at a time.
+	 */
+	class worker_pool
+	{
+	public:
+		/**
+		 * Task function called with the batch context and a task index
+		 */
+		typedef void (*task_fn)(void* ctx, size_t index);
+
+		explicit worker_pool(size_t num_threads):
+			m_mutex(),
+			m_start(),
+			m_done(),
+			m_threads(),
+			m_batch(),
+			m_generation(0),
+			m_active(0),
+			m_stop(false)
+		{
+			if ((pthread_mutex_init(&m_mutex, NULL) != 0) || (pthread_cond_init(&m_start, NULL) != 0) ||
+			    (pthread_cond_init(&m_done, NULL) != 0))
+				throw std::runtime_error("Unable to initialize worker pool");
+
+			for (size_t i=0; i<num_threads; ++i)
+			{
+				pthread_t thread;
+				if (pthread_create(&thread, NULL, &worker_pool::work, this) != 0)
+				{
+					shutdown();
+					throw std::runtime_error("Unable to start worker thread");
+				}
+				m_threads.push_back(thread);
+			}
+		}
+
+		~worker_pool()
+		{
+			shutdown();
+			pthread_cond_destroy(&m_done);
+			pthread_cond_destroy(&m_start);
+			pthread_mutex_destroy(&m_mutex);
+		}
+
+		/**
+		 * Call fn(ctx, i) for i in [0, count) on the workers and the calling
+		 * thread and wait until all calls returned
+		 */
+		void run(size_t count, task_fn fn, void* ctx)
+		{
+			pthread_mutex_lock(&m_mutex);
+			m_batch.fn = fn;
+			m_batch.ctx = ctx;
+			m_batch.count = count;
+			m_batch.next = 0;
+			m_active = m_threads.size();
+			++m_generation;
+			pthread_cond_broadcast(&m_start);
+			pthread_mutex_unlock(&m_mutex);
+
+			execute();
+
+			pthread_mutex_lock(&m_mutex);
+			while (m_active > 0)
+			{
+				pthread_cond_wait(&m_done, &m_mutex);
+			}
+			pthread_mutex_unlock(&m_mutex);
+		}
+
+		size_t size() const
+		{
+			return m_threads.size();
+		}
+
+	private:
+		struct batch
+		{
+			task_fn fn;
+			void* ctx;
+			size_t count;
+			volatile size_t next;
+		};
+
+		/**
+		 * Take and execute tasks of the current batch until none are left
+		 */
+		void execute()
+		{
+			for (;;)
+			{
+				size_t index = util::atomic_fetch_add(&m_batch.next, static_cast<size_t>(1));
+				if (index >= m_batch.count)
+					return;
+				m_batch.fn(m_batch.ctx, index);
+			}
+		}
+
+		static void* work(void* arg)
+		{
+			worker_pool* pool = static_cast<worker_pool*>(arg);
+			unsigned seen = 0;
+			for (;;)
+			{
+				pthread_mutex_lock(&pool->m_mutex);
+				while (!pool->m_stop && (pool->m_generation == seen))
+				{
+					pthread_cond_wait(&pool->m_start, &pool->m_mutex);
+				}
+				if (pool->m_stop)
+				{
+					pthread_mutex_unlock(&pool->m_mutex);
+					return NULL;
+				}
+				seen = pool->m_generation;
+				pthread_mutex_unlock(&pool->m_mutex);
+
+				pool->execute();
+
+				pthread_mutex_lock(&pool->m_mutex);
+				if (--pool->m_active == 0)
+					pthread_cond_signal(&pool->m_done);
+				pthread_mutex_unlock(&pool->m_mutex);
+			}
+		}
+
+		void shutdown()
+		{
+			pthread_mutex_lock(&m_mutex);
+			m_stop = true;
+			pthread_cond_broadcast(&m_start);
+			pthread_mutex_unlock(&m_mutex);
+
+			for (size_t i=0; i<m_threads.size(); ++i)
+			{
+				pthread_join(m_threads[i], NULL);
+			}
+			m_threads.clear();
+		}
+
+		worker_pool(const worker_pool&);
+		worker_pool& operator=(const worker_pool&);
+
+		pthread_mutex_t m_mutex;
+		pthread_cond_t m_start;
+		pthread_cond_t m_done;
+		std::vector<pthread_t> m_threads;
+		batch m_batch;
+		unsigned m_generation;
+		size_t m_active;
+		bool m_stop;
+	};
+
+}
+
+#endif
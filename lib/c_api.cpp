@@ -0,0 +1,276 @@
+/*
+ * Implementation of the C interface of the broker stub (see c_api.h).
+ *
+ * Exceptions must not cross the C boundary, so every entry point catches
+ * them and reports KBS_ERR_INTERNAL (or NULL) instead.
+ */
+
+#include "kafka_broker_stub/c_api.h"
+#include "kafka_broker_stub/main.hpp"
+
+namespace kbs = kafka_broker_stub;
+
+struct kbs_stub
+{
+	kbs_stub(int32_t node_id, const char* host, int32_t port):
+		stub(node_id, host, port),
+		responses(),
+		requests(0),
+		bytes_received(0),
+		bytes_sent(0)
+	{
+
+	}
+
+	kbs::broker_stub stub;
+	std::vector<std::string> responses;
+	uint64_t requests;
+	uint64_t bytes_received;
+	uint64_t bytes_sent;
+
+private:
+	kbs_stub(const kbs_stub&);
+	kbs_stub& operator=(const kbs_stub&);
+};
+
+namespace {
+
+	int find_partition(const kbs_stub* stub, const char* topic, int32_t partition, const kbs::partition** part)
+	{
+		if ((stub == NULL) || (topic == NULL) || (partition < 0))
+			return KBS_ERR_INVALID_ARG;
+
+		const kbs::topic* top = stub->stub.get_topic(topic);
+		if (top == NULL)
+			return KBS_ERR_UNKNOWN_TOPIC;
+
+		*part = top->get_partition(static_cast<size_t>(partition));
+		return (*part == NULL) ? KBS_ERR_UNKNOWN_PARTITION : KBS_OK;
+	}
+
+}
+
+kbs_stub* kbs_stub_create(int32_t node_id, const char* host, int32_t port)
+{
+	if (host == NULL)
+		return NULL;
+
+	try
+	{
+		return new kbs_stub(node_id, host, port);
+	}
+	catch (const std::exception&)
+	{
+		return NULL;
+	}
+}
+
+void kbs_stub_destroy(kbs_stub* stub)
+{
+	delete stub;
+}
+
+int kbs_stub_add_topic(kbs_stub* stub, const char* name, int32_t num_partitions)
+{
+	if ((stub == NULL) || (name == NULL) || (num_partitions <= 0))
+		return KBS_ERR_INVALID_ARG;
+
+	try
+	{
+		std::vector<kbs::partition> partitions;
+		partitions.reserve(static_cast<size_t>(num_partitions));
+		for (int32_t i=0; i<num_partitions; ++i)
+		{
+			partitions.push_back(kbs::partition(i, stub->stub.node_id()));
+		}
+		return stub->stub.adopt_topic(name, partitions) ? KBS_OK : KBS_ERR_TOPIC_EXISTS;
+	}
+	catch (const std::exception&)
+	{
+		return KBS_ERR_INTERNAL;
+	}
+}
+
+int kbs_stub_add_message(kbs_stub* stub, const char* topic, int32_t partition, const uint8_t* key,
+                         size_t key_size, const uint8_t* value, size_t value_size)
+{
+	if ((stub == NULL) || (topic == NULL) || (partition < 0) || ((key == NULL) && (key_size > 0)) ||
+	    ((value == NULL) && (value_size > 0)))
+	{
+		return KBS_ERR_INVALID_ARG;
+	}
+
+	try
+	{
+		kbs::topic* top = stub->stub.get_topic_registry().get_writeable(topic);
+		if (top == NULL)
+			return KBS_ERR_UNKNOWN_TOPIC;
+
+		kbs::partition* part = top->get_partition_writeable(static_cast<size_t>(partition));
+		if (part == NULL)
+			return KBS_ERR_UNKNOWN_PARTITION;
+
+		std::string k = (key_size > 0) ? std::string(reinterpret_cast<const char*>(key), key_size) : std::string();
+		std::string v = (value_size > 0) ? std::string(reinterpret_cast<const char*>(value), value_size) :
+		                                   std::string();
+		part->add_data(k, v);
+		return KBS_OK;
+	}
+	catch (const std::exception&)
+	{
+		return KBS_ERR_INTERNAL;
+	}
+}
+
+int64_t kbs_stub_handle_data(kbs_stub* stub, const uint8_t* data, size_t size)
+{
+	if ((stub == NULL) || ((data == NULL) && (size > 0)))
+		return KBS_ERR_INVALID_ARG;
+
+	try
+	{
+		size_t num_responses = stub->responses.size();
+		int bytes_read = stub->stub.handle_data(data, size, stub->responses);
+		if (bytes_read < 0)
+			return KBS_ERR_PARSE;
+
+		// Count the requests read by walking their sizes
+		size_t pos = 0;
+		while (pos < static_cast<size_t>(bytes_read))
+		{
+			pos += 4 + static_cast<size_t>(kbs::util::read_type<int32_t>(data + pos));
+			++stub->requests;
+		}
+		stub->bytes_received += static_cast<uint64_t>(bytes_read);
+		for (size_t i=num_responses; i<stub->responses.size(); ++i)
+		{
+			stub->bytes_sent += stub->responses[i].size();
+		}
+		return bytes_read;
+	}
+	catch (const std::exception&)
+	{
+		return KBS_ERR_INTERNAL;
+	}
+}
+
+size_t kbs_stub_response_count(const kbs_stub* stub)
+{
+	return (stub == NULL) ? 0 : stub->responses.size();
+}
+
+const uint8_t* kbs_stub_response(const kbs_stub* stub, size_t index, size_t* size)
+{
+	if ((stub == NULL) || (index >= stub->responses.size()))
+		return NULL;
+
+	if (size != NULL)
+		*size = stub->responses[index].size();
+	return reinterpret_cast<const uint8_t*>(stub->responses[index].data());
+}
+
+void kbs_stub_clear_responses(kbs_stub* stub)
+{
+	if (stub != NULL)
+		stub->responses.clear();
+}
+
+int64_t kbs_stub_read_records(const kbs_stub* stub, const char* topic, int32_t partition, int64_t offset,
+                              kbs_record* records, size_t max)
+{
+	if ((records == NULL) && (max > 0))
+		return KBS_ERR_INVALID_ARG;
+
+	try
+	{
+		const kbs::partition* part = NULL;
+		int ret = find_partition(stub, topic, partition, &part);
+		if (ret != KBS_OK)
+			return ret;
+
+		// Tombstones of compacted partitions are read with a NULL value like
+		// values produced as null
+		const kbs::record_log& data = part->data();
+		const kbs::compacted_view* compacted = part->compaction_enabled() ? &part->compacted() : NULL;
+		int64_t start = part->log_start_offset();
+		size_t first = (offset > start) ? static_cast<size_t>(offset - start) : 0;
+		size_t count = 0;
+		for (size_t i=first; (i < data.size()) && (count < max); ++i, ++count)
+		{
+			const kbs::key_value_pair& rec = data[i];
+			kbs_record& out = records[count];
+			out.offset = start + static_cast<int64_t>(i);
+			out.timestamp = rec.timestamp();
+			out.key = rec.null_key() ? NULL : reinterpret_cast<const uint8_t*>(rec.key().data());
+			out.key_size = rec.key().size();
+			out.value = reinterpret_cast<const uint8_t*>(rec.value().data());
+			out.value_size = rec.value().size();
+			if (rec.null_value() || ((compacted != NULL) && compacted->is_tombstone(out.offset)))
+			{
+				out.value = NULL;
+				out.value_size = 0;
+			}
+		}
+		return static_cast<int64_t>(count);
+	}
+	catch (const std::exception&)
+	{
+		return KBS_ERR_INTERNAL;
+	}
+}
+
+int kbs_stub_get_partition_stats(const kbs_stub* stub, const char* topic, int32_t partition,
+                                 kbs_partition_stats* stats)
+{
+	if (stats == NULL)
+		return KBS_ERR_INVALID_ARG;
+
+	try
+	{
+		const kbs::partition* part = NULL;
+		int ret = find_partition(stub, topic, partition, &part);
+		if (ret != KBS_OK)
+			return ret;
+
+		stats->log_start_offset = part->log_start_offset();
+		stats->next_offset = part->next_offset();
+		stats->messages = static_cast<uint64_t>(stats->next_offset - stats->log_start_offset);
+		stats->size_bytes = part->size_bytes();
+		return KBS_OK;
+	}
+	catch (const std::exception&)
+	{
+		return KBS_ERR_INTERNAL;
+	}
+}
+
+int kbs_stub_get_stats(const kbs_stub* stub, kbs_stub_stats* stats)
+{
+	if ((stub == NULL) || (stats == NULL))
+		return KBS_ERR_INVALID_ARG;
+
+	try
+	{
+		memset(stats, 0, sizeof(*stats));
+		const std::vector<kbs::topic>& topics = stub->stub.get_topic_registry().topics();
+		stats->topics = topics.size();
+		for (size_t i=0; i<topics.size(); ++i)
+		{
+			const std::vector<kbs::partition>& partitions = topics[i].partitions();
+			stats->partitions += partitions.size();
+			for (size_t k=0; k<partitions.size(); ++k)
+			{
+				stats->messages += static_cast<uint64_t>(partitions[k].next_offset() - partitions[k].log_start_offset());
+				stats->size_bytes += partitions[k].size_bytes();
+			}
+		}
+		stats->requests = stub->requests;
+		stats->bytes_received = stub->bytes_received;
+		stats->bytes_sent = stub->bytes_sent;
+		return KBS_OK;
+	}
+	catch (const std::exception&)
+	{
+		return KBS_ERR_INTERNAL;
+	}
+}
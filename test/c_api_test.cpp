@@ -0,0 +1,231 @@
+#include "kafka_broker_stub/c_api.h"
+#include "kafka_broker_stub/c_api.h"
+#include "kafka_broker_stub/util.hpp"
+
+#include "test_common.hpp"
+#include <string.h>
+
+namespace kbs = kafka_broker_stub;
+
+/*
+ * Uses the stub through the shared library only, like a harness in another
+ * language would
+ */
+class c_api_test : public kbs::test::suite
+{
+public:
+	c_api_test(const std::string& name):
+		suite(name),
+		m_stub(NULL)
+	{
+
+	}
+
+	~c_api_test()
+	{
+		kbs_stub_destroy(m_stub);
+	}
+
+private:
+	static void put16(std::string& out, int16_t val)
+	{
+		uint8_t buf[2];
+		kbs::util::write_type<int16_t>(val, buf);
+		out.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+	}
+
+	static void put32(std::string& out, int32_t val)
+	{
+		uint8_t buf[4];
+		kbs::util::write_type<int32_t>(val, buf);
+		out.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+	}
+
+	// Metadata request for all topics framed with its size
+	static std::string metadata_request(int32_t corr_id)
+	{
+		std::string out;
+		put16(out, 3);
+		put16(out, 0);
+		put32(out, corr_id);
+		put16(out, 4);
+		out += "test";
+		put32(out, 0);
+		std::string framed;
+		put32(framed, static_cast<int32_t>(out.size()));
+		return framed + out;
+	}
+
+	static void put_bytes(std::string& out, const char* val)
+	{
+		put32(out, (val == NULL) ? -1 : static_cast<int32_t>(strlen(val)));
+		if (val != NULL)
+			out += val;
+	}
+
+	// Produce request v0 with one message for partition 0 of topic "events"
+	static std::string produce_request(const char* key, const char* value)
+	{
+		std::string msg;
+		msg += '\0';
+		msg += '\0';
+		put_bytes(msg, key);
+		put_bytes(msg, value);
+		std::string crc;
+		put32(crc, static_cast<int32_t>(kbs::util::crc32(msg.data(), msg.size())));
+
+		std::string out;
+		put16(out, 0);
+		put16(out, 0);
+		put32(out, 7);
+		put16(out, 4);
+		out += "test";
+		put16(out, 1);
+		put32(out, 1000);
+		put32(out, 1);
+		put16(out, 6);
+		out += "events";
+		put32(out, 1);
+		put32(out, 0);
+		put32(out, static_cast<int32_t>(16 + msg.size()));
+		put32(out, 0);
+		put32(out, 0);
+		put32(out, static_cast<int32_t>(4 + msg.size()));
+		out += crc + msg;
+		std::string framed;
+		put32(framed, static_cast<int32_t>(out.size()));
+		return framed + out;
+	}
+
+	void topic_test()
+	{
+		m_stub = kbs_stub_create(1, "localhost", 9092);
+		ASSERT_NEQ(m_stub, static_cast<kbs_stub*>(NULL));
+		ASSERT_EQ(kbs_stub_create(1, NULL, 9092), static_cast<kbs_stub*>(NULL));
+
+		ASSERT_EQ(kbs_stub_add_topic(m_stub, "events", 2), KBS_OK);
+		ASSERT_EQ(kbs_stub_add_topic(m_stub, "events", 1), KBS_ERR_TOPIC_EXISTS);
+		ASSERT_EQ(kbs_stub_add_topic(m_stub, "empty", 0), KBS_ERR_INVALID_ARG);
+		ASSERT_EQ(kbs_stub_add_topic(NULL, "events", 1), KBS_ERR_INVALID_ARG);
+
+		const uint8_t key[] = { 'k' };
+		const uint8_t value[] = { 'v', 'a', 'l' };
+		ASSERT_EQ(kbs_stub_add_message(m_stub, "events", 1, key, sizeof(key), value, sizeof(value)), KBS_OK);
+		ASSERT_EQ(kbs_stub_add_message(m_stub, "events", 1, NULL, 0, value, 1), KBS_OK);
+		ASSERT_EQ(kbs_stub_add_message(m_stub, "events", 2, key, 1, value, 1), KBS_ERR_UNKNOWN_PARTITION);
+		ASSERT_EQ(kbs_stub_add_message(m_stub, "other", 0, key, 1, value, 1), KBS_ERR_UNKNOWN_TOPIC);
+		ASSERT_EQ(kbs_stub_add_message(m_stub, "events", 0, NULL, 1, value, 1), KBS_ERR_INVALID_ARG);
+	}
+
+	void records_test()
+	{
+		kbs_record records[4];
+		ASSERT_EQ(kbs_stub_read_records(m_stub, "events", 1, 0, records, 4), static_cast<int64_t>(2));
+		ASSERT_EQ(records[0].offset, static_cast<int64_t>(0));
+		ASSERT_EQ(std::string(reinterpret_cast<const char*>(records[0].key), records[0].key_size), std::string("k"));
+		ASSERT_EQ(std::string(reinterpret_cast<const char*>(records[0].value), records[0].value_size),
+		          std::string("val"));
+		ASSERT_EQ(records[0].timestamp > 0, true);
+		ASSERT_EQ(records[1].offset, static_cast<int64_t>(1));
+		ASSERT_EQ(records[1].key_size, static_cast<size_t>(0));
+		ASSERT_EQ(records[1].value_size, static_cast<size_t>(1));
+
+		// Records are read in place - reading again points to the same bytes
+		kbs_record again;
+		ASSERT_EQ(kbs_stub_read_records(m_stub, "events", 1, 1, &again, 1), static_cast<int64_t>(1));
+		ASSERT_EQ(again.value, records[1].value);
+
+		ASSERT_EQ(kbs_stub_read_records(m_stub, "events", 1, 2, records, 4), static_cast<int64_t>(0));
+		ASSERT_EQ(kbs_stub_read_records(m_stub, "events", 0, 0, records, 4), static_cast<int64_t>(0));
+		ASSERT_EQ(kbs_stub_read_records(m_stub, "events", 5, 0, records, 4),
+		          static_cast<int64_t>(KBS_ERR_UNKNOWN_PARTITION));
+		ASSERT_EQ(kbs_stub_read_records(m_stub, "other", 0, 0, records, 4), static_cast<int64_t>(KBS_ERR_UNKNOWN_TOPIC));
+		ASSERT_EQ(kbs_stub_read_records(m_stub, "events", 1, 0, NULL, 4), static_cast<int64_t>(KBS_ERR_INVALID_ARG));
+
+		// Null keys and values are read as NULL, empty ones are not
+		std::string req = produce_request(NULL, "v") + produce_request("k", NULL) + produce_request("", "");
+		ASSERT_EQ(kbs_stub_handle_data(m_stub, reinterpret_cast<const uint8_t*>(req.data()), req.size()),
+		          static_cast<int64_t>(req.size()));
+		kbs_stub_clear_responses(m_stub);
+		ASSERT_EQ(kbs_stub_read_records(m_stub, "events", 0, 0, records, 4), static_cast<int64_t>(3));
+		ASSERT_EQ(records[0].key, static_cast<const uint8_t*>(NULL));
+		ASSERT_EQ(records[0].key_size, static_cast<size_t>(0));
+		ASSERT_NEQ(records[0].value, static_cast<const uint8_t*>(NULL));
+		ASSERT_NEQ(records[1].key, static_cast<const uint8_t*>(NULL));
+		ASSERT_EQ(records[1].value, static_cast<const uint8_t*>(NULL));
+		ASSERT_EQ(records[1].value_size, static_cast<size_t>(0));
+		ASSERT_NEQ(records[2].key, static_cast<const uint8_t*>(NULL));
+		ASSERT_NEQ(records[2].value, static_cast<const uint8_t*>(NULL));
+	}
+
+	void handle_data_test()
+	{
+		std::string req = metadata_request(42) + metadata_request(43);
+		const uint8_t* data = reinterpret_cast<const uint8_t*>(req.data());
+
+		// Incomplete requests are left unread
+		ASSERT_EQ(kbs_stub_handle_data(m_stub, data, req.size() - 1), static_cast<int64_t>(req.size() / 2));
+		ASSERT_EQ(kbs_stub_response_count(m_stub), static_cast<size_t>(1));
+		ASSERT_EQ(kbs_stub_handle_data(m_stub, data + req.size() / 2, req.size() / 2),
+		          static_cast<int64_t>(req.size() / 2));
+		ASSERT_EQ(kbs_stub_response_count(m_stub), static_cast<size_t>(2));
+
+		size_t size = 0;
+		const uint8_t* resp = kbs_stub_response(m_stub, 1, &size);
+		ASSERT_NEQ(resp, static_cast<const uint8_t*>(NULL));
+		ASSERT_EQ(kbs::util::read_type<int32_t>(resp), static_cast<int32_t>(size - 4));
+		ASSERT_EQ(kbs::util::read_type<int32_t>(resp + 4), static_cast<int32_t>(43));
+		ASSERT_EQ(kbs_stub_response(m_stub, 2, &size), static_cast<const uint8_t*>(NULL));
+
+		kbs_stub_clear_responses(m_stub);
+		ASSERT_EQ(kbs_stub_response_count(m_stub), static_cast<size_t>(0));
+
+		// Invalid message size
+		const uint8_t bad[5] = { 0 };
+		ASSERT_EQ(kbs_stub_handle_data(m_stub, bad, sizeof(bad)), static_cast<int64_t>(KBS_ERR_PARSE));
+	}
+
+	void stats_test()
+	{
+		kbs_partition_stats part;
+		ASSERT_EQ(kbs_stub_get_partition_stats(m_stub, "events", 1, &part), KBS_OK);
+		ASSERT_EQ(part.log_start_offset, static_cast<int64_t>(0));
+		ASSERT_EQ(part.next_offset, static_cast<int64_t>(2));
+		ASSERT_EQ(part.messages, static_cast<uint64_t>(2));
+		ASSERT_EQ(part.size_bytes, static_cast<uint64_t>(5));
+		ASSERT_EQ(kbs_stub_get_partition_stats(m_stub, "events", 2, &part), KBS_ERR_UNKNOWN_PARTITION);
+
+		kbs_stub_stats stats;
+		ASSERT_EQ(kbs_stub_get_stats(m_stub, &stats), KBS_OK);
+		ASSERT_EQ(stats.topics, static_cast<uint64_t>(1));
+		ASSERT_EQ(stats.partitions, static_cast<uint64_t>(2));
+		// Including the three messages produced in records_test
+		std::string produced = produce_request(NULL, "v") + produce_request("k", NULL) + produce_request("", "");
+		ASSERT_EQ(stats.messages, static_cast<uint64_t>(5));
+		ASSERT_EQ(stats.size_bytes, static_cast<uint64_t>(7));
+		ASSERT_EQ(stats.requests, static_cast<uint64_t>(5));
+		ASSERT_EQ(stats.bytes_received, static_cast<uint64_t>(2 * metadata_request(0).size() + produced.size()));
+		ASSERT_EQ(stats.bytes_sent > 0, true);
+		ASSERT_EQ(kbs_stub_get_stats(m_stub, NULL), KBS_ERR_INVALID_ARG);
+	}
+
+	void tests()
+	{
+		topic_test();
+		records_test();
+		handle_data_test();
+		stats_test();
+	}
+
+	kbs_stub* m_stub;
+
+	c_api_test(const c_api_test&);
+	c_api_test& operator=(const c_api_test&);
+};
+
+int main()
+{
+	c_api_test suite("C API unittests");
+	suite.execute_tests();
+	return 0;
+}
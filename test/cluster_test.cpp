@@ -0,0 +1,179 @@
+#include "kafka_broker_stub/cluster.hpp"
+#include "kafka_broker_stub/cluster.hpp"
+
+#include "test_common.hpp"
+
+namespace kbs = kafka_broker_stub;
+
+class cluster_test : public kbs::test::suite
+{
+public:
+	cluster_test(const std::string& name): suite(name) { }
+
+private:
+	void assignment_test()
+	{
+		kbs::cluster clu;
+		ASSERT_EQ(clu.add_topic("test", 1, 1), false);
+
+		ASSERT_NEQ(clu.add_node(0, "localhost", 9092), static_cast<kbs::broker_stub*>(NULL));
+		ASSERT_NEQ(clu.add_node(1, "localhost", 9093), static_cast<kbs::broker_stub*>(NULL));
+		ASSERT_NEQ(clu.add_node(2, "localhost", 9094), static_cast<kbs::broker_stub*>(NULL));
+		ASSERT_EQ(clu.add_node(2, "localhost", 9095), static_cast<kbs::broker_stub*>(NULL));
+		ASSERT_EQ(clu.size(), static_cast<size_t>(3));
+
+		// Replication factor must be satisfied by the nodes
+		ASSERT_EQ(clu.add_topic("test", 6, 4), false);
+		ASSERT_EQ(clu.add_topic("test", 6, 3), true);
+		ASSERT_EQ(clu.add_topic("test", 6, 3), false);
+
+		// Leaders are spread round-robin and replicas follow the leader
+		const kbs::topic* top = clu.get_topic("test");
+		ASSERT_NEQ(top, static_cast<const kbs::topic*>(NULL));
+		ASSERT_EQ(top->partitions().size(), static_cast<size_t>(6));
+		for (size_t p=0; p<6; ++p)
+		{
+			const kbs::partition* part = top->get_partition(p);
+			ASSERT_EQ(part->leader(), static_cast<int32_t>(p % 3));
+			ASSERT_EQ(part->replicas().size(), static_cast<size_t>(3));
+			ASSERT_EQ(part->replicas()[0], part->leader());
+			ASSERT_EQ(part->replicas()[1], static_cast<int32_t>((p + 1) % 3));
+			ASSERT_EQ(part->isr().size(), static_cast<size_t>(3));
+		}
+
+		// The next topic starts on the next node
+		ASSERT_EQ(clu.add_topic("other", 2, 1), true);
+		ASSERT_EQ(clu.get_topic("other")->get_partition(0)->leader(), static_cast<int32_t>(1));
+		ASSERT_EQ(clu.get_leader("other", 1), clu.get_node(2));
+		ASSERT_EQ(clu.get_leader("other", 2), static_cast<kbs::broker_stub*>(NULL));
+		ASSERT_EQ(clu.get_leader("unknown", 0), static_cast<kbs::broker_stub*>(NULL));
+
+		// All nodes share the topics
+		ASSERT_EQ(clu.get_node(2)->get_topic("test"), clu.get_topic("test"));
+	}
+
+	void metadata_test()
+	{
+		kbs::cluster clu;
+		clu.add_node(0, "localhost", 9092);
+		clu.add_node(1, "localhost", 9093);
+		clu.add_topic("test", 1, 2);
+
+		// Metadata request for topic "test" sent to node 1
+		uint8_t req[] = {
+			0x00, 0x00, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00,
+			0x00, 0x00, 0x02, 0x00, 0x07, 0x72, 0x64, 0x6b, 0x61,
+			0x66, 0x6b, 0x61, 0x00, 0x00, 0x00, 0x01, 0x00, 0x04,
+			0x74, 0x65, 0x73, 0x74
+		};
+
+		std::vector<std::string> responses;
+		int ret = clu.get_node(1)->handle_data(req, sizeof(req), responses);
+		ASSERT_EQ(ret, static_cast<int>(sizeof(req)));
+
+		uint8_t expected_resp[] = {
+			0x00, 0x00, 0x00, 0x60, // Message size
+			0x00, 0x00, 0x00, 0x02, // Corr. id
+
+			0x00, 0x00, 0x00, 0x02, // Array of brokers
+				0x00, 0x00, 0x00, 0x01, // Broker id
+				0x00, 0x09, 0x6C, 0x6F, 0x63, 0x61, 0x6C, 0x68, 0x6F, 0x73, 0x74, // Host
+				0x00, 0x00, 0x23, 0x85, // Port
+				0x00, 0x00, 0x00, 0x00, // Broker id
+				0x00, 0x09, 0x6C, 0x6F, 0x63, 0x61, 0x6C, 0x68, 0x6F, 0x73, 0x74, // Host
+				0x00, 0x00, 0x23, 0x84, // Port
+
+			0x00, 0x00, 0x00, 0x01, // Array of topic metadata
+				0x00, 0x00, // Err. code success
+				0x00, 0x04, 0x74, 0x65, 0x73, 0x74, // Name as string "test"
+				0x00, 0x00, 0x00, 0x01, // Array of partition metadata
+					0x00, 0x00, // Err. code
+					0x00, 0x00, 0x00, 0x00, // Partition ID
+					0x00, 0x00, 0x00, 0x00, // Leader ID
+					0x00, 0x00, 0x00, 0x02, // Array of replicas IDs
+						0x00, 0x00, 0x00, 0x00,
+						0x00, 0x00, 0x00, 0x01,
+					0x00, 0x00, 0x00, 0x02, // Array of ISR ids
+						0x00, 0x00, 0x00, 0x00,
+						0x00, 0x00, 0x00, 0x01
+		};
+		ASSERT_EQ(responses.size(), static_cast<size_t>(1));
+		ASSERT_EQ(responses[0].size(), sizeof(expected_resp));
+		ASSERT_EQ(memcmp(responses[0].data(), expected_resp, sizeof(expected_resp)), 0);
+	}
+
+	void produce_test()
+	{
+		kbs::cluster clu;
+		clu.add_node(0, "localhost", 9092);
+		clu.add_node(1, "localhost", 9093);
+		clu.add_topic("test", 2, 2);
+
+		// Produce request for partition 1 which is led by node 1
+		uint8_t req[] = {
+			0x00, 0x00, 0x00, 0x52, // Length of message 82 bytes
+			0x00, 0x00, // Api key 0
+			0x00, 0x00, // Api version 0
+			0x00, 0x00, 0x00, 0x03, // Correlation id 3
+			0x00, 0x07, 0x72, 0x64, 0x6b, 0x61, 0x66, 0x6b, 0x61, // client id string
+			0x00, 0x01, // acks
+			0x00, 0x00, 0x13, 0x88, // timeout
+			0x00, 0x00, 0x00, 0x01, // topic data array start
+				0x00, 0x04, 0x74, 0x65, 0x73, 0x74, // topic name string
+				0x00, 0x00, 0x00, 0x01, // data array start
+					0x00, 0x00, 0x00, 0x01, // partition id
+					0x00, 0x00, 0x00, 0x25, // length of binary message (rest of payload)
+						0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x09, // offset
+						0x00, 0x00, 0x00, 0x19, // message size
+						0xa6, 0xb1, 0x36, 0x2b, // crc
+						0xFF, // magic byte
+						0x00, // attributes
+						0xff, 0xff, 0xff, 0xff, // key byte array
+						0x00, 0x00, 0x00, 0x0b, // value bytearray length (rest of payload)
+							0x74, 0x65, 0x73, 0x74, 0x6d, 0x65,
+							0x73, 0x73, 0x61, 0x67, 0x65};
+
+		// Node 0 is only a follower so it must reject the data
+		std::vector<std::string> responses;
+		int ret = clu.get_node(0)->handle_data(req, sizeof(req), responses);
+		ASSERT_EQ(ret, static_cast<int>(sizeof(req)));
+
+		uint8_t expected_resp[] = {
+			0x00, 0x00, 0x00, 0x20,
+			0x00, 0x00, 0x00, 0x03, // Correlation ID
+			0x00, 0x00, 0x00, 0x01, // Array of responses start
+				0x00, 0x04, 0x74, 0x65, 0x73, 0x74, // Topic name string
+				0x00, 0x00, 0x00, 0x01, // Array of partition responses start
+					0x00, 0x00, 0x00, 0x01, // Partition ID
+					0x00, 0x06, // Partition error code (not leader for partition)
+					0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF // Offset
+		};
+		ASSERT_EQ(responses.size(), static_cast<size_t>(1));
+		ASSERT_EQ(responses[0].size(), sizeof(expected_resp));
+		ASSERT_EQ(memcmp(responses[0].data(), expected_resp, sizeof(expected_resp)), 0);
+		ASSERT_EQ(clu.get_topic("test")->get_partition(1)->data().size(), static_cast<size_t>(0));
+
+		// The leader accepts it
+		responses.clear();
+		ret = clu.get_leader("test", 1)->handle_data(req, sizeof(req), responses);
+		ASSERT_EQ(ret, static_cast<int>(sizeof(req)));
+		ASSERT_EQ(responses.size(), static_cast<size_t>(1));
+		ASSERT_EQ(responses[0][27], static_cast<char>(0x00));
+		ASSERT_EQ(clu.get_topic("test")->get_partition(1)->data().size(), static_cast<size_t>(1));
+		ASSERT_EQ(clu.get_topic("test")->get_partition(1)->data()[0].value(), std::string("testmessage"));
+	}
+
+	void tests()
+	{
+		assignment_test();
+		metadata_test();
+		produce_test();
+	}
+};
+
+int main()
+{
+	cluster_test suite("Cluster unittests");
+	suite.execute_tests();
+	return 0;
+}
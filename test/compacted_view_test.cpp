@@ -0,0 +1,128 @@
+#include "kafka_broker_stub/compacted_view.hpp"
+#include "kafka_broker_stub/compacted_view.hpp"
+
+#include "test_common.hpp"
+
+#include <sstream>
+
+namespace kbs = kafka_broker_stub;
+
+class compacted_view_test : public kbs::test::suite
+{
+public:
+	compacted_view_test(const std::string& name): suite(name) { }
+
+private:
+	void add_test()
+	{
+		kbs::compacted_view view;
+		ASSERT_EQ(view.find("a"), static_cast<int64_t>(-1));
+		ASSERT_EQ(view.is_latest(0), false);
+
+		// Offsets start where the partition is
+		ASSERT_EQ(view.add("a", 10, false), static_cast<int64_t>(-1));
+		ASSERT_EQ(view.add("b", 11, false), static_cast<int64_t>(-1));
+		ASSERT_EQ(view.add("a", 12, false), static_cast<int64_t>(10));
+		ASSERT_EQ(view.size(), static_cast<size_t>(2));
+		ASSERT_EQ(view.find("a"), static_cast<int64_t>(12));
+		ASSERT_EQ(view.is_latest(10), false);
+		ASSERT_EQ(view.is_latest(11), true);
+		ASSERT_EQ(view.is_latest(12), true);
+		ASSERT_EQ(view.is_latest(13), false);
+
+		std::vector<int64_t> values = view.values();
+		ASSERT_EQ(values.size(), static_cast<size_t>(2));
+		ASSERT_EQ(values[0], static_cast<int64_t>(11));
+		ASSERT_EQ(values[1], static_cast<int64_t>(12));
+
+		view.clear();
+		ASSERT_EQ(view.size(), static_cast<size_t>(0));
+		ASSERT_EQ(view.find("a"), static_cast<int64_t>(-1));
+		ASSERT_EQ(view.add("a", 0, false), static_cast<int64_t>(-1));
+		ASSERT_EQ(view.is_latest(0), true);
+	}
+
+	void tombstone_test()
+	{
+		kbs::compacted_view view;
+		view.add("a", 0, false);
+		view.add("b", 1, false);
+
+		// Tombstones are the latest message but delete the value
+		ASSERT_EQ(view.add("a", 2, true), static_cast<int64_t>(0));
+		ASSERT_EQ(view.size(), static_cast<size_t>(1));
+		ASSERT_EQ(view.find("a"), static_cast<int64_t>(2));
+		ASSERT_EQ(view.is_latest(2), true);
+		ASSERT_EQ(view.is_tombstone(2), true);
+		ASSERT_EQ(view.values().size(), static_cast<size_t>(1));
+
+		// A new value brings the key back
+		ASSERT_EQ(view.add("a", 3, false), static_cast<int64_t>(2));
+		ASSERT_EQ(view.size(), static_cast<size_t>(2));
+		ASSERT_EQ(view.is_tombstone(2), false);
+		ASSERT_EQ(view.is_latest(2), false);
+	}
+
+	void eviction_test()
+	{
+		kbs::compacted_view view;
+		view.add("a", 0, false);
+		view.add("b", 1, false);
+		view.add("a", 2, false);
+		view.add("c", 3, true);
+
+		// Superseded messages leave the keys alone
+		view.pop_front("a");
+		ASSERT_EQ(view.find("a"), static_cast<int64_t>(2));
+		view.pop_front("b");
+		ASSERT_EQ(view.find("b"), static_cast<int64_t>(-1));
+		ASSERT_EQ(view.size(), static_cast<size_t>(1));
+		view.pop_front("a");
+		view.pop_front("c");
+		ASSERT_EQ(view.size(), static_cast<size_t>(0));
+		ASSERT_EQ(view.find("c"), static_cast<int64_t>(-1));
+
+		// Evicting everything restarts at the next offset
+		view.pop_front("x");
+		ASSERT_EQ(view.add("b", 4, false), static_cast<int64_t>(-1));
+		ASSERT_EQ(view.is_latest(4), true);
+	}
+
+	void many_keys_test()
+	{
+		// Keys come and go across several rehashes
+		kbs::compacted_view view;
+		const int num = 20000;
+		for (int i=0; i<num; ++i)
+		{
+			std::ostringstream key;
+			key << "key" << (i % 5000);
+			view.add(key.str(), i, false);
+			if (i >= 10000)
+			{
+				std::ostringstream old;
+				old << "key" << ((i - 10000) % 5000);
+				view.pop_front(old.str());
+			}
+		}
+		ASSERT_EQ(view.size(), static_cast<size_t>(5000));
+		ASSERT_EQ(view.find("key0"), static_cast<int64_t>(15000));
+		ASSERT_EQ(view.values().size(), static_cast<size_t>(5000));
+		ASSERT_EQ(view.values()[0], static_cast<int64_t>(15000));
+	}
+
+	void tests()
+	{
+		add_test();
+		tombstone_test();
+		eviction_test();
+		many_keys_test();
+	}
+};
+
+int main()
+{
+	compacted_view_test suite("Compacted view unittests");
+	suite.execute_tests();
+	return 0;
+}
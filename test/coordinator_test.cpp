@@ -0,0 +1,527 @@
+#include "kafka_broker_stub/coordinator.hpp"
+#include "kafka_broker_stub/coordinator.hpp"
+
+#include "test_common.hpp"
+
+namespace kbs = kafka_broker_stub;
+
+namespace {
+
+	// Start time of the tests - the coordinator only sees the times passed in
+	const uint64_t T0 = static_cast<uint64_t>(1000) * 1000000000;
+	const uint64_t MS = 1000000;
+
+	void put16(std::string& out, int16_t val)
+	{
+		uint8_t buf[2];
+		kbs::util::write_type<int16_t>(val, buf);
+		out.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+	}
+
+	void put32(std::string& out, int32_t val)
+	{
+		uint8_t buf[4];
+		kbs::util::write_type<int32_t>(val, buf);
+		out.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+	}
+
+	void put64(std::string& out, int64_t val)
+	{
+		uint8_t buf[8];
+		kbs::util::write_type<int64_t>(val, buf);
+		out.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+	}
+
+	void put_string(std::string& out, const std::string& str)
+	{
+		put16(out, static_cast<int16_t>(str.size()));
+		out += str;
+	}
+
+	void put_bytes(std::string& out, const std::string& str)
+	{
+		put32(out, static_cast<int32_t>(str.size()));
+		out += str;
+	}
+
+	std::string header(int16_t api_key, int16_t version)
+	{
+		std::string out;
+		put16(out, api_key);
+		put16(out, version);
+		put32(out, 1);
+		put_string(out, "cli");
+		return out;
+	}
+
+	const uint8_t* bytes(const std::string& str)
+	{
+		return reinterpret_cast<const uint8_t*>(str.data());
+	}
+
+	template <typename Request>
+	Request& parse(Request& req, const std::string& data)
+	{
+		req.deserialize(bytes(data));
+		return req;
+	}
+
+	/**
+	 * Field reader for responses with their size field
+	 */
+	class reader
+	{
+	public:
+		explicit reader(const std::string& data):
+			m_data(data),
+			m_pos(8)
+		{
+
+		}
+
+		int16_t int16()
+		{
+			m_pos += 2;
+			return kbs::util::read_type<int16_t>(bytes(m_data) + m_pos - 2);
+		}
+
+		int32_t int32()
+		{
+			m_pos += 4;
+			return kbs::util::read_type<int32_t>(bytes(m_data) + m_pos - 4);
+		}
+
+		int64_t int64()
+		{
+			m_pos += 8;
+			return kbs::util::read_type<int64_t>(bytes(m_data) + m_pos - 8);
+		}
+
+		std::string string()
+		{
+			size_t len = static_cast<size_t>(int16());
+			m_pos += len;
+			return m_data.substr(m_pos - len, len);
+		}
+
+		std::string bytearray()
+		{
+			size_t len = static_cast<size_t>(int32());
+			m_pos += len;
+			return m_data.substr(m_pos - len, len);
+		}
+
+	private:
+		const std::string& m_data;
+		size_t m_pos;
+	};
+
+	/**
+	 * Parsed JoinGroup response (version 0)
+	 */
+	struct joined
+	{
+		explicit joined(const std::string& data):
+			error(0),
+			generation(0),
+			protocol(),
+			leader(),
+			member(),
+			members()
+		{
+			reader in(data);
+			error = in.int16();
+			generation = in.int32();
+			protocol = in.string();
+			leader = in.string();
+			member = in.string();
+			for (int32_t i=in.int32(); i>0; --i)
+			{
+				members.push_back(in.string());
+				in.bytearray();
+			}
+		}
+
+		int16_t error;
+		int32_t generation;
+		std::string protocol;
+		std::string leader;
+		std::string member;
+		std::vector<std::string> members;
+	};
+
+	std::string join_request(const std::string& member, int32_t session_ms = 10000, int32_t rebalance_ms = 5000,
+	                         const std::string& protocol = "range", const std::string& group = "grp")
+	{
+		std::string out = header(11, 1);
+		put_string(out, group);
+		put32(out, session_ms);
+		put32(out, rebalance_ms);
+		put_string(out, member);
+		put_string(out, "consumer");
+		put32(out, 1);
+		put_string(out, protocol);
+		put_bytes(out, "meta-" + protocol);
+		return out;
+	}
+
+	std::string sync_request(const std::string& member, int32_t generation,
+	                         const std::vector<std::string>& assigned = std::vector<std::string>())
+	{
+		std::string out = header(14, 0);
+		put_string(out, "grp");
+		put32(out, generation);
+		put_string(out, member);
+		put32(out, static_cast<int32_t>(assigned.size()));
+		for (size_t i=0; i<assigned.size(); ++i)
+		{
+			put_string(out, assigned[i]);
+			put_bytes(out, "assigned-" + assigned[i]);
+		}
+		return out;
+	}
+
+	std::string member_request(int16_t api_key, const std::string& member, int32_t generation)
+	{
+		std::string out = header(api_key, 0);
+		put_string(out, "grp");
+		if (api_key == 12)
+			put32(out, generation);
+		put_string(out, member);
+		return out;
+	}
+
+	std::string commit_request(const std::string& member, int32_t generation, int32_t partition, int64_t offset)
+	{
+		std::string out = header(8, 2);
+		put_string(out, "grp");
+		put32(out, generation);
+		put_string(out, member);
+		put64(out, -1);
+		put32(out, 1);
+		put_string(out, "test");
+		put32(out, 1);
+		put32(out, partition);
+		put64(out, offset);
+		put_string(out, "meta");
+		return out;
+	}
+
+}
+
+class coordinator_test : public kbs::test::suite
+{
+public:
+	coordinator_test(const std::string& name): suite(name) { }
+
+private:
+	kbs::deferred_response* join(kbs::group_coordinator& coord, const std::string& member, uint64_t now,
+	                             bool can_wait, std::string& out, int32_t session_ms = 10000)
+	{
+		kbs::group::join_request req(1);
+		return coord.join(parse(req, join_request(member, session_ms)), now, can_wait, out);
+	}
+
+	kbs::deferred_response* sync(kbs::group_coordinator& coord, const std::string& member, int32_t generation,
+	                             uint64_t now, std::string& out,
+	                             const std::vector<std::string>& assigned = std::vector<std::string>())
+	{
+		kbs::group::sync_request req(0);
+		return coord.sync(parse(req, sync_request(member, generation, assigned)), now, true, out);
+	}
+
+	int16_t heartbeat(kbs::group_coordinator& coord, const std::string& member, int32_t generation, uint64_t now)
+	{
+		kbs::group::heartbeat_request req;
+		return coord.heartbeat(parse(req, member_request(12, member, generation)), now);
+	}
+
+	void single_member_test()
+	{
+		kbs::group_coordinator coord;
+		ASSERT_EQ(coord.state("grp", T0) == kbs::GROUP_DEAD, true);
+
+		// The only member joins at once and becomes leader
+		std::string out;
+		ASSERT_EQ(join(coord, "", T0, true, out) == NULL, true);
+		joined resp(out);
+		ASSERT_EQ(resp.error, static_cast<int16_t>(0));
+		ASSERT_EQ(resp.generation, static_cast<int32_t>(1));
+		ASSERT_EQ(resp.protocol, std::string("range"));
+		ASSERT_EQ(resp.leader, resp.member);
+		ASSERT_EQ(resp.member.compare(0, 4, "cli-"), 0);
+		ASSERT_EQ(resp.members.size(), static_cast<size_t>(1));
+		ASSERT_EQ(coord.state("grp", T0) == kbs::GROUP_COMPLETING_REBALANCE, true);
+		ASSERT_EQ(heartbeat(coord, resp.member, 1, T0), static_cast<int16_t>(kbs::GROUP_ERR_REBALANCE_IN_PROGRESS));
+
+		// Its assignment completes the rebalance
+		std::vector<std::string> assigned(1, resp.member);
+		ASSERT_EQ(sync(coord, resp.member, 1, T0, out, assigned) == NULL, true);
+		reader in(out);
+		ASSERT_EQ(in.int16(), static_cast<int16_t>(0));
+		ASSERT_EQ(in.bytearray(), "assigned-" + resp.member);
+		ASSERT_EQ(coord.state("grp", T0) == kbs::GROUP_STABLE, true);
+		ASSERT_EQ(heartbeat(coord, resp.member, 1, T0), static_cast<int16_t>(0));
+		ASSERT_EQ(heartbeat(coord, resp.member, 0, T0), static_cast<int16_t>(kbs::GROUP_ERR_ILLEGAL_GENERATION));
+		ASSERT_EQ(heartbeat(coord, resp.member + "0", 1, T0), static_cast<int16_t>(kbs::GROUP_ERR_UNKNOWN_MEMBER_ID));
+		ASSERT_EQ(heartbeat(coord, "bogus", 1, T0), static_cast<int16_t>(kbs::GROUP_ERR_UNKNOWN_MEMBER_ID));
+
+		// Leaving empties the group
+		kbs::group::leave_request leave;
+		ASSERT_EQ(coord.leave(parse(leave, member_request(13, resp.member, 0)), T0),
+		          static_cast<int16_t>(0));
+		ASSERT_EQ(coord.leave(parse(leave, member_request(13, resp.member, 0)), T0),
+		          static_cast<int16_t>(kbs::GROUP_ERR_UNKNOWN_MEMBER_ID));
+		ASSERT_EQ(coord.state("grp", T0) == kbs::GROUP_EMPTY, true);
+		ASSERT_EQ(coord.member_count("grp"), static_cast<size_t>(0));
+	}
+
+	void rebalance_test()
+	{
+		kbs::group_coordinator coord;
+		std::string out;
+		join(coord, "", T0, true, out);
+		std::string first = joined(out).member;
+		sync(coord, first, 1, T0, out);
+
+		// A second member waits until the first joins again
+		kbs::deferred_response* waiting = join(coord, "", T0 + MS, true, out);
+		ASSERT_EQ(waiting != NULL, true);
+		ASSERT_EQ(waiting->poll(T0 + MS, out), false);
+		ASSERT_EQ(coord.state("grp", T0 + MS) == kbs::GROUP_PREPARING_REBALANCE, true);
+		ASSERT_EQ(heartbeat(coord, first, 1, T0 + MS), static_cast<int16_t>(kbs::GROUP_ERR_REBALANCE_IN_PROGRESS));
+
+		ASSERT_EQ(join(coord, first, T0 + 2 * MS, true, out) == NULL, true);
+		joined leader(out);
+		ASSERT_EQ(leader.generation, static_cast<int32_t>(2));
+		ASSERT_EQ(leader.leader, first);
+		ASSERT_EQ(leader.members.size(), static_cast<size_t>(2));
+
+		ASSERT_EQ(waiting->poll(T0 + 2 * MS, out), true);
+		delete waiting;
+		joined follower(out);
+		ASSERT_EQ(follower.error, static_cast<int16_t>(0));
+		ASSERT_EQ(follower.generation, static_cast<int32_t>(2));
+		ASSERT_EQ(follower.leader, first);
+		ASSERT_EQ(follower.members.size(), static_cast<size_t>(0));
+		ASSERT_NEQ(follower.member, first);
+
+		// The follower waits for the assignment of the leader
+		waiting = sync(coord, follower.member, 2, T0 + 3 * MS, out);
+		ASSERT_EQ(waiting != NULL, true);
+		ASSERT_EQ(waiting->poll(T0 + 3 * MS, out), false);
+		std::vector<std::string> assigned;
+		assigned.push_back(first);
+		assigned.push_back(follower.member);
+		ASSERT_EQ(sync(coord, first, 2, T0 + 4 * MS, out, assigned) == NULL, true);
+		ASSERT_EQ(waiting->poll(T0 + 4 * MS, out), true);
+		delete waiting;
+		reader in(out);
+		ASSERT_EQ(in.int16(), static_cast<int16_t>(0));
+		ASSERT_EQ(in.bytearray(), "assigned-" + follower.member);
+		ASSERT_EQ(coord.state("grp", T0 + 4 * MS) == kbs::GROUP_STABLE, true);
+		ASSERT_EQ(coord.generation("grp"), static_cast<int32_t>(2));
+
+		// A member that does not join within the rebalance timeout is dropped
+		waiting = join(coord, follower.member, T0 + 5 * MS, true, out);
+		ASSERT_EQ(waiting != NULL, true);
+		ASSERT_EQ(waiting->poll(T0 + 5004 * MS, out), false);
+		ASSERT_EQ(waiting->poll(T0 + 5005 * MS, out), true);
+		delete waiting;
+		joined alone(out);
+		ASSERT_EQ(alone.generation, static_cast<int32_t>(3));
+		ASSERT_EQ(alone.leader, follower.member);
+		ASSERT_EQ(alone.members.size(), static_cast<size_t>(1));
+		ASSERT_EQ(heartbeat(coord, first, 3, T0 + 5005 * MS), static_cast<int16_t>(kbs::GROUP_ERR_UNKNOWN_MEMBER_ID));
+
+		// Abandoned waits are dropped
+		kbs::deferred_response* abandoned = join(coord, "", T0 + 5006 * MS, true, out);
+		ASSERT_EQ(abandoned != NULL, true);
+		delete abandoned;
+		ASSERT_EQ(join(coord, follower.member, T0 + 5007 * MS, true, out) == NULL, true);
+		ASSERT_EQ(joined(out).generation, static_cast<int32_t>(4));
+		ASSERT_EQ(coord.member_count("grp"), static_cast<size_t>(2));
+	}
+
+	void no_wait_test()
+	{
+		// Joins complete at once and other members learn of the new generation
+		kbs::group_coordinator coord;
+		std::string out;
+		join(coord, "", T0, false, out);
+		std::string first = joined(out).member;
+		ASSERT_EQ(join(coord, "", T0, false, out) == NULL, true);
+		joined second(out);
+		ASSERT_EQ(second.generation, static_cast<int32_t>(2));
+		ASSERT_EQ(second.leader, first);
+		ASSERT_EQ(heartbeat(coord, first, 1, T0), static_cast<int16_t>(kbs::GROUP_ERR_ILLEGAL_GENERATION));
+
+		// Followers syncing before the leader are told to retry
+		kbs::group::sync_request req(0);
+		ASSERT_EQ(coord.sync(parse(req, sync_request(second.member, 2)), T0, false, out) == NULL, true);
+		ASSERT_EQ(reader(out).int16(), static_cast<int16_t>(kbs::GROUP_ERR_REBALANCE_IN_PROGRESS));
+	}
+
+	void session_test()
+	{
+		kbs::group_coordinator coord;
+		coord.set_session_timeout_range(10, 1000);
+		std::string out;
+		join(coord, "", T0, true, out, 5);
+		ASSERT_EQ(joined(out).error, static_cast<int16_t>(kbs::GROUP_ERR_INVALID_SESSION_TIMEOUT));
+		join(coord, "", T0, true, out, 100);
+		std::string member = joined(out).member;
+		sync(coord, member, 1, T0, out);
+
+		// Heartbeats keep the session alive
+		for (uint64_t t=50; t<=500; t+=50)
+		{
+			ASSERT_EQ(heartbeat(coord, member, 1, T0 + t * MS), static_cast<int16_t>(0));
+		}
+		ASSERT_EQ(coord.state("grp", T0 + 599 * MS) == kbs::GROUP_STABLE, true);
+		ASSERT_EQ(coord.state("grp", T0 + 620 * MS) == kbs::GROUP_EMPTY, true);
+		ASSERT_EQ(heartbeat(coord, member, 1, T0 + 620 * MS), static_cast<int16_t>(kbs::GROUP_ERR_UNKNOWN_MEMBER_ID));
+	}
+
+	void many_members_test()
+	{
+		// Hundreds of members join without waiting and keep heartbeating
+		kbs::group_coordinator coord;
+		std::string out;
+		std::vector<std::string> members;
+		for (size_t i=0; i<300; ++i)
+		{
+			join(coord, "", T0, false, out);
+			members.push_back(joined(out).member);
+		}
+		int32_t generation = coord.generation("grp");
+		ASSERT_EQ(generation, static_cast<int32_t>(300));
+		ASSERT_EQ(coord.member_count("grp"), static_cast<size_t>(300));
+		sync(coord, members[0], generation, T0, out, members);
+		ASSERT_EQ(coord.state("grp", T0) == kbs::GROUP_STABLE, true);
+
+		size_t failed = 0;
+		for (uint64_t t=1; t<=30; ++t)
+		{
+			for (size_t i=0; i<members.size(); ++i)
+			{
+				if (heartbeat(coord, members[i], generation, T0 + t * 1000 * MS) != 0)
+					++failed;
+			}
+		}
+		ASSERT_EQ(failed, static_cast<size_t>(0));
+		ASSERT_EQ(coord.member_count("grp"), static_cast<size_t>(300));
+	}
+
+	void error_test()
+	{
+		kbs::group_coordinator coord;
+		std::string out;
+		kbs::group::join_request req(1);
+		coord.join(parse(req, join_request("", 10000, 5000, "range", "")), T0, true, out);
+		ASSERT_EQ(joined(out).error, static_cast<int16_t>(kbs::GROUP_ERR_INVALID_GROUP_ID));
+		join(coord, "cli-0-0", T0, true, out);
+		ASSERT_EQ(joined(out).error, static_cast<int16_t>(kbs::GROUP_ERR_UNKNOWN_MEMBER_ID));
+
+		// Members must share a protocol
+		join(coord, "", T0, true, out);
+		ASSERT_EQ(joined(out).error, static_cast<int16_t>(0));
+		coord.join(parse(req, join_request("", 10000, 5000, "sticky")), T0, true, out);
+		ASSERT_EQ(joined(out).error, static_cast<int16_t>(kbs::GROUP_ERR_INCONSISTENT_PROTOCOL));
+		ASSERT_EQ(coord.member_count("grp"), static_cast<size_t>(1));
+
+		kbs::group::sync_request sreq(0);
+		coord.sync(parse(sreq, sync_request("cli-x-0", 1)), T0, true, out);
+		ASSERT_EQ(reader(out).int16(), static_cast<int16_t>(kbs::GROUP_ERR_UNKNOWN_MEMBER_ID));
+	}
+
+	void offset_test()
+	{
+		kbs::group_coordinator coord;
+		std::string out;
+		kbs::group::offset_commit_request commit(2);
+		int64_t offset = 0;
+
+		// Without members offsets are committed without a generation
+		ASSERT_EQ(coord.committed("grp", "test", 0, offset), false);
+		coord.commit_offsets(parse(commit, commit_request("", -1, 0, 42)), T0, out);
+		reader in(out);
+		ASSERT_EQ(in.int32(), static_cast<int32_t>(1));
+		ASSERT_EQ(in.string(), std::string("test"));
+		ASSERT_EQ(in.int32(), static_cast<int32_t>(1));
+		ASSERT_EQ(in.int32(), static_cast<int32_t>(0));
+		ASSERT_EQ(in.int16(), static_cast<int16_t>(0));
+		ASSERT_EQ(coord.committed("grp", "test", 0, offset), true);
+		ASSERT_EQ(offset, static_cast<int64_t>(42));
+
+		// Members commit in their generation once the group is stable
+		join(coord, "", T0, true, out);
+		std::string member = joined(out).member;
+		coord.commit_offsets(parse(commit, commit_request(member, 1, 1, 7)), T0, out);
+		ASSERT_EQ(kbs::util::read_type<int16_t>(bytes(out) + out.size() - 2),
+		          static_cast<int16_t>(kbs::GROUP_ERR_REBALANCE_IN_PROGRESS));
+		sync(coord, member, 1, T0, out);
+		coord.commit_offsets(parse(commit, commit_request(member, 1, 1, 7)), T0, out);
+		ASSERT_EQ(kbs::util::read_type<int16_t>(bytes(out) + out.size() - 2), static_cast<int16_t>(0));
+		coord.commit_offsets(parse(commit, commit_request(member, 0, 1, 8)), T0, out);
+		ASSERT_EQ(kbs::util::read_type<int16_t>(bytes(out) + out.size() - 2),
+		          static_cast<int16_t>(kbs::GROUP_ERR_ILLEGAL_GENERATION));
+		coord.commit_offsets(parse(commit, commit_request("", -1, 1, 8)), T0, out);
+		ASSERT_EQ(kbs::util::read_type<int16_t>(bytes(out) + out.size() - 2),
+		          static_cast<int16_t>(kbs::GROUP_ERR_UNKNOWN_MEMBER_ID));
+		ASSERT_EQ(coord.committed("grp", "test", 1, offset), true);
+		ASSERT_EQ(offset, static_cast<int64_t>(7));
+
+		// Partitions without an offset get -1
+		std::string req = header(9, 1);
+		put_string(req, "grp");
+		put32(req, 1);
+		put_string(req, "test");
+		put32(req, 2);
+		put32(req, 1);
+		put32(req, 5);
+		kbs::group::offset_fetch_request fetch(1);
+		coord.fetch_offsets(parse(fetch, req), out);
+		reader offsets(out);
+		ASSERT_EQ(offsets.int32(), static_cast<int32_t>(1));
+		ASSERT_EQ(offsets.string(), std::string("test"));
+		ASSERT_EQ(offsets.int32(), static_cast<int32_t>(2));
+		ASSERT_EQ(offsets.int32(), static_cast<int32_t>(1));
+		ASSERT_EQ(offsets.int64(), static_cast<int64_t>(7));
+		ASSERT_EQ(offsets.string(), std::string("meta"));
+		ASSERT_EQ(offsets.int16(), static_cast<int16_t>(0));
+		ASSERT_EQ(offsets.int32(), static_cast<int32_t>(5));
+		ASSERT_EQ(offsets.int64(), static_cast<int64_t>(-1));
+
+		// Version 2 fetches all offsets for a null array
+		req = header(9, 2);
+		put_string(req, "grp");
+		put32(req, -1);
+		kbs::group::offset_fetch_request all(2);
+		coord.fetch_offsets(parse(all, req), out);
+		reader committed(out);
+		ASSERT_EQ(committed.int32(), static_cast<int32_t>(1));
+		ASSERT_EQ(committed.string(), std::string("test"));
+		ASSERT_EQ(committed.int32(), static_cast<int32_t>(2));
+		ASSERT_EQ(committed.int32(), static_cast<int32_t>(0));
+		ASSERT_EQ(committed.int64(), static_cast<int64_t>(42));
+	}
+
+	void tests()
+	{
+		single_member_test();
+		rebalance_test();
+		no_wait_test();
+		session_test();
+		many_members_test();
+		error_test();
+		offset_test();
+	}
+};
+
+int main()
+{
+	coordinator_test suite("Coordinator unittests");
+	suite.execute_tests();
+	return 0;
+}
@@ -0,0 +1,119 @@
+#include "kafka_broker_stub/dispatch.hpp"
+#include "kafka_broker_stub/dispatch.hpp"
+
+#include "test_common.hpp"
+
+namespace kbs = kafka_broker_stub;
+
+namespace {
+
+	class counting_handler : public kbs::request_handlerI
+	{
+	public:
+		counting_handler():
+			calls(0)
+		{
+
+		}
+
+		int handle(kbs::request_context& ctx)
+		{
+			++calls;
+			ctx.throttle_ms = 5;
+			ctx.responses.push_back("response");
+			return 0;
+		}
+
+		int calls;
+	};
+
+}
+
+class dispatch_test : public kbs::test::suite
+{
+public:
+	dispatch_test(const std::string& name): suite(name) { }
+
+private:
+	void table_test()
+	{
+		kbs::handler_table table;
+		counting_handler first;
+		counting_handler second;
+		kbs::request_handlerI* h1 = &first;
+		kbs::request_handlerI* h2 = &second;
+		ASSERT_EQ(table.get(0, 0), static_cast<kbs::request_handlerI*>(NULL));
+		ASSERT_EQ(table.max_version(0), static_cast<int16_t>(-1));
+
+		ASSERT_EQ(table.set(0, 0, 3, &first), true);
+		ASSERT_EQ(table.get(0, 0), h1);
+		ASSERT_EQ(table.get(0, 3), h1);
+		ASSERT_EQ(table.get(0, 4), static_cast<kbs::request_handlerI*>(NULL));
+		ASSERT_EQ(table.get(1, 0), static_cast<kbs::request_handlerI*>(NULL));
+		ASSERT_EQ(table.max_version(0), static_cast<int16_t>(3));
+
+		// Later registrations replace handlers of overlapping versions
+		ASSERT_EQ(table.set(0, 2, 5, &second), true);
+		ASSERT_EQ(table.get(0, 1), h1);
+		ASSERT_EQ(table.get(0, 2), h2);
+		ASSERT_EQ(table.max_version(0), static_cast<int16_t>(5));
+
+		// NULL removes handlers
+		ASSERT_EQ(table.set(0, 4, 5, NULL), true);
+		ASSERT_EQ(table.get(0, 4), static_cast<kbs::request_handlerI*>(NULL));
+		ASSERT_EQ(table.max_version(0), static_cast<int16_t>(3));
+
+		// Limits of the table
+		ASSERT_EQ(table.set(kbs::handler_table::MAX_API_KEY, 0, kbs::handler_table::MAX_VERSION, &first), true);
+		ASSERT_EQ(table.get(kbs::handler_table::MAX_API_KEY, kbs::handler_table::MAX_VERSION), h1);
+		ASSERT_EQ(table.set(-1, 0, 0, &first), false);
+		ASSERT_EQ(table.set(kbs::handler_table::MAX_API_KEY + 1, 0, 0, &first), false);
+		ASSERT_EQ(table.set(1, -1, 0, &first), false);
+		ASSERT_EQ(table.set(1, 0, kbs::handler_table::MAX_VERSION + 1, &first), false);
+		ASSERT_EQ(table.set(1, 2, 1, &first), false);
+		ASSERT_EQ(table.max_version(1), static_cast<int16_t>(-1));
+		ASSERT_EQ(table.get(-1, 0), static_cast<kbs::request_handlerI*>(NULL));
+		ASSERT_EQ(table.get(0, -1), static_cast<kbs::request_handlerI*>(NULL));
+		ASSERT_EQ(table.get(0, kbs::handler_table::MAX_VERSION + 1), static_cast<kbs::request_handlerI*>(NULL));
+	}
+
+	void context_test()
+	{
+		// API key 3, version 1, correlation ID 7
+		const uint8_t req[] = { 0x00, 0x03, 0x00, 0x01, 0x00, 0x00, 0x00, 0x07 };
+		uint8_t buf[16];
+		std::vector<std::string> responses;
+		kbs::request_context ctx(req, sizeof(req), buf, sizeof(buf), responses, NULL);
+		ASSERT_EQ(ctx.api_key, static_cast<int16_t>(3));
+		ASSERT_EQ(ctx.api_version, static_cast<int16_t>(1));
+		ASSERT_EQ(ctx.throttle_ms, static_cast<uint32_t>(0));
+		ASSERT_EQ(ctx.response_buf_size, sizeof(buf));
+
+		kbs::handler_table table;
+		counting_handler handler;
+		table.set(ctx.api_key, 0, 1, &handler);
+		ASSERT_EQ(table.get(ctx.api_key, ctx.api_version)->handle(ctx), 0);
+		ASSERT_EQ(handler.calls, 1);
+		ASSERT_EQ(ctx.throttle_ms, static_cast<uint32_t>(5));
+		ASSERT_EQ(responses.size(), static_cast<size_t>(1));
+
+		// Requests too short for a header have no key
+		kbs::request_context empty(req, 1, buf, sizeof(buf), responses, NULL);
+		ASSERT_EQ(empty.api_key, static_cast<int16_t>(-1));
+		ASSERT_EQ(empty.api_version, static_cast<int16_t>(-1));
+		ASSERT_EQ(table.get(empty.api_key, empty.api_version), static_cast<kbs::request_handlerI*>(NULL));
+	}
+
+	void tests()
+	{
+		table_test();
+		context_test();
+	}
+};
+
+int main()
+{
+	dispatch_test suite("Dispatch unittests");
+	suite.execute_tests();
+	return 0;
+}
@@ -0,0 +1,158 @@
+#include "kafka_broker_stub/fetch.hpp"
+#include "kafka_broker_stub/fetch.hpp"
+#include "kafka_broker_stub/produce.hpp"
+
+#include "test_common.hpp"
+
+namespace kbs = kafka_broker_stub;
+
+class fetch_test : public kbs::test::suite
+{
+public:
+	fetch_test(const std::string& name): suite(name) { }
+
+private:
+	void request_test()
+	{
+		uint8_t req[] = {
+			0x00, 0x01, // Api key 1
+			0x00, 0x01, // Api version 1
+			0x00, 0x00, 0x00, 0x05, // Correlation id 5
+			0x00, 0x03, 0x63, 0x6c, 0x69, // Client id "cli"
+			0xff, 0xff, 0xff, 0xff, // Replica id
+			0x00, 0x00, 0x00, 0x64, // Max wait time
+			0x00, 0x00, 0x00, 0x01, // Min bytes
+			0x00, 0x00, 0x00, 0x01, // Topic array start
+				0x00, 0x04, 0x74, 0x65, 0x73, 0x74, // Topic name
+				0x00, 0x00, 0x00, 0x02, // Partition array start
+					0x00, 0x00, 0x00, 0x00, // Partition
+					0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07, // Fetch offset
+					0x00, 0x10, 0x00, 0x00, // Max bytes
+					0x00, 0x00, 0x00, 0x01,
+					0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+					0x00, 0x00, 0x10, 0x00};
+
+		kbs::fetch::request_v0 request;
+		const uint8_t* end = request.deserialize(req);
+		ASSERT_EQ(static_cast<size_t>(end - req), sizeof(req));
+		ASSERT_EQ(static_cast<int>(request.header().correlation_id()), 5);
+		ASSERT_EQ(request.header().client_id().std_str(), std::string("cli"));
+		ASSERT_EQ(static_cast<int>(request.replica_id()), -1);
+		ASSERT_EQ(static_cast<int>(request.max_wait()), 100);
+		ASSERT_EQ(static_cast<int>(request.min_bytes()), 1);
+		ASSERT_EQ(request.topics().size(), static_cast<size_t>(1));
+		ASSERT_EQ(request.topics()[0].topic_name().std_str(), std::string("test"));
+		ASSERT_EQ(request.topics()[0].partitions().size(), static_cast<size_t>(2));
+		ASSERT_EQ(static_cast<int64_t>(request.topics()[0].partitions()[0].fetch_offset()), static_cast<int64_t>(7));
+		ASSERT_EQ(static_cast<int>(request.topics()[0].partitions()[0].max_bytes()), 0x100000);
+		ASSERT_EQ(static_cast<int>(request.topics()[0].partitions()[1].partition()), 1);
+	}
+
+	void message_set_test()
+	{
+		std::string key("k");
+		std::string value("value");
+		std::string empty;
+		kbs::fetch::partition_data data(3, 0, 12);
+		data.add_message(kbs::fetch::message_ref(10, key, value));
+		data.add_message(kbs::fetch::message_ref(11, empty, value));
+
+		// Partition, error, high watermark, set size and two messages
+		size_t msg_size = kbs::fetch::partition_data::message_size(kbs::fetch::message_ref(10, key, value));
+		ASSERT_EQ(msg_size, static_cast<size_t>(32));
+		ASSERT_EQ(data.serial_size(), static_cast<size_t>(4 + 2 + 8 + 4 + 32 + 31));
+
+		std::vector<uint8_t> buf(data.serial_size());
+		ASSERT_EQ(static_cast<size_t>(data.serialize(&buf[0]) - &buf[0]), buf.size());
+		ASSERT_EQ(kbs::util::read_type<int32_t>(&buf[0]), static_cast<int32_t>(3));
+		ASSERT_EQ(kbs::util::read_type<int16_t>(&buf[4]), static_cast<int16_t>(0));
+		ASSERT_EQ(kbs::util::read_type<int64_t>(&buf[6]), static_cast<int64_t>(12));
+		ASSERT_EQ(kbs::util::read_type<int32_t>(&buf[14]), static_cast<int32_t>(63));
+
+		// First message with a valid crc
+		const uint8_t* msg = &buf[18];
+		ASSERT_EQ(kbs::util::read_type<int64_t>(msg), static_cast<int64_t>(10));
+		ASSERT_EQ(kbs::util::read_type<int32_t>(msg + 8), static_cast<int32_t>(20));
+		ASSERT_EQ(kbs::util::read_type<uint32_t>(msg + 12), kbs::util::crc32(msg + 16, 16));
+
+		// Empty key is sent as an empty key
+		const uint8_t* second = msg + 32;
+		ASSERT_EQ(kbs::util::read_type<int32_t>(second + 18), static_cast<int32_t>(0));
+
+		// The set decodes as produced data
+		kbs::produce::message_set set;
+		ASSERT_EQ(set.deserialize(&buf[18], 63), true);
+		ASSERT_EQ(set.size(), static_cast<size_t>(2));
+		ASSERT_EQ(std::string(reinterpret_cast<const char*>(set[0].key), set[0].key_size), key);
+		ASSERT_EQ(std::string(reinterpret_cast<const char*>(set[1].value), set[1].value_size), value);
+		ASSERT_EQ(set[1].key_size, static_cast<size_t>(0));
+	}
+
+	void message_format_v1_test()
+	{
+		std::string key("k");
+		std::string value("value");
+		const int64_t timestamp = static_cast<int64_t>(1500000000) * 1000;
+		kbs::fetch::message_ref keyless(10, key, value, timestamp);
+		keyless.key = NULL;
+		kbs::fetch::partition_data data(3, 0, 11, 1);
+		data.add_message(keyless);
+
+		// The timestamp follows the attributes and the null key has no bytes
+		ASSERT_EQ(kbs::fetch::partition_data::message_size(keyless, 1), static_cast<size_t>(39));
+		std::vector<uint8_t> buf(data.serial_size());
+		ASSERT_EQ(static_cast<size_t>(data.serialize(&buf[0]) - &buf[0]), buf.size());
+		const uint8_t* msg = &buf[18];
+		ASSERT_EQ(kbs::util::read_type<int32_t>(msg + 8), static_cast<int32_t>(27));
+		ASSERT_EQ(kbs::util::read_type<uint32_t>(msg + 12), kbs::util::crc32(msg + 16, 23));
+		ASSERT_EQ(msg[16], static_cast<uint8_t>(1));
+		ASSERT_EQ(kbs::util::read_type<int64_t>(msg + 18), timestamp);
+		ASSERT_EQ(kbs::util::read_type<int32_t>(msg + 26), static_cast<int32_t>(-1));
+
+		// Decodes as produced data with the timestamp
+		kbs::produce::message_set set;
+		ASSERT_EQ(set.deserialize(msg, 39), true);
+		ASSERT_EQ(set.size(), static_cast<size_t>(1));
+		ASSERT_EQ(set[0].key, static_cast<const uint8_t*>(NULL));
+		ASSERT_EQ(set[0].timestamp, timestamp);
+		ASSERT_EQ(std::string(reinterpret_cast<const char*>(set[0].value), set[0].value_size), value);
+	}
+
+	void response_test()
+	{
+		kbs::primitive::array<kbs::fetch::partition_data> partitions;
+		partitions.push_back(kbs::fetch::partition_data(0, 3, -1));
+		kbs::primitive::array<kbs::fetch::topic_data> topics;
+		topics.push_back(kbs::fetch::topic_data("ab", partitions));
+
+		// Version 0 has no throttle time
+		kbs::fetch::response_v0 v0(9, topics);
+		ASSERT_EQ(v0.serial_size(), static_cast<size_t>(4 + 4 + 4 + 4 + 4 + 2 + 8 + 4));
+
+		// Version 1 has it right after the correlation id
+		kbs::fetch::response_v1 v1(9, 250, topics);
+		std::vector<uint8_t> buf(v1.serial_size());
+		ASSERT_EQ(buf.size(), v0.serial_size() + 4);
+		v1.serialize(&buf[0]);
+		ASSERT_EQ(kbs::util::read_type<int32_t>(&buf[0]), static_cast<int32_t>(9));
+		ASSERT_EQ(kbs::util::read_type<int32_t>(&buf[4]), static_cast<int32_t>(250));
+		ASSERT_EQ(kbs::util::read_type<int32_t>(&buf[8]), static_cast<int32_t>(1));
+		ASSERT_EQ(kbs::util::read_type<int16_t>(&buf[24]), static_cast<int16_t>(3));
+		ASSERT_EQ(kbs::util::read_type<int32_t>(&buf[34]), static_cast<int32_t>(0));
+	}
+
+	void tests()
+	{
+		request_test();
+		message_set_test();
+		message_format_v1_test();
+		response_test();
+	}
+};
+
+int main()
+{
+	fetch_test suite("Fetch unittests");
+	suite.execute_tests();
+	return 0;
+}
@@ -0,0 +1,288 @@
+#include "kafka_broker_stub/group.hpp"
+#include "kafka_broker_stub/group.hpp"
+
+#include "test_common.hpp"
+
+namespace kbs = kafka_broker_stub;
+
+namespace {
+
+	void put16(std::string& out, int16_t val)
+	{
+		uint8_t buf[2];
+		kbs::util::write_type<int16_t>(val, buf);
+		out.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+	}
+
+	void put32(std::string& out, int32_t val)
+	{
+		uint8_t buf[4];
+		kbs::util::write_type<int32_t>(val, buf);
+		out.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+	}
+
+	void put64(std::string& out, int64_t val)
+	{
+		uint8_t buf[8];
+		kbs::util::write_type<int64_t>(val, buf);
+		out.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+	}
+
+	void put_string(std::string& out, const std::string& str)
+	{
+		put16(out, static_cast<int16_t>(str.size()));
+		out += str;
+	}
+
+	void put_bytes(std::string& out, const std::string& str)
+	{
+		put32(out, static_cast<int32_t>(str.size()));
+		out += str;
+	}
+
+	std::string header(int16_t api_key, int16_t version, int32_t corr_id)
+	{
+		std::string out;
+		put16(out, api_key);
+		put16(out, version);
+		put32(out, corr_id);
+		put_string(out, "cli");
+		return out;
+	}
+
+	const uint8_t* bytes(const std::string& str)
+	{
+		return reinterpret_cast<const uint8_t*>(str.data());
+	}
+
+	template <typename Response>
+	std::string serialize(const Response& resp)
+	{
+		std::string out(resp.serial_size(), '\0');
+		uint8_t* end = resp.serialize(reinterpret_cast<uint8_t*>(&out[0]));
+		out.resize(static_cast<size_t>(end - reinterpret_cast<uint8_t*>(&out[0])));
+		return out;
+	}
+
+}
+
+class group_test : public kbs::test::suite
+{
+public:
+	group_test(const std::string& name): suite(name) { }
+
+private:
+	void find_coordinator_test()
+	{
+		std::string req = header(10, 1, 3);
+		put_string(req, "grp");
+		req += '\0';
+
+		kbs::group::find_coordinator_request request(1);
+		ASSERT_EQ(static_cast<size_t>(request.deserialize(bytes(req)) - bytes(req)), req.size());
+		ASSERT_EQ(request.key().std_str(), std::string("grp"));
+		ASSERT_EQ(static_cast<int>(request.key_type()), 0);
+
+		// Version 1 adds the throttle time and error message
+		kbs::group::find_coordinator_response v0(0, 3, 0, 2, "host", 9092);
+		kbs::group::find_coordinator_response v1(1, 3, 0, 2, "host", 9092);
+		ASSERT_EQ(v0.serial_size(), static_cast<size_t>(4 + 2 + 4 + 6 + 4));
+		ASSERT_EQ(v1.serial_size(), v0.serial_size() + 4 + 2);
+
+		std::string out = serialize(v1);
+		ASSERT_EQ(out.size(), v1.serial_size());
+		ASSERT_EQ(kbs::util::read_type<int32_t>(bytes(out) + 8 + 2 + 2), static_cast<int32_t>(2));
+		ASSERT_EQ(kbs::util::read_type<int32_t>(bytes(out) + out.size() - 4), static_cast<int32_t>(9092));
+	}
+
+	void join_test()
+	{
+		// Version 0 has no rebalance timeout
+		std::string req = header(11, 0, 4);
+		put_string(req, "grp");
+		put32(req, 10000);
+		put_string(req, "");
+		put_string(req, "consumer");
+		put32(req, 2);
+		put_string(req, "range");
+		put_bytes(req, "r");
+		put_string(req, "roundrobin");
+		put_bytes(req, "rr");
+
+		kbs::group::join_request v0(0);
+		ASSERT_EQ(static_cast<size_t>(v0.deserialize(bytes(req)) - bytes(req)), req.size());
+		ASSERT_EQ(v0.version(), static_cast<int16_t>(0));
+		ASSERT_EQ(static_cast<int>(v0.session_timeout()), 10000);
+		ASSERT_EQ(static_cast<int>(v0.rebalance_timeout()), 10000);
+		ASSERT_EQ(v0.member_id().size(), static_cast<size_t>(0));
+		ASSERT_EQ(v0.protocol_type().std_str(), std::string("consumer"));
+		ASSERT_EQ(v0.protocols().size(), static_cast<size_t>(2));
+		ASSERT_EQ(v0.protocols()[1].name().std_str(), std::string("roundrobin"));
+		ASSERT_EQ(v0.protocols()[1].metadata().std_str(), std::string("rr"));
+
+		req = header(11, 1, 4);
+		put_string(req, "grp");
+		put32(req, 10000);
+		put32(req, 60000);
+		put_string(req, "m-1");
+		put_string(req, "consumer");
+		put32(req, 0);
+		kbs::group::join_request v1(1);
+		ASSERT_EQ(static_cast<size_t>(v1.deserialize(bytes(req)) - bytes(req)), req.size());
+		ASSERT_EQ(static_cast<int>(v1.rebalance_timeout()), 60000);
+		ASSERT_EQ(v1.member_id().std_str(), std::string("m-1"));
+
+		// Members are only sent to the leader
+		kbs::primitive::array<kbs::group::member_metadata> members;
+		members.push_back(kbs::group::member_metadata("m-1", kbs::primitive::bytearray(std::string("abc"))));
+		kbs::group::join_response resp(2, 4, 0, 5, "range", "m-1", "m-1", members);
+		std::string out = serialize(resp);
+		ASSERT_EQ(out.size(), static_cast<size_t>(4 + 4 + 2 + 4 + 7 + 5 + 5 + 4 + 5 + 7));
+		ASSERT_EQ(kbs::util::read_type<int32_t>(bytes(out) + 10), static_cast<int32_t>(5));
+		ASSERT_EQ(kbs::util::read_type<int32_t>(bytes(out) + 31), static_cast<int32_t>(1));
+		ASSERT_EQ(kbs::group::join_response(1, 4, 0, 5, "range", "m-1", "m-1", members).serial_size(),
+		          out.size() - 4);
+	}
+
+	void sync_test()
+	{
+		std::string req = header(14, 1, 6);
+		put_string(req, "grp");
+		put32(req, 3);
+		put_string(req, "m-1");
+		put32(req, 2);
+		put_string(req, "m-1");
+		put_bytes(req, "a1");
+		put_string(req, "m-2");
+		put_bytes(req, "");
+
+		kbs::group::sync_request request(1);
+		ASSERT_EQ(static_cast<size_t>(request.deserialize(bytes(req)) - bytes(req)), req.size());
+		ASSERT_EQ(static_cast<int>(request.generation()), 3);
+		ASSERT_EQ(request.assignments().size(), static_cast<size_t>(2));
+		ASSERT_EQ(request.assignments()[0].assignment().std_str(), std::string("a1"));
+		ASSERT_EQ(request.assignments()[1].member_id().std_str(), std::string("m-2"));
+
+		kbs::group::sync_response v0(0, 6, 27, kbs::primitive::bytearray());
+		kbs::group::sync_response v1(1, 6, 0, kbs::primitive::bytearray(std::string("a1")));
+		ASSERT_EQ(v0.serial_size(), static_cast<size_t>(4 + 2 + 4));
+		std::string out = serialize(v1);
+		ASSERT_EQ(out.size(), static_cast<size_t>(4 + 4 + 2 + 4 + 2));
+		ASSERT_EQ(out.substr(14), std::string("a1"));
+
+		// Heartbeat and leave responses only hold the error
+		ASSERT_EQ(kbs::group::error_response(0, 1, 25).serial_size(), static_cast<size_t>(6));
+		out = serialize(kbs::group::error_response(1, 1, 25));
+		ASSERT_EQ(kbs::util::read_type<int16_t>(bytes(out) + 8), static_cast<int16_t>(25));
+	}
+
+	void offset_commit_test()
+	{
+		// Version 1 has a timestamp per partition
+		std::string req = header(8, 1, 7);
+		put_string(req, "grp");
+		put32(req, 2);
+		put_string(req, "m-1");
+		put32(req, 1);
+		put_string(req, "test");
+		put32(req, 1);
+		put32(req, 4);
+		put64(req, 42);
+		put64(req, 1234);
+		put_string(req, "meta");
+
+		kbs::group::offset_commit_request v1(1);
+		ASSERT_EQ(static_cast<size_t>(v1.deserialize(bytes(req)) - bytes(req)), req.size());
+		ASSERT_EQ(static_cast<int>(v1.generation()), 2);
+		ASSERT_EQ(v1.topics().size(), static_cast<size_t>(1));
+		ASSERT_EQ(v1.topics()[0].partitions[0].partition, static_cast<int32_t>(4));
+		ASSERT_EQ(v1.topics()[0].partitions[0].offset, static_cast<int64_t>(42));
+		ASSERT_EQ(v1.topics()[0].partitions[0].metadata, std::string("meta"));
+
+		// Version 2 has a retention time instead and version 0 no generation
+		req = header(8, 2, 7);
+		put_string(req, "grp");
+		put32(req, 2);
+		put_string(req, "m-1");
+		put64(req, -1);
+		put32(req, 1);
+		put_string(req, "test");
+		put32(req, 1);
+		put32(req, 4);
+		put64(req, 43);
+		put_string(req, "");
+		kbs::group::offset_commit_request v2(2);
+		ASSERT_EQ(static_cast<size_t>(v2.deserialize(bytes(req)) - bytes(req)), req.size());
+		ASSERT_EQ(v2.topics()[0].partitions[0].offset, static_cast<int64_t>(43));
+
+		req = header(8, 0, 7);
+		put_string(req, "grp");
+		put32(req, 0);
+		kbs::group::offset_commit_request v0(0);
+		ASSERT_EQ(static_cast<size_t>(v0.deserialize(bytes(req)) - bytes(req)), req.size());
+		ASSERT_EQ(static_cast<int>(v0.generation()), -1);
+
+		kbs::primitive::array<kbs::group::partition_error> partitions;
+		partitions.push_back(kbs::group::partition_error(4, 0));
+		kbs::primitive::array<kbs::group::topic_errors> topics;
+		topics.push_back(kbs::group::topic_errors("test", partitions));
+		ASSERT_EQ(kbs::group::offset_commit_response(2, 7, topics).serial_size(),
+		          static_cast<size_t>(4 + 4 + 6 + 4 + 6));
+		ASSERT_EQ(kbs::group::offset_commit_response(3, 7, topics).serial_size(),
+		          static_cast<size_t>(4 + 4 + 4 + 6 + 4 + 6));
+	}
+
+	void offset_fetch_test()
+	{
+		std::string req = header(9, 1, 8);
+		put_string(req, "grp");
+		put32(req, 1);
+		put_string(req, "test");
+		put32(req, 2);
+		put32(req, 0);
+		put32(req, 1);
+
+		kbs::group::offset_fetch_request v1(1);
+		ASSERT_EQ(static_cast<size_t>(v1.deserialize(bytes(req)) - bytes(req)), req.size());
+		ASSERT_EQ(v1.all_topics(), false);
+		ASSERT_EQ(v1.topics()[0].partitions().size(), static_cast<size_t>(2));
+
+		// A null array asks for all topics from version 2 on
+		req = header(9, 2, 8);
+		put_string(req, "grp");
+		put32(req, -1);
+		kbs::group::offset_fetch_request v2(2);
+		ASSERT_EQ(static_cast<size_t>(v2.deserialize(bytes(req)) - bytes(req)), req.size());
+		ASSERT_EQ(v2.all_topics(), true);
+		ASSERT_EQ(v2.topics().size(), static_cast<size_t>(0));
+
+		kbs::primitive::array<kbs::group::partition_offset> partitions;
+		partitions.push_back(kbs::group::partition_offset(0, 42, "m", 0));
+		kbs::primitive::array<kbs::group::topic_offsets> topics;
+		topics.push_back(kbs::group::topic_offsets("test", partitions));
+		size_t v1_size = kbs::group::offset_fetch_response(1, 8, topics, 0).serial_size();
+		ASSERT_EQ(v1_size, static_cast<size_t>(4 + 4 + 6 + 4 + 4 + 8 + 3 + 2));
+		ASSERT_EQ(kbs::group::offset_fetch_response(2, 8, topics, 0).serial_size(), v1_size + 2);
+
+		std::string out = serialize(kbs::group::offset_fetch_response(3, 8, topics, 16));
+		ASSERT_EQ(out.size(), v1_size + 6);
+		ASSERT_EQ(kbs::util::read_type<int64_t>(bytes(out) + 26), static_cast<int64_t>(42));
+		ASSERT_EQ(kbs::util::read_type<int16_t>(bytes(out) + out.size() - 2), static_cast<int16_t>(16));
+	}
+
+	void tests()
+	{
+		find_coordinator_test();
+		join_test();
+		sync_test();
+		offset_commit_test();
+		offset_fetch_test();
+	}
+};
+
+int main()
+{
+	group_test suite("Group unittests");
+	suite.execute_tests();
+	return 0;
+}
@@ -0,0 +1,65 @@
+#include "kafka_broker_stub/init_producer_id.hpp"
+#include "kafka_broker_stub/init_producer_id.hpp"
+
+#include "test_common.hpp"
+
+namespace kbs = kafka_broker_stub;
+
+class init_producer_id_test : public kbs::test::suite
+{
+public:
+	init_producer_id_test(const std::string& name): suite(name) { }
+
+private:
+	void request_test()
+	{
+		uint8_t req[] = {
+			0x00, 0x16, // Api key 22
+			0x00, 0x00, // Api version 0
+			0x00, 0x00, 0x00, 0x02, // Correlation id 2
+			0x00, 0x01, 0x63, // Client id "c"
+			0x00, 0x02, 0x74, 0x31, // Transactional id "t1"
+			0x00, 0x00, 0xea, 0x60}; // Transaction timeout
+
+		kbs::init_producer_id::request request;
+		ASSERT_EQ(static_cast<size_t>(request.deserialize(req) - req), sizeof(req));
+		ASSERT_EQ(static_cast<int>(request.header().correlation_id()), 2);
+		ASSERT_EQ(request.transactional_id().std_str(), std::string("t1"));
+		ASSERT_EQ(static_cast<int>(request.transaction_timeout()), 60000);
+
+		// Null transactional id
+		req[11] = 0xff;
+		req[12] = 0xff;
+		uint8_t* timeout = req + 13;
+		kbs::util::write_type<int32_t>(100, timeout);
+		ASSERT_EQ(static_cast<size_t>(request.deserialize(req) - req), sizeof(req) - 2);
+		ASSERT_EQ(request.transactional_id().std_str(), std::string());
+		ASSERT_EQ(static_cast<int>(request.transaction_timeout()), 100);
+	}
+
+	void response_test()
+	{
+		// Correlation id, throttle time, error, producer id and epoch
+		kbs::init_producer_id::response resp(2, 0, 0, 4000, 1);
+		std::vector<uint8_t> buf(resp.serial_size());
+		ASSERT_EQ(buf.size(), static_cast<size_t>(4 + 4 + 2 + 8 + 2));
+		ASSERT_EQ(static_cast<size_t>(resp.serialize(&buf[0]) - &buf[0]), buf.size());
+		ASSERT_EQ(kbs::util::read_type<int32_t>(&buf[0]), static_cast<int32_t>(2));
+		ASSERT_EQ(kbs::util::read_type<int16_t>(&buf[8]), static_cast<int16_t>(0));
+		ASSERT_EQ(kbs::util::read_type<int64_t>(&buf[10]), static_cast<int64_t>(4000));
+		ASSERT_EQ(kbs::util::read_type<int16_t>(&buf[18]), static_cast<int16_t>(1));
+	}
+
+	void tests()
+	{
+		request_test();
+		response_test();
+	}
+};
+
+int main()
+{
+	init_producer_id_test suite("Init producer ID unittests");
+	suite.execute_tests();
+	return 0;
+}
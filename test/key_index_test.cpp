@@ -0,0 +1,112 @@
+#include "kafka_broker_stub/key_index.hpp"
+#include "kafka_broker_stub/key_index.hpp"
+
+#include "test_common.hpp"
+
+#include <sstream>
+
+namespace kbs = kafka_broker_stub;
+
+class key_index_test : public kbs::test::suite
+{
+public:
+	key_index_test(const std::string& name): suite(name) { }
+
+private:
+	void add_find_test()
+	{
+		kbs::key_index index;
+		size_t count = 1;
+		ASSERT_EQ(index.find("missing", count), static_cast<const int64_t*>(NULL));
+		ASSERT_EQ(count, static_cast<size_t>(0));
+
+		index.add("a", 0);
+		index.add("b", 1);
+		index.add("a", 2);
+		index.add("", 3);
+		ASSERT_EQ(index.size(), static_cast<size_t>(3));
+
+		const int64_t* offsets = index.find("a", count);
+		ASSERT_EQ(count, static_cast<size_t>(2));
+		ASSERT_EQ(offsets[0], static_cast<int64_t>(0));
+		ASSERT_EQ(offsets[1], static_cast<int64_t>(2));
+
+		offsets = index.find("", count);
+		ASSERT_EQ(count, static_cast<size_t>(1));
+		ASSERT_EQ(offsets[0], static_cast<int64_t>(3));
+
+		index.clear();
+		ASSERT_EQ(index.size(), static_cast<size_t>(0));
+		ASSERT_EQ(index.find("a", count), static_cast<const int64_t*>(NULL));
+	}
+
+	void remove_test()
+	{
+		kbs::key_index index;
+		index.add("a", 0);
+		index.add("b", 1);
+		index.add("a", 2);
+
+		// Only the oldest offset is removed
+		index.remove_first("a", 2);
+		size_t count = 0;
+		index.find("a", count);
+		ASSERT_EQ(count, static_cast<size_t>(2));
+
+		index.remove_first("a", 0);
+		const int64_t* offsets = index.find("a", count);
+		ASSERT_EQ(count, static_cast<size_t>(1));
+		ASSERT_EQ(offsets[0], static_cast<int64_t>(2));
+
+		// Keys without offsets are dropped and can be added again
+		index.remove_first("b", 1);
+		ASSERT_EQ(index.size(), static_cast<size_t>(1));
+		ASSERT_EQ(index.find("b", count), static_cast<const int64_t*>(NULL));
+		index.add("b", 3);
+		offsets = index.find("b", count);
+		ASSERT_EQ(count, static_cast<size_t>(1));
+		ASSERT_EQ(offsets[0], static_cast<int64_t>(3));
+		index.remove_first("unknown", 0);
+		ASSERT_EQ(index.size(), static_cast<size_t>(2));
+	}
+
+	void many_keys_test()
+	{
+		// Grows past several rehashes while keys come and go
+		kbs::key_index index;
+		const int num = 20000;
+		for (int i=0; i<num; ++i)
+		{
+			std::ostringstream key;
+			key << "key_" << i;
+			index.add(key.str(), i);
+			if (i >= 100)
+			{
+				std::ostringstream old;
+				old << "key_" << (i - 100);
+				index.remove_first(old.str(), i - 100);
+			}
+		}
+		ASSERT_EQ(index.size(), static_cast<size_t>(100));
+
+		size_t count = 0;
+		ASSERT_EQ(index.find("key_0", count), static_cast<const int64_t*>(NULL));
+		const int64_t* offsets = index.find("key_19999", count);
+		ASSERT_EQ(count, static_cast<size_t>(1));
+		ASSERT_EQ(offsets[0], static_cast<int64_t>(19999));
+	}
+
+	void tests()
+	{
+		add_find_test();
+		remove_test();
+		many_keys_test();
+	}
+};
+
+int main()
+{
+	key_index_test suite("Key index unittests");
+	suite.execute_tests();
+	return 0;
+}
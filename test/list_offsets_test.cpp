@@ -0,0 +1,100 @@
+#include "kafka_broker_stub/list_offsets.hpp"
+#include "kafka_broker_stub/list_offsets.hpp"
+
+#include "test_common.hpp"
+
+namespace kbs = kafka_broker_stub;
+
+class list_offsets_test : public kbs::test::suite
+{
+public:
+	list_offsets_test(const std::string& name): suite(name) { }
+
+private:
+	void request_test()
+	{
+		uint8_t v0[] = {
+			0x00, 0x02, // Api key 2
+			0x00, 0x00, // Api version 0
+			0x00, 0x00, 0x00, 0x04, // Correlation id 4
+			0x00, 0x01, 0x63, // Client id "c"
+			0xff, 0xff, 0xff, 0xff, // Replica id
+			0x00, 0x00, 0x00, 0x01, // Topic array start
+				0x00, 0x02, 0x61, 0x62, // Topic name
+				0x00, 0x00, 0x00, 0x01, // Partition array start
+					0x00, 0x00, 0x00, 0x02, // Partition
+					0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfe, // Earliest
+					0x00, 0x00, 0x00, 0x05}; // Max offsets
+
+		kbs::list_offsets::request req0(0);
+		ASSERT_EQ(static_cast<size_t>(req0.deserialize(v0) - v0), sizeof(v0));
+		ASSERT_EQ(static_cast<int>(req0.header().correlation_id()), 4);
+		ASSERT_EQ(static_cast<int>(req0.replica_id()), -1);
+		ASSERT_EQ(req0.topics().size(), static_cast<size_t>(1));
+		ASSERT_EQ(req0.topics()[0].name, std::string("ab"));
+		ASSERT_EQ(req0.topics()[0].partitions.size(), static_cast<size_t>(1));
+		ASSERT_EQ(req0.topics()[0].partitions[0].partition, static_cast<int32_t>(2));
+		ASSERT_EQ(req0.topics()[0].partitions[0].timestamp, kbs::list_offsets::EARLIEST_TIMESTAMP);
+		ASSERT_EQ(req0.topics()[0].partitions[0].max_offsets, static_cast<int32_t>(5));
+
+		// Version 1 has no max offsets
+		uint8_t v1[] = {
+			0x00, 0x02, 0x00, 0x01, 0x00, 0x00, 0x00, 0x04, 0xff, 0xff, // Header with null client id
+			0xff, 0xff, 0xff, 0xff, // Replica id
+			0x00, 0x00, 0x00, 0x01, 0x00, 0x01, 0x61, // Topic "a"
+				0x00, 0x00, 0x00, 0x02,
+					0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x64,
+					0x00, 0x00, 0x00, 0x01, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+		kbs::list_offsets::request req1(1);
+		ASSERT_EQ(static_cast<size_t>(req1.deserialize(v1) - v1), sizeof(v1));
+		ASSERT_EQ(req1.topics()[0].partitions.size(), static_cast<size_t>(2));
+		ASSERT_EQ(req1.topics()[0].partitions[0].timestamp, static_cast<int64_t>(100));
+		ASSERT_EQ(req1.topics()[0].partitions[1].partition, static_cast<int32_t>(1));
+		ASSERT_EQ(req1.topics()[0].partitions[1].timestamp, kbs::list_offsets::LATEST_TIMESTAMP);
+	}
+
+	void response_test()
+	{
+		kbs::primitive::array<kbs::list_offsets::partition_response> partitions;
+		partitions.push_back(kbs::list_offsets::partition_response(1, 0, 0, 1234, 17));
+		kbs::primitive::array<kbs::list_offsets::topic_response> topics;
+		topics.push_back(kbs::list_offsets::topic_response("ab", partitions));
+
+		// Correlation id, topic array, partition with timestamp and offset
+		kbs::list_offsets::response v1(6, topics);
+		std::vector<uint8_t> buf(v1.serial_size());
+		ASSERT_EQ(buf.size(), static_cast<size_t>(4 + 4 + 4 + 4 + 4 + 2 + 8 + 8));
+		ASSERT_EQ(static_cast<size_t>(v1.serialize(&buf[0]) - &buf[0]), buf.size());
+		ASSERT_EQ(kbs::util::read_type<int32_t>(&buf[0]), static_cast<int32_t>(6));
+		ASSERT_EQ(kbs::util::read_type<int64_t>(&buf[22]), static_cast<int64_t>(1234));
+		ASSERT_EQ(kbs::util::read_type<int64_t>(&buf[30]), static_cast<int64_t>(17));
+
+		// Version 0 sends an offset array which is empty without an offset
+		kbs::list_offsets::partition_response found(0, 1, 0, 1234, 17);
+		std::vector<uint8_t> part(found.serial_size());
+		ASSERT_EQ(part.size(), static_cast<size_t>(4 + 2 + 4 + 8));
+		found.serialize(&part[0]);
+		ASSERT_EQ(kbs::util::read_type<int32_t>(&part[6]), static_cast<int32_t>(1));
+		ASSERT_EQ(kbs::util::read_type<int64_t>(&part[10]), static_cast<int64_t>(17));
+
+		kbs::list_offsets::partition_response none(0, 1, 3, -1, -1);
+		ASSERT_EQ(none.serial_size(), static_cast<size_t>(4 + 2 + 4));
+		none.serialize(&part[0]);
+		ASSERT_EQ(kbs::util::read_type<int16_t>(&part[4]), static_cast<int16_t>(3));
+		ASSERT_EQ(kbs::util::read_type<int32_t>(&part[6]), static_cast<int32_t>(0));
+	}
+
+	void tests()
+	{
+		request_test();
+		response_test();
+	}
+};
+
+int main()
+{
+	list_offsets_test suite("List offsets unittests");
+	suite.execute_tests();
+	return 0;
+}
@@ -0,0 +1,178 @@
+#include "kafka_broker_stub/log.hpp"
+#include "kafka_broker_stub/main.hpp"
+
+#include "test_common.hpp"
+
+namespace kbs = kafka_broker_stub;
+
+/**
+ * Sink storing the text of all records written to it
+ */
+class capture_sink : public kbs::log::sinkI
+{
+public:
+	capture_sink(): m_texts() { }
+
+	void write(const kbs::log::record& rec)
+	{
+		m_texts.push_back(rec.text);
+	}
+
+	std::vector<std::string> m_texts;
+};
+
+class log_test : public kbs::test::suite
+{
+public:
+	log_test(const std::string& name): suite(name) { }
+
+private:
+	void ring_buffer_test()
+	{
+		// Capacity is rounded up to a power of two
+		kbs::log::ring_buffer<int> buf(3);
+		ASSERT_EQ(buf.capacity(), static_cast<size_t>(4));
+
+		int val = 0;
+		ASSERT_EQ(buf.pop(val), false);
+
+		// Fill buffer and check that it rejects more elements
+		for (int i=0; i<4; ++i)
+		{
+			ASSERT_EQ(buf.push(i), true);
+		}
+		ASSERT_EQ(buf.push(4), false);
+
+		// Elements come out in order and free up space for wrapping around
+		ASSERT_EQ(buf.pop(val), true);
+		ASSERT_EQ(val, 0);
+		ASSERT_EQ(buf.push(4), true);
+		for (int i=1; i<5; ++i)
+		{
+			ASSERT_EQ(buf.pop(val), true);
+			ASSERT_EQ(val, i);
+		}
+		ASSERT_EQ(buf.pop(val), false);
+	}
+
+	void logger_test()
+	{
+		capture_sink sink;
+		kbs::log::logger logger;
+		logger.set_sink(sink);
+
+		// Default level is info so debug statements are filtered
+		ASSERT_EQ(static_cast<int>(logger.get_level()), static_cast<int>(kbs::log::LEVEL_INFO));
+		logger.write(kbs::log::LEVEL_DEBUG, kbs::log::MSG_GENERIC, 0, "debug");
+		logger.write(kbs::log::LEVEL_INFO, kbs::log::MSG_GENERIC, 0, "info [%i]", 7);
+		ASSERT_EQ(sink.m_texts.size(), static_cast<size_t>(1));
+		ASSERT_EQ(sink.m_texts[0], std::string("info [7]"));
+
+		// The statement macro does not evaluate the arguments of filtered statements
+		int evaluated = 0;
+		KAFKA_BROKER_STUB_LOG(logger, kbs::log::LEVEL_DEBUG, kbs::log::MSG_GENERIC)(0, "debug [%i]", ++evaluated);
+		ASSERT_EQ(evaluated, 0);
+		KAFKA_BROKER_STUB_LOG(logger, kbs::log::LEVEL_INFO, kbs::log::MSG_GENERIC)(0, "info [%i]", ++evaluated);
+		ASSERT_EQ(evaluated, 1);
+		ASSERT_EQ(sink.m_texts.size(), static_cast<size_t>(2));
+		ASSERT_EQ(sink.m_texts[1], std::string("info [1]"));
+		sink.m_texts.pop_back();
+
+		logger.set_level(kbs::log::LEVEL_DEBUG);
+		ASSERT_EQ(logger.enabled(kbs::log::LEVEL_DEBUG), true);
+		logger.write(kbs::log::LEVEL_DEBUG, kbs::log::MSG_GENERIC, 0, "debug");
+		ASSERT_EQ(sink.m_texts.size(), static_cast<size_t>(2));
+
+		// Long messages are truncated
+		std::string long_msg(2*kbs::log::MSG_MAX_SIZE, 'x');
+		logger.write(kbs::log::LEVEL_ERROR, kbs::log::MSG_GENERIC, 0, "%s", long_msg.c_str());
+		ASSERT_EQ(sink.m_texts.back().size(), kbs::log::MSG_MAX_SIZE-1);
+
+		// Rate limit a message type - other types are unaffected
+		logger.set_rate_limit(kbs::log::MSG_REQUEST, 2, 60000);
+		sink.m_texts.clear();
+		for (int i=0; i<5; ++i)
+		{
+			logger.write(kbs::log::LEVEL_INFO, kbs::log::MSG_REQUEST, 0, "request");
+			logger.write(kbs::log::LEVEL_INFO, kbs::log::MSG_GENERIC, 0, "generic");
+		}
+		ASSERT_EQ(sink.m_texts.size(), static_cast<size_t>(7));
+		ASSERT_EQ(logger.suppressed(kbs::log::MSG_REQUEST), static_cast<uint64_t>(3));
+		ASSERT_EQ(logger.suppressed(kbs::log::MSG_GENERIC), static_cast<uint64_t>(0));
+	}
+
+	void rate_limiter_test()
+	{
+		kbs::log::rate_limiter limiter;
+		limiter.set_limit(kbs::log::MSG_UNKNOWN_API, 1, 10);
+
+		// One message per 10 ms window
+		uint64_t ms = 1000000;
+		ASSERT_EQ(limiter.allow(kbs::log::MSG_UNKNOWN_API, 100*ms), true);
+		ASSERT_EQ(limiter.allow(kbs::log::MSG_UNKNOWN_API, 105*ms), false);
+		ASSERT_EQ(limiter.allow(kbs::log::MSG_UNKNOWN_API, 110*ms), true);
+		ASSERT_EQ(limiter.allow(kbs::log::MSG_UNKNOWN_API, 111*ms), false);
+		ASSERT_EQ(limiter.suppressed(kbs::log::MSG_UNKNOWN_API), static_cast<uint64_t>(2));
+
+		// No limit configured
+		ASSERT_EQ(limiter.allow(kbs::log::MSG_GENERIC, 100*ms), true);
+		ASSERT_EQ(limiter.allow(kbs::log::MSG_GENERIC, 100*ms), true);
+	}
+
+	void async_sink_test()
+	{
+		capture_sink target;
+		{
+			kbs::log::async_sink sink(target, 4096);
+			kbs::log::logger logger;
+			logger.set_sink(sink);
+			for (int i=0; i<100; ++i)
+			{
+				logger.write(kbs::log::LEVEL_INFO, kbs::log::MSG_GENERIC, 0, "msg [%i]", i);
+			}
+			ASSERT_EQ(sink.dropped(), static_cast<uint64_t>(0));
+
+			// Records are drained when the sink is destroyed
+		}
+
+		ASSERT_EQ(target.m_texts.size(), static_cast<size_t>(100));
+		ASSERT_EQ(target.m_texts[0], std::string("msg [0]"));
+		ASSERT_EQ(target.m_texts[99], std::string("msg [99]"));
+	}
+
+	void broker_stub_test()
+	{
+		capture_sink sink;
+		kbs::broker_stub stub(0, "localhost", 9092);
+		stub.get_logger().set_sink(sink);
+
+		// Requests with an unknown api key are logged but rate limited
+		uint8_t req[] = {
+			0x00, 0x00, 0x00, 0x04, 0x00, 0x7F, 0x00, 0x00
+		};
+		std::vector<std::string> responses;
+		for (int i=0; i<50; ++i)
+		{
+			ASSERT_EQ(stub.handle_data(req, sizeof(req), responses), static_cast<int>(sizeof(req)));
+		}
+		ASSERT_EQ(sink.m_texts.size(), static_cast<size_t>(10));
+		ASSERT_EQ(sink.m_texts[0], std::string("Got unknown API key [127]"));
+		ASSERT_EQ(stub.get_logger().suppressed(kbs::log::MSG_UNKNOWN_API), static_cast<uint64_t>(40));
+	}
+
+	void tests()
+	{
+		ring_buffer_test();
+		logger_test();
+		rate_limiter_test();
+		async_sink_test();
+		broker_stub_test();
+	}
+};
+
+int main()
+{
+	log_test suite("Log unittests");
+	suite.execute_tests();
+	return 0;
+}
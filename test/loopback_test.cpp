@@ -0,0 +1,479 @@
+#include "kafka_broker_stub/loopback.hpp"
+#include "kafka_broker_stub/loopback.hpp"
+
+#include "test_common.hpp"
+
+namespace kbs = kafka_broker_stub;
+
+namespace {
+
+	// Produce request with one message "testmessage" for partition 1 of topic "test"
+	const uint8_t produce_req[] = {
+		0x00, 0x00, 0x00, 0x52,
+		0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x03,
+		0x00, 0x07, 0x72, 0x64, 0x6b, 0x61, 0x66, 0x6b, 0x61,
+		0x00, 0x01,
+		0x00, 0x00, 0x13, 0x88,
+		0x00, 0x00, 0x00, 0x01,
+			0x00, 0x04, 0x74, 0x65, 0x73, 0x74,
+			0x00, 0x00, 0x00, 0x01,
+				0x00, 0x00, 0x00, 0x01,
+				0x00, 0x00, 0x00, 0x25,
+					0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x09,
+					0x00, 0x00, 0x00, 0x19,
+					0xa6, 0xb1, 0x36, 0x2b,
+					0xFF,
+					0x00,
+					0xff, 0xff, 0xff, 0xff,
+					0x00, 0x00, 0x00, 0x0b,
+						0x74, 0x65, 0x73, 0x74, 0x6d, 0x65,
+						0x73, 0x73, 0x61, 0x67, 0x65};
+
+	// Size of the produce response
+	const size_t PRODUCE_RESP_SIZE = 36;
+
+	// Requests sent by each client thread
+	const int CLIENT_REQUESTS = 1000;
+
+	struct server_args
+	{
+		explicit server_args(kbs::transport::transportI& t):
+			transport(t),
+			running(1)
+		{
+
+		}
+
+		kbs::transport::transportI& transport;
+		volatile int running;
+	};
+
+	void* server_thread(void* arg)
+	{
+		server_args* args = static_cast<server_args*>(arg);
+		kbs::transport::serve(args->transport, &args->running);
+		return NULL;
+	}
+
+	struct client_args
+	{
+		explicit client_args(kbs::transport::loopback_transport& t):
+			transport(t),
+			ok(0)
+		{
+
+		}
+
+		kbs::transport::loopback_transport& transport;
+		int ok;
+	};
+
+	void* client_thread(void* arg)
+	{
+		client_args* args = static_cast<client_args*>(arg);
+		kbs::transport::loopback_channel& channel = args->transport.connect();
+		uint8_t resp[PRODUCE_RESP_SIZE];
+		for (int i=0; i<CLIENT_REQUESTS; ++i)
+		{
+			if (channel.write_all(produce_req, sizeof(produce_req), 5000) &&
+			    channel.read_all(resp, sizeof(resp), 5000))
+			{
+				++args->ok;
+			}
+		}
+		return NULL;
+	}
+
+	void put16(std::string& out, int16_t val)
+	{
+		uint8_t buf[2];
+		kbs::util::write_type<int16_t>(val, buf);
+		out.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+	}
+
+	void put32(std::string& out, int32_t val)
+	{
+		uint8_t buf[4];
+		kbs::util::write_type<int32_t>(val, buf);
+		out.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+	}
+
+	void put_string(std::string& out, const std::string& str)
+	{
+		put16(out, static_cast<int16_t>(str.size()));
+		out += str;
+	}
+
+	std::string frame(const std::string& msg)
+	{
+		std::string out;
+		put32(out, static_cast<int32_t>(msg.size()));
+		return out + msg;
+	}
+
+	std::string group_header(int16_t api_key, int32_t corr_id)
+	{
+		std::string out;
+		put16(out, api_key);
+		put16(out, 0);
+		put32(out, corr_id);
+		put_string(out, "rdkafka");
+		put_string(out, "grp");
+		return out;
+	}
+
+	// JoinGroup version 0 with a session timeout of 10 s
+	std::string join_req(int32_t corr_id, const std::string& member)
+	{
+		std::string out = group_header(11, corr_id);
+		put32(out, 10000);
+		put_string(out, member);
+		put_string(out, "consumer");
+		put32(out, 1);
+		put_string(out, "range");
+		put32(out, 0);
+		return frame(out);
+	}
+
+	// SyncGroup version 0 without assignments
+	std::string sync_req(int32_t corr_id, const std::string& member, int32_t generation)
+	{
+		std::string out = group_header(14, corr_id);
+		put32(out, generation);
+		put_string(out, member);
+		put32(out, 0);
+		return frame(out);
+	}
+
+	std::string heartbeat_req(int32_t corr_id, const std::string& member, int32_t generation)
+	{
+		std::string out = group_header(12, corr_id);
+		put32(out, generation);
+		put_string(out, member);
+		return frame(out);
+	}
+
+	/**
+	 * Read one response waiting up to a second for it
+	 */
+	std::string read_response(kbs::transport::loopback_transport& transport,
+	                          kbs::transport::loopback_channel& channel)
+	{
+		uint64_t start = kbs::util::monotonic_ns();
+		uint8_t size[4] = {0};
+		while ((kbs::util::monotonic_ns() - start < static_cast<uint64_t>(1000000000)) &&
+		       (channel.read(size, sizeof(size)) == 0))
+		{
+			transport.poll(1);
+		}
+		std::string resp(static_cast<size_t>(kbs::util::read_type<int32_t>(size)), '\0');
+		channel.read_all(&resp[0], resp.size(), 1000);
+		return resp;
+	}
+
+	// Error code of a response without a throttle time
+	int16_t error_code(const std::string& resp)
+	{
+		return kbs::util::read_type<int16_t>(reinterpret_cast<const uint8_t*>(resp.data()) + 4);
+	}
+
+	/**
+	 * JoinGroup response version 0 without the members
+	 */
+	struct join_result
+	{
+		explicit join_result(const std::string& resp):
+			corr_id(0),
+			generation(0),
+			leader(),
+			member()
+		{
+			const uint8_t* data = reinterpret_cast<const uint8_t*>(resp.data());
+			corr_id = kbs::util::read_type<int32_t>(data);
+			generation = kbs::util::read_type<int32_t>(data + 6);
+			size_t pos = 10;
+			pos += 2 + static_cast<size_t>(kbs::util::read_type<int16_t>(data + pos));
+			size_t len = static_cast<size_t>(kbs::util::read_type<int16_t>(data + pos));
+			leader = resp.substr(pos + 2, len);
+			pos += 2 + len;
+			len = static_cast<size_t>(kbs::util::read_type<int16_t>(data + pos));
+			member = resp.substr(pos + 2, len);
+		}
+
+		int32_t corr_id;
+		int32_t generation;
+		std::string leader;
+		std::string member;
+	};
+
+	kbs::broker_stub* make_stub()
+	{
+		std::vector<kbs::partition> partitions;
+		partitions.push_back(kbs::partition(0, 0));
+		partitions.push_back(kbs::partition(1, 0));
+		kbs::broker_stub* stub = new kbs::broker_stub(0, "localhost", 9092);
+		stub->get_logger().set_level(kbs::log::LEVEL_NONE);
+		stub->add_topic("test", partitions);
+		return stub;
+	}
+
+}
+
+class loopback_test : public kbs::test::suite
+{
+public:
+	loopback_test(const std::string& name): suite(name) { }
+
+private:
+	void queue_test()
+	{
+		kbs::transport::spsc_byte_queue queue(100);
+		ASSERT_EQ(queue.capacity(), static_cast<size_t>(128));
+		ASSERT_EQ(queue.empty(), true);
+
+		// Fill up and wrap around
+		uint8_t data[100];
+		for (size_t i=0; i<sizeof(data); ++i)
+		{
+			data[i] = static_cast<uint8_t>(i);
+		}
+		ASSERT_EQ(queue.write(data, 100), static_cast<size_t>(100));
+		ASSERT_EQ(queue.write(data, 100), static_cast<size_t>(28));
+
+		uint8_t out[100];
+		ASSERT_EQ(queue.read(out, 90), static_cast<size_t>(90));
+		ASSERT_EQ(out[89], static_cast<uint8_t>(89));
+		ASSERT_EQ(queue.write(data, 50), static_cast<size_t>(50));
+
+		// Readable bytes are contiguous up to the end of the buffer
+		const uint8_t* peeked = NULL;
+		ASSERT_EQ(queue.peek(peeked), static_cast<size_t>(38));
+		ASSERT_EQ(peeked[0], static_cast<uint8_t>(90));
+		queue.consume(38);
+		ASSERT_EQ(queue.read(out, 100), static_cast<size_t>(50));
+		ASSERT_EQ(out[0], static_cast<uint8_t>(0));
+		ASSERT_EQ(out[49], static_cast<uint8_t>(49));
+		ASSERT_EQ(queue.empty(), true);
+	}
+
+	void poll_test()
+	{
+		// Client and broker on the same thread
+		kbs::broker_stub* stub = make_stub();
+		kbs::transport::loopback_transport transport(*stub, 256);
+		ASSERT_EQ(transport.listen("", 0), true);
+		kbs::transport::loopback_channel& channel = transport.connect();
+
+		ASSERT_EQ(transport.poll(0), 0);
+		ASSERT_EQ(channel.write(produce_req, 10), static_cast<size_t>(10));
+		ASSERT_EQ(transport.poll(0), 1);
+		uint8_t resp[3 * PRODUCE_RESP_SIZE];
+		ASSERT_EQ(channel.read(resp, sizeof(resp)), static_cast<size_t>(0));
+
+		// Three requests in a queue of 256 bytes - responses are handed out
+		// as they fit
+		ASSERT_EQ(channel.write(produce_req + 10, sizeof(produce_req) - 10), sizeof(produce_req) - 10);
+		ASSERT_EQ(channel.write(produce_req, sizeof(produce_req)), sizeof(produce_req));
+		ASSERT_EQ(transport.poll(0), 1);
+		ASSERT_EQ(channel.write(produce_req, sizeof(produce_req)), sizeof(produce_req));
+		ASSERT_EQ(transport.poll(0), 1);
+		ASSERT_EQ(channel.read_all(resp, sizeof(resp), 0), true);
+		ASSERT_EQ(kbs::util::read_type<int64_t>(resp + PRODUCE_RESP_SIZE - 8), static_cast<int64_t>(0));
+		ASSERT_EQ(kbs::util::read_type<int64_t>(resp + 3 * PRODUCE_RESP_SIZE - 8), static_cast<int64_t>(2));
+
+		// Invalid stream closes the channel
+		uint8_t bad_size[5] = {0};
+		channel.write(bad_size, sizeof(bad_size));
+		transport.poll(0);
+		ASSERT_EQ(channel.closed(), true);
+		ASSERT_EQ(channel.read_all(resp, 1, 1000), false);
+		ASSERT_EQ(channel.write_all(produce_req, sizeof(produce_req), 1000), false);
+		delete stub;
+	}
+
+	void throttle_test()
+	{
+		// 37 record bytes at 370 bytes per second without burst are 100 ms
+		kbs::broker_stub* stub = make_stub();
+		stub->get_quotas().set_burst_ms(0);
+		stub->get_quotas().set_client_quota(kbs::QUOTA_PRODUCE, "rdkafka", 370);
+		stub->get_quotas().set_delay_responses(true);
+		kbs::transport::loopback_transport transport(*stub);
+		kbs::transport::loopback_channel& channel = transport.connect();
+
+		// The response is held back and the next request waits meanwhile
+		uint64_t start = kbs::util::monotonic_ns();
+		ASSERT_EQ(channel.write(produce_req, sizeof(produce_req)), sizeof(produce_req));
+		transport.poll(0);
+		ASSERT_EQ(channel.write(produce_req, sizeof(produce_req)), sizeof(produce_req));
+		transport.poll(0);
+		uint8_t resp[2 * PRODUCE_RESP_SIZE];
+		ASSERT_EQ(channel.read(resp, sizeof(resp)), static_cast<size_t>(0));
+		ASSERT_EQ(stub->get_topic("test")->get_partition(1)->next_offset(), static_cast<int64_t>(1));
+
+		while ((kbs::util::monotonic_ns() - start) < static_cast<uint64_t>(1000000000) &&
+		       (channel.read(resp, PRODUCE_RESP_SIZE) == 0))
+		{
+			transport.poll(10);
+		}
+		ASSERT_EQ(kbs::util::monotonic_ns() - start >= static_cast<uint64_t>(90000000), true);
+		ASSERT_EQ(stub->get_topic("test")->get_partition(1)->next_offset(), static_cast<int64_t>(2));
+		delete stub;
+	}
+
+	void shaping_test()
+	{
+		// 25 ms each way for the client, none for others
+		kbs::broker_stub* stub = make_stub();
+		kbs::link_profile profile;
+		profile.latency_us = 25000;
+		stub->get_shaping().set_client_profile("rdkafka", profile);
+		kbs::transport::loopback_transport transport(*stub);
+		kbs::transport::loopback_channel& channel = transport.connect();
+
+		// The request only reaches the stub after the latency
+		uint64_t start = kbs::util::monotonic_ns();
+		ASSERT_EQ(channel.write(produce_req, sizeof(produce_req)), sizeof(produce_req));
+		transport.poll(0);
+		ASSERT_EQ(stub->get_topic("test")->get_partition(1)->next_offset(), static_cast<int64_t>(0));
+
+		// The response takes the latency again
+		uint8_t resp[PRODUCE_RESP_SIZE];
+		while ((kbs::util::monotonic_ns() - start) < static_cast<uint64_t>(1000000000) &&
+		       (channel.read(resp, sizeof(resp)) == 0))
+		{
+			transport.poll(1);
+		}
+		ASSERT_EQ(kbs::util::monotonic_ns() - start >= static_cast<uint64_t>(50000000), true);
+		ASSERT_EQ(stub->get_topic("test")->get_partition(1)->next_offset(), static_cast<int64_t>(1));
+
+		// Removing the profile applies to the open connection
+		stub->get_shaping().remove_client_profile("rdkafka");
+		start = kbs::util::monotonic_ns();
+		ASSERT_EQ(channel.write(produce_req, sizeof(produce_req)), sizeof(produce_req));
+		transport.poll(0);
+		ASSERT_EQ(channel.read(resp, sizeof(resp)), PRODUCE_RESP_SIZE);
+		ASSERT_EQ(kbs::util::monotonic_ns() - start < static_cast<uint64_t>(25000000), true);
+
+		// A connection used before the profile was set picks it up
+		kbs::transport::loopback_channel& early = transport.connect();
+		ASSERT_EQ(early.write(produce_req, sizeof(produce_req)), sizeof(produce_req));
+		transport.poll(0);
+		ASSERT_EQ(early.read(resp, sizeof(resp)), PRODUCE_RESP_SIZE);
+		ASSERT_EQ(stub->get_topic("test")->get_partition(1)->next_offset(), static_cast<int64_t>(3));
+
+		stub->get_shaping().set_client_profile("rdkafka", profile);
+		start = kbs::util::monotonic_ns();
+		ASSERT_EQ(early.write(produce_req, sizeof(produce_req)), sizeof(produce_req));
+		transport.poll(0);
+		ASSERT_EQ(stub->get_topic("test")->get_partition(1)->next_offset(), static_cast<int64_t>(3));
+		while ((kbs::util::monotonic_ns() - start) < static_cast<uint64_t>(1000000000) &&
+		       (early.read(resp, sizeof(resp)) == 0))
+		{
+			transport.poll(1);
+		}
+		ASSERT_EQ(kbs::util::monotonic_ns() - start >= static_cast<uint64_t>(50000000), true);
+		ASSERT_EQ(stub->get_topic("test")->get_partition(1)->next_offset(), static_cast<int64_t>(4));
+		delete stub;
+	}
+
+	void group_test()
+	{
+		kbs::broker_stub* stub = make_stub();
+		kbs::transport::loopback_transport transport(*stub);
+		kbs::transport::loopback_channel& first = transport.connect();
+		kbs::transport::loopback_channel& second = transport.connect();
+
+		// The first member joins and syncs on its own
+		std::string req = join_req(1, "");
+		first.write_all(req.data(), req.size(), 1000);
+		join_result leader(read_response(transport, first));
+		ASSERT_EQ(leader.corr_id, static_cast<int32_t>(1));
+		ASSERT_EQ(leader.generation, static_cast<int32_t>(1));
+		ASSERT_EQ(leader.leader, leader.member);
+		req = sync_req(2, leader.member, 1);
+		first.write_all(req.data(), req.size(), 1000);
+		ASSERT_EQ(error_code(read_response(transport, first)), static_cast<int16_t>(0));
+
+		// The join of the second member waits for the first, and so does its
+		// next request
+		req = join_req(3, "") + heartbeat_req(4, "", 0);
+		second.write_all(req.data(), req.size(), 1000);
+		for (int i=0; i<5; ++i)
+		{
+			transport.poll(1);
+		}
+		uint8_t byte;
+		ASSERT_EQ(second.read(&byte, 1), static_cast<size_t>(0));
+
+		req = heartbeat_req(5, leader.member, 1);
+		first.write_all(req.data(), req.size(), 1000);
+		ASSERT_EQ(error_code(read_response(transport, first)),
+		          static_cast<int16_t>(kbs::GROUP_ERR_REBALANCE_IN_PROGRESS));
+		req = join_req(6, leader.member);
+		first.write_all(req.data(), req.size(), 1000);
+		join_result rejoined(read_response(transport, first));
+		ASSERT_EQ(rejoined.generation, static_cast<int32_t>(2));
+		ASSERT_EQ(rejoined.leader, leader.member);
+
+		join_result follower(read_response(transport, second));
+		ASSERT_EQ(follower.corr_id, static_cast<int32_t>(3));
+		ASSERT_EQ(follower.generation, static_cast<int32_t>(2));
+		ASSERT_EQ(follower.leader, leader.member);
+		std::string heartbeat = read_response(transport, second);
+		ASSERT_EQ(kbs::util::read_type<int32_t>(reinterpret_cast<const uint8_t*>(heartbeat.data())),
+		          static_cast<int32_t>(4));
+		ASSERT_EQ(error_code(heartbeat), static_cast<int16_t>(kbs::GROUP_ERR_UNKNOWN_MEMBER_ID));
+		ASSERT_EQ(stub->get_groups().member_count("grp"), static_cast<size_t>(2));
+		delete stub;
+	}
+
+	void threads_test()
+	{
+		kbs::broker_stub* stub = make_stub();
+		kbs::transport::loopback_transport transport(*stub);
+		server_args server(transport);
+		pthread_t server_id;
+		ASSERT_EQ(pthread_create(&server_id, NULL, &server_thread, &server), 0);
+
+		uint64_t start = kbs::util::monotonic_ns();
+		std::vector<client_args> clients(4, client_args(transport));
+		std::vector<pthread_t> ids(clients.size());
+		for (size_t i=0; i<clients.size(); ++i)
+		{
+			ASSERT_EQ(pthread_create(&ids[i], NULL, &client_thread, &clients[i]), 0);
+		}
+		for (size_t i=0; i<clients.size(); ++i)
+		{
+			pthread_join(ids[i], NULL);
+			ASSERT_EQ(clients[i].ok, CLIENT_REQUESTS);
+		}
+		uint64_t elapsed = kbs::util::monotonic_ns() - start;
+
+		kbs::util::atomic_store(&server.running, 0);
+		pthread_join(server_id, NULL);
+		ASSERT_EQ(stub->get_topic("test")->get_partition(1)->next_offset(),
+		          static_cast<int64_t>(clients.size()) * CLIENT_REQUESTS);
+		printf("%d request round trips in [%lu] us\n", static_cast<int>(clients.size()) * CLIENT_REQUESTS,
+		       static_cast<unsigned long>(elapsed / 1000));
+		delete stub;
+	}
+
+	void tests()
+	{
+		queue_test();
+		poll_test();
+		throttle_test();
+		shaping_test();
+		group_test();
+		threads_test();
+	}
+};
+
+int main()
+{
+	loopback_test suite("Loopback unittests");
+	suite.execute_tests();
+	return 0;
+}
@@ -5,6 +5,293 @@
 
 namespace kbs = kafka_broker_stub;
 
+namespace {
+
+	void put16(std::string& out, int16_t val)
+	{
+		uint8_t buf[2];
+		kbs::util::write_type<int16_t>(val, buf);
+		out.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+	}
+
+	void put32(std::string& out, int32_t val)
+	{
+		uint8_t buf[4];
+		kbs::util::write_type<int32_t>(val, buf);
+		out.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+	}
+
+	void put_string(std::string& out, const std::string& str)
+	{
+		put16(out, static_cast<int16_t>(str.size()));
+		out += str;
+	}
+
+	// Partition record with a message set holding one message with the value
+	void put_partition(std::string& out, int32_t part, const std::string& value)
+	{
+		std::string set(12, '\0');
+		set += std::string(6, '\0');
+		put32(set, -1);
+		put32(set, static_cast<int32_t>(value.size()));
+		set += value;
+		kbs::util::write_type<int32_t>(static_cast<int32_t>(set.size() - 12), reinterpret_cast<uint8_t*>(&set[8]));
+		put32(out, part);
+		put32(out, static_cast<int32_t>(set.size()));
+		out += set;
+	}
+
+	// Produce request header for the number of topic records
+	std::string produce_header(int32_t topics, int16_t version = 0, const std::string& client = "test")
+	{
+		std::string out;
+		put16(out, 0);
+		put16(out, version);
+		put32(out, 7);
+		put_string(out, client);
+		if (version >= 3)
+			put16(out, -1);
+		put16(out, 1);
+		put32(out, 1000);
+		put32(out, topics);
+		return out;
+	}
+
+	// Uncompressed record batch of a producer with a value per record
+	std::string record_batch(int64_t producer_id, int16_t epoch, int32_t sequence, const std::vector<std::string>& values)
+	{
+		std::string records;
+		for (size_t i=0; i<values.size(); ++i)
+		{
+			// Zigzag varints - values and offset deltas are small
+			std::string record;
+			record += '\0';
+			record += '\0';
+			record += static_cast<char>(i * 2);
+			record += '\x01';
+			record += static_cast<char>(values[i].size() * 2);
+			record += values[i];
+			record += '\0';
+			records += static_cast<char>(record.size() * 2);
+			records += record;
+		}
+
+		std::string batch(8, '\0');
+		put32(batch, static_cast<int32_t>(49 + records.size()));
+		put32(batch, -1);
+		batch += '\x02';
+		batch += std::string(6, '\0');
+		put32(batch, static_cast<int32_t>(values.size()) - 1);
+		batch += std::string(16, '\0');
+		put32(batch, static_cast<int32_t>(producer_id >> 32));
+		put32(batch, static_cast<int32_t>(producer_id & 0xFFFFFFFF));
+		put16(batch, epoch);
+		put32(batch, sequence);
+		put32(batch, static_cast<int32_t>(values.size()));
+		return batch + records;
+	}
+
+	// Fetch request for one partition of a topic
+	std::string fetch_request(int16_t version, const std::string& topic, int32_t part, int64_t offset,
+	                          int32_t max_bytes)
+	{
+		std::string out;
+		put16(out, 1);
+		put16(out, version);
+		put32(out, 8);
+		put_string(out, "test");
+		put32(out, -1);
+		put32(out, 0);
+		put32(out, 1);
+		put32(out, 1);
+		put_string(out, topic);
+		put32(out, 1);
+		put32(out, part);
+		put32(out, static_cast<int32_t>(offset >> 32));
+		put32(out, static_cast<int32_t>(offset & 0xFFFFFFFF));
+		put32(out, max_bytes);
+		std::string framed;
+		put32(framed, static_cast<int32_t>(out.size()));
+		return framed + out;
+	}
+
+	// List offsets request for one partition of a topic
+	std::string list_offsets_request(int16_t version, const std::string& topic, int32_t part, int64_t timestamp)
+	{
+		std::string out;
+		put16(out, 2);
+		put16(out, version);
+		put32(out, 11);
+		put_string(out, "test");
+		put32(out, -1);
+		put32(out, 1);
+		put_string(out, topic);
+		put32(out, 1);
+		put32(out, part);
+		put32(out, static_cast<int32_t>(timestamp >> 32));
+		put32(out, static_cast<int32_t>(timestamp & 0xFFFFFFFF));
+		if (version == 0)
+			put32(out, 1);
+		std::string framed;
+		put32(framed, static_cast<int32_t>(out.size()));
+		return framed + out;
+	}
+
+	std::string frame(const std::string& msg)
+	{
+		std::string out;
+		put32(out, static_cast<int32_t>(msg.size()));
+		return out + msg;
+	}
+
+	struct produce_result
+	{
+		produce_result(const std::string& name, const uint8_t* data):
+			topic(name),
+			partition(kbs::util::read_type<int32_t>(data)),
+			error(kbs::util::read_type<int16_t>(data + 4)),
+			offset(kbs::util::read_type<int64_t>(data + 6))
+		{
+
+		}
+
+		std::string topic;
+		int32_t partition;
+		int16_t error;
+		int64_t offset;
+	};
+
+	// Flatten a produce response to one result per partition
+	std::vector<produce_result> parse_produce_response(const std::string& resp)
+	{
+		std::vector<produce_result> results;
+		const uint8_t* data = reinterpret_cast<const uint8_t*>(resp.data()) + 8;
+		int32_t topics = kbs::util::read_type<int32_t>(data);
+		data += 4;
+		for (int32_t t=0; t<topics; ++t)
+		{
+			size_t len = static_cast<size_t>(kbs::util::read_type<int16_t>(data));
+			std::string name(reinterpret_cast<const char*>(data + 2), len);
+			data += 2 + len;
+			int32_t parts = kbs::util::read_type<int32_t>(data);
+			data += 4;
+			for (int32_t p=0; p<parts; ++p)
+			{
+				results.push_back(produce_result(name, data));
+				data += 14;
+			}
+		}
+		return results;
+	}
+
+	// Metadata request for all topics framed with its size
+	std::string metadata_request(int16_t api_key, int16_t version)
+	{
+		std::string out;
+		put16(out, api_key);
+		put16(out, version);
+		put32(out, 9);
+		put_string(out, "test");
+		put32(out, 0);
+		std::string framed;
+		put32(framed, static_cast<int32_t>(out.size()));
+		return framed + out;
+	}
+
+	// Heap allocations counted by the replaced operator new below
+	volatile size_t allocations = 0;
+
+	// Allocations made while handling a request
+	size_t count_allocations(kbs::broker_stub& stub, const std::string& req)
+	{
+		std::vector<std::string> responses;
+		responses.reserve(1);
+		const uint8_t* data = reinterpret_cast<const uint8_t*>(req.data());
+		size_t before = allocations;
+		stub.handle_data(data, req.size(), responses);
+		return allocations - before;
+	}
+
+	// Handler answering with the correlation ID only
+	class echo_handler : public kbs::request_handlerI
+	{
+	public:
+		echo_handler():
+			calls(0)
+		{
+
+		}
+
+		int handle(kbs::request_context& ctx)
+		{
+			++calls;
+			memcpy(ctx.response_buf, ctx.data + 4, 4);
+			return 4;
+		}
+
+		int calls;
+	};
+
+	// Handler failing every other request and delegating the others
+	class flaky_handler : public kbs::request_handlerI
+	{
+	public:
+		explicit flaky_handler(kbs::request_handlerI* handler):
+			m_handler(handler),
+			m_calls(0)
+		{
+
+		}
+
+		int handle(kbs::request_context& ctx)
+		{
+			return ((m_calls++ % 2) == 0) ? -1 : m_handler->handle(ctx);
+		}
+
+	private:
+		flaky_handler(const flaky_handler&);
+		flaky_handler& operator=(const flaky_handler&);
+
+		kbs::request_handlerI* m_handler;
+		int m_calls;
+	};
+
+}
+
+// The replaced operators below pair malloc and free themselves
+#if defined(__GNUC__) && (__GNUC__ >= 11)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+#if __cplusplus >= 201103L
+#define TEST_THROW_BAD_ALLOC
+#define TEST_NO_THROW noexcept
+#else
+#define TEST_THROW_BAD_ALLOC throw(std::bad_alloc)
+#define TEST_NO_THROW throw()
+#endif
+
+void* operator new(size_t size) TEST_THROW_BAD_ALLOC
+{
+	allocations = allocations + 1;
+	void* ptr = malloc((size > 0) ? size : 1);
+	if (ptr == NULL)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void operator delete(void* ptr) TEST_NO_THROW
+{
+	free(ptr);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void* ptr, size_t) TEST_NO_THROW
+{
+	free(ptr);
+}
+#endif
+
 class produce_test : public kbs::test::suite
 {
 public:
@@ -129,7 +416,7 @@ private:
 						0x00, 0x00, 0x00, 0x19, // message size
 						0xa6, 0xb1, 0x36, 0x2b, // crc
 						0xFF, // magic byte
-						0xEE, // attributes
+						0x00, // attributes
 						0xff, 0xff, 0xff, 0xff, // key byte array
 				   	0x00, 0x00, 0x00, 0x0b, // value bytearray length (rest of payload)
 				   		0x74, 0x65, 0x73, 0x74, 0x6d, 0x65,
@@ -159,6 +446,874 @@ private:
       ASSERT_EQ(cmp, static_cast<int>(0));
 	}
 
+	void partition_test()
+	{
+		// Two messages with key "k" and values "v1" and "v2"
+		uint8_t set[] = {
+			0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+			0x00, 0x00, 0x00, 0x11,
+			0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+			0x00, 0x00, 0x00, 0x01, 0x6b,
+			0x00, 0x00, 0x00, 0x02, 0x76, 0x31,
+			0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+			0x00, 0x00, 0x00, 0x11,
+			0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+			0x00, 0x00, 0x00, 0x01, 0x6b,
+			0x00, 0x00, 0x00, 0x02, 0x76, 0x32
+		};
+		kbs::produce::message_set messages;
+		ASSERT_EQ(messages.deserialize(set, sizeof(set)), true);
+
+		// Batches get contiguous offsets following single messages
+		kbs::partition part(0, 0);
+		part.add_data("a", "b");
+		ASSERT_EQ(part.next_offset(), static_cast<int64_t>(1));
+		ASSERT_EQ(part.add_data(messages), static_cast<int64_t>(1));
+		ASSERT_EQ(part.add_data(messages), static_cast<int64_t>(3));
+		ASSERT_EQ(part.next_offset(), static_cast<int64_t>(5));
+		ASSERT_EQ(part.data().size(), static_cast<size_t>(5));
+		ASSERT_EQ(part.data()[3].key(), std::string("k"));
+		ASSERT_EQ(part.data()[3].value(), std::string("v1"));
+		ASSERT_EQ(part.data()[4].value(), std::string("v2"));
+
+		// An empty batch appends nothing
+		kbs::produce::message_set empty;
+		ASSERT_EQ(part.add_data(empty), static_cast<int64_t>(5));
+		ASSERT_EQ(part.data().size(), static_cast<size_t>(5));
+	}
+
+	void retention_test()
+	{
+		// Message count limit
+		kbs::partition part(0, 0);
+		part.set_retention(kbs::retention_policy(0, 100, 0));
+		for (int i=0; i<10000; ++i)
+		{
+			part.add_data("key", "value");
+		}
+		ASSERT_EQ(part.data().size(), static_cast<size_t>(100));
+		ASSERT_EQ(part.log_start_offset(), static_cast<int64_t>(9900));
+		ASSERT_EQ(part.next_offset(), static_cast<int64_t>(10000));
+		ASSERT_EQ(part.size_bytes(), static_cast<uint64_t>(800));
+
+		// Appending while evicting only moves the retained pairs when the
+		// removed slots are reclaimed, not on every append
+		kbs::record_log log;
+		size_t moves = 0;
+		for (int i=0; i<10000; ++i)
+		{
+			const kbs::key_value_pair* newest = log.empty() ? NULL : &log[log.size() - 1];
+			log.reserve(1);
+			log.push_back(kbs::key_value_pair("key", "value"));
+			if (log.size() > 100)
+			{
+				log.pop_front();
+			}
+			if ((newest != NULL) && (&log[log.size() - 2] != newest))
+			{
+				++moves;
+			}
+		}
+		ASSERT_EQ(log.size(), static_cast<size_t>(100));
+		ASSERT_EQ(moves < 150, true);
+
+		// Byte limit keeps the newest messages
+		kbs::partition bytes(0, 0);
+		bytes.set_retention(kbs::retention_policy(10, 0, 0));
+		bytes.add_data("a", "1111");
+		bytes.add_data("b", "2222");
+		bytes.add_data("c", "3333");
+		ASSERT_EQ(bytes.data().size(), static_cast<size_t>(2));
+		ASSERT_EQ(bytes.data()[0].key(), std::string("b"));
+		ASSERT_EQ(bytes.data()[1].key(), std::string("c"));
+		ASSERT_EQ(bytes.log_start_offset(), static_cast<int64_t>(1));
+
+		// Iteration starts at the log start like indexing
+		std::string keys;
+		for (kbs::record_log::const_iterator it = bytes.data().begin(); it != bytes.data().end(); ++it)
+		{
+			keys += it->key();
+		}
+		ASSERT_EQ(keys, std::string("bc"));
+
+		// Age limit - pretend that time has passed
+		kbs::partition age(0, 0);
+		age.set_retention(kbs::retention_policy(0, 0, 1000));
+		age.add_data("a", "1");
+		age.add_data("b", "2");
+		int64_t now = age.data()[1].timestamp();
+		age.enforce_retention(now + 500);
+		ASSERT_EQ(age.data().size(), static_cast<size_t>(2));
+		age.enforce_retention(now + 5000);
+		ASSERT_EQ(age.data().size(), static_cast<size_t>(0));
+		ASSERT_EQ(age.log_start_offset(), static_cast<int64_t>(2));
+		ASSERT_EQ(age.size_bytes(), static_cast<uint64_t>(0));
+
+		// Offsets stay monotonic after everything was removed
+		age.add_data("c", "3");
+		ASSERT_EQ(age.next_offset(), static_cast<int64_t>(3));
+		ASSERT_EQ(age.data()[0].key(), std::string("c"));
+
+		// Retention set through the stub
+		ASSERT_EQ(m_stub->set_retention("test", kbs::retention_policy(0, 5, 0)), true);
+		ASSERT_EQ(m_stub->set_retention("unknown", kbs::retention_policy()), false);
+		ASSERT_EQ(m_stub->get_topic("test")->get_partition(1)->retention().max_messages, static_cast<uint64_t>(5));
+	}
+
+	void key_lookup_test()
+	{
+		// Lookups scan the partition without the index
+		kbs::partition part(3, 0);
+		part.add_data("a", "1");
+		part.add_data("b", "2");
+		part.add_data("a", "3");
+		kbs::record_view found = part.find_last("a");
+		ASSERT_EQ(found.partition, static_cast<int32_t>(3));
+		ASSERT_EQ(found.offset, static_cast<int64_t>(2));
+		ASSERT_EQ(found.record->value(), std::string("3"));
+		ASSERT_EQ(part.find_all("a").size(), static_cast<size_t>(2));
+		ASSERT_EQ(part.find_last("c").record, static_cast<const kbs::key_value_pair*>(NULL));
+
+		// Same results with the index which follows appends and evictions
+		part.set_retention(kbs::retention_policy(0, 3, 0));
+		part.enable_key_index();
+		ASSERT_EQ(part.key_index_enabled(), true);
+		ASSERT_EQ(part.find_last("a").offset, static_cast<int64_t>(2));
+		part.add_data("c", "4");
+		std::vector<int64_t> offsets = part.find_all("a");
+		ASSERT_EQ(offsets.size(), static_cast<size_t>(1));
+		ASSERT_EQ(offsets[0], static_cast<int64_t>(2));
+		ASSERT_EQ(part.find_last("c").record->value(), std::string("4"));
+		part.add_data("d", "5");
+		part.add_data("e", "6");
+		ASSERT_EQ(part.find_last("a").record, static_cast<const kbs::key_value_pair*>(NULL));
+		ASSERT_EQ(part.find_all("b").size(), static_cast<size_t>(0));
+
+		// Offset lookups
+		ASSERT_EQ(part.at_offset(1).record, static_cast<const kbs::key_value_pair*>(NULL));
+		ASSERT_EQ(part.at_offset(6).record, static_cast<const kbs::key_value_pair*>(NULL));
+		ASSERT_EQ(part.at_offset(5).record->key(), std::string("e"));
+
+		// Topic lookups find the latest message in any partition
+		kbs::topic_registry& registry = m_stub->get_topic_registry();
+		kbs::topic* top = registry.get_writeable("test");
+		top->enable_key_index();
+		top->get_partition_writeable(1)->add_data("lookup", "first");
+		top->get_partition_writeable(0)->add_data("lookup", "second");
+		found = m_stub->get_topic("test")->find_last("lookup");
+		ASSERT_NEQ(found.record, static_cast<const kbs::key_value_pair*>(NULL));
+		ASSERT_EQ(found.record->value(), std::string("second"));
+		ASSERT_EQ(found.partition, static_cast<int32_t>(0));
+	}
+
+	void multi_partition_test()
+	{
+		// Topic "test" with records for partitions 0, 1, 0 and 5, then an
+		// unknown topic
+		std::string req = produce_header(2);
+		put_string(req, "test");
+		put32(req, 4);
+		put_partition(req, 0, "a");
+		put_partition(req, 1, "b");
+		put_partition(req, 0, "c");
+		put_partition(req, 5, "d");
+		put_string(req, "missing");
+		put32(req, 1);
+		put_partition(req, 0, "e");
+		req = frame(req);
+
+		// The same results and data with and without worker threads
+		for (size_t threads=0; threads<4; threads+=3)
+		{
+			std::vector<kbs::partition> partitions;
+			partitions.push_back(kbs::partition(0, 0));
+			partitions.push_back(kbs::partition(1, 0));
+			kbs::broker_stub stub(0, "localhost", 9092);
+			stub.add_topic("test", partitions);
+			stub.set_worker_threads(threads, 0);
+
+			std::vector<std::string> responses;
+			int ret = stub.handle_data(reinterpret_cast<const uint8_t*>(req.data()), req.size(), responses);
+			ASSERT_EQ(ret, static_cast<int>(req.size()));
+			ASSERT_EQ(responses.size(), static_cast<size_t>(1));
+
+			// Topic results differ in size
+			ASSERT_EQ(responses[0].size(), static_cast<size_t>(4 + 4 + 4 + (6 + 4 + 4 * 14) + (9 + 4 + 14)));
+			ASSERT_EQ(kbs::util::read_type<int32_t>(reinterpret_cast<const uint8_t*>(responses[0].data())),
+			          static_cast<int32_t>(responses[0].size() - 4));
+
+			std::vector<produce_result> results = parse_produce_response(responses[0]);
+			ASSERT_EQ(results.size(), static_cast<size_t>(5));
+			ASSERT_EQ(results[0].partition, static_cast<int32_t>(0));
+			ASSERT_EQ(results[0].error, static_cast<int16_t>(0));
+			ASSERT_EQ(results[0].offset, static_cast<int64_t>(0));
+			ASSERT_EQ(results[1].partition, static_cast<int32_t>(1));
+			ASSERT_EQ(results[1].error, static_cast<int16_t>(0));
+			ASSERT_EQ(results[1].offset, static_cast<int64_t>(0));
+			ASSERT_EQ(results[2].partition, static_cast<int32_t>(0));
+			ASSERT_EQ(results[2].error, static_cast<int16_t>(0));
+			ASSERT_EQ(results[2].offset, static_cast<int64_t>(1));
+			ASSERT_EQ(results[3].partition, static_cast<int32_t>(5));
+			ASSERT_EQ(results[3].error, static_cast<int16_t>(3));
+			ASSERT_EQ(results[3].offset, static_cast<int64_t>(-1));
+			ASSERT_EQ(results[4].topic, std::string("missing"));
+			ASSERT_EQ(results[4].partition, static_cast<int32_t>(0));
+			ASSERT_EQ(results[4].error, static_cast<int16_t>(3));
+			ASSERT_EQ(results[4].offset, static_cast<int64_t>(-1));
+
+			const kbs::topic* top = stub.get_topic("test");
+			ASSERT_EQ(top->partitions()[0].data().size(), static_cast<size_t>(2));
+			ASSERT_EQ(top->partitions()[0].data()[0].value(), std::string("a"));
+			ASSERT_EQ(top->partitions()[0].data()[1].value(), std::string("c"));
+			ASSERT_EQ(top->partitions()[1].data().size(), static_cast<size_t>(1));
+			ASSERT_EQ(top->partitions()[1].data()[0].value(), std::string("b"));
+		}
+	}
+
+	void fetch_test()
+	{
+		std::vector<kbs::partition> partitions;
+		partitions.push_back(kbs::partition(0, 0));
+		partitions.push_back(kbs::partition(1, 1));
+		kbs::broker_stub stub(0, "localhost", 9092);
+		stub.add_topic("test", partitions);
+		kbs::partition* part = stub.get_topic_registry().get_writeable("test")->get_partition_writeable(0);
+		part->add_data("k1", "first");
+		part->add_data("", "second");
+		part->add_data("k3", "third");
+
+		// Version 0 from offset 1 - response size, correlation id, topic and partition
+		std::vector<std::string> responses;
+		std::string req = fetch_request(0, "test", 0, 1, 1024);
+		ASSERT_EQ(stub.handle_data(reinterpret_cast<const uint8_t*>(req.data()), req.size(), responses),
+		          static_cast<int>(req.size()));
+		ASSERT_EQ(responses.size(), static_cast<size_t>(1));
+		const uint8_t* resp = reinterpret_cast<const uint8_t*>(responses[0].data());
+		ASSERT_EQ(kbs::util::read_type<int32_t>(resp), static_cast<int32_t>(responses[0].size() - 4));
+		ASSERT_EQ(kbs::util::read_type<int32_t>(resp + 4), static_cast<int32_t>(8));
+		const uint8_t* data = resp + 4 + 4 + 4 + 6 + 4;
+		ASSERT_EQ(kbs::util::read_type<int32_t>(data), static_cast<int32_t>(0));
+		ASSERT_EQ(kbs::util::read_type<int16_t>(data + 4), static_cast<int16_t>(0));
+		ASSERT_EQ(kbs::util::read_type<int64_t>(data + 6), static_cast<int64_t>(3));
+
+		kbs::produce::message_set set;
+		ASSERT_EQ(set.deserialize(data + 18, static_cast<size_t>(kbs::util::read_type<int32_t>(data + 14))), true);
+		ASSERT_EQ(set.size(), static_cast<size_t>(2));
+		ASSERT_EQ(kbs::util::read_type<int64_t>(data + 18), static_cast<int64_t>(1));
+		ASSERT_EQ(std::string(reinterpret_cast<const char*>(set[0].value), set[0].value_size), std::string("second"));
+		ASSERT_EQ(std::string(reinterpret_cast<const char*>(set[1].key), set[1].key_size), std::string("k3"));
+		ASSERT_EQ(data[18 + 16], static_cast<uint8_t>(0));
+
+		// Max bytes cut the set but the first message is always sent
+		responses.clear();
+		req = fetch_request(1, "test", 0, 0, 1);
+		stub.handle_data(reinterpret_cast<const uint8_t*>(req.data()), req.size(), responses);
+		resp = reinterpret_cast<const uint8_t*>(responses[0].data());
+		ASSERT_EQ(kbs::util::read_type<int32_t>(resp + 8), static_cast<int32_t>(0));
+		data = resp + 4 + 4 + 4 + 4 + 6 + 4;
+		ASSERT_EQ(set.deserialize(data + 18, static_cast<size_t>(kbs::util::read_type<int32_t>(data + 14))), true);
+		ASSERT_EQ(set.size(), static_cast<size_t>(1));
+		ASSERT_EQ(data[18 + 16], static_cast<uint8_t>(0));
+
+		// Version 2 sends messages in format v1 with the stored timestamps
+		responses.clear();
+		req = fetch_request(2, "test", 0, 0, 1);
+		stub.handle_data(reinterpret_cast<const uint8_t*>(req.data()), req.size(), responses);
+		data = reinterpret_cast<const uint8_t*>(responses[0].data()) + 4 + 4 + 4 + 4 + 6 + 4;
+		ASSERT_EQ(set.deserialize(data + 18, static_cast<size_t>(kbs::util::read_type<int32_t>(data + 14))), true);
+		ASSERT_EQ(data[18 + 16], static_cast<uint8_t>(1));
+		ASSERT_EQ(set[0].timestamp, part->data()[0].timestamp());
+
+		// A null value stays null on a plain topic, unlike an empty one
+		part->add_data("k4", "");
+		part->add_tombstone("k5");
+		responses.clear();
+		req = fetch_request(0, "test", 0, 3, 1024);
+		stub.handle_data(reinterpret_cast<const uint8_t*>(req.data()), req.size(), responses);
+		data = reinterpret_cast<const uint8_t*>(responses[0].data()) + 4 + 4 + 4 + 6 + 4;
+		ASSERT_EQ(set.deserialize(data + 18, static_cast<size_t>(kbs::util::read_type<int32_t>(data + 14))), true);
+		ASSERT_EQ(set.size(), static_cast<size_t>(2));
+		ASSERT_NEQ(set[0].value, static_cast<const uint8_t*>(NULL));
+		ASSERT_EQ(set[0].value_size, static_cast<size_t>(0));
+		ASSERT_EQ(set[1].value, static_cast<const uint8_t*>(NULL));
+		ASSERT_EQ(part->data()[4].null_value(), true);
+
+		// Fetching at the end returns an empty set
+		responses.clear();
+		req = fetch_request(0, "test", 0, 5, 1024);
+		stub.handle_data(reinterpret_cast<const uint8_t*>(req.data()), req.size(), responses);
+		data = reinterpret_cast<const uint8_t*>(responses[0].data()) + 4 + 4 + 4 + 6 + 4;
+		ASSERT_EQ(kbs::util::read_type<int16_t>(data + 4), static_cast<int16_t>(0));
+		ASSERT_EQ(kbs::util::read_type<int32_t>(data + 14), static_cast<int32_t>(0));
+
+		// Errors: offset out of range, not leader and unknown partition
+		int64_t offsets[] = {6, 0, 0};
+		int32_t parts[] = {0, 1, 7};
+		int16_t errors[] = {1, 6, 3};
+		for (size_t i=0; i<3; ++i)
+		{
+			responses.clear();
+			req = fetch_request(0, "test", parts[i], offsets[i], 1024);
+			stub.handle_data(reinterpret_cast<const uint8_t*>(req.data()), req.size(), responses);
+			data = reinterpret_cast<const uint8_t*>(responses[0].data()) + 4 + 4 + 4 + 6 + 4;
+			ASSERT_EQ(kbs::util::read_type<int16_t>(data + 4), errors[i]);
+		}
+	}
+
+	void list_offsets_test()
+	{
+		std::vector<kbs::partition> partitions;
+		partitions.push_back(kbs::partition(0, 0));
+		partitions.push_back(kbs::partition(1, 1));
+		kbs::broker_stub stub(0, "localhost", 9092);
+		stub.add_topic("test", partitions);
+		kbs::partition* part = stub.get_topic_registry().get_writeable("test")->get_partition_writeable(0);
+		for (int64_t i=0; i<100; ++i)
+		{
+			part->add_data("", "v", 1000 + i * 10);
+		}
+
+		// Version 1 - timestamp and offset of the first message at or after the timestamp
+		int64_t stamps[] = {0, 1000, 1005, 1990, 2000, kbs::list_offsets::LATEST_TIMESTAMP,
+		                    kbs::list_offsets::EARLIEST_TIMESTAMP};
+		int64_t found[] = {1000, 1000, 1010, 1990, -1, -1, -1};
+		int64_t offsets[] = {0, 0, 1, 99, -1, 100, 0};
+		for (size_t i=0; i<sizeof(stamps) / sizeof(stamps[0]); ++i)
+		{
+			std::vector<std::string> responses;
+			std::string req = list_offsets_request(1, "test", 0, stamps[i]);
+			ASSERT_EQ(stub.handle_data(reinterpret_cast<const uint8_t*>(req.data()), req.size(), responses),
+			          static_cast<int>(req.size()));
+			ASSERT_EQ(responses.size(), static_cast<size_t>(1));
+			const uint8_t* resp = reinterpret_cast<const uint8_t*>(responses[0].data());
+			ASSERT_EQ(kbs::util::read_type<int32_t>(resp), static_cast<int32_t>(responses[0].size() - 4));
+			ASSERT_EQ(kbs::util::read_type<int32_t>(resp + 4), static_cast<int32_t>(11));
+			const uint8_t* data = resp + 4 + 4 + 4 + 6 + 4;
+			ASSERT_EQ(kbs::util::read_type<int16_t>(data + 4), static_cast<int16_t>(0));
+			ASSERT_EQ(kbs::util::read_type<int64_t>(data + 6), found[i]);
+			ASSERT_EQ(kbs::util::read_type<int64_t>(data + 14), offsets[i]);
+		}
+
+		// Version 0 sends the offset in an array
+		std::vector<std::string> responses;
+		std::string req = list_offsets_request(0, "test", 0, 1005);
+		stub.handle_data(reinterpret_cast<const uint8_t*>(req.data()), req.size(), responses);
+		const uint8_t* data = reinterpret_cast<const uint8_t*>(responses[0].data()) + 4 + 4 + 4 + 6 + 4;
+		ASSERT_EQ(kbs::util::read_type<int32_t>(data + 6), static_cast<int32_t>(1));
+		ASSERT_EQ(kbs::util::read_type<int64_t>(data + 10), static_cast<int64_t>(1));
+
+		// Not leader and unknown partition
+		int32_t parts[] = {1, 7};
+		int16_t errors[] = {6, 3};
+		for (size_t i=0; i<2; ++i)
+		{
+			responses.clear();
+			req = list_offsets_request(1, "test", parts[i], 0);
+			stub.handle_data(reinterpret_cast<const uint8_t*>(req.data()), req.size(), responses);
+			data = reinterpret_cast<const uint8_t*>(responses[0].data()) + 4 + 4 + 4 + 6 + 4;
+			ASSERT_EQ(kbs::util::read_type<int16_t>(data + 4), errors[i]);
+		}
+
+		// Producer timestamps of magic byte 1 messages are retained
+		std::string set(12, '\0');
+		set += std::string(4, '\0');
+		set += '\x01';
+		set += '\0';
+		put32(set, 0);
+		put32(set, 5000);
+		put32(set, -1);
+		put32(set, 1);
+		set += "t";
+		kbs::util::write_type<int32_t>(static_cast<int32_t>(set.size() - 12), reinterpret_cast<uint8_t*>(&set[8]));
+		std::string produce = produce_header(1);
+		put_string(produce, "test");
+		put32(produce, 1);
+		put32(produce, 0);
+		put32(produce, static_cast<int32_t>(set.size()));
+		produce = frame(produce + set);
+		responses.clear();
+		stub.handle_data(reinterpret_cast<const uint8_t*>(produce.data()), produce.size(), responses);
+		ASSERT_EQ(part->data().size(), static_cast<size_t>(101));
+		ASSERT_EQ(part->data()[100].timestamp(), static_cast<int64_t>(5000));
+		ASSERT_EQ(part->find_time(2000).offset, static_cast<int64_t>(100));
+	}
+
+	void compaction_test()
+	{
+		kbs::partition part(0, 0);
+		part.add_data("a", "1");
+		part.add_data("b", "2");
+		part.enable_compaction();
+		ASSERT_EQ(part.compaction_enabled(), true);
+		part.add_data("a", "3");
+		part.add_tombstone("b");
+		part.add_data("c", "4");
+
+		// Latest value per key in offset order
+		std::vector<kbs::record_view> values = part.compacted_data();
+		ASSERT_EQ(values.size(), static_cast<size_t>(2));
+		ASSERT_EQ(values[0].offset, static_cast<int64_t>(2));
+		ASSERT_EQ(values[0].record->value(), std::string("3"));
+		ASSERT_EQ(values[1].record->key(), std::string("c"));
+		ASSERT_EQ(part.find_value("a").offset, static_cast<int64_t>(2));
+		ASSERT_EQ(part.find_value("b").record, static_cast<const kbs::key_value_pair*>(NULL));
+		ASSERT_EQ(part.find_last("b").offset, static_cast<int64_t>(3));
+		ASSERT_EQ(part.data().size(), static_cast<size_t>(5));
+
+		// Reclaiming releases superseded messages but keeps their offsets
+		part.enable_key_index();
+		part.enable_compaction(true);
+		ASSERT_EQ(part.data().size(), static_cast<size_t>(5));
+		ASSERT_EQ(part.data()[0].value(), std::string());
+		ASSERT_EQ(part.size_bytes(), static_cast<uint64_t>(2 + 1 + 2));
+		part.add_data("c", "5");
+		ASSERT_EQ(part.data()[4].key(), std::string());
+		ASSERT_EQ(part.find_all("c").size(), static_cast<size_t>(1));
+		ASSERT_EQ(part.find_value("c").record->value(), std::string("5"));
+
+		// Eviction drops the keys of evicted latest messages
+		part.set_retention(kbs::retention_policy(0, 3, 0));
+		part.add_data("d", "6");
+		ASSERT_EQ(part.log_start_offset(), static_cast<int64_t>(4));
+		ASSERT_EQ(part.compacted().size(), static_cast<size_t>(2));
+		ASSERT_EQ(part.find_value("a").record, static_cast<const kbs::key_value_pair*>(NULL));
+		ASSERT_EQ(part.find_value("d").offset, static_cast<int64_t>(6));
+
+		// Fetches skip superseded messages and send tombstones with null values
+		std::vector<kbs::partition> partitions;
+		partitions.push_back(kbs::partition(0, 0));
+		kbs::broker_stub stub(0, "localhost", 9092);
+		stub.add_topic("compacted", partitions);
+		stub.get_topic_registry().get_writeable("compacted")->enable_compaction();
+
+		std::string set(12, '\0');
+		set += std::string(6, '\0');
+		put32(set, 1);
+		set += "k";
+		put32(set, -1);
+		kbs::util::write_type<int32_t>(static_cast<int32_t>(set.size() - 12), reinterpret_cast<uint8_t*>(&set[8]));
+		kbs::partition* stub_part = stub.get_topic_registry().get_writeable("compacted")->get_partition_writeable(0);
+		stub_part->add_data("k", "old");
+		stub_part->add_data("x", "kept");
+		std::string produce = produce_header(1);
+		put_string(produce, "compacted");
+		put32(produce, 1);
+		put32(produce, 0);
+		put32(produce, static_cast<int32_t>(set.size()));
+		produce = frame(produce + set);
+		std::vector<std::string> responses;
+		stub.handle_data(reinterpret_cast<const uint8_t*>(produce.data()), produce.size(), responses);
+		ASSERT_EQ(stub_part->compacted().is_tombstone(2), true);
+
+		responses.clear();
+		std::string req = fetch_request(0, "compacted", 0, 0, 1024);
+		stub.handle_data(reinterpret_cast<const uint8_t*>(req.data()), req.size(), responses);
+		const uint8_t* data = reinterpret_cast<const uint8_t*>(responses[0].data()) + 4 + 4 + 4 + 11 + 4;
+		ASSERT_EQ(kbs::util::read_type<int64_t>(data + 6), static_cast<int64_t>(3));
+		kbs::produce::message_set fetched;
+		ASSERT_EQ(fetched.deserialize(data + 18, static_cast<size_t>(kbs::util::read_type<int32_t>(data + 14))), true);
+		ASSERT_EQ(fetched.size(), static_cast<size_t>(2));
+		ASSERT_EQ(kbs::util::read_type<int64_t>(data + 18), static_cast<int64_t>(1));
+		ASSERT_EQ(fetched[1].key_size, static_cast<size_t>(1));
+		ASSERT_EQ(fetched[1].value, static_cast<const uint8_t*>(NULL));
+	}
+
+	void idempotent_test()
+	{
+		std::vector<kbs::partition> partitions;
+		partitions.push_back(kbs::partition(0, 2));
+		kbs::broker_stub stub(2, "localhost", 9092);
+		stub.add_topic("test", partitions);
+
+		// Init producer ID - correlation id, throttle time, error, producer id and epoch
+		std::string init;
+		put16(init, 22);
+		put16(init, 0);
+		put32(init, 5);
+		put_string(init, "test");
+		put16(init, -1);
+		put32(init, 60000);
+		init = frame(init);
+		std::vector<std::string> responses;
+		ASSERT_EQ(stub.handle_data(reinterpret_cast<const uint8_t*>(init.data()), init.size(), responses),
+		          static_cast<int>(init.size()));
+		ASSERT_EQ(responses.size(), static_cast<size_t>(1));
+		ASSERT_EQ(responses[0].size(), static_cast<size_t>(4 + 4 + 4 + 2 + 8 + 2));
+		const uint8_t* resp = reinterpret_cast<const uint8_t*>(responses[0].data());
+		ASSERT_EQ(kbs::util::read_type<int32_t>(resp + 4), static_cast<int32_t>(5));
+		ASSERT_EQ(kbs::util::read_type<int16_t>(resp + 12), static_cast<int16_t>(0));
+		int64_t producer_id = kbs::util::read_type<int64_t>(resp + 14);
+		ASSERT_EQ(producer_id, static_cast<int64_t>(2) << 32);
+		ASSERT_EQ(kbs::util::read_type<int16_t>(resp + 22), static_cast<int16_t>(0));
+
+		// Sequences 0-1, a retry of them, a gap, 2, an old epoch and an unknown producer
+		std::vector<std::string> values(2, "v");
+		int32_t sequences[] = {0, 0, 3, 2, 4, 5};
+		int16_t epochs[] = {0, 0, 0, 0, -1, 0};
+		int64_t producers[] = {producer_id, producer_id, producer_id, producer_id, producer_id, producer_id + 1};
+		int16_t errors[] = {0, 0, 45, 0, 47, 59};
+		int64_t offsets[] = {0, 0, -1, 2, -1, -1};
+		for (size_t i=0; i<sizeof(errors) / sizeof(errors[0]); ++i)
+		{
+			std::string set = record_batch(producers[i], epochs[i], sequences[i], values);
+			std::string req = produce_header(1, 3);
+			put_string(req, "test");
+			put32(req, 1);
+			put32(req, 0);
+			put32(req, static_cast<int32_t>(set.size()));
+			req = frame(req + set);
+			responses.clear();
+			ASSERT_EQ(stub.handle_data(reinterpret_cast<const uint8_t*>(req.data()), req.size(), responses),
+			          static_cast<int>(req.size()));
+			std::vector<produce_result> results = parse_produce_response(responses[0]);
+			ASSERT_EQ(results.size(), static_cast<size_t>(1));
+			ASSERT_EQ(results[0].error, errors[i]);
+			ASSERT_EQ(results[0].offset, offsets[i]);
+		}
+
+		const kbs::partition& part = stub.get_topic("test")->partitions()[0];
+		ASSERT_EQ(part.data().size(), static_cast<size_t>(4));
+		ASSERT_EQ(part.producers().size(), static_cast<size_t>(1));
+	}
+
+	void compression_test()
+	{
+		std::vector<kbs::partition> partitions;
+		partitions.push_back(kbs::partition(0, 0));
+		kbs::broker_stub stub(0, "localhost", 9092);
+		stub.add_topic("test", partitions);
+
+		// A gzip wrapper message (format v0) and a gzip record batch (format v2)
+		std::string v0 = produce_header(1);
+		put_string(v0, "test");
+		put32(v0, 1);
+		put_partition(v0, 0, "v");
+		v0[v0.size() - 10] = '\x01';
+		std::string set = record_batch(-1, -1, -1, std::vector<std::string>(1, "v"));
+		set[22] = '\x01';
+		std::string v2 = produce_header(1, 3);
+		put_string(v2, "test");
+		put32(v2, 1);
+		put32(v2, 0);
+		put32(v2, static_cast<int32_t>(set.size()));
+		v2 += set;
+
+		std::string reqs[] = {frame(v0), frame(v2)};
+		for (size_t i=0; i<2; ++i)
+		{
+			std::vector<std::string> responses;
+			ASSERT_EQ(stub.handle_data(reinterpret_cast<const uint8_t*>(reqs[i].data()), reqs[i].size(), responses),
+			          static_cast<int>(reqs[i].size()));
+			std::vector<produce_result> results = parse_produce_response(responses[0]);
+			ASSERT_EQ(results.size(), static_cast<size_t>(1));
+			ASSERT_EQ(results[0].error, static_cast<int16_t>(76));
+			ASSERT_EQ(results[0].offset, static_cast<int64_t>(-1));
+		}
+		ASSERT_EQ(stub.get_topic("test")->partitions()[0].data().size(), static_cast<size_t>(0));
+	}
+
+	void throttle_test()
+	{
+		std::vector<kbs::partition> partitions;
+		partitions.push_back(kbs::partition(0, 0));
+		kbs::broker_stub stub(0, "localhost", 9092);
+		stub.add_topic("test", partitions);
+		stub.get_quotas().set_client_quota(kbs::QUOTA_PRODUCE, "slow", 100);
+
+		std::string value(200, 'x');
+		std::vector<std::string> responses;
+		std::vector<uint32_t> delays;
+		for (int16_t version=0; version<3; ++version)
+		{
+			std::string req = produce_header(1, version, "slow");
+			put_string(req, "test");
+			put32(req, 1);
+			put_partition(req, 0, value);
+			req = frame(req);
+			responses.clear();
+			delays.clear();
+			ASSERT_EQ(stub.handle_data(reinterpret_cast<const uint8_t*>(req.data()), req.size(), responses, &delays),
+			          static_cast<int>(req.size()));
+			ASSERT_EQ(responses.size(), static_cast<size_t>(1));
+			ASSERT_EQ(delays.size(), static_cast<size_t>(1));
+			ASSERT_EQ(delays[0], static_cast<uint32_t>(0));
+
+			// Version 1 appends the throttle time and version 2 the log append time
+			const std::string& resp = responses[0];
+			size_t base = 4 + 4 + 4 + 6 + 4 + 14;
+			if (version == 0)
+			{
+				ASSERT_EQ(resp.size(), base);
+				continue;
+			}
+
+			const uint8_t* tail = reinterpret_cast<const uint8_t*>(resp.data()) + base;
+			if (version == 2)
+			{
+				ASSERT_EQ(kbs::util::read_type<int64_t>(tail), static_cast<int64_t>(-1));
+				tail += 8;
+			}
+			ASSERT_EQ(resp.size(), base + 4 + ((version == 2) ? 8 : 0));
+			int32_t throttle = kbs::util::read_type<int32_t>(tail);
+			ASSERT_EQ((throttle > 1000) && (throttle <= 10000), true);
+		}
+
+		// Throttled responses are delayed on request
+		stub.get_quotas().set_delay_responses(true);
+		std::string req = produce_header(1, 1, "slow");
+		put_string(req, "test");
+		put32(req, 1);
+		put_partition(req, 0, value);
+		req = frame(req);
+		responses.clear();
+		delays.clear();
+		stub.handle_data(reinterpret_cast<const uint8_t*>(req.data()), req.size(), responses, &delays);
+		ASSERT_EQ(delays.size(), static_cast<size_t>(1));
+		ASSERT_EQ(delays[0] > 0, true);
+
+		// Other clients are not throttled
+		req = frame(produce_header(0, 1, "fast"));
+		responses.clear();
+		delays.clear();
+		stub.handle_data(reinterpret_cast<const uint8_t*>(req.data()), req.size(), responses, &delays);
+		ASSERT_EQ(delays[0], static_cast<uint32_t>(0));
+	}
+
+	void group_test()
+	{
+		// Groups are spread over the brokers - find one of each
+		kbs::broker_stub stub(0, "localhost", 9092);
+		stub.add_broker_reference(1, "otherhost", 9093);
+		std::string local;
+		std::string remote;
+		for (char c='a'; c<='z'; ++c)
+		{
+			std::string name(1, c);
+			if (stub.coordinator_id(name) == 0)
+				local = name;
+			else
+				remote = name;
+		}
+		ASSERT_EQ(local.empty() || remote.empty(), false);
+
+		// FindCoordinator version 1 points to the other broker
+		std::string req;
+		put16(req, 10);
+		put16(req, 1);
+		put32(req, 3);
+		put_string(req, "test");
+		put_string(req, remote);
+		req += '\0';
+		req = frame(req);
+		std::vector<std::string> responses;
+		ASSERT_EQ(stub.handle_data(reinterpret_cast<const uint8_t*>(req.data()), req.size(), responses),
+		          static_cast<int>(req.size()));
+		ASSERT_EQ(responses.size(), static_cast<size_t>(1));
+		const uint8_t* resp = reinterpret_cast<const uint8_t*>(responses[0].data());
+		ASSERT_EQ(kbs::util::read_type<int32_t>(resp + 4), static_cast<int32_t>(3));
+		ASSERT_EQ(kbs::util::read_type<int16_t>(resp + 12), static_cast<int16_t>(0));
+		ASSERT_EQ(kbs::util::read_type<int32_t>(resp + 16), static_cast<int32_t>(1));
+		ASSERT_EQ(responses[0].substr(22, 9), std::string("otherhost"));
+		ASSERT_EQ(kbs::util::read_type<int32_t>(resp + 31), static_cast<int32_t>(9093));
+
+		// Joins are answered at once without a deferred response
+		for (size_t i=0; i<2; ++i)
+		{
+			req.clear();
+			put16(req, 11);
+			put16(req, 0);
+			put32(req, 4);
+			put_string(req, "test");
+			put_string(req, (i == 0) ? local : remote);
+			put32(req, 10000);
+			put_string(req, "");
+			put_string(req, "consumer");
+			put32(req, 1);
+			put_string(req, "range");
+			put32(req, 0);
+			req = frame(req);
+			responses.clear();
+			stub.handle_data(reinterpret_cast<const uint8_t*>(req.data()), req.size(), responses);
+			ASSERT_EQ(responses.size(), static_cast<size_t>(1));
+			resp = reinterpret_cast<const uint8_t*>(responses[0].data());
+			ASSERT_EQ(kbs::util::read_type<int16_t>(resp + 8), static_cast<int16_t>((i == 0) ? 0 : 16));
+			ASSERT_EQ(kbs::util::read_type<int32_t>(resp + 10), static_cast<int32_t>((i == 0) ? 1 : -1));
+		}
+		ASSERT_EQ(stub.get_groups().member_count(local), static_cast<size_t>(1));
+		ASSERT_EQ(stub.get_groups().state(local, kbs::util::monotonic_ns()) == kbs::GROUP_COMPLETING_REBALANCE,
+		          true);
+
+		// Offsets are committed on the coordinator only
+		for (size_t i=0; i<2; ++i)
+		{
+			req.clear();
+			put16(req, 8);
+			put16(req, 0);
+			put32(req, 5);
+			put_string(req, "test");
+			put_string(req, (i == 0) ? local : remote);
+			put32(req, 1);
+			put_string(req, "test");
+			put32(req, 1);
+			put32(req, 0);
+			put32(req, 0);
+			put32(req, 17);
+			put_string(req, "");
+			req = frame(req);
+			responses.clear();
+			stub.handle_data(reinterpret_cast<const uint8_t*>(req.data()), req.size(), responses);
+			ASSERT_EQ(kbs::util::read_type<int16_t>(reinterpret_cast<const uint8_t*>(responses[0].data()) +
+			                                        responses[0].size() - 2), static_cast<int16_t>((i == 0) ? 25 : 16));
+		}
+		int64_t offset = 0;
+		ASSERT_EQ(stub.get_groups().committed(local, "test", 0, offset), false);
+	}
+
+	void handler_test()
+	{
+		kbs::request_handlerI* builtin = m_stub->get_handler(3, 0);
+		ASSERT_NEQ(builtin, static_cast<kbs::request_handlerI*>(NULL));
+		ASSERT_EQ(m_stub->get_handler(3, 1), static_cast<kbs::request_handlerI*>(NULL));
+		ASSERT_NEQ(m_stub->get_handler(0, 3), static_cast<kbs::request_handlerI*>(NULL));
+		ASSERT_EQ(m_stub->get_handler(0, 4), static_cast<kbs::request_handlerI*>(NULL));
+		ASSERT_EQ(m_stub->get_handler(18, 0), static_cast<kbs::request_handlerI*>(NULL));
+
+		// Unsupported versions and unknown APIs are skipped without a response
+		std::vector<std::string> responses;
+		std::string req = metadata_request(3, 1);
+		const uint8_t* data = reinterpret_cast<const uint8_t*>(req.data());
+		ASSERT_EQ(m_stub->handle_data(data, req.size(), responses), static_cast<int>(req.size()));
+		std::string unknown = metadata_request(18, 0);
+		const uint8_t* unknown_data = reinterpret_cast<const uint8_t*>(unknown.data());
+		ASSERT_EQ(m_stub->handle_data(unknown_data, unknown.size(), responses), static_cast<int>(unknown.size()));
+		ASSERT_EQ(responses.size(), static_cast<size_t>(0));
+
+		// A custom handler serves a further API
+		echo_handler echo;
+		ASSERT_EQ(m_stub->set_handler(18, 0, 2, &echo), true);
+		ASSERT_EQ(m_stub->handle_data(unknown_data, unknown.size(), responses), static_cast<int>(unknown.size()));
+		ASSERT_EQ(echo.calls, 1);
+		ASSERT_EQ(responses.size(), static_cast<size_t>(1));
+		ASSERT_EQ(responses[0], std::string("\x00\x00\x00\x04\x00\x00\x00\x09", 8));
+
+		// And can wrap a built-in handler to inject errors
+		flaky_handler flaky(builtin);
+		ASSERT_EQ(m_stub->set_handler(3, 0, 0, &flaky), true);
+		req = metadata_request(3, 0);
+		data = reinterpret_cast<const uint8_t*>(req.data());
+		ASSERT_EQ(m_stub->handle_data(data, req.size(), responses), static_cast<int>(-1));
+		ASSERT_EQ(m_stub->handle_data(data, req.size(), responses), static_cast<int>(req.size()));
+		ASSERT_EQ(responses.size(), static_cast<size_t>(2));
+		ASSERT_EQ(kbs::util::read_type<int32_t>(reinterpret_cast<const uint8_t*>(responses[1].data()) + 4),
+		          static_cast<int32_t>(9));
+
+		// Keys and versions beyond the table are rejected
+		ASSERT_EQ(m_stub->set_handler(kbs::handler_table::MAX_API_KEY + 1, 0, 0, &echo), false);
+		ASSERT_EQ(m_stub->set_handler(18, 0, kbs::handler_table::MAX_VERSION + 1, &echo), false);
+		ASSERT_EQ(m_stub->set_handler(18, 2, 1, &echo), false);
+
+		// Restore the handlers
+		ASSERT_EQ(m_stub->set_handler(3, 0, 0, builtin), true);
+		ASSERT_EQ(m_stub->set_handler(18, 0, 2, NULL), true);
+		ASSERT_EQ(m_stub->get_handler(3, 0), builtin);
+		ASSERT_EQ(m_stub->get_handler(18, 1), static_cast<kbs::request_handlerI*>(NULL));
+	}
+
+	void large_metadata_test()
+	{
+		// Metadata of many topics does not fit the response buffer
+		kbs::broker_stub stub(1, "localhost", 9092);
+		for (int i=0; i<500; ++i)
+		{
+			std::vector<kbs::partition> partitions;
+			partitions.push_back(kbs::partition(0, 1));
+			std::string name("large-metadata-topic-000");
+			name[21] = static_cast<char>('0' + i / 100);
+			name[22] = static_cast<char>('0' + (i / 10) % 10);
+			name[23] = static_cast<char>('0' + i % 10);
+			stub.add_topic(name, partitions);
+		}
+
+		std::vector<std::string> responses;
+		std::string req = metadata_request(3, 0);
+		const uint8_t* data = reinterpret_cast<const uint8_t*>(req.data());
+		ASSERT_EQ(stub.handle_data(data, req.size(), responses), static_cast<int>(req.size()));
+		ASSERT_EQ(responses.size(), static_cast<size_t>(1));
+		ASSERT_EQ(responses[0].size() > kbs::RESP_MAX_SIZE, true);
+		const uint8_t* resp = reinterpret_cast<const uint8_t*>(responses[0].data());
+		ASSERT_EQ(kbs::util::read_type<int32_t>(resp), static_cast<int32_t>(responses[0].size() - 4));
+		ASSERT_EQ(kbs::util::read_type<int32_t>(resp + 4), static_cast<int32_t>(9));
+	}
+
+	void allocation_test()
+	{
+		// Responses are built in place, so the metadata of each topic takes
+		// a single allocation for its partitions
+		kbs::broker_stub few(1, "localhost", 9092);
+		kbs::broker_stub many(1, "localhost", 9092);
+		for (int i=0; i<20; ++i)
+		{
+			std::vector<kbs::partition> partitions;
+			for (int k=0; k<4; ++k)
+			{
+				partitions.push_back(kbs::partition(k, 1));
+			}
+			std::string name("alloc-00");
+			name[6] = static_cast<char>('0' + i / 10);
+			name[7] = static_cast<char>('0' + i % 10);
+			if (i < 10)
+			{
+				std::vector<kbs::partition> copy(partitions);
+				few.adopt_topic(name, copy);
+			}
+			many.adopt_topic(name, partitions);
+		}
+		std::string req = metadata_request(3, 0);
+		size_t few_allocs = count_allocations(few, req);
+		size_t many_allocs = count_allocations(many, req);
+		ASSERT_EQ(many_allocs - few_allocs, static_cast<size_t>(10));
+
+		// Produce results are filled in place as well, leaving one allocation
+		// per decoded record
+		std::string small = produce_header(1);
+		put_string(small, "unknown");
+		put32(small, 8);
+		std::string large = produce_header(1);
+		put_string(large, "unknown");
+		put32(large, 16);
+		for (int32_t p=0; p<16; ++p)
+		{
+			if (p < 8)
+				put_partition(small, p, "value");
+			put_partition(large, p, "value");
+		}
+		size_t small_allocs = count_allocations(few, frame(small));
+		size_t large_allocs = count_allocations(few, frame(large));
+		ASSERT_EQ(large_allocs - small_allocs, static_cast<size_t>(8));
+
+		// Fetched messages are referenced by the response - the topic and
+		// partition arrays too large to be kept inline, growing the list of
+		// four messages and the response itself are left
+		kbs::partition* part = few.get_topic_registry().get_writeable("alloc-00")->get_partition_writeable(0);
+		for (int i=0; i<4; ++i)
+		{
+			part->add_data("key", "value");
+		}
+		ASSERT_EQ(count_allocations(few, fetch_request(0, "alloc-00", 0, 0, 1000)) <= 7, true);
+
+		// Topics added from an lvalue copy the partitions, moved ones are
+		// taken over
+		std::vector<kbs::partition> parts(1, kbs::partition(0, 1));
+		ASSERT_EQ(few.add_topic("copied", parts), true);
+		ASSERT_EQ(parts.size(), static_cast<size_t>(1));
+		ASSERT_NEQ(few.get_topic("copied")->get_partition(0), const_cast<const kbs::partition*>(&parts[0]));
+#if __cplusplus >= 201103L
+		const kbs::partition* moved = &parts[0];
+		ASSERT_EQ(few.add_topic("moved", std::move(parts)), true);
+		ASSERT_EQ(few.get_topic("moved")->get_partition(0), moved);
+#endif
+	}
+
 	void misc_test()
 	{
 		// NULL pointer
@@ -187,6 +1342,20 @@ private:
 		setup();
 		metadata_v0_test();
 		produce_v0_test();
+		partition_test();
+		retention_test();
+		key_lookup_test();
+		multi_partition_test();
+		fetch_test();
+		list_offsets_test();
+		compaction_test();
+		idempotent_test();
+		compression_test();
+		throttle_test();
+		group_test();
+		handler_test();
+		large_metadata_test();
+		allocation_test();
 		misc_test();
 	}
 
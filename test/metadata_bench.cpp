@@ -0,0 +1,126 @@
+#include "kafka_broker_stub/main.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Count the heap allocations of metadata requests
+ *
+ * A stub holds 1000 topics with 50 partitions each. Prints the allocations,
+ * allocated bytes and time per request for a request for all topics and for
+ * a request for a single topic.
+ */
+
+namespace kbs = kafka_broker_stub;
+
+// The replaced operators below pair malloc and free themselves
+#if defined(__GNUC__) && (__GNUC__ >= 11)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+#if __cplusplus >= 201103L
+#define BENCH_THROW_BAD_ALLOC
+#define BENCH_NO_THROW noexcept
+#else
+#define BENCH_THROW_BAD_ALLOC throw(std::bad_alloc)
+#define BENCH_NO_THROW throw()
+#endif
+
+namespace {
+
+	const int NUM_TOPICS = 1000;
+	const int NUM_PARTITIONS = 50;
+	const size_t ITERATIONS = 20;
+
+	volatile size_t allocations = 0;
+	volatile size_t allocated_bytes = 0;
+
+	// Metadata request framed with its size - all topics if name is empty
+	std::string metadata_request(const std::string& name)
+	{
+		std::string req(14, '\0');
+		uint8_t* data = reinterpret_cast<uint8_t*>(&req[0]);
+		kbs::util::write_type<int16_t>(3, data);
+		kbs::util::write_type<int16_t>(0, data + 2);
+		kbs::util::write_type<int32_t>(1, data + 4);
+		kbs::util::write_type<int16_t>(0, data + 8);
+		kbs::util::write_type<int32_t>(name.empty() ? 0 : 1, data + 10);
+		if (!name.empty())
+		{
+			std::string str(2, '\0');
+			kbs::util::write_type<int16_t>(static_cast<int16_t>(name.size()), reinterpret_cast<uint8_t*>(&str[0]));
+			req += str + name;
+		}
+
+		std::string framed(4, '\0');
+		kbs::util::write_type<int32_t>(static_cast<int32_t>(req.size()), reinterpret_cast<uint8_t*>(&framed[0]));
+		return framed + req;
+	}
+
+	void run(kbs::broker_stub& stub, const char* label, const std::string& req)
+	{
+		const uint8_t* data = reinterpret_cast<const uint8_t*>(req.data());
+		std::vector<std::string> responses;
+		responses.reserve(ITERATIONS);
+
+		size_t allocs = allocations;
+		size_t bytes = allocated_bytes;
+		uint64_t start = kbs::util::monotonic_ns();
+		for (size_t i=0; i<ITERATIONS; ++i)
+		{
+			stub.handle_data(data, req.size(), responses);
+		}
+		uint64_t elapsed = kbs::util::monotonic_ns() - start;
+		allocs = allocations - allocs;
+		bytes = allocated_bytes - bytes;
+
+		printf("%-12s %10.0f allocations %12.0f bytes %10.3f ms per request (%lu byte response)\n", label,
+		       static_cast<double>(allocs) / ITERATIONS, static_cast<double>(bytes) / ITERATIONS,
+		       static_cast<double>(elapsed) / 1e6 / ITERATIONS, static_cast<unsigned long>(responses[0].size()));
+	}
+
+}
+
+void* operator new(size_t size) BENCH_THROW_BAD_ALLOC
+{
+	allocations = allocations + 1;
+	allocated_bytes = allocated_bytes + size;
+	void* ptr = malloc((size > 0) ? size : 1);
+	if (ptr == NULL)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void operator delete(void* ptr) BENCH_NO_THROW
+{
+	free(ptr);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void* ptr, size_t) BENCH_NO_THROW
+{
+	free(ptr);
+}
+#endif
+
+int main()
+{
+	kbs::broker_stub stub(1, "localhost", 9092);
+	stub.get_logger().set_level(kbs::log::LEVEL_ERROR);
+	for (int i=0; i<NUM_TOPICS; ++i)
+	{
+		char name[32];
+		sprintf(name, "topic-%04i", i);
+		std::vector<kbs::partition> partitions;
+		for (int k=0; k<NUM_PARTITIONS; ++k)
+		{
+			partitions.push_back(kbs::partition(k, 1));
+		}
+		stub.adopt_topic(name, partitions);
+	}
+
+	printf("%i topics with %i partitions\n", NUM_TOPICS, NUM_PARTITIONS);
+	run(stub, "all topics", metadata_request(std::string()));
+	run(stub, "one topic", metadata_request("topic-0500"));
+	return 0;
+}
@@ -81,6 +81,36 @@ private:
 		ASSERT_EQ(memcmp(data, cmp, sizeof(cmp)), 0);
 	}
 
+	void in_place_test()
+	{
+		kbs::primitive::array<kbs::metadata::broker> broker_arr;
+		broker_arr.push_back(kbs::metadata::broker(1, "localhost", 9092));
+		kbs::primitive::array<kbs::primitive::int32> replica_isr_arr;
+		replica_isr_arr.push_back(1);
+		kbs::primitive::array<kbs::metadata::partition> part_meta_arr;
+		part_meta_arr.push_back(kbs::metadata::partition(2, 3, 1, replica_isr_arr, replica_isr_arr));
+		kbs::primitive::array<kbs::metadata::topic> topic_arr;
+		topic_arr.push_back(kbs::metadata::topic(7, kbs::primitive::string("test"), part_meta_arr));
+		kbs::metadata::response_v0 copied(1, broker_arr, topic_arr);
+
+		// The same response filled in place
+		kbs::metadata::response_v0 resp(1, broker_arr);
+		resp.topics().push_back(kbs::metadata::topic(7, kbs::primitive::string("test")));
+		kbs::primitive::array<kbs::metadata::partition>& parts = resp.topics().back().partitions();
+		parts.push_back(kbs::metadata::partition(2, 3, 1));
+		parts.back().replicas().push_back(1);
+		parts.back().isr().push_back(1);
+		ASSERT_EQ(resp.topics().size(), static_cast<size_t>(1));
+		ASSERT_EQ(resp.topics()[0].partitions()[0].isr().size(), static_cast<size_t>(1));
+
+		uint8_t expected[128];
+		uint8_t data[128];
+		ASSERT_EQ(resp.serial_size(), copied.serial_size());
+		ASSERT_EQ(resp.serialize(data), static_cast<uint8_t*>(data+69));
+		copied.serialize(expected);
+		ASSERT_EQ(memcmp(data, expected, 69), 0);
+	}
+
 	void default_ctor_tests()
 	{
 		// Just some silly tests of the default ctor for code coverage
@@ -98,6 +128,7 @@ private:
 	{
 		request_test();
 		response_test();
+		in_place_test();
 		default_ctor_tests();
 	}
 };
@@ -0,0 +1,143 @@
+#include "kafka_broker_stub/mirrored_buffer.hpp"
+#include "kafka_broker_stub/mirrored_buffer.hpp"
+#include "kafka_broker_stub/transport.hpp"
+
+#include "test_common.hpp"
+
+namespace kbs = kafka_broker_stub;
+
+class mirrored_buffer_test : public kbs::test::suite
+{
+public:
+	mirrored_buffer_test(const std::string& name): suite(name) { }
+
+private:
+	void fill(kbs::mirrored_buffer& buf, size_t size, uint8_t first)
+	{
+		uint8_t* ptr = buf.write_ptr();
+		for (size_t i=0; i<size; ++i)
+		{
+			ptr[i] = static_cast<uint8_t>(first + i);
+		}
+		buf.commit(size);
+	}
+
+	void wrap(bool mirror)
+	{
+		kbs::mirrored_buffer buf(100, mirror);
+		ASSERT_EQ(buf.mirrored(), mirror);
+		size_t cap = buf.capacity();
+		ASSERT_EQ(cap >= 100, true);
+		ASSERT_EQ(buf.readable(), static_cast<size_t>(0));
+		ASSERT_EQ(buf.writable(), cap);
+
+		// Leave 10 unread bytes at the end of the ring and write past the end
+		fill(buf, cap, 0);
+		ASSERT_EQ(buf.writable(), static_cast<size_t>(0));
+		if (!mirror)
+			ASSERT_EQ(const_cast<const uint8_t*>(buf.write_ptr()), buf.read_ptr() + cap);
+		buf.consume(cap - 10);
+		ASSERT_EQ(buf.writable(), cap - 10);
+		fill(buf, 20, 10);
+
+		// The unread bytes are contiguous across the wrap
+		ASSERT_EQ(buf.readable(), static_cast<size_t>(30));
+		const uint8_t* data = buf.read_ptr();
+		ASSERT_EQ(data[0], static_cast<uint8_t>(cap - 10));
+		ASSERT_EQ(data[10], static_cast<uint8_t>(10));
+		ASSERT_EQ(data[29], static_cast<uint8_t>(29));
+
+		buf.consume(30);
+		ASSERT_EQ(buf.readable(), static_cast<size_t>(0));
+		ASSERT_EQ(buf.writable(), cap);
+	}
+
+	void wrap_test()
+	{
+		wrap(true);
+		wrap(false);
+	}
+
+	void grow_test()
+	{
+		kbs::mirrored_buffer buf(4096);
+		size_t cap = buf.capacity();
+		fill(buf, cap - 1, 0);
+		buf.consume(cap - 11);
+
+		// Appending more than fits moves the unread bytes to a larger ring
+		std::vector<uint8_t> big(3 * cap, 0xAB);
+		buf.append(&big[0], big.size());
+		ASSERT_EQ(buf.capacity() >= 3 * cap + 10, true);
+		ASSERT_EQ(buf.readable(), 3 * cap + 10);
+		ASSERT_EQ(buf.read_ptr()[0], static_cast<uint8_t>(cap - 11));
+		ASSERT_EQ(buf.read_ptr()[10], static_cast<uint8_t>(0xAB));
+		ASSERT_EQ(buf.read_ptr()[3 * cap + 9], static_cast<uint8_t>(0xAB));
+	}
+
+	void session_test()
+	{
+		// A produce request with a large value received in small pieces
+		kbs::broker_stub stub(0, "localhost", 9092);
+		stub.add_topic("test", std::vector<kbs::partition>(1, kbs::partition(0, 0)));
+
+		const size_t value_size = 200000;
+		std::vector<uint8_t> req(4 + 2 + 2 + 4 + 2 + 2 + 4 + 4 + 6 + 4 + 4 + 4 + 8 + 4 + 4 + 1 + 1 + 4 + 4 + value_size);
+		uint8_t* cur = &req[0];
+		kbs::util::write_type<int32_t>(static_cast<int32_t>(req.size() - 4), cur); cur += 4;
+		cur += 4; // api key and version 0
+		kbs::util::write_type<int32_t>(7, cur); cur += 4; // correlation id
+		kbs::util::write_type<int16_t>(0, cur); cur += 2; // client id
+		kbs::util::write_type<int16_t>(1, cur); cur += 2; // acks
+		kbs::util::write_type<int32_t>(1000, cur); cur += 4; // timeout
+		kbs::util::write_type<int32_t>(1, cur); cur += 4; // topics
+		kbs::util::write_type<int16_t>(4, cur); memcpy(cur + 2, "test", 4); cur += 6;
+		kbs::util::write_type<int32_t>(1, cur); cur += 4; // partitions
+		kbs::util::write_type<int32_t>(0, cur); cur += 4; // partition id
+		kbs::util::write_type<int32_t>(static_cast<int32_t>(8 + 4 + 4 + 1 + 1 + 4 + 4 + value_size), cur); cur += 4;
+		cur += 8; // offset
+		kbs::util::write_type<int32_t>(static_cast<int32_t>(4 + 1 + 1 + 4 + 4 + value_size), cur); cur += 4;
+		cur += 4 + 1 + 1; // crc, magic, attributes
+		kbs::util::write_type<int32_t>(-1, cur); cur += 4; // no key
+		kbs::util::write_type<int32_t>(static_cast<int32_t>(value_size), cur); cur += 4;
+		memset(cur, 'v', value_size);
+
+		kbs::transport::session sess(stub);
+		size_t sent = 0;
+		while (sent < req.size())
+		{
+			size_t space = 0;
+			uint8_t* buf = sess.recv_buffer(space);
+			size_t num = std::min(std::min(space, static_cast<size_t>(1500)), req.size() - sent);
+			memcpy(buf, &req[sent], num);
+			ASSERT_EQ(sess.received(num), true);
+			sent += num;
+		}
+		ASSERT_EQ(sess.has_output(), true);
+		ASSERT_EQ(stub.get_topic("test")->get_partition(0)->data().size(), static_cast<size_t>(1));
+		ASSERT_EQ(stub.get_topic("test")->get_partition(0)->data()[0].value().size(), value_size);
+
+		// Pieces passed in from elsewhere
+		kbs::transport::session other(stub);
+		ASSERT_EQ(other.receive(&req[0], 3), true);
+		ASSERT_EQ(other.receive(&req[3], req.size() - 3 - 10), true);
+		ASSERT_EQ(other.has_output(), false);
+		ASSERT_EQ(other.receive(&req[req.size() - 10], 10), true);
+		ASSERT_EQ(other.has_output(), true);
+		ASSERT_EQ(stub.get_topic("test")->get_partition(0)->next_offset(), static_cast<int64_t>(2));
+	}
+
+	void tests()
+	{
+		wrap_test();
+		grow_test();
+		session_test();
+	}
+};
+
+int main()
+{
+	mirrored_buffer_test suite("Mirrored buffer unittests");
+	suite.execute_tests();
+	return 0;
+}
@@ -0,0 +1,229 @@
+#include "kafka_broker_stub/observer.hpp"
+#include "kafka_broker_stub/observer.hpp"
+#include "kafka_broker_stub/main.hpp"
+
+#include "test_common.hpp"
+
+namespace kbs = kafka_broker_stub;
+
+namespace {
+
+	// Produce request with one message "testmessage" for partition 1 of topic "test"
+	const uint8_t produce_req[] = {
+		0x00, 0x00, 0x00, 0x52,
+		0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x03,
+		0x00, 0x07, 0x72, 0x64, 0x6b, 0x61, 0x66, 0x6b, 0x61,
+		0x00, 0x01,
+		0x00, 0x00, 0x13, 0x88,
+		0x00, 0x00, 0x00, 0x01,
+			0x00, 0x04, 0x74, 0x65, 0x73, 0x74,
+			0x00, 0x00, 0x00, 0x01,
+				0x00, 0x00, 0x00, 0x01,
+				0x00, 0x00, 0x00, 0x25,
+					0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x09,
+					0x00, 0x00, 0x00, 0x19,
+					0xa6, 0xb1, 0x36, 0x2b,
+					0xFF,
+					0x00,
+					0xff, 0xff, 0xff, 0xff,
+					0x00, 0x00, 0x00, 0x0b,
+						0x74, 0x65, 0x73, 0x74, 0x6d, 0x65,
+						0x73, 0x73, 0x61, 0x67, 0x65};
+
+	class counting_observer : public kbs::append_observerI
+	{
+	public:
+		counting_observer():
+			calls(0),
+			messages(0),
+			last_offset(-1),
+			last_partition(-1),
+			last_topic()
+		{
+
+		}
+
+		void on_append(const std::string& topic, const kbs::partition& part, int64_t base_offset, size_t count)
+		{
+			++calls;
+			messages += count;
+			last_offset = base_offset;
+			last_partition = part.id();
+			last_topic = topic;
+		}
+
+		int calls;
+		size_t messages;
+		int64_t last_offset;
+		int32_t last_partition;
+		std::string last_topic;
+	};
+
+	struct has_value
+	{
+		explicit has_value(const std::string& v):
+			value(v)
+		{
+
+		}
+
+		bool operator()(const kbs::partition& part) const
+		{
+			return !part.data().empty() && (part.data().back().value() == value);
+		}
+
+		std::string value;
+	};
+
+	struct waiter_args
+	{
+		waiter_args(kbs::broker_stub& s):
+			stub(s),
+			result(false)
+		{
+
+		}
+
+		kbs::broker_stub& stub;
+		bool result;
+	};
+
+	void* wait_thread(void* arg)
+	{
+		waiter_args* args = static_cast<waiter_args*>(arg);
+		args->result = args->stub.wait_for("test", 1, 2, 10000);
+		return NULL;
+	}
+
+	struct churn_args
+	{
+		churn_args(kbs::broker_stub& s):
+			stub(s),
+			observer()
+		{
+
+		}
+
+		kbs::broker_stub& stub;
+		counting_observer observer;
+	};
+
+	void* churn_thread(void* arg)
+	{
+		churn_args* args = static_cast<churn_args*>(arg);
+		for (int i=0; i<1000; ++i)
+		{
+			args->stub.add_observer(args->observer, "test");
+			args->stub.remove_observer(args->observer);
+		}
+		return NULL;
+	}
+
+	kbs::broker_stub* make_stub()
+	{
+		std::vector<kbs::partition> partitions;
+		partitions.push_back(kbs::partition(0, 0));
+		partitions.push_back(kbs::partition(1, 0));
+		kbs::broker_stub* stub = new kbs::broker_stub(0, "localhost", 9092);
+		stub->add_topic("test", partitions);
+		stub->add_topic("other", partitions);
+		return stub;
+	}
+
+}
+
+class observer_test : public kbs::test::suite
+{
+public:
+	observer_test(const std::string& name): suite(name) { }
+
+private:
+	void callback_test()
+	{
+		kbs::broker_stub* stub = make_stub();
+		counting_observer all;
+		counting_observer topic;
+		counting_observer other_part;
+		counting_observer other_topic;
+		stub->add_observer(all);
+		stub->add_observer(topic, "test");
+		stub->add_observer(other_part, "test", 0);
+		stub->add_observer(other_topic, "other");
+
+		std::vector<std::string> responses;
+		stub->handle_data(produce_req, sizeof(produce_req), responses);
+		stub->handle_data(produce_req, sizeof(produce_req), responses);
+
+		ASSERT_EQ(all.calls, 2);
+		ASSERT_EQ(all.messages, static_cast<size_t>(2));
+		ASSERT_EQ(all.last_offset, static_cast<int64_t>(1));
+		ASSERT_EQ(all.last_partition, static_cast<int32_t>(1));
+		ASSERT_EQ(all.last_topic, std::string("test"));
+		ASSERT_EQ(topic.calls, 2);
+		ASSERT_EQ(other_part.calls, 0);
+		ASSERT_EQ(other_topic.calls, 0);
+
+		// Removed observers are not called
+		stub->remove_observer(all);
+		stub->handle_data(produce_req, sizeof(produce_req), responses);
+		ASSERT_EQ(all.calls, 2);
+		ASSERT_EQ(topic.calls, 3);
+
+		// Observers come and go on another thread while producing
+		churn_args args(*stub);
+		pthread_t thread;
+		ASSERT_EQ(pthread_create(&thread, NULL, &churn_thread, &args), 0);
+		for (int i=0; i<200; ++i)
+		{
+			stub->handle_data(produce_req, sizeof(produce_req), responses);
+		}
+		pthread_join(thread, NULL);
+		ASSERT_EQ(topic.calls, 203);
+		ASSERT_EQ(args.observer.calls <= 200, true);
+		delete stub;
+	}
+
+	void wait_test()
+	{
+		kbs::broker_stub* stub = make_stub();
+
+		// Nothing arrives
+		uint64_t start = kbs::util::monotonic_ns();
+		ASSERT_EQ(stub->wait_for("test", 1, 1, 20), false);
+		ASSERT_EQ(kbs::util::monotonic_ns() - start >= static_cast<uint64_t>(20000000), true);
+		ASSERT_EQ(stub->wait_for("unknown", 0, 0, 0), false);
+		ASSERT_EQ(stub->wait_for("test", 2, 0, 0), false);
+
+		// Already satisfied conditions return right away
+		ASSERT_EQ(stub->wait_for("test", 1, 0, 0), true);
+
+		// Another thread waits for two messages that are produced here
+		waiter_args args(*stub);
+		pthread_t thread;
+		ASSERT_EQ(pthread_create(&thread, NULL, &wait_thread, &args), 0);
+		std::vector<std::string> responses;
+		stub->handle_data(produce_req, sizeof(produce_req), responses);
+		stub->handle_data(produce_req, sizeof(produce_req), responses);
+		pthread_join(thread, NULL);
+		ASSERT_EQ(args.result, true);
+
+		// Predicates inspect the partition
+		ASSERT_EQ(stub->wait_until("test", 1, has_value("testmessage"), 0), true);
+		ASSERT_EQ(stub->wait_until("test", 1, has_value("other"), 0), false);
+		delete stub;
+	}
+
+	void tests()
+	{
+		callback_test();
+		wait_test();
+	}
+};
+
+int main()
+{
+	observer_test suite("Observer unittests");
+	suite.execute_tests();
+	return 0;
+}
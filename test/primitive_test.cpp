@@ -243,6 +243,139 @@ private:
 		}
 	}
 
+	void small_array_tests()
+	{
+		typedef kbs::primitive::array<kbs::primitive::int32> int_array;
+		typedef kbs::primitive::array<kbs::primitive::string> str_array;
+
+		// Small arrays keep their elements inline
+		int_array small;
+		ASSERT_EQ(int_array::INLINE_CAPACITY > static_cast<size_t>(1), true);
+		for (size_t i=0; i<int_array::INLINE_CAPACITY; ++i)
+		{
+			small.push_back(kbs::primitive::int32(static_cast<int32_t>(i)));
+		}
+		ASSERT_EQ(small.capacity(), int_array::INLINE_CAPACITY);
+
+		// And allocate once they outgrow it
+		int_array large(small);
+		large.push_back(large[0]);
+		ASSERT_EQ(large.size(), int_array::INLINE_CAPACITY + 1);
+		ASSERT_EQ(large.capacity() > int_array::INLINE_CAPACITY, true);
+		ASSERT_EQ(large[int_array::INLINE_CAPACITY], kbs::primitive::int32(0));
+
+		// Swapping heap arrays hands over the allocation
+		int_array other(large);
+		other.push_back(kbs::primitive::int32(7));
+		kbs::primitive::int32* heap = &other[0];
+		large.swap(other);
+		ASSERT_EQ(&large[0], heap);
+		ASSERT_EQ(large.size(), int_array::INLINE_CAPACITY + 2);
+		ASSERT_EQ(other.size(), int_array::INLINE_CAPACITY + 1);
+
+		// Also when swapped with an inline array
+		small.swap(large);
+		ASSERT_EQ(&small[0], heap);
+		ASSERT_EQ(large.size(), int_array::INLINE_CAPACITY);
+		ASSERT_EQ(large.capacity(), int_array::INLINE_CAPACITY);
+		ASSERT_EQ(large[1], kbs::primitive::int32(1));
+		large.swap(small);
+		ASSERT_EQ(&large[0], heap);
+		ASSERT_EQ(small.size(), int_array::INLINE_CAPACITY);
+		ASSERT_EQ(small[1], kbs::primitive::int32(1));
+
+		// Elements with members on the heap are copied and destroyed
+		str_array strs;
+		ASSERT_EQ(str_array::INLINE_CAPACITY, static_cast<size_t>(1));
+		const uint8_t abc[] = {0x00, 0x03, 'a', 'b', 'c'};
+		strs.emplace_back().deserialize(abc);
+		for (int i=0; i<10; ++i)
+		{
+			strs.push_back(strs[0]);
+		}
+		str_array copy;
+		copy.push_back(kbs::primitive::string("x"));
+		copy = strs;
+		ASSERT_EQ(copy.size(), static_cast<size_t>(11));
+		ASSERT_EQ(copy[10].std_str(), std::string("abc"));
+		str_array single;
+		single.push_back(kbs::primitive::string("single"));
+		single.swap(copy);
+		ASSERT_EQ(single.size(), static_cast<size_t>(11));
+		ASSERT_EQ(copy.size(), static_cast<size_t>(1));
+		ASSERT_EQ(copy[0].std_str(), std::string("single"));
+		copy.clear();
+		ASSERT_EQ(copy.size(), static_cast<size_t>(0));
+
+		// Decoding reserves room for the decoded length
+		uint8_t in[] = {0x00, 0x00, 0x00, 0x03, 0x00, 0x01, 0x00, 0x02, 0x00, 0x03};
+		kbs::primitive::array<kbs::primitive::int16> decoded;
+		decoded.deserialize(in);
+		ASSERT_EQ(decoded.size(), static_cast<size_t>(3));
+		ASSERT_EQ(decoded[2], kbs::primitive::int16(3));
+		str_array decoded_strs;
+		uint8_t str_in[] = {0x00, 0x00, 0x00, 0x02, 0x00, 0x01, 'a', 0x00, 0x01, 'b'};
+		decoded_strs.deserialize(str_in);
+		ASSERT_EQ(decoded_strs.capacity(), static_cast<size_t>(2));
+		ASSERT_EQ(decoded_strs[1].std_str(), std::string("b"));
+		ASSERT_EQ(decoded_strs.back().std_str(), std::string("b"));
+		decoded_strs.back() = kbs::primitive::string("c");
+		ASSERT_EQ(decoded_strs[1].std_str(), std::string("c"));
+
+		// Decoded lengths reserve no more than ARRAY_MAX_RESERVE_BYTES
+		ASSERT_EQ(kbs::primitive::reserve_count<kbs::primitive::int16>(3), static_cast<size_t>(3));
+		ASSERT_EQ(kbs::primitive::reserve_count<kbs::primitive::int16>(-1), static_cast<size_t>(0));
+		ASSERT_EQ(kbs::primitive::reserve_count<int_array>(0x7fffffff),
+		          kbs::primitive::ARRAY_MAX_RESERVE_BYTES / sizeof(int_array));
+
+		// Arrays of large elements such as arrays keep nothing inline
+		typedef kbs::primitive::array<int_array> nested_array;
+		ASSERT_EQ(nested_array::INLINE_CAPACITY, static_cast<size_t>(0));
+		ASSERT_EQ(sizeof(nested_array) < sizeof(int_array), true);
+		nested_array nested;
+		ASSERT_EQ(nested.capacity(), static_cast<size_t>(0));
+		nested.push_back(small);
+		nested.emplace_back().push_back(kbs::primitive::int32(5));
+		nested.push_back(nested[0]);
+		ASSERT_EQ(nested.size(), static_cast<size_t>(3));
+		ASSERT_EQ(nested[1][0], kbs::primitive::int32(5));
+		ASSERT_EQ(nested[2].size(), int_array::INLINE_CAPACITY);
+		nested_array empty;
+		empty.swap(nested);
+		ASSERT_EQ(empty.size(), static_cast<size_t>(3));
+		ASSERT_EQ(nested.size(), static_cast<size_t>(0));
+		ASSERT_EQ(nested.capacity(), static_cast<size_t>(0));
+
+#if __cplusplus >= 201103L
+		// Moving hands over the allocation and leaves the source empty
+		int_array moved(std::move(large));
+		ASSERT_EQ(&moved[0], heap);
+		ASSERT_EQ(large.size(), static_cast<size_t>(0));
+		int_array assigned;
+		assigned.push_back(kbs::primitive::int32(1));
+		assigned = std::move(moved);
+		ASSERT_EQ(&assigned[0], heap);
+		ASSERT_EQ(moved.size(), static_cast<size_t>(0));
+
+		// Temporaries are moved in with their arrays
+		nested_array moved_in;
+		moved_in.push_back(int_array(assigned));
+		ASSERT_EQ(moved_in[0].size(), assigned.size());
+		int_array inner(assigned);
+		kbs::primitive::int32* inner_heap = &inner[0];
+		moved_in.push_back(std::move(inner));
+		ASSERT_EQ(&moved_in.back()[0], inner_heap);
+
+		// Growing moves the elements instead of copying them
+		while (moved_in.size() < moved_in.capacity())
+		{
+			moved_in.emplace_back();
+		}
+		moved_in.emplace_back();
+		ASSERT_EQ(&moved_in[1][0], inner_heap);
+#endif
+	}
+
 	class dummy : public kbs::kafka_elementI { };
 	void exception_tests()
 	{
@@ -270,6 +403,7 @@ private:
 		string_tests();
 		bytearray_tests();
 		array_tests();
+		small_array_tests();
 		exception_tests();
 	}
 
@@ -102,6 +102,168 @@ private:
 		ASSERT_EQ(memcmp(data, cmp, sizeof(cmp)), 0);
 	}
 
+	void in_place_test()
+	{
+		kbs::primitive::array<kbs::produce::partition_result> part_arr;
+		part_arr.push_back(kbs::produce::partition_result(8, 7, 1, 2));
+		kbs::primitive::array<kbs::produce::topic_result> topic_arr;
+		topic_arr.push_back(kbs::produce::topic_result(kbs::primitive::string("test"), part_arr));
+		kbs::produce::response_v1 copied(3, topic_arr, 100);
+
+		// The same response filled in place
+		kbs::produce::response_v1 resp(3, 100);
+		resp.topic_results().push_back(kbs::produce::topic_result(kbs::primitive::string("test")));
+		resp.topic_results().back().partition_results().push_back(kbs::produce::partition_result(8, 7, 1, 2));
+		ASSERT_EQ(resp.topic_results()[0].partition_results().size(), static_cast<size_t>(1));
+
+		uint8_t expected[64];
+		uint8_t data[64];
+		ASSERT_EQ(resp.serial_size(), copied.serial_size());
+		ASSERT_EQ(resp.serialize(data), static_cast<uint8_t*>(data+44));
+		copied.serialize(expected);
+		ASSERT_EQ(memcmp(data, expected, 44), 0);
+
+		kbs::produce::response_v0 empty(3);
+		ASSERT_EQ(empty.serial_size(), static_cast<size_t>(8));
+	}
+
+	void message_set_test()
+	{
+		// Two messages - the first with a null key and the second with key "k"
+		uint8_t set[] = {
+			0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // offset
+			0x00, 0x00, 0x00, 0x10, // message size
+			0xa6, 0xb1, 0x36, 0x2b, // crc
+			0x00, // magic byte
+			0x00, // attributes
+			0xff, 0xff, 0xff, 0xff, // null key
+			0x00, 0x00, 0x00, 0x02, 0x76, 0x31, // value "v1"
+			0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, // offset
+			0x00, 0x00, 0x00, 0x11, // message size
+			0xa6, 0xb1, 0x36, 0x2b, // crc
+			0x00, // magic byte
+			0x00, // attributes
+			0x00, 0x00, 0x00, 0x01, 0x6b, // key "k"
+			0x00, 0x00, 0x00, 0x02, 0x76, 0x32 // value "v2"
+		};
+
+		kbs::produce::message_set messages;
+		ASSERT_EQ(messages.deserialize(set, sizeof(set)), true);
+		ASSERT_EQ(messages.size(), static_cast<size_t>(2));
+		ASSERT_EQ(messages.payload_size(), static_cast<size_t>(5));
+		ASSERT_EQ(messages[0].key_size, static_cast<size_t>(0));
+		ASSERT_EQ(messages[0].value_size, static_cast<size_t>(2));
+		ASSERT_EQ(messages[0].value - set, static_cast<ptrdiff_t>(26));
+		ASSERT_EQ(messages[1].key_size, static_cast<size_t>(1));
+		ASSERT_EQ(messages[1].key[0], static_cast<uint8_t>('k'));
+		ASSERT_EQ(messages[1].value[1], static_cast<uint8_t>('2'));
+		ASSERT_EQ(messages[1].timestamp, static_cast<int64_t>(-1));
+
+		// Truncated sets are rejected
+		ASSERT_EQ(messages.deserialize(set, sizeof(set)-1), false);
+		ASSERT_EQ(messages.deserialize(set, 20), false);
+
+		ASSERT_EQ(messages.compressed(), false);
+
+		// Compressed wrapper messages are not supported
+		set[45] = 0x01;
+		ASSERT_EQ(messages.deserialize(set, sizeof(set)), false);
+		ASSERT_EQ(messages.compressed(), true);
+		set[45] = 0x00;
+
+		// Value length exceeding the message size is rejected
+		set[23] = 0x03;
+		ASSERT_EQ(messages.deserialize(set, sizeof(set)), false);
+		ASSERT_EQ(messages.compressed(), false);
+	}
+
+	void versions_test()
+	{
+		// Magic byte 1 messages carry a timestamp before the key
+		uint8_t set[] = {
+			0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // offset
+			0x00, 0x00, 0x00, 0x19, // message size
+			0x00, 0x00, 0x00, 0x00, // crc
+			0x01, // magic byte
+			0x00, // attributes
+			0x00, 0x00, 0x01, 0x5f, 0x00, 0x00, 0x00, 0x00, // timestamp
+			0x00, 0x00, 0x00, 0x01, 0x6b, // key "k"
+			0x00, 0x00, 0x00, 0x02, 0x76, 0x31 // value "v1"
+		};
+		kbs::produce::message_set messages;
+		ASSERT_EQ(messages.deserialize(set, sizeof(set)), true);
+		ASSERT_EQ(messages.size(), static_cast<size_t>(1));
+		ASSERT_EQ(messages[0].key[0], static_cast<uint8_t>('k'));
+		ASSERT_EQ(messages[0].value_size, static_cast<size_t>(2));
+		ASSERT_EQ(messages[0].timestamp, static_cast<int64_t>(0x15f) << 32);
+
+		// Version 2 results add the log append time and version 1 responses
+		// the throttle time
+		kbs::primitive::array<kbs::produce::partition_result> part_arr;
+		part_arr.push_back(kbs::produce::partition_result(8, 0, 1, 2));
+		ASSERT_EQ(part_arr[0].serial_size(), static_cast<size_t>(22));
+		kbs::primitive::array<kbs::produce::topic_result> topic_arr;
+		topic_arr.push_back(kbs::produce::topic_result(kbs::primitive::string("test"), part_arr));
+		kbs::produce::response_v1 resp(3, topic_arr, 100);
+		ASSERT_EQ(resp.serial_size(), static_cast<size_t>(44));
+
+		uint8_t data[64];
+		ASSERT_EQ(resp.serialize(data), static_cast<uint8_t*>(data+44));
+		ASSERT_EQ(kbs::util::read_type<int64_t>(data + 32), static_cast<int64_t>(-1));
+		ASSERT_EQ(kbs::util::read_type<int32_t>(data + 40), static_cast<int32_t>(100));
+	}
+
+	void record_batch_test()
+	{
+		// Record batch of an idempotent producer with two records
+		uint8_t set[] = {
+			0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // base offset
+			0x00, 0x00, 0x00, 0x44, // batch length
+			0xff, 0xff, 0xff, 0xff, // partition leader epoch
+			0x02, // magic byte
+			0x00, 0x00, 0x00, 0x00, // crc
+			0x00, 0x00, // attributes
+			0x00, 0x00, 0x00, 0x01, // last offset delta
+			0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03, 0xe8, // first timestamp
+			0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03, 0xed, // max timestamp
+			0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x2a, // producer id
+			0x00, 0x01, // producer epoch
+			0x00, 0x00, 0x00, 0x07, // base sequence
+			0x00, 0x00, 0x00, 0x02, // records
+				0x12, 0x00, 0x00, 0x00, 0x02, 0x6b, 0x04, 0x76, 0x31, 0x00, // key "k", value "v1"
+				0x10, 0x00, 0x0a, 0x02, 0x01, 0x04, 0x76, 0x32, 0x00 // null key, value "v2", timestamp +5
+		};
+
+		kbs::produce::message_set messages;
+		ASSERT_EQ(messages.deserialize(set, sizeof(set)), true);
+		ASSERT_EQ(messages.size(), static_cast<size_t>(2));
+		ASSERT_EQ(messages.payload_size(), static_cast<size_t>(5));
+		ASSERT_EQ(messages[0].key_size, static_cast<size_t>(1));
+		ASSERT_EQ(messages[0].key[0], static_cast<uint8_t>('k'));
+		ASSERT_EQ(messages[0].timestamp, static_cast<int64_t>(1000));
+		ASSERT_EQ(messages[1].key_size, static_cast<size_t>(0));
+		ASSERT_EQ(messages[1].value[1], static_cast<uint8_t>('2'));
+		ASSERT_EQ(messages[1].timestamp, static_cast<int64_t>(1005));
+
+		ASSERT_EQ(messages.batch_count(), static_cast<size_t>(1));
+		ASSERT_EQ(messages.batch(0).producer_id, static_cast<int64_t>(42));
+		ASSERT_EQ(messages.batch(0).producer_epoch, static_cast<int16_t>(1));
+		ASSERT_EQ(messages.batch(0).base_sequence, static_cast<int32_t>(7));
+		ASSERT_EQ(messages.batch(0).first, static_cast<size_t>(0));
+		ASSERT_EQ(messages.batch(0).count, static_cast<size_t>(2));
+
+		// Records exceeding the batch are rejected
+		ASSERT_EQ(messages.deserialize(set, sizeof(set) - 1), false);
+		set[61] = 0x7e;
+		ASSERT_EQ(messages.deserialize(set, sizeof(set)), false);
+		set[61] = 0x12;
+
+		// Compressed batches are not supported
+		set[22] = 0x01;
+		ASSERT_EQ(messages.deserialize(set, sizeof(set)), false);
+		ASSERT_EQ(messages.compressed(), true);
+	}
+
 	void default_ctor_tests()
 	{
 		// Just some silly tests of the default ctor for code coverage
@@ -116,6 +278,10 @@ private:
 	{
 		request_test();
 		response_test();
+		in_place_test();
+		message_set_test();
+		versions_test();
+		record_batch_test();
 		default_ctor_tests();
 	}
 };
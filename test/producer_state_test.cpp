@@ -0,0 +1,129 @@
+#include "kafka_broker_stub/producer_state.hpp"
+#include "kafka_broker_stub/producer_state.hpp"
+
+#include "test_common.hpp"
+
+namespace kbs = kafka_broker_stub;
+
+class producer_state_test : public kbs::test::suite
+{
+public:
+	producer_state_test(const std::string& name): suite(name) { }
+
+private:
+	void sequence_test()
+	{
+		kbs::producer_table table;
+		int64_t offset = -1;
+
+		// Unknown producers must start at sequence 0
+		ASSERT_EQ(table.check(7, 0, 3, 5, offset) == kbs::SEQUENCE_UNKNOWN_PRODUCER, true);
+		ASSERT_EQ(table.check(7, 0, 0, 2, offset) == kbs::SEQUENCE_OK, true);
+		table.add(7, 0, 0, 2, 100);
+		ASSERT_EQ(table.size(), static_cast<size_t>(1));
+
+		// The next batch continues the sequence
+		ASSERT_EQ(table.check(7, 0, 3, 3, offset) == kbs::SEQUENCE_OK, true);
+		ASSERT_EQ(table.check(7, 0, 4, 4, offset) == kbs::SEQUENCE_OUT_OF_ORDER, true);
+		ASSERT_EQ(table.check(7, 0, 2, 2, offset) == kbs::SEQUENCE_OUT_OF_ORDER, true);
+		table.add(7, 0, 3, 3, 103);
+
+		// Retries of earlier batches get their offset
+		ASSERT_EQ(table.check(7, 0, 0, 2, offset) == kbs::SEQUENCE_DUPLICATE, true);
+		ASSERT_EQ(offset, static_cast<int64_t>(100));
+		ASSERT_EQ(table.check(7, 0, 3, 3, offset) == kbs::SEQUENCE_DUPLICATE, true);
+		ASSERT_EQ(offset, static_cast<int64_t>(103));
+
+		// Older epochs are fenced and new epochs restart at 0
+		table.add(7, 1, 0, 0, 104);
+		ASSERT_EQ(table.check(7, 0, 4, 4, offset) == kbs::SEQUENCE_FENCED, true);
+		ASSERT_EQ(table.check(7, 2, 1, 1, offset) == kbs::SEQUENCE_OUT_OF_ORDER, true);
+		ASSERT_EQ(table.check(7, 1, 0, 2, offset) == kbs::SEQUENCE_OUT_OF_ORDER, true);
+		ASSERT_EQ(table.check(7, 1, 1, 1, offset) == kbs::SEQUENCE_OK, true);
+
+		table.clear();
+		ASSERT_EQ(table.size(), static_cast<size_t>(0));
+		ASSERT_EQ(table.check(7, 0, 3, 3, offset) == kbs::SEQUENCE_UNKNOWN_PRODUCER, true);
+	}
+
+	void cache_test()
+	{
+		// Only the last five batches are remembered
+		kbs::producer_table table;
+		for (int32_t i=0; i<7; ++i)
+		{
+			table.add(1, 0, i, i, i);
+		}
+
+		int64_t offset = -1;
+		ASSERT_EQ(table.check(1, 0, 1, 1, offset) == kbs::SEQUENCE_OUT_OF_ORDER, true);
+		ASSERT_EQ(table.check(1, 0, 2, 2, offset) == kbs::SEQUENCE_DUPLICATE, true);
+		ASSERT_EQ(offset, static_cast<int64_t>(2));
+		ASSERT_EQ(table.check(1, 0, 6, 6, offset) == kbs::SEQUENCE_DUPLICATE, true);
+		ASSERT_EQ(table.check(1, 0, 7, 7, offset) == kbs::SEQUENCE_OK, true);
+
+		// Sequences wrap after the largest int32
+		const int32_t max = 0x7FFFFFFF;
+		ASSERT_EQ(kbs::producer_table::next_sequence(max - 1, 3), static_cast<int32_t>(1));
+		table.add(2, 0, 0, 0, 0);
+		table.add(2, 0, 1, max, 1);
+		ASSERT_EQ(table.check(2, 0, 0, 4, offset) == kbs::SEQUENCE_OK, true);
+	}
+
+	void many_producers_test()
+	{
+		// Grows past several rehashes
+		kbs::producer_table table;
+		const int64_t num = 5000;
+		for (int64_t id=0; id<num; ++id)
+		{
+			table.add(id * 977, 0, 0, 9, id);
+		}
+		ASSERT_EQ(table.size(), static_cast<size_t>(num));
+
+		bool all = true;
+		for (int64_t id=0; id<num; ++id)
+		{
+			int64_t offset = -1;
+			all = all && (table.check(id * 977, 0, 0, 9, offset) == kbs::SEQUENCE_DUPLICATE) && (offset == id) &&
+			      (table.check(id * 977, 0, 10, 10, offset) == kbs::SEQUENCE_OK);
+		}
+		ASSERT_EQ(all, true);
+	}
+
+	void producer_ids_test()
+	{
+		kbs::producer_ids ids(3);
+		int64_t id = -1;
+		int16_t epoch = -1;
+		ids.init("", id, epoch);
+		ASSERT_EQ(id, static_cast<int64_t>(3) << 32);
+		ASSERT_EQ(epoch, static_cast<int16_t>(0));
+		ids.init("", id, epoch);
+		ASSERT_EQ(id, (static_cast<int64_t>(3) << 32) + 1);
+
+		// Transactional IDs keep the producer ID and bump the epoch
+		int64_t txn_id = -1;
+		ids.init("txn", txn_id, epoch);
+		ASSERT_EQ(txn_id, (static_cast<int64_t>(3) << 32) + 2);
+		ASSERT_EQ(epoch, static_cast<int16_t>(0));
+		ids.init("txn", id, epoch);
+		ASSERT_EQ(id, txn_id);
+		ASSERT_EQ(epoch, static_cast<int16_t>(1));
+	}
+
+	void tests()
+	{
+		sequence_test();
+		cache_test();
+		many_producers_test();
+		producer_ids_test();
+	}
+};
+
+int main()
+{
+	producer_state_test suite("Producer state unittests");
+	suite.execute_tests();
+	return 0;
+}
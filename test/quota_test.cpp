@@ -0,0 +1,143 @@
+#include "kafka_broker_stub/quota.hpp"
+#include "kafka_broker_stub/quota.hpp"
+
+#include "test_common.hpp"
+
+#include <pthread.h>
+
+namespace kbs = kafka_broker_stub;
+
+namespace {
+
+	const uint64_t SECOND = 1000000000;
+
+	struct charge_args
+	{
+		charge_args(kbs::token_bucket& b):
+			bucket(b)
+		{
+
+		}
+
+		kbs::token_bucket& bucket;
+	};
+
+	void* charge_thread(void* arg)
+	{
+		charge_args* args = static_cast<charge_args*>(arg);
+		for (int i=0; i<10000; ++i)
+		{
+			args->bucket.charge(100, SECOND);
+		}
+		return NULL;
+	}
+
+}
+
+class quota_test : public kbs::test::suite
+{
+public:
+	quota_test(const std::string& name): suite(name) { }
+
+private:
+	void bucket_test()
+	{
+		// Unlimited until configured
+		kbs::token_bucket bucket;
+		ASSERT_EQ(bucket.limited(), false);
+		ASSERT_EQ(bucket.charge(1000000, SECOND), static_cast<uint32_t>(0));
+
+		// 1000 bytes per second with one second of burst
+		bucket.configure(1000, 1000);
+		ASSERT_EQ(bucket.limited(), true);
+		ASSERT_EQ(bucket.charge(1000, 10 * SECOND), static_cast<uint32_t>(0));
+
+		// Another 500 bytes exceed the burst by half a second
+		uint32_t throttle = bucket.charge(500, 10 * SECOND);
+		ASSERT_EQ((throttle >= 500) && (throttle <= 513), true);
+
+		// The bucket refills over time
+		ASSERT_EQ(bucket.charge(100, 14 * SECOND), static_cast<uint32_t>(0));
+
+		// Removing the limit
+		bucket.configure(0, 1000);
+		ASSERT_EQ(bucket.charge(1000000, 14 * SECOND), static_cast<uint32_t>(0));
+	}
+
+	void concurrent_test()
+	{
+		// No charge is lost when charging from several threads
+		kbs::token_bucket bucket;
+		bucket.configure(1024, 0);
+		charge_args args(bucket);
+		pthread_t threads[4];
+		for (int i=0; i<4; ++i)
+		{
+			ASSERT_EQ(pthread_create(&threads[i], NULL, &charge_thread, &args), 0);
+		}
+		for (int i=0; i<4; ++i)
+		{
+			pthread_join(threads[i], NULL);
+		}
+
+		// 4 MB at 1 KB/s is close to 3906 seconds
+		uint32_t throttle = bucket.charge(0, SECOND);
+		ASSERT_EQ((throttle >= 3906000) && (throttle <= 3907000), true);
+	}
+
+	void manager_test()
+	{
+		kbs::quota_manager quotas;
+		ASSERT_EQ(quotas.charge(kbs::QUOTA_PRODUCE, "client", 100000000), static_cast<uint32_t>(0));
+
+		// Client quota only applies to the client and type
+		quotas.set_client_quota(kbs::QUOTA_PRODUCE, "slow", 1000);
+		ASSERT_EQ(quotas.charge(kbs::QUOTA_PRODUCE, "slow", 1000), static_cast<uint32_t>(0));
+		ASSERT_EQ(quotas.charge(kbs::QUOTA_PRODUCE, "slow", 2000) > 0, true);
+		ASSERT_EQ(quotas.charge(kbs::QUOTA_FETCH, "slow", 100000000), static_cast<uint32_t>(0));
+		ASSERT_EQ(quotas.charge(kbs::QUOTA_PRODUCE, "fast", 100000000), static_cast<uint32_t>(0));
+
+		// Default quota applies to each other client on its own
+		quotas.set_default_quota(kbs::QUOTA_FETCH, 1000);
+		ASSERT_EQ(quotas.charge(kbs::QUOTA_FETCH, "a", 1000), static_cast<uint32_t>(0));
+		ASSERT_EQ(quotas.charge(kbs::QUOTA_FETCH, "b", 1000), static_cast<uint32_t>(0));
+		ASSERT_EQ(quotas.charge(kbs::QUOTA_FETCH, "a", 1000) > 0, true);
+
+		// Many clients grow the lookup table
+		for (int i=0; i<100; ++i)
+		{
+			std::string client(1, static_cast<char>('A' + (i % 26)));
+			client += static_cast<char>('0' + (i / 26));
+			ASSERT_EQ(quotas.charge(kbs::QUOTA_FETCH, client, 10), static_cast<uint32_t>(0));
+		}
+		ASSERT_EQ(quotas.charge(kbs::QUOTA_FETCH, "a", 1) > 0, true);
+
+		// Removing the default
+		quotas.set_default_quota(kbs::QUOTA_FETCH, 0);
+		ASSERT_EQ(quotas.charge(kbs::QUOTA_FETCH, "a", 100000000), static_cast<uint32_t>(0));
+
+		// User quota is shared by all clients
+		quotas.set_user_quota(kbs::QUOTA_FETCH, 1000);
+		ASSERT_EQ(quotas.charge(kbs::QUOTA_FETCH, "x", 1000), static_cast<uint32_t>(0));
+		ASSERT_EQ(quotas.charge(kbs::QUOTA_FETCH, "y", 1000) > 0, true);
+
+		// Responses are only delayed on request
+		ASSERT_EQ(quotas.delay_responses(), false);
+		quotas.set_delay_responses(true);
+		ASSERT_EQ(quotas.delay_responses(), true);
+	}
+
+	void tests()
+	{
+		bucket_test();
+		concurrent_test();
+		manager_test();
+	}
+};
+
+int main()
+{
+	quota_test suite("Quota unittests");
+	suite.execute_tests();
+	return 0;
+}
@@ -0,0 +1,211 @@
+#include "kafka_broker_stub/scatter.hpp"
+#include "kafka_broker_stub/scatter.hpp"
+#include "kafka_broker_stub/fetch.hpp"
+
+#include "test_common.hpp"
+#include <unistd.h>
+
+namespace kbs = kafka_broker_stub;
+
+class scatter_test : public kbs::test::suite
+{
+public:
+	scatter_test(const std::string& name): suite(name) { }
+
+private:
+	/**
+	 * Contiguous serialization of an element
+	 */
+	static std::string serialized(const kbs::kafka_elementI& element)
+	{
+		std::string out(element.serial_size(), '\0');
+		if (!out.empty())
+		{
+			element.serialize(reinterpret_cast<uint8_t*>(&out[0]));
+		}
+		return out;
+	}
+
+	static std::string gathered(const kbs::scatter_buffer& buf)
+	{
+		std::string out;
+		buf.copy_to(out);
+		return out;
+	}
+
+	void buffer_test()
+	{
+		kbs::scatter_buffer buf(8, 16);
+		ASSERT_EQ(buf.empty(), true);
+		ASSERT_EQ(buf.count(), static_cast<size_t>(0));
+
+		// Consecutive arena writes make one range
+		memcpy(buf.reserve(2), "ab", 2);
+		buf.append("cd", 2);
+		ASSERT_EQ(buf.count(), static_cast<size_t>(1));
+		ASSERT_EQ(buf.size(), static_cast<size_t>(4));
+
+		// Large payloads are referenced in place
+		const std::string payload("0123456789");
+		buf.append(payload.data(), payload.size());
+		ASSERT_EQ(buf.count(), static_cast<size_t>(2));
+		ASSERT_EQ(buf.referenced(), payload.size());
+		memcpy(buf.reserve(1), "e", 1);
+		ASSERT_EQ(buf.count(), static_cast<size_t>(3));
+
+		struct iovec iov[4];
+		ASSERT_EQ(buf.fill_iovec(iov, 4), static_cast<size_t>(3));
+		ASSERT_EQ(static_cast<const char*>(iov[1].iov_base), payload.data());
+		ASSERT_EQ(iov[1].iov_len, payload.size());
+		ASSERT_EQ(gathered(buf), std::string("abcd0123456789e"));
+
+		// Arena chunks are filled up before the next one is used and
+		// reservations larger than a chunk get their own
+		memcpy(buf.reserve(12), "fghijklmnopq", 12);
+		memcpy(buf.reserve(20), "rstuvwxyzABCDEFGHIJK", 20);
+		ASSERT_EQ(gathered(buf), std::string("abcd0123456789efghijklmnopqrstuvwxyzABCDEFGHIJK"));
+		ASSERT_EQ(buf.size(), static_cast<size_t>(47));
+
+		// Sent bytes are dropped from the front
+		buf.consumed(6);
+		ASSERT_EQ(buf.size(), static_cast<size_t>(41));
+		ASSERT_EQ(buf.fill_iovec(iov, 1), static_cast<size_t>(1));
+		ASSERT_EQ(static_cast<const char*>(iov[0].iov_base), payload.data() + 2);
+		ASSERT_EQ(iov[0].iov_len, static_cast<size_t>(8));
+		buf.consumed(8);
+		ASSERT_EQ(gathered(buf), std::string("efghijklmnopqrstuvwxyzABCDEFGHIJK"));
+		buf.consumed(100);
+		ASSERT_EQ(buf.empty(), true);
+		ASSERT_EQ(buf.count(), static_cast<size_t>(0));
+
+		// Clearing keeps the arena
+		buf.clear();
+		ASSERT_EQ(buf.referenced(), static_cast<size_t>(0));
+		memcpy(buf.reserve(3), "xyz", 3);
+		buf.reference(payload.data(), 2);
+		ASSERT_EQ(gathered(buf), std::string("xyz01"));
+		ASSERT_EQ(buf.referenced(), static_cast<size_t>(2));
+	}
+
+	void primitive_test()
+	{
+		kbs::scatter_buffer buf(16);
+		std::string large(100, 'l');
+		kbs::primitive::string small_str("small");
+		kbs::primitive::string large_str(large);
+		kbs::primitive::bytearray bytes(large);
+		kbs::primitive::array<kbs::primitive::bytearray> arr;
+		arr.push_back(kbs::primitive::bytearray("tiny"));
+		arr.push_back(bytes);
+		kbs::primitive::int64 num(-5);
+
+		small_str.scatter(buf);
+		large_str.scatter(buf);
+		bytes.scatter(buf);
+		arr.scatter(buf);
+		num.scatter(buf);
+
+		std::string expected = serialized(small_str) + serialized(large_str) + serialized(bytes) + serialized(arr) +
+		                       serialized(num);
+		ASSERT_EQ(gathered(buf), expected);
+		ASSERT_EQ(buf.size(), expected.size());
+		ASSERT_EQ(buf.referenced(), static_cast<size_t>(300));
+
+		// The payloads are not copied
+		struct iovec iov[16];
+		size_t count = buf.fill_iovec(iov, 16);
+		ASSERT_EQ(count, static_cast<size_t>(7));
+		ASSERT_EQ(static_cast<const char*>(iov[1].iov_base), large_str.std_str().data());
+		ASSERT_EQ(static_cast<const uint8_t*>(iov[3].iov_base), bytes.data());
+	}
+
+	void fetch_test()
+	{
+		std::string key("key");
+		std::string small("value");
+		const std::string large(1000, 'v');
+		std::string empty;
+		kbs::fetch::partition_data part(2, 0, 5);
+		part.add_message(kbs::fetch::message_ref(1, key, small));
+		part.add_message(kbs::fetch::message_ref(2, empty, large));
+		part.add_message(kbs::fetch::message_ref(3, large, large));
+		part.add_message(kbs::fetch::message_ref(4, key, empty));
+		kbs::primitive::array<kbs::fetch::partition_data> partitions;
+		partitions.push_back(part);
+		kbs::primitive::array<kbs::fetch::topic_data> topics;
+		topics.push_back(kbs::fetch::topic_data("test", partitions));
+		kbs::fetch::response_v0 resp_v0(7, topics);
+		kbs::fetch::response_v1 resp_v1(7, 100, topics);
+
+		// Same bytes as the contiguous serialization with valid crcs
+		kbs::scatter_buffer buf;
+		resp_v0.scatter(buf);
+		ASSERT_EQ(gathered(buf), serialized(resp_v0));
+		ASSERT_EQ(buf.referenced(), static_cast<size_t>(3000));
+
+		// Each large payload is a range of its own
+		struct iovec iov[16];
+		size_t count = buf.fill_iovec(iov, 16);
+		ASSERT_EQ(count, static_cast<size_t>(7));
+		ASSERT_EQ(static_cast<const char*>(iov[1].iov_base), large.data());
+		ASSERT_EQ(iov[1].iov_len, large.size());
+
+		buf.clear();
+		resp_v1.scatter(buf);
+		ASSERT_EQ(gathered(buf), serialized(resp_v1));
+	}
+
+	void writev_test()
+	{
+		std::string large(5000, 'w');
+		kbs::primitive::array<kbs::primitive::bytearray> arr;
+		for (int i=0; i<3; ++i)
+		{
+			arr.push_back(kbs::primitive::bytearray(large));
+		}
+		kbs::scatter_buffer buf;
+		arr.scatter(buf);
+		std::string expected = serialized(arr);
+
+		// The ranges are written straight to a pipe
+		int fds[2];
+		ASSERT_EQ(pipe(fds), 0);
+		std::string received;
+		struct iovec iov[2];
+		while (!buf.empty())
+		{
+			size_t count = buf.fill_iovec(iov, 2);
+			ssize_t ret = writev(fds[1], iov, static_cast<int>(count));
+			ASSERT_EQ(ret > 0, true);
+			buf.consumed(static_cast<size_t>(ret));
+
+			char chunk[4096];
+			size_t left = static_cast<size_t>(ret);
+			while (left > 0)
+			{
+				ssize_t num = read(fds[0], chunk, (left < sizeof(chunk)) ? left : sizeof(chunk));
+				ASSERT_EQ(num > 0, true);
+				received.append(chunk, static_cast<size_t>(num));
+				left -= static_cast<size_t>(num);
+			}
+		}
+		close(fds[0]);
+		close(fds[1]);
+		ASSERT_EQ(received, expected);
+	}
+
+	void tests()
+	{
+		buffer_test();
+		primitive_test();
+		fetch_test();
+		writev_test();
+	}
+};
+
+int main()
+{
+	scatter_test suite("Scatter unittests");
+	suite.execute_tests();
+	return 0;
+}
@@ -0,0 +1,292 @@
+#include "kafka_broker_stub/segments.hpp"
+#include "kafka_broker_stub/segments.hpp"
+
+#include "test_common.hpp"
+#include <dirent.h>
+#include <unistd.h>
+
+namespace kbs = kafka_broker_stub;
+
+class segments_test : public kbs::test::suite
+{
+public:
+	segments_test(const std::string& name):
+		suite(name),
+		m_dir("segments_test.d")
+	{
+
+	}
+
+	~segments_test()
+	{
+		remove_all(m_dir);
+	}
+
+private:
+	/**
+	 * Batch header fields read back from a segment
+	 */
+	struct batch_info
+	{
+		int64_t base_offset;
+		int64_t last_offset;
+		int64_t max_timestamp;
+		int32_t count;
+		size_t position;
+		size_t size;
+	};
+
+	static std::string read_file(const std::string& path)
+	{
+		std::string content;
+		FILE* file = fopen(path.c_str(), "rb");
+		if (file == NULL)
+		{
+			return content;
+		}
+
+		char buf[4096];
+		size_t read;
+		while ((read = fread(buf, 1, sizeof(buf), file)) > 0)
+		{
+			content.append(buf, read);
+		}
+		fclose(file);
+		return content;
+	}
+
+	static const uint8_t* bytes(const std::string& str, size_t pos)
+	{
+		return reinterpret_cast<const uint8_t*>(str.data()) + pos;
+	}
+
+	static void remove_all(const std::string& path)
+	{
+		DIR* dir = opendir(path.c_str());
+		if (dir == NULL)
+		{
+			remove(path.c_str());
+			return;
+		}
+
+		for (struct dirent* entry = readdir(dir); entry != NULL; entry = readdir(dir))
+		{
+			std::string name(entry->d_name);
+			if ((name != ".") && (name != ".."))
+			{
+				remove_all(path + "/" + name);
+			}
+		}
+		closedir(dir);
+		rmdir(path.c_str());
+	}
+
+	/**
+	 * Parse the batches of a .log file checking their CRCs - an empty
+	 * vector if the file is malformed
+	 */
+	static std::vector<batch_info> read_batches(const std::string& log)
+	{
+		std::vector<batch_info> batches;
+		size_t pos = 0;
+		while (pos + kbs::segments::batch_builder::HEADER_SIZE <= log.size())
+		{
+			batch_info info;
+			info.position = pos;
+			info.base_offset = kbs::util::read_type<int64_t>(bytes(log, pos));
+			info.size = static_cast<size_t>(kbs::util::read_type<int32_t>(bytes(log, pos + 8))) + 12;
+			uint32_t crc = kbs::util::read_type<uint32_t>(bytes(log, pos + 17));
+			if ((pos + info.size > log.size()) || (log[pos + 16] != 2) ||
+			    (crc != kbs::util::crc32c(bytes(log, pos + 21), info.size - 21)))
+			{
+				return std::vector<batch_info>();
+			}
+			info.last_offset = info.base_offset + kbs::util::read_type<int32_t>(bytes(log, pos + 23));
+			info.max_timestamp = kbs::util::read_type<int64_t>(bytes(log, pos + 35));
+			info.count = kbs::util::read_type<int32_t>(bytes(log, pos + 57));
+			batches.push_back(info);
+			pos += info.size;
+		}
+		return batches;
+	}
+
+	void batch_test()
+	{
+		kbs::segments::batch_builder batch;
+		std::string key("key");
+		std::string value("value");
+		batch.add(10, 1000, &key, &value);
+		batch.add(11, 999, NULL, &value);
+		batch.add(13, 1005, &key, NULL);
+		ASSERT_EQ(batch.count(), static_cast<size_t>(3));
+		ASSERT_EQ(batch.base_offset(), static_cast<int64_t>(10));
+		ASSERT_EQ(batch.last_offset(), static_cast<int64_t>(13));
+		ASSERT_EQ(batch.max_timestamp(), static_cast<int64_t>(1005));
+
+		std::string out;
+		batch.build(out);
+		ASSERT_EQ(out.size(), batch.size());
+
+		std::vector<batch_info> batches = read_batches(out);
+		ASSERT_EQ(batches.size(), static_cast<size_t>(1));
+		ASSERT_EQ(batches[0].base_offset, static_cast<int64_t>(10));
+		ASSERT_EQ(batches[0].last_offset, static_cast<int64_t>(13));
+		ASSERT_EQ(batches[0].max_timestamp, static_cast<int64_t>(1005));
+		ASSERT_EQ(batches[0].count, static_cast<int32_t>(3));
+		ASSERT_EQ(kbs::util::read_type<int64_t>(bytes(out, 27)), static_cast<int64_t>(1000));
+
+		// First record: length 14, attributes, timestamp and offset delta 0,
+		// key and value (zigzag encoded lengths), no headers
+		const uint8_t first[] = { 28, 0, 0, 0, 6, 'k', 'e', 'y', 10, 'v', 'a', 'l', 'u', 'e', 0 };
+		ASSERT_EQ(out.compare(61, sizeof(first), reinterpret_cast<const char*>(first), sizeof(first)), 0);
+
+		// Second record: timestamp delta -1, offset delta 1, null key
+		const uint8_t second[] = { 22, 0, 1, 2, 1, 10, 'v', 'a', 'l', 'u', 'e', 0 };
+		ASSERT_EQ(out.compare(61 + sizeof(first), sizeof(second), reinterpret_cast<const char*>(second),
+		                      sizeof(second)), 0);
+
+		// Third record: tombstone with a null value
+		const uint8_t third[] = { 18, 0, 10, 6, 6, 'k', 'e', 'y', 1, 0 };
+		ASSERT_EQ(out.compare(61 + sizeof(first) + sizeof(second), std::string::npos,
+		                      reinterpret_cast<const char*>(third), sizeof(third)), 0);
+
+		// A corrupted record fails the CRC
+		out[out.size() - 2] = 'x';
+		ASSERT_EQ(read_batches(out).size(), static_cast<size_t>(0));
+	}
+
+	void export_test()
+	{
+		kbs::broker_stub stub(0, "localhost", 9092);
+		std::vector<kbs::partition> partitions;
+		partitions.push_back(kbs::partition(0, 0));
+		partitions.push_back(kbs::partition(1, 0));
+		stub.add_topic("test", partitions);
+
+		kbs::partition* part = stub.get_topic_registry().get_writeable("test")->get_partition_writeable(0);
+		part->set_retention(kbs::retention_policy(0, 200, 0));
+		for (int i=0; i<250; ++i)
+		{
+			part->add_data("key", std::string(100, 'v'), 1000 + i * 10);
+		}
+		ASSERT_EQ(part->log_start_offset(), static_cast<int64_t>(50));
+
+		// Batches of ~1 KiB, segments of ~8 KiB and an index entry every ~2 KiB
+		kbs::segments::options opts;
+		opts.batch_bytes = 1000;
+		opts.segment_bytes = 8000;
+		opts.index_interval_bytes = 2000;
+		ASSERT_EQ(kbs::segments::export_stub(stub, m_dir, opts), true);
+
+		// The empty partition has an empty segment
+		std::string empty_dir = m_dir + "/test-1/";
+		FILE* file = fopen((empty_dir + "00000000000000000000.log").c_str(), "rb");
+		ASSERT_NEQ(file, static_cast<FILE*>(NULL));
+		fclose(file);
+		ASSERT_EQ(read_file(empty_dir + "00000000000000000000.index").size(), static_cast<size_t>(0));
+		ASSERT_EQ(read_file(empty_dir + "00000000000000000000.timeindex").size(), static_cast<size_t>(0));
+
+		// Follow the segments of partition 0 from the log start offset
+		std::string dir = m_dir + "/test-0/";
+		int64_t next = 50;
+		size_t segments = 0;
+		size_t index_entries = 0;
+		while (next < 250)
+		{
+			std::string log = read_file(dir + kbs::segments::file_name(next, ".log"));
+			ASSERT_NEQ(log.size(), static_cast<size_t>(0));
+			ASSERT_EQ(log.size() <= opts.segment_bytes, true);
+			std::vector<batch_info> batches = read_batches(log);
+			ASSERT_NEQ(batches.size(), static_cast<size_t>(0));
+
+			int64_t base = next;
+			for (size_t i=0; i<batches.size(); ++i)
+			{
+				ASSERT_EQ(batches[i].base_offset, next);
+				ASSERT_EQ(batches[i].max_timestamp, 1000 + batches[i].last_offset * 10);
+				ASSERT_EQ(static_cast<int64_t>(batches[i].count), batches[i].last_offset - next + 1);
+				next = batches[i].last_offset + 1;
+			}
+
+			// Index entries point at the batch with the relative offset last
+			std::string index = read_file(dir + kbs::segments::file_name(base, ".index"));
+			ASSERT_EQ(index.size() % 8, static_cast<size_t>(0));
+			size_t last_position = 0;
+			for (size_t i=0; i<index.size(); i+=8)
+			{
+				int32_t offset = kbs::util::read_type<int32_t>(bytes(index, i));
+				size_t position = static_cast<size_t>(kbs::util::read_type<int32_t>(bytes(index, i + 4)));
+				ASSERT_EQ(position > last_position, true);
+				size_t b = 0;
+				while ((b < batches.size()) && (batches[b].position != position))
+				{
+					++b;
+				}
+				ASSERT_NEQ(b, batches.size());
+				ASSERT_EQ(base + offset, batches[b].last_offset);
+				last_position = position;
+				++index_entries;
+			}
+
+			// The time index ends with the largest timestamp of the segment
+			std::string time_index = read_file(dir + kbs::segments::file_name(base, ".timeindex"));
+			ASSERT_EQ(time_index.size() % 12, static_cast<size_t>(0));
+			ASSERT_NEQ(time_index.size(), static_cast<size_t>(0));
+			size_t last = time_index.size() - 12;
+			ASSERT_EQ(kbs::util::read_type<int64_t>(bytes(time_index, last)), 1000 + (next - 1) * 10);
+			ASSERT_EQ(base + kbs::util::read_type<int32_t>(bytes(time_index, last + 8)), next - 1);
+			++segments;
+		}
+		ASSERT_EQ(next, static_cast<int64_t>(250));
+		ASSERT_EQ(segments > 1, true);
+		ASSERT_NEQ(index_entries, static_cast<size_t>(0));
+	}
+
+	void compacted_test()
+	{
+		kbs::partition part(0, 0);
+		part.enable_compaction();
+		part.add_data("a", "1", 100);
+		part.add_data("b", "2", 101);
+		part.add_data("a", "3", 102);
+		part.add_tombstone("b", 103);
+		part.add_data("c", "4", 104);
+
+		std::string dir = m_dir + "/compacted-0";
+		ASSERT_EQ(kbs::segments::export_partition(part, dir), true);
+
+		// Only offsets 2, 3 and 4 remain in a single batch
+		std::string log = read_file(dir + "/" + kbs::segments::file_name(2, ".log"));
+		std::vector<batch_info> batches = read_batches(log);
+		ASSERT_EQ(batches.size(), static_cast<size_t>(1));
+		ASSERT_EQ(batches[0].base_offset, static_cast<int64_t>(2));
+		ASSERT_EQ(batches[0].last_offset, static_cast<int64_t>(4));
+		ASSERT_EQ(batches[0].count, static_cast<int32_t>(3));
+
+		// The tombstone of b has a null value
+		const uint8_t tombstone[] = { 14, 0, 2, 2, 2, 'b', 1, 0 };
+		size_t pos = log.find(std::string(reinterpret_cast<const char*>(tombstone), sizeof(tombstone)));
+		ASSERT_NEQ(pos, std::string::npos);
+
+		// Segments are named after the first offset exported
+		ASSERT_EQ(read_file(dir + "/" + kbs::segments::file_name(0, ".log")).size(), static_cast<size_t>(0));
+		ASSERT_EQ(kbs::segments::file_name(2, ".log"), std::string("00000000000000000002.log"));
+	}
+
+	void tests()
+	{
+		remove_all(m_dir);
+		batch_test();
+		export_test();
+		compacted_test();
+	}
+
+	std::string m_dir;
+};
+
+int main()
+{
+	segments_test suite("Segments unittests");
+	suite.execute_tests();
+	return 0;
+}
@@ -0,0 +1,155 @@
+#include "kafka_broker_stub/server.hpp"
+
+#include <stdio.h>
+
+/*
+ * Compare the transport backends on loopback
+ *
+ * A number of clients send pipelined batches of small metadata requests and
+ * wait for the responses of each batch. Prints the requests handled per
+ * second for each backend.
+ */
+
+namespace kbs = kafka_broker_stub;
+
+namespace {
+
+	const size_t NUM_CLIENTS = 4;
+	const size_t BATCH = 32;
+	const size_t REQUESTS_PER_CLIENT = 100000;
+
+	// Metadata request for topic "test"
+	const uint8_t metadata_req[] = {
+		0x00, 0x00, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x02, 0x00, 0x07, 0x72, 0x64, 0x6b, 0x61,
+		0x66, 0x6b, 0x61, 0x00, 0x00, 0x00, 0x01, 0x00, 0x04,
+		0x74, 0x65, 0x73, 0x74
+	};
+
+	struct server_args
+	{
+		explicit server_args(kbs::transport::transportI& t):
+			transport(t),
+			running(1)
+		{
+
+		}
+
+		kbs::transport::transportI& transport;
+		volatile int running;
+	};
+
+	void* server_thread(void* arg)
+	{
+		server_args* args = static_cast<server_args*>(arg);
+		kbs::transport::serve(args->transport, &args->running);
+		return NULL;
+	}
+
+	bool read_all(int fd, uint8_t* buf, size_t size)
+	{
+		size_t got = 0;
+		while (got < size)
+		{
+			ssize_t ret = read(fd, buf + got, size - got);
+			if (ret <= 0)
+				return false;
+			got += static_cast<size_t>(ret);
+		}
+		return true;
+	}
+
+	void* client_thread(void* arg)
+	{
+		int32_t port = *static_cast<int32_t*>(arg);
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(static_cast<uint16_t>(port));
+		inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+		if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0)
+		{
+			close(fd);
+			return NULL;
+		}
+		kbs::transport::set_nodelay(fd);
+
+		// Learn the response size from a first request
+		uint8_t head[4];
+		if ((write(fd, metadata_req, sizeof(metadata_req)) != static_cast<ssize_t>(sizeof(metadata_req))) ||
+		    !read_all(fd, head, sizeof(head)))
+		{
+			close(fd);
+			return NULL;
+		}
+		size_t resp_size = 4 + static_cast<size_t>(kbs::util::read_type<int32_t>(head));
+		std::vector<uint8_t> resp(resp_size * BATCH);
+		read_all(fd, &resp[0], resp_size - 4);
+
+		std::vector<uint8_t> batch;
+		for (size_t i=0; i<BATCH; ++i)
+		{
+			batch.insert(batch.end(), metadata_req, metadata_req + sizeof(metadata_req));
+		}
+
+		for (size_t sent=0; sent<REQUESTS_PER_CLIENT; sent+=BATCH)
+		{
+			if ((write(fd, &batch[0], batch.size()) != static_cast<ssize_t>(batch.size())) ||
+			    !read_all(fd, &resp[0], resp.size()))
+			{
+				break;
+			}
+		}
+		close(fd);
+		return NULL;
+	}
+
+	void run(kbs::transport::backend which)
+	{
+		kbs::broker_stub stub(0, "127.0.0.1", 0);
+		stub.get_logger().set_level(kbs::log::LEVEL_NONE);
+		stub.add_topic("test", std::vector<kbs::partition>(1, kbs::partition(0, 0)));
+
+		kbs::transport::transportI* transport = kbs::transport::open_transport(stub, "127.0.0.1", 0, which);
+		if (transport == NULL)
+		{
+			printf("Backend unavailable\n");
+			return;
+		}
+
+		server_args args(*transport);
+		pthread_t server;
+		pthread_create(&server, NULL, &server_thread, &args);
+
+		int32_t port = transport->port();
+		uint64_t start = kbs::util::monotonic_ns();
+		pthread_t clients[NUM_CLIENTS];
+		for (size_t i=0; i<NUM_CLIENTS; ++i)
+		{
+			pthread_create(&clients[i], NULL, &client_thread, &port);
+		}
+		for (size_t i=0; i<NUM_CLIENTS; ++i)
+		{
+			pthread_join(clients[i], NULL);
+		}
+		uint64_t elapsed = kbs::util::monotonic_ns() - start;
+
+		kbs::util::atomic_store(&args.running, 0);
+		pthread_join(server, NULL);
+
+		double total = static_cast<double>(NUM_CLIENTS * REQUESTS_PER_CLIENT);
+		printf("%-8s %10.0f requests/s\n", transport->name(), total / (static_cast<double>(elapsed) / 1e9));
+		delete transport;
+	}
+
+}
+
+int main()
+{
+	printf("%lu clients, batches of %lu requests\n", static_cast<unsigned long>(NUM_CLIENTS),
+	       static_cast<unsigned long>(BATCH));
+	run(kbs::transport::BACKEND_EPOLL);
+	run(kbs::transport::BACKEND_IO_URING);
+	return 0;
+}
@@ -0,0 +1,450 @@
+#include "kafka_broker_stub/server.hpp"
+#include "kafka_broker_stub/server.hpp"
+
+#include "test_common.hpp"
+
+namespace kbs = kafka_broker_stub;
+
+namespace {
+
+	// Produce request with one message "testmessage" for partition 1 of topic "test"
+	const uint8_t produce_req[] = {
+		0x00, 0x00, 0x00, 0x52,
+		0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x03,
+		0x00, 0x07, 0x72, 0x64, 0x6b, 0x61, 0x66, 0x6b, 0x61,
+		0x00, 0x01,
+		0x00, 0x00, 0x13, 0x88,
+		0x00, 0x00, 0x00, 0x01,
+			0x00, 0x04, 0x74, 0x65, 0x73, 0x74,
+			0x00, 0x00, 0x00, 0x01,
+				0x00, 0x00, 0x00, 0x01,
+				0x00, 0x00, 0x00, 0x25,
+					0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x09,
+					0x00, 0x00, 0x00, 0x19,
+					0xa6, 0xb1, 0x36, 0x2b,
+					0xFF,
+					0x00,
+					0xff, 0xff, 0xff, 0xff,
+					0x00, 0x00, 0x00, 0x0b,
+						0x74, 0x65, 0x73, 0x74, 0x6d, 0x65,
+						0x73, 0x73, 0x61, 0x67, 0x65};
+
+	// Size of the produce response
+	const size_t PRODUCE_RESP_SIZE = 36;
+
+	struct server_args
+	{
+		explicit server_args(kbs::transport::transportI& t):
+			transport(t),
+			running(1),
+			result(false)
+		{
+
+		}
+
+		kbs::transport::transportI& transport;
+		volatile int running;
+		bool result;
+	};
+
+	void* server_thread(void* arg)
+	{
+		server_args* args = static_cast<server_args*>(arg);
+		args->result = kbs::transport::serve(args->transport, &args->running);
+		return NULL;
+	}
+
+	int connect_to(int32_t port)
+	{
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(static_cast<uint16_t>(port));
+		inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+		if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0)
+		{
+			close(fd);
+			return -1;
+		}
+
+		struct timeval tv;
+		tv.tv_sec = 5;
+		tv.tv_usec = 0;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		return fd;
+	}
+
+	void put16(std::string& out, int16_t val)
+	{
+		uint8_t buf[2];
+		kbs::util::write_type<int16_t>(val, buf);
+		out.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+	}
+
+	void put32(std::string& out, int32_t val)
+	{
+		uint8_t buf[4];
+		kbs::util::write_type<int32_t>(val, buf);
+		out.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+	}
+
+	void put_string(std::string& out, const std::string& val)
+	{
+		put16(out, static_cast<int16_t>(val.size()));
+		out += val;
+	}
+
+	// Fetch request v0 for partition 0 of topic "test" from offset 0
+	std::string fetch_request(int32_t max_bytes)
+	{
+		std::string out;
+		put16(out, 1);
+		put16(out, 0);
+		put32(out, 5);
+		put_string(out, "test");
+		put32(out, -1);
+		put32(out, 0);
+		put32(out, 1);
+		put32(out, 1);
+		put_string(out, "test");
+		put32(out, 1);
+		put32(out, 0);
+		put32(out, 0);
+		put32(out, 0);
+		put32(out, max_bytes);
+		std::string framed;
+		put32(framed, static_cast<int32_t>(out.size()));
+		return framed + out;
+	}
+
+	bool read_all(int fd, uint8_t* buf, size_t size)
+	{
+		size_t got = 0;
+		while (got < size)
+		{
+			ssize_t ret = read(fd, buf + got, size - got);
+			if ((ret < 0) && (errno == EINTR))
+				continue;
+			if (ret <= 0)
+				return false;
+			got += static_cast<size_t>(ret);
+		}
+		return true;
+	}
+
+}
+
+class server_test : public kbs::test::suite
+{
+public:
+	server_test(const std::string& name): suite(name) { }
+
+private:
+	void roundtrip(kbs::transport::backend which)
+	{
+		std::vector<kbs::partition> partitions;
+		partitions.push_back(kbs::partition(0, 0));
+		partitions.push_back(kbs::partition(1, 0));
+		kbs::broker_stub stub(0, "127.0.0.1", 0);
+		stub.get_logger().set_level(kbs::log::LEVEL_NONE);
+		stub.add_topic("test", partitions);
+
+		kbs::transport::transportI* transport = kbs::transport::open_transport(stub, "127.0.0.1", 0, which);
+		if ((transport == NULL) && (which == kbs::transport::BACKEND_IO_URING))
+		{
+			printf("io_uring transport unavailable - skipped\n");
+			return;
+		}
+		ASSERT_NEQ(transport, static_cast<kbs::transport::transportI*>(NULL));
+		ASSERT_EQ(transport->port() > 0, true);
+		printf("Testing %s transport\n", transport->name());
+
+		server_args args(*transport);
+		pthread_t thread;
+		ASSERT_EQ(pthread_create(&thread, NULL, &server_thread, &args), 0);
+
+		int fd = connect_to(transport->port());
+		ASSERT_EQ(fd >= 0, true);
+
+		// A request split over two writes followed by two pipelined requests
+		ASSERT_EQ(write(fd, produce_req, 10), static_cast<ssize_t>(10));
+		ASSERT_EQ(stub.wait_for("test", 1, 1, 20), false);
+		ASSERT_EQ(write(fd, produce_req + 10, sizeof(produce_req) - 10), static_cast<ssize_t>(sizeof(produce_req) - 10));
+		uint8_t twice[2 * sizeof(produce_req)];
+		memcpy(twice, produce_req, sizeof(produce_req));
+		memcpy(twice + sizeof(produce_req), produce_req, sizeof(produce_req));
+		ASSERT_EQ(write(fd, twice, sizeof(twice)), static_cast<ssize_t>(sizeof(twice)));
+
+		uint8_t resp[3 * PRODUCE_RESP_SIZE];
+		ASSERT_EQ(read_all(fd, resp, sizeof(resp)), true);
+		ASSERT_EQ(kbs::util::read_type<int32_t>(resp), static_cast<int32_t>(PRODUCE_RESP_SIZE - 4));
+
+		// Offsets of the three messages in order
+		ASSERT_EQ(kbs::util::read_type<int64_t>(resp + PRODUCE_RESP_SIZE - 8), static_cast<int64_t>(0));
+		ASSERT_EQ(kbs::util::read_type<int64_t>(resp + 2 * PRODUCE_RESP_SIZE - 8), static_cast<int64_t>(1));
+		ASSERT_EQ(kbs::util::read_type<int64_t>(resp + 3 * PRODUCE_RESP_SIZE - 8), static_cast<int64_t>(2));
+		ASSERT_EQ(stub.wait_for("test", 1, 3, 1000), true);
+
+		// Invalid stream closes the connection
+		uint8_t bad_size[5] = {0};
+		ASSERT_EQ(write(fd, bad_size, sizeof(bad_size)), static_cast<ssize_t>(sizeof(bad_size)));
+		ASSERT_EQ(read(fd, resp, 1), static_cast<ssize_t>(0));
+		close(fd);
+
+		// Several clients
+		int fds[4];
+		for (size_t i=0; i<4; ++i)
+		{
+			fds[i] = connect_to(transport->port());
+			ASSERT_EQ(write(fds[i], produce_req, sizeof(produce_req)), static_cast<ssize_t>(sizeof(produce_req)));
+		}
+		for (size_t i=0; i<4; ++i)
+		{
+			ASSERT_EQ(read_all(fds[i], resp, PRODUCE_RESP_SIZE), true);
+			close(fds[i]);
+		}
+		ASSERT_EQ(stub.get_topic("test")->get_partition(1)->next_offset(), static_cast<int64_t>(7));
+
+		kbs::util::atomic_store(&args.running, 0);
+		pthread_join(thread, NULL);
+		ASSERT_EQ(args.result, true);
+		delete transport;
+	}
+
+	/**
+	 * Time a produce round trip through a backend - returns 0 if the backend
+	 * is unavailable
+	 */
+	uint64_t timed_roundtrip(kbs::broker_stub& stub, kbs::transport::backend which)
+	{
+		kbs::transport::transportI* transport = kbs::transport::open_transport(stub, "127.0.0.1", 0, which);
+		if (transport == NULL)
+			return 0;
+
+		server_args args(*transport);
+		pthread_t thread;
+		ASSERT_EQ(pthread_create(&thread, NULL, &server_thread, &args), 0);
+
+		int fd = connect_to(transport->port());
+		ASSERT_EQ(fd >= 0, true);
+		uint64_t start = kbs::util::monotonic_ns();
+		ASSERT_EQ(write(fd, produce_req, sizeof(produce_req)), static_cast<ssize_t>(sizeof(produce_req)));
+		uint8_t resp[PRODUCE_RESP_SIZE];
+		ASSERT_EQ(read_all(fd, resp, sizeof(resp)), true);
+		uint64_t elapsed = kbs::util::monotonic_ns() - start;
+		close(fd);
+
+		kbs::util::atomic_store(&args.running, 0);
+		pthread_join(thread, NULL);
+		delete transport;
+		return elapsed;
+	}
+
+	kbs::broker_stub* make_stub()
+	{
+		std::vector<kbs::partition> partitions;
+		partitions.push_back(kbs::partition(0, 0));
+		partitions.push_back(kbs::partition(1, 0));
+		kbs::broker_stub* stub = new kbs::broker_stub(0, "127.0.0.1", 0);
+		stub->get_logger().set_level(kbs::log::LEVEL_NONE);
+		stub->add_topic("test", partitions);
+		return stub;
+	}
+
+	/**
+	 * Throttled responses are held back by the transport
+	 */
+	void throttle(kbs::transport::backend which)
+	{
+		// 37 record bytes at 370 bytes per second without burst are 100 ms
+		kbs::broker_stub* stub = make_stub();
+		stub->get_quotas().set_burst_ms(0);
+		stub->get_quotas().set_client_quota(kbs::QUOTA_PRODUCE, "rdkafka", 370);
+		stub->get_quotas().set_delay_responses(true);
+
+		uint64_t elapsed = timed_roundtrip(*stub, which);
+		ASSERT_EQ((elapsed == 0) || (elapsed >= static_cast<uint64_t>(90000000)), true);
+		delete stub;
+	}
+
+	/**
+	 * Requests and responses cross a shaped link
+	 */
+	void shaping(kbs::transport::backend which)
+	{
+		// 10 ms each way plus 10 ms for the request and 4 ms for the response
+		kbs::broker_stub* stub = make_stub();
+		kbs::link_profile profile;
+		profile.bytes_per_sec = 8600;
+		profile.latency_us = 10000;
+		profile.jitter_us = 1000;
+		stub->get_shaping().set_default_profile(profile);
+
+		uint64_t elapsed = timed_roundtrip(*stub, which);
+		ASSERT_EQ((elapsed == 0) || (elapsed >= static_cast<uint64_t>(30000000)), true);
+		delete stub;
+	}
+
+	/**
+	 * Add topic "test" with 1 MiB of messages in partition 0
+	 */
+	kbs::partition* fill_fetch_stub(kbs::broker_stub& stub)
+	{
+		std::vector<kbs::partition> partitions;
+		partitions.push_back(kbs::partition(0, 0));
+		stub.get_logger().set_level(kbs::log::LEVEL_NONE);
+		stub.add_topic("test", partitions);
+		kbs::partition* part = stub.get_topic_registry().get_writeable("test")->get_partition_writeable(0);
+		for (int i=0; i<64; ++i)
+		{
+			part->add_data("key", std::string(16384, static_cast<char>('a' + i % 26)));
+		}
+		return part;
+	}
+
+	/**
+	 * A large fetch response arrives complete through a backend
+	 */
+	void fetch_roundtrip(kbs::transport::backend which)
+	{
+		kbs::broker_stub stub(0, "127.0.0.1", 0);
+		fill_fetch_stub(stub);
+		std::string req = fetch_request(2000000);
+		std::vector<std::string> expected;
+		stub.handle_data(reinterpret_cast<const uint8_t*>(req.data()), req.size(), expected);
+		ASSERT_EQ(expected.size(), static_cast<size_t>(1));
+
+		kbs::transport::transportI* transport = kbs::transport::open_transport(stub, "127.0.0.1", 0, which);
+		if (transport == NULL)
+			return;
+
+		server_args args(*transport);
+		pthread_t thread;
+		ASSERT_EQ(pthread_create(&thread, NULL, &server_thread, &args), 0);
+
+		int fd = connect_to(transport->port());
+		ASSERT_EQ(fd >= 0, true);
+		for (int i=0; i<2; ++i)
+		{
+			ASSERT_EQ(write(fd, req.data(), req.size()), static_cast<ssize_t>(req.size()));
+			std::string got(expected[0].size(), '\0');
+			ASSERT_EQ(read_all(fd, reinterpret_cast<uint8_t*>(&got[0]), got.size()), true);
+			ASSERT_EQ(got == expected[0], true);
+		}
+		close(fd);
+
+		kbs::util::atomic_store(&args.running, 0);
+		pthread_join(thread, NULL);
+		delete transport;
+	}
+
+	/**
+	 * Fetch responses are sent to the socket of a session straight from the
+	 * stored messages, and only the part the socket does not take is queued
+	 */
+	void sink_test()
+	{
+		kbs::broker_stub stub(0, "127.0.0.1", 0);
+		kbs::partition* part = fill_fetch_stub(stub);
+
+		// Contiguous response for comparison
+		std::string req = fetch_request(2000000);
+		std::vector<std::string> expected;
+		ASSERT_EQ(stub.handle_data(reinterpret_cast<const uint8_t*>(req.data()), req.size(), expected),
+		          static_cast<int>(req.size()));
+		ASSERT_EQ(expected.size(), static_cast<size_t>(1));
+		ASSERT_EQ(expected[0].size() > static_cast<size_t>(64 * 16384), true);
+
+		// A socket taking the whole response of one message
+		std::string first = fetch_request(1);
+		std::vector<std::string> first_expected;
+		ASSERT_EQ(stub.handle_data(reinterpret_cast<const uint8_t*>(first.data()), first.size(), first_expected),
+		          static_cast<int>(first.size()));
+		int fds[2];
+		ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+		kbs::transport::session sess(stub);
+		sess.set_socket(fds[0]);
+		ASSERT_EQ(sess.receive(reinterpret_cast<const uint8_t*>(first.data()), first.size()), true);
+		ASSERT_EQ(sess.has_output(), false);
+		std::string got(first_expected[0].size(), '\0');
+		ASSERT_EQ(read_all(fds[1], reinterpret_cast<uint8_t*>(&got[0]), got.size()), true);
+		ASSERT_EQ(got == first_expected[0], true);
+		close(fds[0]);
+		close(fds[1]);
+
+		// A small socket buffer leaves the rest queued as a copy
+		ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+		int size = 65536;
+		setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+		fcntl(fds[0], F_SETFL, O_NONBLOCK);
+		kbs::transport::session small(stub);
+		small.set_socket(fds[0]);
+		ASSERT_EQ(small.receive(reinterpret_cast<const uint8_t*>(req.data()), req.size()), true);
+		ASSERT_EQ(small.has_output(), true);
+
+		// Evicting the fetched messages does not change the queued rest
+		part->set_retention(kbs::retention_policy(0, 1, 0));
+		part->add_data("key", "late");
+		got.assign(expected[0].size(), '\0');
+		size_t pos = 0;
+		while (pos < got.size())
+		{
+			ssize_t ret = read(fds[1], &got[pos], got.size() - pos);
+			ASSERT_EQ(ret > 0, true);
+			if (ret <= 0)
+				break;
+			pos += static_cast<size_t>(ret);
+
+			struct iovec iov[kbs::transport::MAX_IOV];
+			size_t count = small.fill_iovec(iov, kbs::transport::MAX_IOV);
+			ssize_t sent = (count > 0) ? writev(fds[0], iov, static_cast<int>(count)) : 0;
+			if (sent > 0)
+				small.consumed(static_cast<size_t>(sent));
+		}
+		ASSERT_EQ(got == expected[0], true);
+		ASSERT_EQ(small.has_output(), false);
+		close(fds[0]);
+		close(fds[1]);
+
+		// Without a socket the response is queued contiguous
+		kbs::transport::session plain(stub);
+		ASSERT_EQ(plain.receive(reinterpret_cast<const uint8_t*>(req.data()), req.size()), true);
+		ASSERT_EQ(plain.has_output(), true);
+		struct iovec iov[kbs::transport::MAX_IOV];
+		ASSERT_EQ(plain.fill_iovec(iov, kbs::transport::MAX_IOV), static_cast<size_t>(1));
+	}
+
+	void backend_test()
+	{
+		roundtrip(kbs::transport::BACKEND_EPOLL);
+		roundtrip(kbs::transport::BACKEND_IO_URING);
+		roundtrip(kbs::transport::BACKEND_AUTO);
+		throttle(kbs::transport::BACKEND_EPOLL);
+		throttle(kbs::transport::BACKEND_IO_URING);
+		shaping(kbs::transport::BACKEND_EPOLL);
+		shaping(kbs::transport::BACKEND_IO_URING);
+		fetch_roundtrip(kbs::transport::BACKEND_EPOLL);
+		fetch_roundtrip(kbs::transport::BACKEND_IO_URING);
+
+		// Invalid address
+		kbs::broker_stub stub(0, "127.0.0.1", 0);
+		stub.get_logger().set_level(kbs::log::LEVEL_NONE);
+		ASSERT_EQ(kbs::transport::open_transport(stub, "not an address", 0),
+		          static_cast<kbs::transport::transportI*>(NULL));
+	}
+
+	void tests()
+	{
+		sink_test();
+		backend_test();
+	}
+};
+
+int main()
+{
+	server_test suite("Server unittests");
+	suite.execute_tests();
+	return 0;
+}
@@ -0,0 +1,167 @@
+#include "kafka_broker_stub/shaping.hpp"
+#include "kafka_broker_stub/shaping.hpp"
+
+#include "test_common.hpp"
+
+namespace kbs = kafka_broker_stub;
+
+namespace {
+
+	const uint64_t MS = 1000000;
+
+}
+
+class shaping_test : public kbs::test::suite
+{
+public:
+	shaping_test(const std::string& name): suite(name) { }
+
+private:
+	void config_test()
+	{
+		kbs::network_shaper shaper;
+		ASSERT_EQ(shaper.active(), false);
+		unsigned generation = shaper.generation();
+
+		// Client profiles override the default
+		kbs::link_profile slow;
+		slow.latency_us = 5000;
+		shaper.set_client_profile("slow", slow);
+		ASSERT_EQ(shaper.active(), true);
+		ASSERT_EQ(shaper.generation() != generation, true);
+		ASSERT_EQ(shaper.profile("slow").latency_us, static_cast<uint32_t>(5000));
+		ASSERT_EQ(shaper.profile("other").active(), false);
+
+		kbs::link_profile wan;
+		wan.bytes_per_sec = 1000;
+		shaper.set_default_profile(wan);
+		ASSERT_EQ(shaper.profile("other").bytes_per_sec, static_cast<uint64_t>(1000));
+		ASSERT_EQ(shaper.profile("slow").bytes_per_sec, static_cast<uint64_t>(0));
+
+		shaper.remove_client_profile("slow");
+		ASSERT_EQ(shaper.profile("slow").bytes_per_sec, static_cast<uint64_t>(1000));
+		shaper.set_default_profile(kbs::link_profile());
+		ASSERT_EQ(shaper.active(), false);
+	}
+
+	void link_test()
+	{
+		kbs::network_shaper shaper;
+		kbs::link_shaper link(shaper);
+		ASSERT_EQ(link.active(), false);
+		ASSERT_EQ(link.schedule(kbs::LINK_IN, 100, 10 * MS), 10 * MS);
+
+		// Changes apply to open links
+		kbs::link_profile profile;
+		profile.bytes_per_sec = 1000;
+		profile.latency_us = 2000;
+		shaper.set_default_profile(profile);
+		ASSERT_EQ(link.active(), true);
+
+		// 100 bytes take 100 ms to send plus the latency
+		ASSERT_EQ(link.schedule(kbs::LINK_IN, 100, 1000 * MS), 1102 * MS);
+
+		// Bytes queue behind earlier ones, each direction on its own
+		ASSERT_EQ(link.schedule(kbs::LINK_IN, 10, 1050 * MS), 1112 * MS);
+		ASSERT_EQ(link.schedule(kbs::LINK_OUT, 10, 1050 * MS), 1062 * MS);
+
+		// An idle link sends right away
+		ASSERT_EQ(link.schedule(kbs::LINK_IN, 1, 2000 * MS), 2003 * MS);
+
+		// The client profile applies once the link is identified
+		kbs::link_profile fast;
+		fast.latency_us = 1000;
+		shaper.set_client_profile("fast", fast);
+		link.identify("fast");
+		ASSERT_EQ(link.schedule(kbs::LINK_OUT, 1000000, 3000 * MS), 3001 * MS);
+		ASSERT_EQ(link.profile().bytes_per_sec, static_cast<uint64_t>(0));
+	}
+
+	/**
+	 * Jitter stays in order and averages out near the latency
+	 */
+	void jitter(kbs::jitter_distribution distribution, double min_ms, double max_ms)
+	{
+		kbs::network_shaper shaper;
+		kbs::link_profile profile;
+		profile.latency_us = 10000;
+		profile.jitter_us = 2000;
+		profile.distribution = distribution;
+		shaper.set_default_profile(profile);
+		kbs::link_shaper link(shaper);
+
+		// Far apart messages show the drawn delay
+		uint64_t total = 0;
+		bool spread = false;
+		uint64_t first = link.schedule(kbs::LINK_OUT, 1, 1000 * MS) - 1000 * MS;
+		for (uint64_t i=1; i<=1000; ++i)
+		{
+			uint64_t now = (1000 + i * 100) * MS;
+			uint64_t delay = link.schedule(kbs::LINK_OUT, 1, now) - now;
+			total += delay;
+			spread = spread || (delay != first);
+		}
+		double mean_ms = static_cast<double>(total) / 1000.0 / static_cast<double>(MS);
+		ASSERT_EQ(spread, true);
+		ASSERT_EQ((mean_ms > min_ms) && (mean_ms < max_ms), true);
+
+		// Messages sent at once arrive in order despite the jitter
+		uint64_t last = 0;
+		bool ordered = true;
+		for (size_t i=0; i<1000; ++i)
+		{
+			uint64_t due = link.schedule(kbs::LINK_IN, 1, 500000 * MS);
+			ordered = ordered && (due >= last);
+			last = due;
+		}
+		ASSERT_EQ(ordered, true);
+	}
+
+	void jitter_test()
+	{
+		jitter(kbs::JITTER_UNIFORM, 9.8, 10.2);
+		jitter(kbs::JITTER_NORMAL, 9.7, 10.3);
+		jitter(kbs::JITTER_PARETO, 11.5, 12.5);
+	}
+
+	void seed_test()
+	{
+		// Equal seeds give equal jitter
+		kbs::network_shaper shaper;
+		kbs::link_profile profile;
+		profile.jitter_us = 5000;
+		shaper.set_default_profile(profile);
+		shaper.set_seed(42);
+		kbs::link_shaper first(shaper);
+		shaper.set_seed(42);
+		kbs::link_shaper second(shaper);
+		kbs::link_shaper third(shaper);
+
+		bool same = true;
+		bool differs = false;
+		for (uint64_t i=0; i<10; ++i)
+		{
+			uint64_t now = i * 100 * MS;
+			uint64_t due = first.schedule(kbs::LINK_IN, 1, now);
+			same = same && (due == second.schedule(kbs::LINK_IN, 1, now));
+			differs = differs || (due != third.schedule(kbs::LINK_IN, 1, now));
+		}
+		ASSERT_EQ(same, true);
+		ASSERT_EQ(differs, true);
+	}
+
+	void tests()
+	{
+		config_test();
+		link_test();
+		jitter_test();
+		seed_test();
+	}
+};
+
+int main()
+{
+	shaping_test suite("Shaping unittests");
+	suite.execute_tests();
+	return 0;
+}
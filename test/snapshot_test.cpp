@@ -0,0 +1,195 @@
+#include "kafka_broker_stub/snapshot.hpp"
+#include "kafka_broker_stub/snapshot.hpp"
+
+#include "test_common.hpp"
+
+namespace kbs = kafka_broker_stub;
+
+class snapshot_test : public kbs::test::suite
+{
+public:
+	snapshot_test(const std::string& name):
+		suite(name),
+		m_path("snapshot_test.kbss")
+	{
+
+	}
+
+	~snapshot_test()
+	{
+		remove(m_path.c_str());
+	}
+
+private:
+	void save_restore_test()
+	{
+		// Make a stub with a reference to another broker and two topics with data
+		kbs::broker_stub stub(0, "localhost", 9092);
+		stub.add_broker_reference(1, "otherhost", 9093);
+
+		std::vector<kbs::partition> partitions;
+		partitions.push_back(kbs::partition(0, 0));
+		std::vector<int32_t> replicas;
+		replicas.push_back(1);
+		replicas.push_back(0);
+		partitions.push_back(kbs::partition(1, 1, replicas));
+		stub.add_topic("test", partitions);
+		stub.add_topic("empty", std::vector<kbs::partition>());
+
+		kbs::topic_registry& registry = stub.get_topic_registry();
+		kbs::partition* part = registry.get_writeable("test")->get_partition_writeable(0);
+		part->add_data("key", "value");
+		part->add_data("", "");
+		part->add_data(std::string(1000, 'k'), std::string(100000, 'v'));
+
+		// Partition 1 has dropped its first message due to retention
+		kbs::partition* part1 = registry.get_writeable("test")->get_partition_writeable(1);
+		part1->set_retention(kbs::retention_policy(0, 1, 0));
+		part1->add_data("old", "old");
+		part1->add_data("new", "new");
+
+		ASSERT_EQ(kbs::snapshot::save(stub, m_path), true);
+
+		// Restore into a stub with another identity
+		kbs::broker_stub restored(1, "otherhost", 9093);
+		ASSERT_EQ(kbs::snapshot::restore(restored, m_path), true);
+
+		ASSERT_EQ(restored.brokers().size(), static_cast<size_t>(2));
+		ASSERT_EQ(static_cast<int>(restored.brokers()[1].node_id()), 0);
+		ASSERT_EQ(restored.brokers()[1].host().std_str(), std::string("localhost"));
+		ASSERT_EQ(static_cast<int>(restored.brokers()[1].port()), 9092);
+
+		ASSERT_NEQ(restored.get_topic("empty"), static_cast<const kbs::topic*>(NULL));
+		ASSERT_EQ(restored.get_topic("empty")->partitions().size(), static_cast<size_t>(0));
+
+		const kbs::topic* top = restored.get_topic("test");
+		ASSERT_NEQ(top, static_cast<const kbs::topic*>(NULL));
+		ASSERT_EQ(top->partitions().size(), static_cast<size_t>(2));
+
+		const kbs::partition* p1 = top->get_partition(1);
+		ASSERT_EQ(p1->leader(), static_cast<int32_t>(1));
+		ASSERT_EQ(p1->replicas().size(), static_cast<size_t>(2));
+		ASSERT_EQ(p1->replicas()[1], static_cast<int32_t>(0));
+		ASSERT_EQ(p1->isr().size(), static_cast<size_t>(2));
+		ASSERT_EQ(p1->retention().max_messages, static_cast<uint64_t>(1));
+		ASSERT_EQ(p1->log_start_offset(), static_cast<int64_t>(1));
+		ASSERT_EQ(p1->next_offset(), static_cast<int64_t>(2));
+		ASSERT_EQ(p1->data().size(), static_cast<size_t>(1));
+		ASSERT_EQ(p1->data()[0].key(), std::string("new"));
+		ASSERT_EQ(p1->data()[0].timestamp(), part1->data()[0].timestamp());
+
+		// Offsets are known before the records are decoded
+		const kbs::partition* p0 = top->get_partition(0);
+		ASSERT_EQ(p0->next_offset(), static_cast<int64_t>(3));
+		ASSERT_EQ(p0->data().size(), static_cast<size_t>(3));
+		ASSERT_EQ(p0->data()[0].key(), std::string("key"));
+		ASSERT_EQ(p0->data()[0].value(), std::string("value"));
+		ASSERT_EQ(p0->data()[1].key(), std::string(""));
+		ASSERT_EQ(p0->data()[2].key(), std::string(1000, 'k'));
+		ASSERT_EQ(p0->data()[2].value(), std::string(100000, 'v'));
+
+		// Appending continues after the restored records
+		kbs::partition* wp0 = restored.get_topic_registry().get_writeable("test")->get_partition_writeable(0);
+		wp0->add_data("new", "data");
+		ASSERT_EQ(wp0->next_offset(), static_cast<int64_t>(4));
+
+		// Restoring again fails as the topics exist
+		ASSERT_EQ(kbs::snapshot::restore(restored, m_path), false);
+	}
+
+	void compacted_test()
+	{
+		// Compacted topic with reclaim, a superseded key, a tombstone and an idempotent producer
+		kbs::broker_stub stub(0, "localhost", 9092);
+		stub.add_topic("compacted", std::vector<kbs::partition>(1, kbs::partition(0, 0)));
+		kbs::topic_registry& registry = stub.get_topic_registry();
+		kbs::partition* part = registry.get_writeable("compacted")->get_partition_writeable(0);
+		part->enable_key_index();
+		part->enable_compaction(true);
+		part->add_data("a", "1");
+		part->add_data("b", "1");
+		part->add_data("a", "2");
+		part->add_tombstone("b");
+
+		kbs::producer_table producers;
+		producers.add(1000, 0, 0, 1, 0);
+		producers.add(1000, 0, 2, 3, 2);
+		part->set_producers(producers);
+
+		ASSERT_EQ(kbs::snapshot::save(stub, m_path), true);
+		kbs::broker_stub restored(0, "localhost", 9092);
+		ASSERT_EQ(kbs::snapshot::restore(restored, m_path), true);
+
+		const kbs::partition* p0 = restored.get_topic("compacted")->get_partition(0);
+		ASSERT_EQ(p0->key_index_enabled(), true);
+		ASSERT_EQ(p0->compaction_enabled(), true);
+		ASSERT_EQ(p0->reclaim_enabled(), true);
+		ASSERT_EQ(p0->next_offset(), static_cast<int64_t>(4));
+		ASSERT_EQ(p0->size_bytes(), part->size_bytes());
+
+		// Reclaimed messages stay superseded rather than turning into empty messages
+		ASSERT_EQ(p0->compacted().is_latest(0), false);
+		ASSERT_EQ(p0->compacted().is_latest(1), false);
+		ASSERT_EQ(p0->compacted().is_latest(2), true);
+		ASSERT_EQ(p0->compacted().is_tombstone(3), true);
+		std::vector<kbs::record_view> values = p0->compacted_data();
+		ASSERT_EQ(values.size(), static_cast<size_t>(1));
+		ASSERT_EQ(values[0].offset, static_cast<int64_t>(2));
+		ASSERT_EQ(values[0].record->value(), std::string("2"));
+		ASSERT_EQ(p0->find_value("b").record, static_cast<const kbs::key_value_pair*>(NULL));
+
+		// The key index only holds the messages that were not reclaimed
+		std::vector<int64_t> offsets = p0->find_all("a");
+		ASSERT_EQ(offsets.size(), static_cast<size_t>(1));
+		ASSERT_EQ(offsets[0], static_cast<int64_t>(2));
+
+		// A retried batch is still a duplicate
+		int64_t offset = -1;
+		ASSERT_EQ(p0->producers().check(1000, 0, 2, 3, offset) == kbs::SEQUENCE_DUPLICATE, true);
+		ASSERT_EQ(offset, static_cast<int64_t>(2));
+		ASSERT_EQ(p0->producers().check(1000, 0, 4, 4, offset) == kbs::SEQUENCE_OK, true);
+
+		// Compaction continues on appends
+		kbs::partition* wp0 = restored.get_topic_registry().get_writeable("compacted")->get_partition_writeable(0);
+		wp0->add_data("a", "3");
+		ASSERT_EQ(wp0->compacted().is_latest(2), false);
+		ASSERT_EQ(wp0->data()[2].value(), std::string(""));
+		ASSERT_EQ(wp0->find_value("a").record->value(), std::string("3"));
+	}
+
+	void invalid_file_test()
+	{
+		kbs::broker_stub stub(0, "localhost", 9092);
+		ASSERT_EQ(kbs::snapshot::restore(stub, "does_not_exist.kbss"), false);
+
+		// Truncated snapshot
+		FILE* file = fopen(m_path.c_str(), "wb");
+		const uint8_t data[] = { 'K', 'B', 'S', 'S', 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x01 };
+		fwrite(data, 1, sizeof(data), file);
+		fclose(file);
+		ASSERT_EQ(kbs::snapshot::restore(stub, m_path), false);
+
+		// Wrong magic
+		file = fopen(m_path.c_str(), "wb");
+		fwrite(data+1, 1, sizeof(data)-1, file);
+		fclose(file);
+		ASSERT_EQ(kbs::snapshot::restore(stub, m_path), false);
+		ASSERT_EQ(stub.brokers().size(), static_cast<size_t>(1));
+	}
+
+	void tests()
+	{
+		save_restore_test();
+		compacted_test();
+		invalid_file_test();
+	}
+
+	std::string m_path;
+};
+
+int main()
+{
+	snapshot_test suite("Snapshot unittests");
+	suite.execute_tests();
+	return 0;
+}
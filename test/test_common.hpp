@@ -64,8 +64,8 @@ namespace kafka_broker_stub { namespace test {
 			if (a != b)
 			{
 				std::cout << "Assert equal failed [" << file << ":" << line << "] ";
-				std::cout << "[" << reinterpret_cast<const size_t>(a) << " == ";
-				std::cout << reinterpret_cast<const size_t>(b) << "]\n";
+				std::cout << "[" << reinterpret_cast<size_t>(a) << " == ";
+				std::cout << reinterpret_cast<size_t>(b) << "]\n";
 				m_num_fail++;
 				return;
 			}
@@ -0,0 +1,88 @@
+#include "kafka_broker_stub/time_index.hpp"
+#include "kafka_broker_stub/time_index.hpp"
+
+#include "test_common.hpp"
+
+namespace kbs = kafka_broker_stub;
+
+class time_index_test : public kbs::test::suite
+{
+public:
+	time_index_test(const std::string& name): suite(name) { }
+
+private:
+	void lookup_test()
+	{
+		kbs::time_index index(2);
+		ASSERT_EQ(index.lookup(100), static_cast<int64_t>(-1));
+		ASSERT_EQ(index.max_timestamp(), static_cast<int64_t>(-1));
+
+		// An entry every two messages
+		for (int64_t i=0; i<10; ++i)
+		{
+			index.add(1000 + i * 10, i);
+		}
+		ASSERT_EQ(index.size(), static_cast<size_t>(5));
+		ASSERT_EQ(index.max_timestamp(), static_cast<int64_t>(1090));
+
+		// Entries are (1010, 1), (1030, 3), ... (1090, 9)
+		ASSERT_EQ(index.lookup(999), static_cast<int64_t>(-1));
+		ASSERT_EQ(index.lookup(1009), static_cast<int64_t>(-1));
+		ASSERT_EQ(index.lookup(1010), static_cast<int64_t>(1));
+		ASSERT_EQ(index.lookup(1045), static_cast<int64_t>(3));
+		ASSERT_EQ(index.lookup(5000), static_cast<int64_t>(9));
+
+		index.clear();
+		ASSERT_EQ(index.size(), static_cast<size_t>(0));
+		ASSERT_EQ(index.lookup(5000), static_cast<int64_t>(-1));
+	}
+
+	void out_of_order_test()
+	{
+		kbs::time_index index(1);
+		index.add(50, 0);
+		index.add(40, 1);
+		index.add(60, 2);
+		index.add(60, 3);
+		index.add(55, 4);
+
+		// Only growing maxima are indexed with the offset they first appeared at
+		ASSERT_EQ(index.size(), static_cast<size_t>(2));
+		ASSERT_EQ(index.lookup(45), static_cast<int64_t>(-1));
+		ASSERT_EQ(index.lookup(59), static_cast<int64_t>(0));
+		ASSERT_EQ(index.lookup(60), static_cast<int64_t>(2));
+		ASSERT_EQ(index.max_timestamp(), static_cast<int64_t>(60));
+	}
+
+	void truncate_test()
+	{
+		kbs::time_index index(1);
+		for (int64_t i=0; i<5; ++i)
+		{
+			index.add(i, i);
+		}
+		index.truncate_front(3);
+		ASSERT_EQ(index.size(), static_cast<size_t>(2));
+		ASSERT_EQ(index.lookup(1), static_cast<int64_t>(-1));
+		ASSERT_EQ(index.lookup(4), static_cast<int64_t>(4));
+
+		// Zero interval is treated as one
+		kbs::time_index every(0);
+		every.add(7, 0);
+		ASSERT_EQ(every.size(), static_cast<size_t>(1));
+	}
+
+	void tests()
+	{
+		lookup_test();
+		out_of_order_test();
+		truncate_test();
+	}
+};
+
+int main()
+{
+	time_index_test suite("Time index unittests");
+	suite.execute_tests();
+	return 0;
+}
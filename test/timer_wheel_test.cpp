@@ -0,0 +1,121 @@
+#include "kafka_broker_stub/timer_wheel.hpp"
+#include "kafka_broker_stub/timer_wheel.hpp"
+
+#include "test_common.hpp"
+
+namespace kbs = kafka_broker_stub;
+
+namespace {
+
+	const uint64_t MS = 1000000;
+
+}
+
+class timer_wheel_test : public kbs::test::suite
+{
+public:
+	timer_wheel_test(const std::string& name): suite(name) { }
+
+private:
+	void expire_test()
+	{
+		kbs::timer_wheel timers(MS, 16);
+		std::vector<int> ids;
+		timers.expire(1000 * MS, ids);
+		ASSERT_EQ(timers.empty(), true);
+		ASSERT_EQ(timers.timeout(1000 * MS, 100), 100);
+		ASSERT_EQ(timers.timeout(1000 * MS, -1), -1);
+
+		// Timers expire once their time has passed, not at the tick before
+		timers.schedule(1, 1005 * MS + 500);
+		timers.schedule(2, 1003 * MS);
+		ASSERT_EQ(timers.size(), static_cast<size_t>(2));
+		ASSERT_EQ(timers.timeout(1000 * MS, 100), 3);
+		ASSERT_EQ(timers.timeout(1000 * MS, 2), 2);
+		ASSERT_EQ(timers.timeout(1000 * MS, -1), 3);
+
+		timers.expire(1002 * MS, ids);
+		ASSERT_EQ(ids.empty(), true);
+		timers.expire(1003 * MS, ids);
+		ASSERT_EQ(ids.size(), static_cast<size_t>(1));
+		ASSERT_EQ(ids[0], 2);
+		timers.expire(1005 * MS, ids);
+		ASSERT_EQ(ids.size(), static_cast<size_t>(1));
+		ASSERT_EQ(timers.timeout(1005 * MS, 100), 1);
+		timers.expire(1006 * MS, ids);
+		ASSERT_EQ(ids.size(), static_cast<size_t>(2));
+		ASSERT_EQ(ids[1], 1);
+		ASSERT_EQ(timers.empty(), true);
+
+		// Timers in the past expire on the next call
+		timers.schedule(3, 10 * MS);
+		ASSERT_EQ(timers.timeout(1006 * MS, 100), 0);
+		ids.clear();
+		timers.expire(1006 * MS, ids);
+		ASSERT_EQ(ids.size(), static_cast<size_t>(1));
+		ASSERT_EQ(ids[0], 3);
+	}
+
+	void rounds_test()
+	{
+		// Timers more than a turn ahead share slots with earlier ones
+		kbs::timer_wheel timers(MS, 16);
+		std::vector<int> ids;
+		timers.expire(0, ids);
+		timers.schedule(1, 40 * MS);
+		timers.schedule(2, 8 * MS);
+		timers.schedule(3, 24 * MS);
+		ASSERT_EQ(timers.timeout(0, -1), 8);
+
+		timers.expire(8 * MS, ids);
+		ASSERT_EQ(ids.size(), static_cast<size_t>(1));
+		ASSERT_EQ(ids[0], 2);
+
+		// The next timer is found beyond the current turn
+		timers.expire(20 * MS, ids);
+		ASSERT_EQ(timers.timeout(20 * MS, -1), 4);
+		timers.expire(30 * MS, ids);
+		ASSERT_EQ(ids.size(), static_cast<size_t>(2));
+		ASSERT_EQ(ids[1], 3);
+		ASSERT_EQ(timers.timeout(30 * MS, -1), 10);
+
+		// Skipping several turns at once
+		timers.schedule(4, 31 * MS);
+		timers.expire(500 * MS, ids);
+		ASSERT_EQ(ids.size(), static_cast<size_t>(4));
+		ASSERT_EQ(timers.empty(), true);
+	}
+
+	void cancel_test()
+	{
+		// All timers of an ID are removed, including ones a turn ahead
+		kbs::timer_wheel timers(MS, 16);
+		std::vector<int> ids;
+		timers.expire(0, ids);
+		timers.schedule(1, 5 * MS);
+		timers.schedule(2, 5 * MS);
+		timers.schedule(1, 40 * MS);
+		timers.cancel(1);
+		ASSERT_EQ(timers.size(), static_cast<size_t>(1));
+		timers.cancel(7);
+		ASSERT_EQ(timers.size(), static_cast<size_t>(1));
+		timers.expire(100 * MS, ids);
+		ASSERT_EQ(ids.size(), static_cast<size_t>(1));
+		ASSERT_EQ(ids[0], 2);
+		ASSERT_EQ(timers.empty(), true);
+	}
+
+	void tests()
+	{
+		expire_test();
+		rounds_test();
+		cancel_test();
+	}
+};
+
+int main()
+{
+	timer_wheel_test suite("Timer wheel unittests");
+	suite.execute_tests();
+	return 0;
+}
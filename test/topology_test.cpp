@@ -0,0 +1,134 @@
+#include "kafka_broker_stub/topology.hpp"
+#include "kafka_broker_stub/topology.hpp"
+
+#include "test_common.hpp"
+
+#include <sstream>
+
+namespace kbs = kafka_broker_stub;
+
+class topology_test : public kbs::test::suite
+{
+public:
+	topology_test(const std::string& name): suite(name) { }
+
+private:
+	void parse_test()
+	{
+		kbs::topology::description desc;
+		ASSERT_EQ(desc.parse("# Two brokers\n"
+		                     "broker 0 localhost 9092\n"
+		                     "\n"
+		                     "   broker 1 otherhost 9093\n"
+		                     "topic test 4 2\n"
+		                     "topic single 3\n"), true);
+
+		ASSERT_EQ(desc.brokers().size(), static_cast<size_t>(2));
+		ASSERT_EQ(desc.brokers()[1].node_id, static_cast<int32_t>(1));
+		ASSERT_EQ(desc.brokers()[1].host, std::string("otherhost"));
+		ASSERT_EQ(desc.brokers()[1].port, static_cast<int32_t>(9093));
+
+		ASSERT_EQ(desc.topics().size(), static_cast<size_t>(2));
+		ASSERT_EQ(desc.topics()[0].name, std::string("test"));
+		ASSERT_EQ(desc.topics()[0].partitions, static_cast<int32_t>(4));
+		ASSERT_EQ(desc.topics()[0].replication_factor, static_cast<int32_t>(2));
+		ASSERT_EQ(desc.topics()[1].replication_factor, static_cast<int32_t>(1));
+
+		// Invalid lines
+		kbs::topology::description bad;
+		ASSERT_EQ(bad.parse("broker 0 localhost\n"), false);
+		ASSERT_EQ(bad.error(), std::string("Invalid topology line 1: broker 0 localhost"));
+		ASSERT_EQ(bad.parse("topic test 1 1 extra\n"), false);
+		ASSERT_EQ(bad.parse("topic test x\n"), false);
+		ASSERT_EQ(bad.parse("topic test 1 0\n"), false);
+		ASSERT_EQ(bad.parse("partition test 1\n"), false);
+		ASSERT_EQ(bad.load_file("does_not_exist.topology"), false);
+	}
+
+	void apply_test()
+	{
+		kbs::topology::description desc;
+		desc.parse("broker 0 localhost 9092\n"
+		           "broker 1 otherhost 9093\n"
+		           "topic test 4 2\n"
+		           "topic single 3\n");
+
+		kbs::broker_stub stub(0, "localhost", 9092);
+		stub.get_logger().set_level(kbs::log::LEVEL_NONE);
+		kbs::topology::load_stats stats;
+		ASSERT_EQ(kbs::topology::apply(desc, stub, &stats), true);
+		ASSERT_EQ(stats.topics, static_cast<size_t>(2));
+		ASSERT_EQ(stats.partitions, static_cast<size_t>(7));
+
+		// The stub itself is not added twice
+		ASSERT_EQ(stub.brokers().size(), static_cast<size_t>(2));
+
+		const kbs::topic* top = stub.get_topic("test");
+		ASSERT_NEQ(top, static_cast<const kbs::topic*>(NULL));
+		ASSERT_EQ(top->partitions().size(), static_cast<size_t>(4));
+		ASSERT_EQ(top->get_partition(1)->leader(), static_cast<int32_t>(1));
+		ASSERT_EQ(top->get_partition(1)->replicas().size(), static_cast<size_t>(2));
+		ASSERT_EQ(top->get_partition(1)->replicas()[1], static_cast<int32_t>(0));
+
+		// Second topic starts on the second broker
+		ASSERT_EQ(stub.get_topic("single")->get_partition(0)->leader(), static_cast<int32_t>(1));
+		ASSERT_EQ(stub.get_topic("single")->get_partition(0)->replicas().size(), static_cast<size_t>(1));
+
+		// Applying again fails as the topics exist
+		ASSERT_EQ(kbs::topology::apply(desc, stub), false);
+
+		// Replication factor exceeding the brokers
+		kbs::topology::description too_many;
+		too_many.parse("topic other 1 2\n");
+		ASSERT_EQ(kbs::topology::apply(too_many, stub), false);
+		ASSERT_EQ(stub.get_topic("other"), static_cast<const kbs::topic*>(NULL));
+
+		// A topic listed twice rejects the whole topology
+		kbs::topology::description duplicate;
+		duplicate.parse("topic first 1\n"
+		                "topic twice 1\n"
+		                "topic twice 3\n");
+		size_t num_brokers = stub.brokers().size();
+		ASSERT_EQ(kbs::topology::apply(duplicate, stub), false);
+		ASSERT_EQ(stub.get_topic("first"), static_cast<const kbs::topic*>(NULL));
+		ASSERT_EQ(stub.get_topic("twice"), static_cast<const kbs::topic*>(NULL));
+		ASSERT_EQ(stub.brokers().size(), num_brokers);
+	}
+
+	void bulk_test()
+	{
+		// Many topics without brokers are all led by the stub
+		std::ostringstream text;
+		for (int i=0; i<5000; ++i)
+		{
+			text << "topic topic_" << i << " 4\n";
+		}
+
+		kbs::topology::description desc;
+		ASSERT_EQ(desc.parse(text.str()), true);
+
+		kbs::broker_stub stub(3, "localhost", 9092);
+		stub.get_logger().set_level(kbs::log::LEVEL_NONE);
+		kbs::topology::load_stats stats;
+		ASSERT_EQ(kbs::topology::apply(desc, stub, &stats), true);
+		ASSERT_EQ(stats.topics, static_cast<size_t>(5000));
+		ASSERT_EQ(stats.partitions, static_cast<size_t>(20000));
+		ASSERT_EQ(stub.get_topic_registry().topics().size(), static_cast<size_t>(5000));
+		ASSERT_EQ(stub.get_topic("topic_4999")->get_partition(3)->leader(), static_cast<int32_t>(3));
+		printf("Registered 5000 topics in [%lu] us\n", static_cast<unsigned long>(stats.elapsed_ns / 1000));
+	}
+
+	void tests()
+	{
+		parse_test();
+		apply_test();
+		bulk_test();
+	}
+};
+
+int main()
+{
+	topology_test suite("Topology unittests");
+	suite.execute_tests();
+	return 0;
+}
@@ -0,0 +1,219 @@
+#include "kafka_broker_stub/trace.hpp"
+#include "kafka_broker_stub/trace.hpp"
+#include "kafka_broker_stub/main.hpp"
+
+#include "test_common.hpp"
+#include <sstream>
+
+namespace kbs = kafka_broker_stub;
+
+class trace_test : public kbs::test::suite
+{
+public:
+	trace_test(const std::string& name):
+		suite(name),
+		m_path("trace_test.json")
+	{
+
+	}
+
+	~trace_test()
+	{
+		remove(m_path.c_str());
+	}
+
+private:
+	static bool contains(const std::string& str, const std::string& part)
+	{
+		return str.find(part) != std::string::npos;
+	}
+
+	/**
+	 * Request header with API key, version, correlation ID and client ID
+	 */
+	static std::string request_header(int16_t api_key, int16_t api_version, int32_t corr_id, const std::string& client)
+	{
+		std::string req(10 + client.size(), '\0');
+		uint8_t* data = reinterpret_cast<uint8_t*>(&req[0]);
+		kbs::util::write_type<int16_t>(api_key, data);
+		kbs::util::write_type<int16_t>(api_version, data + 2);
+		kbs::util::write_type<int32_t>(corr_id, data + 4);
+		kbs::util::write_type<int16_t>(static_cast<int16_t>(client.size()), data + 8);
+		memcpy(data + 10, client.data(), client.size());
+		return req;
+	}
+
+	static void* record_spans(void* ctx)
+	{
+		kbs::trace::tracer* tracer = static_cast<kbs::trace::tracer*>(ctx);
+		for (int i=0; i<10; ++i)
+		{
+			kbs::trace::span span(*tracer, "worker");
+		}
+		return NULL;
+	}
+
+	void span_test()
+	{
+		kbs::trace::tracer tracer(5);
+		ASSERT_EQ(tracer.enabled(), false);
+
+		// Nothing is recorded while disabled
+		{
+			kbs::trace::span span(tracer, "disabled");
+			ASSERT_EQ(span.active(), false);
+		}
+		ASSERT_EQ(tracer.size(), static_cast<size_t>(0));
+		ASSERT_EQ(tracer.chrome_json(), std::string("{\"traceEvents\":[],\"displayTimeUnit\":\"ns\"}"));
+
+		tracer.enable(true);
+		ASSERT_EQ(tracer.enabled(), true);
+		{
+			std::string req = request_header(3, 1, 42, "my \"client\"");
+			kbs::trace::span outer(tracer, "request");
+			ASSERT_EQ(outer.active(), true);
+			outer.set_request(reinterpret_cast<const uint8_t*>(req.data()), req.size());
+			outer.set_response_bytes(100);
+			kbs::trace::span inner(tracer, "decode");
+		}
+		ASSERT_EQ(tracer.size(), static_cast<size_t>(2));
+
+		std::string json = tracer.chrome_json();
+		ASSERT_EQ(contains(json, "{\"name\":\"decode\",\"cat\":\"kafka\",\"ph\":\"X\",\"ts\":"), true);
+		ASSERT_EQ(contains(json, "{\"name\":\"request\",\"cat\":\"kafka\",\"ph\":\"X\",\"ts\":"), true);
+		ASSERT_EQ(contains(json, "\"pid\":5,\"tid\":1"), true);
+		ASSERT_EQ(contains(json, "\"args\":{\"api_key\":3,\"api_version\":1,\"correlation_id\":42,"
+		                         "\"request_bytes\":21,\"response_bytes\":100,"
+		                         "\"client_id\":\"my \\\"client\\\"\"}"), true);
+
+		// The phase span has no arguments
+		ASSERT_EQ(json.find("\"args\""), json.rfind("\"args\""));
+
+		// Spans stop once disabled and clearing drops them
+		tracer.enable(false);
+		{
+			kbs::trace::span span(tracer, "disabled");
+		}
+		ASSERT_EQ(tracer.size(), static_cast<size_t>(2));
+		tracer.clear();
+		ASSERT_EQ(tracer.size(), static_cast<size_t>(0));
+	}
+
+	void request_header_test()
+	{
+		kbs::trace::tracer tracer(0);
+		tracer.enable(true);
+
+		// Long client IDs are truncated, truncated headers are tolerated
+		std::string req = request_header(0, 2, 7, std::string(100, 'c'));
+		{
+			kbs::trace::span span(tracer, "long");
+			span.set_request(reinterpret_cast<const uint8_t*>(req.data()), req.size());
+		}
+		{
+			kbs::trace::span span(tracer, "short");
+			span.set_request(reinterpret_cast<const uint8_t*>(req.data()), 12);
+		}
+		{
+			kbs::trace::span span(tracer, "tiny");
+			span.set_request(reinterpret_cast<const uint8_t*>(req.data()), 6);
+		}
+
+		std::string json = tracer.chrome_json();
+		ASSERT_EQ(contains(json, "\"client_id\":\"" + std::string(kbs::trace::CLIENT_ID_MAX_SIZE - 1, 'c') + "\""),
+		          true);
+		ASSERT_EQ(contains(json, "\"request_bytes\":110,"), true);
+		ASSERT_EQ(contains(json, "\"correlation_id\":7,\"request_bytes\":12,\"response_bytes\":0,\"client_id\":\"cc\""),
+		          true);
+		ASSERT_EQ(contains(json, "\"correlation_id\":0,\"request_bytes\":6,\"response_bytes\":0,\"client_id\":\"\""),
+		          true);
+	}
+
+	void ring_buffer_test()
+	{
+		// Only the last four spans per thread are kept
+		kbs::trace::tracer tracer(0, 4);
+		tracer.enable(true);
+		for (int i=0; i<10; ++i)
+		{
+			kbs::trace::span span(tracer, (i < 6) ? "old" : "new");
+		}
+		ASSERT_EQ(tracer.size(), static_cast<size_t>(4));
+		ASSERT_EQ(contains(tracer.chrome_json(), "\"old\""), false);
+
+		// Other threads record into their own buffers
+		pthread_t threads[2];
+		for (size_t i=0; i<2; ++i)
+		{
+			pthread_create(&threads[i], NULL, &trace_test::record_spans, &tracer);
+		}
+		for (size_t i=0; i<2; ++i)
+		{
+			pthread_join(threads[i], NULL);
+		}
+		ASSERT_EQ(tracer.size(), static_cast<size_t>(12));
+
+		std::string json = tracer.chrome_json();
+		ASSERT_EQ(contains(json, "\"tid\":1"), true);
+		ASSERT_EQ(contains(json, "\"tid\":2"), true);
+		ASSERT_EQ(contains(json, "\"tid\":3"), true);
+
+		ASSERT_EQ(tracer.save_chrome_json(m_path), true);
+		FILE* file = fopen(m_path.c_str(), "rb");
+		ASSERT_NEQ(file, static_cast<FILE*>(NULL));
+		fseek(file, 0, SEEK_END);
+		ASSERT_EQ(static_cast<size_t>(ftell(file)), json.size());
+		fclose(file);
+	}
+
+	void stub_test()
+	{
+		kbs::broker_stub stub(3, "localhost", 9092);
+		std::vector<kbs::partition> partitions;
+		partitions.push_back(kbs::partition(0, 3));
+		stub.add_topic("test", partitions);
+
+		// Metadata request for all topics
+		std::string req = request_header(3, 0, 99, "tracer") + std::string(4, '\0');
+		std::string msg(4, '\0');
+		kbs::util::write_type<int32_t>(static_cast<int32_t>(req.size()), reinterpret_cast<uint8_t*>(&msg[0]));
+		msg += req;
+
+		std::vector<std::string> responses;
+		const uint8_t* data = reinterpret_cast<const uint8_t*>(msg.data());
+		ASSERT_EQ(stub.handle_data(data, msg.size(), responses), static_cast<int>(msg.size()));
+		ASSERT_EQ(stub.get_tracer().size(), static_cast<size_t>(0));
+
+		stub.get_tracer().enable(true);
+		ASSERT_EQ(stub.handle_data(data, msg.size(), responses), static_cast<int>(msg.size()));
+		ASSERT_EQ(responses.size(), static_cast<size_t>(2));
+		ASSERT_EQ(stub.get_tracer().size(), static_cast<size_t>(4));
+
+		std::ostringstream expected;
+		expected << "\"args\":{\"api_key\":3,\"api_version\":0,\"correlation_id\":99,\"request_bytes\":" << req.size()
+		         << ",\"response_bytes\":" << responses[1].size() << ",\"client_id\":\"tracer\"}";
+		std::string json = stub.get_tracer().chrome_json();
+		ASSERT_EQ(contains(json, expected.str()), true);
+		ASSERT_EQ(contains(json, "\"name\":\"handle\""), true);
+		ASSERT_EQ(contains(json, "\"name\":\"decode\""), true);
+		ASSERT_EQ(contains(json, "\"name\":\"serialize\""), true);
+		ASSERT_EQ(contains(json, "\"pid\":3"), true);
+	}
+
+	void tests()
+	{
+		span_test();
+		request_header_test();
+		ring_buffer_test();
+		stub_test();
+	}
+
+	std::string m_path;
+};
+
+int main()
+{
+	trace_test suite("Trace unittests");
+	suite.execute_tests();
+	return 0;
+}
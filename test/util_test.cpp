@@ -113,6 +113,16 @@ private:
 
 		kbs::util::write_type<int64_t>(1, data);
 		ASSERT_EQ(kbs::util::read_type<int64_t>(data), static_cast<int64_t>(1));
+
+		// CRC-32 check value and continuation
+		const char* check = "123456789";
+		ASSERT_EQ(kbs::util::crc32(check, 9), static_cast<uint32_t>(0xCBF43926));
+		ASSERT_EQ(kbs::util::crc32(check + 4, 5, kbs::util::crc32(check, 4)), static_cast<uint32_t>(0xCBF43926));
+		ASSERT_EQ(kbs::util::crc32(check, 0), static_cast<uint32_t>(0));
+
+		// CRC-32C check value and continuation
+		ASSERT_EQ(kbs::util::crc32c(check, 9), static_cast<uint32_t>(0xE3069283));
+		ASSERT_EQ(kbs::util::crc32c(check + 4, 5, kbs::util::crc32c(check, 4)), static_cast<uint32_t>(0xE3069283));
 	}
 	
 };
@@ -0,0 +1,85 @@
+#include "kafka_broker_stub/worker_pool.hpp"
+#include "kafka_broker_stub/worker_pool.hpp"
+
+#include "test_common.hpp"
+
+namespace kbs = kafka_broker_stub;
+
+namespace {
+
+	struct counters
+	{
+		counters(size_t n):
+			hits(n, 0),
+			total(0)
+		{
+
+		}
+
+		std::vector<int> hits;
+		volatile size_t total;
+	};
+
+	void count_task(void* ctx, size_t index)
+	{
+		counters* c = static_cast<counters*>(ctx);
+		++c->hits[index];
+		kbs::util::atomic_fetch_add(&c->total, index);
+	}
+
+}
+
+class worker_pool_test : public kbs::test::suite
+{
+public:
+	worker_pool_test(const std::string& name): suite(name) { }
+
+private:
+	void run_test()
+	{
+		kbs::worker_pool pool(3);
+		ASSERT_EQ(pool.size(), static_cast<size_t>(3));
+
+		// Every task runs exactly once, also over repeated batches
+		for (size_t round=0; round<50; ++round)
+		{
+			counters c(100);
+			pool.run(c.hits.size(), &count_task, &c);
+			ASSERT_EQ(kbs::util::atomic_load(&c.total), static_cast<size_t>(4950));
+			size_t once = 0;
+			for (size_t i=0; i<c.hits.size(); ++i)
+			{
+				if (c.hits[i] == 1)
+					++once;
+			}
+			ASSERT_EQ(once, c.hits.size());
+		}
+
+		// Empty batch
+		counters empty(0);
+		pool.run(0, &count_task, &empty);
+		ASSERT_EQ(kbs::util::atomic_load(&empty.total), static_cast<size_t>(0));
+	}
+
+	void no_threads_test()
+	{
+		// The calling thread runs all tasks
+		kbs::worker_pool pool(0);
+		counters c(10);
+		pool.run(c.hits.size(), &count_task, &c);
+		ASSERT_EQ(kbs::util::atomic_load(&c.total), static_cast<size_t>(45));
+	}
+
+	void tests()
+	{
+		run_test();
+		no_threads_test();
+	}
+};
+
+int main()
+{
+	worker_pool_test suite("Worker pool unittests");
+	suite.execute_tests();
+	return 0;
+}